@@ -39,6 +39,7 @@ LOCAL_SRC_FILES := \
 	ForwardingManager.cpp \
 	ForwarderAsynchronous.cpp \
 	ForwarderProphet.cpp \
+	ForwarderSprayAndWait.cpp \
 	HaggleKernel.cpp \
 	Interface.cpp \
 	InterfaceStore.cpp \
@@ -48,7 +49,9 @@ LOCAL_SRC_FILES := \
 	NodeManager.cpp \
 	NodeStore.cpp \
 	Policy.cpp \
+	ProphetRIB.cpp \
 	Protocol.cpp \
+	ProtocolEngine.cpp \
 	ProtocolLOCAL.cpp \
 	ProtocolManager.cpp \
 	ProtocolRFCOMM.cpp \
@@ -24,7 +24,7 @@
 #include "Interface.h"
 #include "Attribute.h"
 
-Attribute::Attribute(const string _name, const string _value, unsigned long _weight) : 
+Attribute::Attribute(const string& _name, const string& _value, unsigned long _weight) : 
 #ifdef DEBUG_LEAKS
 	LeakMonitor(LEAK_TYPE_ATTRIBUTE),
 #endif
@@ -52,7 +52,7 @@ public:
 		Constructor that takes two strings of type "ABC" and "DEF" and 
 		creates an attribute of type "ABC=DEF" from it.
 	*/
-        Attribute(const string _name = "", const string _value = "", unsigned long _weight = 1);
+        Attribute(const string& _name = "", const string& _value = "", unsigned long _weight = 1);
         /// Copy-constructor
         Attribute(const Attribute& attr);
 	/**
@@ -19,8 +19,11 @@
 #include "Trace.h"
 #include "XMLMetadata.h"
 
+#include <math.h>
+
 double Bloomfilter::default_error_rate = DEFAULT_BLOOMFILTER_ERROR_RATE;
 unsigned int Bloomfilter::default_capacity = DEFAULT_BLOOMFILTER_CAPACITY;
+Bloomfilter::Hash_t Bloomfilter::default_hash = Bloomfilter::HASH_SHA1;
 
 const char *Bloomfilter::type_str[] = {
 	"normal",
@@ -46,6 +49,31 @@ Bloomfilter::Type_t Bloomfilter::strToType(const char *str)
 	return TYPE_UNDEFINED;
 }
 
+const char *Bloomfilter::hash_str[] = {
+	"sha1",
+	"double",
+	"blocked",
+	"undefined",
+	NULL
+};
+
+Bloomfilter::Hash_t Bloomfilter::strToHash(const char *str)
+{
+	int i = 0;
+	
+	if (!str)
+		return HASH_UNDEFINED;
+	
+	while (hash_str[i]) {
+		if (strcmp(str, hash_str[i]) == 0)
+			return (Hash_t)i;
+	
+		i++;
+	}
+	
+	return HASH_UNDEFINED;
+}
+
 Bloomfilter::Bloomfilter(Type_t _type, double _error_rate, unsigned int _capacity) :
 #ifdef DEBUG_LEAKS
 	LeakMonitor(LEAK_TYPE_BLOOMFILTER),
@@ -54,12 +82,13 @@ Bloomfilter::Bloomfilter(Type_t _type, double _error_rate, unsigned int _capacit
 	error_rate(_error_rate),
 	capacity(_capacity),
 	init_n(0),
-	raw(NULL)
+	raw(NULL),
+	scalable(false)
 {
 	if (type == TYPE_COUNTING) {
-		cbf = counting_bloomfilter_new(error_rate, capacity);
+		cbf = counting_bloomfilter_new_with_hash(error_rate, capacity, default_hash);
 	} else {
-		bf = bloomfilter_new(error_rate, capacity);
+		bf = bloomfilter_new_with_hash(error_rate, capacity, default_hash);
 	}
 }
 
@@ -71,7 +100,8 @@ Bloomfilter::Bloomfilter(double _error_rate, unsigned int _capacity, struct bloo
 	error_rate(_error_rate),
 	capacity(_capacity),
 	init_n(_bf->n),
-	bf(_bf)
+	bf(_bf),
+	scalable(false)
 {
 }
 
@@ -83,7 +113,8 @@ Bloomfilter::Bloomfilter(double _error_rate, unsigned int _capacity, struct coun
 	error_rate(_error_rate),
 	capacity(_capacity),
 	init_n(_cbf->n),
-	cbf(_cbf)
+	cbf(_cbf),
+	scalable(false)
 {
 }
 
@@ -95,13 +126,21 @@ Bloomfilter::Bloomfilter(const Bloomfilter &_bf) :
 	error_rate(_bf.error_rate),
 	capacity(_bf.capacity),
 	init_n(_bf.init_n),
-	raw(NULL)
+	raw(NULL),
+	scalable(_bf.scalable)
 {
 	if (type == TYPE_NORMAL) {
 		bf = bloomfilter_copy(_bf.bf);
 	} else {
 		cbf = counting_bloomfilter_copy(_bf.cbf);
 	} 
+	
+	for (List<Bloomfilter *>::const_iterator it = _bf.slices.begin(); it != _bf.slices.end(); it++) {
+		Bloomfilter *slice = create(**it);
+		
+		if (slice)
+			slices.push_back(slice);
+	}
 }
 
 Bloomfilter *Bloomfilter::create(double error_rate, unsigned int capacity, struct bloomfilter *bf)
@@ -163,6 +202,22 @@ Bloomfilter *Bloomfilter::create(const unsigned char *raw_bf, size_t len)
 		}
 		
 		HAGGLE_DBG("Bloomfilter is counting and contains %lu objects\n", counting_bloomfilter_get_n(bf->cbf)); 
+	} else if (COUNTING_BLOOMFILTER_LEGACY_TOT_LEN((struct counting_bloomfilter *)raw_bf) == len) {
+		// Saved by an older version with 16-bit counters
+		struct counting_bloomfilter *c_cbf = counting_bloomfilter_from_legacy((struct counting_bloomfilter*)raw_bf);
+
+		if (!c_cbf)
+			return NULL;
+
+		bf = create(default_error_rate, default_capacity, c_cbf);
+
+		if (!bf) {
+			counting_bloomfilter_free(c_cbf);
+			return NULL;
+		}
+
+		HAGGLE_DBG("Bloomfilter is counting (converted from 16-bit counters) and contains %lu objects\n",
+			   counting_bloomfilter_get_n(bf->cbf));
 	} else {
 		HAGGLE_ERR("bloomfilter is neither counting nor non-counting\n");
 		return NULL;
@@ -212,6 +267,11 @@ Bloomfilter *Bloomfilter::create(const Bloomfilter &bf)
 
 Bloomfilter::~Bloomfilter()
 {
+	while (!slices.empty()) {
+		delete slices.front();
+		slices.pop_front();
+	}
+	
 	if (raw) {
 		if (type == TYPE_NORMAL)
 			bloomfilter_free(bf);
@@ -221,8 +281,26 @@ Bloomfilter::~Bloomfilter()
 }
 bool Bloomfilter::add(const unsigned char *blob, size_t len)
 {
+	Bloomfilter *target = this;
 	int ret = 0;
 
+	for (List<Bloomfilter *>::iterator it = slices.begin(); it != slices.end(); it++)
+		target = *it;
+	
+	if (scalable && target->isFull() && slices.size() < BLOOMFILTER_SCALABLE_MAX_SLICES) {
+		Bloomfilter *slice = newSlice();
+		
+		if (slice) {
+			slices.push_back(slice);
+			target = slice;
+			HAGGLE_DBG("Bloomfilter full, added slice %lu with capacity %u\n", 
+				   slices.size(), slice->capacity);
+		}
+	}
+	
+	if (target != this)
+		return target->add(blob, len);
+	
 	if (type == TYPE_NORMAL) {
 		ret = bloomfilter_add(bf, (const char *)blob, len);
 	} else {
@@ -244,8 +322,36 @@ bool Bloomfilter::add(const DataObjectRef &dObj)
 
 bool Bloomfilter::remove(const unsigned char *blob, size_t len)
 {
+	Bloomfilter *target = NULL;
+	unsigned int num_has = 0;
 	int ret = 0;
 
+	if (!slices.empty()) {
+		// Find the slice that has the data object
+		if (sliceHas(blob, len)) {
+			target = this;
+			num_has++;
+		}
+
+		for (List<Bloomfilter *>::iterator it = slices.begin(); it != slices.end(); it++) {
+			if ((*it)->sliceHas(blob, len)) {
+				target = *it;
+				num_has++;
+			}
+		}
+		
+		if (num_has != 1) {
+			if (num_has > 1) {
+				HAGGLE_DBG("Object in %u bloomfilter slices, cannot tell which one to remove it from\n", 
+					   num_has);
+			}
+			return false;
+		}
+
+		if (target != this)
+			return target->remove(blob, len);
+	}
+	
 	if (type == TYPE_COUNTING) {
 		ret = counting_bloomfilter_remove(cbf, (const char *)blob, len);
 	} else {
@@ -266,6 +372,16 @@ bool Bloomfilter::remove(const DataObjectRef &dObj)
 }
 
 bool Bloomfilter::has(const unsigned char *blob, size_t len) const
+{
+	for (List<Bloomfilter *>::const_iterator it = slices.begin(); it != slices.end(); it++) {
+		if ((*it)->sliceHas(blob, len))
+			return true;
+	}
+	
+	return sliceHas(blob, len);
+}
+
+bool Bloomfilter::sliceHas(const unsigned char *blob, size_t len) const
 {
 	if (type == TYPE_NORMAL) {
 		return bloomfilter_check(bf, (const char *)blob, len) == 1;
@@ -284,8 +400,65 @@ bool Bloomfilter::has(const DataObjectRef &dObj) const
 	return has(dObj->getId());
 }
 
+unsigned long Bloomfilter::hasMany(const DataObjectRefList& dObjs, bool *results) const
+{
+	unsigned long num_found = 0, i = 0;
+	
+	if (dObjs.size() == 0)
+		return 0;
+	
+	if (type == TYPE_NORMAL && slices.empty()) {
+		unsigned int num = dObjs.size();
+		const char **keys = new const char *[num];
+		unsigned int *lens = new unsigned int[num];
+		int *res = new int[num];
+		int ret;
+		
+		for (DataObjectRefList::const_iterator it = dObjs.begin(); it != dObjs.end(); it++, i++) {
+			keys[i] = (const char *)(*it)->getId();
+			lens[i] = DATAOBJECT_ID_LEN;
+		}
+		
+		ret = bloomfilter_check_many(bf, keys, lens, num, res);
+		
+		if (ret > 0) {
+			num_found = ret;
+			
+			if (results) {
+				for (i = 0; i < num; i++)
+					results[i] = (res[i] == 1);
+			}
+		} else if (results) {
+			for (i = 0; i < num; i++)
+				results[i] = false;
+		}
+		
+		delete [] keys;
+		delete [] lens;
+		delete [] res;
+	} else {
+		for (DataObjectRefList::const_iterator it = dObjs.begin(); it != dObjs.end(); it++, i++) {
+			bool found = has(*it);
+			
+			if (found)
+				num_found++;
+			
+			if (results)
+				results[i] = found;
+		}
+	}
+	
+	return num_found;
+}
+
 bool Bloomfilter::merge(const Bloomfilter& bf_merge)
 {
+	if (!slices.empty() || !bf_merge.slices.empty()) {
+		HAGGLE_ERR("Cannot merge scalable bloomfilters\n");
+		return false;
+	}
+	
+
 	if (type == TYPE_NORMAL && bf_merge.type == TYPE_NORMAL){
 		// Cannot merge a counting bloomfilter
 		if (BLOOMFILTER_TOT_LEN(bf) != BLOOMFILTER_TOT_LEN(bf_merge.bf)) {
@@ -313,7 +486,19 @@ Bloomfilter *Bloomfilter::to_noncounting() const
 	if (!bf_copy)
 		return NULL;
 
-	return new Bloomfilter(error_rate, capacity, bf_copy);
+	Bloomfilter *bf_nc = new Bloomfilter(error_rate, capacity, bf_copy);
+	
+	for (List<Bloomfilter *>::const_iterator it = slices.begin(); it != slices.end(); it++) {
+		Bloomfilter *slice = (*it)->to_noncounting();
+		
+		if (!slice) {
+			delete bf_nc;
+			return NULL;
+		}
+		bf_nc->slices.push_back(slice);
+	}
+	
+	return bf_nc;
 }
 
 string Bloomfilter::toBase64(void) const
@@ -383,11 +568,67 @@ string Bloomfilter::toBase64NonCounting(void) const
 	return retval;
 }
 
+string Bloomfilter::toBase64Delta(const Bloomfilter& base) const
+{
+	string retval;
+	
+	if (type != TYPE_NORMAL || base.type != TYPE_NORMAL)
+		return retval;
+	
+	// Deltas only cover a single filter
+	if (!slices.empty() || !base.slices.empty())
+		return retval;
+	
+	char *tmp = bloomfilter_delta_to_base64(base.bf, bf);
+	
+	if (tmp != NULL) {
+		retval = tmp;
+		free(tmp);
+	}
+	
+	return retval;
+}
+
+bool Bloomfilter::applyBase64Delta(const string& b64, bool exact)
+{
+	if (type != TYPE_NORMAL) {
+		HAGGLE_ERR("Cannot apply delta to counting bloomfilter\n");
+		return false;
+	}
+	
+	if (!slices.empty()) {
+		HAGGLE_ERR("Cannot apply delta to scalable bloomfilter\n");
+		return false;
+	}
+	
+	int ret = bloomfilter_delta_apply_base64(bf, b64.c_str(), b64.length(), exact ? 1 : 0);
+	
+	if (ret != MERGE_RESULT_OK) {
+		HAGGLE_DBG("Could not apply bloomfilter delta, error=%d\n", ret);
+		return false;
+	}
+	return true;
+}
+
 Metadata *Bloomfilter::toMetadata(bool keep_counting) const
+{
+	return toMetadataNamed(BLOOMFILTER_METADATA, keep_counting);
+}
+
+Metadata *Bloomfilter::sliceToMetadata(unsigned int i) const
+{
+	for (List<Bloomfilter *>::const_iterator it = slices.begin(); it != slices.end(); it++) {
+		if (i-- == 0)
+			return (*it)->toMetadataNamed(BLOOMFILTER_SLICE_METADATA, false);
+	}
+	return NULL;
+}
+
+Metadata *Bloomfilter::toMetadataNamed(const char *name, bool keep_counting) const
 {
 	char buf[40];
 	string b64;
-	Metadata *m = new XMLMetadata(BLOOMFILTER_METADATA);
+	Metadata *m = new XMLMetadata(name);
 	
 	if (!m)
 		return NULL;
@@ -417,6 +658,27 @@ Metadata *Bloomfilter::toMetadata(bool keep_counting) const
 	return m;
 }
 
+Metadata *Bloomfilter::toMetadataDelta(const Bloomfilter& base) const
+{
+	char buf[40];
+	string b64 = toBase64Delta(base);
+	
+	if (b64.length() == 0)
+		return NULL;
+	
+	Metadata *m = new XMLMetadata(BLOOMFILTER_DELTA_METADATA);
+	
+	if (!m)
+		return NULL;
+	
+	m->setContent(b64);
+	
+	snprintf(buf, 40, "%lu", numObjects());
+	m->setParameter(BLOOMFILTER_METADATA_NUM_OBJECTS_PARAM, buf);
+	
+	return m;
+}
+
 Bloomfilter *Bloomfilter::fromMetadata(const Metadata& m)
 {
 	const char *param;
@@ -424,7 +686,7 @@ Bloomfilter *Bloomfilter::fromMetadata(const Metadata& m)
 	unsigned int capacity = default_capacity;
 	Type_t type;
 	
-	if (!m.isName(BLOOMFILTER_METADATA))
+	if (!m.isName(BLOOMFILTER_METADATA) && !m.isName(BLOOMFILTER_SLICE_METADATA))
 		return NULL;
 	
 	param = m.getParameter(BLOOMFILTER_METADATA_TYPE_PARAM);
@@ -472,10 +734,15 @@ Bloomfilter *Bloomfilter::fromMetadata(const Metadata& m)
 
 unsigned long Bloomfilter::numObjects(void) const
 {
+	unsigned long n = 0;
+	
+	for (List<Bloomfilter *>::const_iterator it = slices.begin(); it != slices.end(); it++)
+		n += (*it)->numObjects();
+	
 	if (type == TYPE_NORMAL) {
-		return bloomfilter_get_n(bf);
+		return n + bloomfilter_get_n(bf);
 	} else {
-		return counting_bloomfilter_get_n(cbf);
+		return n + counting_bloomfilter_get_n(cbf);
 	}
 }
 
@@ -498,6 +765,12 @@ bool Bloomfilter::setRaw(const unsigned char *_bf, size_t _bf_len)
 	if (!_bf || _bf_len == 0)
 		return false;
 
+	// The slices belong to the old filter
+	while (!slices.empty()) {
+		delete slices.front();
+		slices.pop_front();
+	}
+
 	if (type == TYPE_NORMAL) {
 		if (BLOOMFILTER_TOT_LEN(bf) != _bf_len) {
 			HAGGLE_DBG("Old and new bloomfilter differ in length: %lu vs. %lu!\n",
@@ -530,16 +803,227 @@ bool Bloomfilter::setRaw(const unsigned char *_bf, size_t _bf_len)
 	return true;
 }
 
+Bloomfilter::Hash_t Bloomfilter::getHash() const
+{
+	if (!raw)
+		return HASH_UNDEFINED;
+	
+	if (type == TYPE_NORMAL)
+		return (Hash_t)bloomfilter_get_hash(bf);
+	
+	return (Hash_t)counting_bloomfilter_get_hash(cbf);
+}
+
 void Bloomfilter::reset()
 {
+	Hash_t hash = getHash();
+	
 	if (!raw)
 		return;
 	
+	while (!slices.empty()) {
+		delete slices.front();
+		slices.pop_front();
+	}
+	
 	if (type == TYPE_NORMAL) {
 		bloomfilter_free(bf);
-		bf = bloomfilter_new(error_rate, capacity);
+		bf = bloomfilter_new_with_hash(error_rate, capacity, hash);
 	} else {
 		counting_bloomfilter_free(cbf);
-		cbf = counting_bloomfilter_new(error_rate, capacity);
+		cbf = counting_bloomfilter_new_with_hash(error_rate, capacity, hash);
+	}
+}
+
+/*
+	A filter is full when half of its bins are expected to be set, which
+	is where the false positive rate of a filter with the optimal number
+	of hash functions reaches its target.
+*/
+bool Bloomfilter::isFull() const
+{
+	unsigned int m, k;
+	
+	if (type == TYPE_NORMAL) {
+		m = bf->m;
+		k = bf->k;
+	} else {
+		m = cbf->m;
+		k = cbf->k;
+	}
+	
+	if (k == 0)
+		return false;
+	
+	return (double)numObjects() >= (double)m * log(2.0) / k;
+}
+
+Bloomfilter *Bloomfilter::newSlice() const
+{
+	unsigned int n = slices.size() + 1;
+	double slice_error_rate = error_rate * pow(BLOOMFILTER_SCALABLE_TIGHTENING, (double)n);
+	unsigned int slice_capacity = capacity;
+	Bloomfilter *slice;
+	
+	while (n--)
+		slice_capacity *= BLOOMFILTER_SCALABLE_GROWTH;
+	
+	slice = new Bloomfilter(type, slice_error_rate, slice_capacity);
+	
+	if (!slice)
+		return NULL;
+	
+	if (!slice->raw) {
+		delete slice;
+		return NULL;
+	}
+	
+	// Use the same hash as the first filter
+	if (slice->getHash() != getHash()) {
+		if (type == TYPE_NORMAL) {
+			bloomfilter_free(slice->bf);
+			slice->bf = bloomfilter_new_with_hash(slice_error_rate, slice_capacity, getHash());
+		} else {
+			counting_bloomfilter_free(slice->cbf);
+			slice->cbf = counting_bloomfilter_new_with_hash(slice_error_rate, slice_capacity, getHash());
+		}
+		
+		if (!slice->raw) {
+			delete slice;
+			return NULL;
+		}
+	}
+	
+	return slice;
+}
+
+bool Bloomfilter::addSlice(Bloomfilter *slice)
+{
+	if (!slice)
+		return false;
+	
+	if (slice->type != type || !slice->slices.empty()) {
+		HAGGLE_ERR("Bad bloomfilter slice\n");
+		delete slice;
+		return false;
 	}
+	
+	slices.push_back(slice);
+	
+	return true;
+}
+
+unsigned char *Bloomfilter::getSlicesRawAlloc(size_t *len) const
+{
+	unsigned char *raw_slices, *p;
+	
+	*len = 0;
+	
+	for (List<Bloomfilter *>::const_iterator it = slices.begin(); it != slices.end(); it++)
+		*len += (*it)->getRawLen();
+	
+	if (*len == 0)
+		return NULL;
+	
+	raw_slices = (unsigned char *)malloc(*len);
+	
+	if (!raw_slices) {
+		*len = 0;
+		return NULL;
+	}
+	
+	p = raw_slices;
+	
+	for (List<Bloomfilter *>::const_iterator it = slices.begin(); it != slices.end(); it++) {
+		memcpy(p, (*it)->getRaw(), (*it)->getRawLen());
+		p += (*it)->getRawLen();
+	}
+	
+	return raw_slices;
+}
+
+bool Bloomfilter::setSlicesRaw(const unsigned char *raw_slices, size_t len)
+{
+	while (!slices.empty()) {
+		delete slices.front();
+		slices.pop_front();
+	}
+	
+	while (len > 0) {
+		size_t slice_len;
+		
+		// Each raw slice starts with a header that gives its length
+		if (type == TYPE_NORMAL) {
+			if (len < sizeof(struct bloomfilter))
+				return false;
+			slice_len = BLOOMFILTER_TOT_LEN((const struct bloomfilter *)raw_slices);
+		} else {
+			if (len < sizeof(struct counting_bloomfilter))
+				return false;
+			slice_len = COUNTING_BLOOMFILTER_TOT_LEN((const struct counting_bloomfilter *)raw_slices);
+		}
+		
+		if (slice_len > len)
+			return false;
+		
+		if (!addSlice(create(raw_slices, slice_len)))
+			return false;
+		
+		raw_slices += slice_len;
+		len -= slice_len;
+	}
+	
+	return true;
+}
+
+size_t Bloomfilter::getTotalRawLen() const
+{
+	size_t len = getRawLen();
+	
+	for (List<Bloomfilter *>::const_iterator it = slices.begin(); it != slices.end(); it++)
+		len += (*it)->getRawLen();
+	
+	return len;
+}
+
+double Bloomfilter::estimatedErrorRate() const
+{
+	double p_none = 1.0;
+	unsigned int m, k;
+	unsigned long n;
+	
+	if (type == TYPE_NORMAL) {
+		m = bf->m;
+		k = bf->k;
+		n = bloomfilter_get_n(bf);
+	} else {
+		m = cbf->m;
+		k = cbf->k;
+		n = counting_bloomfilter_get_n(cbf);
+	}
+	
+	if (m > 0)
+		p_none = 1.0 - pow(1.0 - exp(-(double)k * n / m), (double)k);
+	
+	// A false positive in any slice is a false positive of the filter
+	for (List<Bloomfilter *>::const_iterator it = slices.begin(); it != slices.end(); it++)
+		p_none *= 1.0 - (*it)->estimatedErrorRate();
+	
+	return 1.0 - p_none;
+}
+
+bool Bloomfilter::equals(const Bloomfilter& _bf) const
+{
+	if (getRawLen() != _bf.getRawLen() || 
+	    memcmp(getRaw(), _bf.getRaw(), getRawLen()) != 0 ||
+	    slices.size() != _bf.slices.size())
+		return false;
+	
+	List<Bloomfilter *>::const_iterator it2 = _bf.slices.begin();
+	
+	for (List<Bloomfilter *>::const_iterator it = slices.begin(); it != slices.end(); it++, it2++) {
+		if (!(*it)->equals(**it2))
+			return false;
+	}
+	return true;
 }
@@ -27,6 +27,9 @@ class Bloomfilter;
 #include "DataObject.h"
 #include "Metadata.h"
 
+#include <haggleutils.h>
+#include <libcpphaggle/List.h>
+
 using namespace haggle;
 
 #define DEFAULT_BLOOMFILTER_ERROR_RATE  (0.01)
@@ -37,6 +40,22 @@ using namespace haggle;
 #define BLOOMFILTER_METADATA_ERROR_RATE_PARAM "error_rate"
 #define BLOOMFILTER_METADATA_CAPACITY_PARAM "capacity"
 #define BLOOMFILTER_METADATA_NUM_OBJECTS_PARAM "num_objects"
+#define BLOOMFILTER_METADATA_VERSION_PARAM "version"
+#define BLOOMFILTER_DELTA_METADATA "BloomfilterDelta"
+#define BLOOMFILTER_DELTA_METADATA_BASE_VERSION_PARAM "base_version"
+#define BLOOMFILTER_REQUEST_METADATA "BloomfilterRequest"
+#define BLOOMFILTER_REQUEST_METADATA_NODE_ID_PARAM "node_id"
+#define BLOOMFILTER_SLICE_METADATA "BloomfilterSlice"
+
+/*
+  A scalable bloomfilter adds a new slice when the newest one is half 
+  full. Each slice has GROWTH times the capacity of the previous one and
+  TIGHTENING times its error rate, so that the compound error rate stays
+  below error_rate / (1 - TIGHTENING).
+*/
+#define BLOOMFILTER_SCALABLE_GROWTH      (2)
+#define BLOOMFILTER_SCALABLE_TIGHTENING  (0.5)
+#define BLOOMFILTER_SCALABLE_MAX_SLICES  (8)
 
 /** */
 #ifdef DEBUG_LEAKS
@@ -51,10 +70,23 @@ public:
 		TYPE_COUNTING,
 		TYPE_UNDEFINED
 	} Type_t;
+	/*
+	  The hash used to compute the bins. The hash is carried in the
+	  raw bloomfilter, so filters received from other nodes keep the
+	  hash they were created with.
+	*/
+	typedef enum {
+		HASH_SHA1 = BF_HASH_SHA1,
+		HASH_DOUBLE = BF_HASH_DOUBLE,
+		HASH_BLOCKED = BF_HASH_BLOCKED,
+		HASH_UNDEFINED
+	} Hash_t;
 private:	
 	static double default_error_rate;
 	static unsigned int default_capacity;
+	static Hash_t default_hash;
 	static const char *type_str[];
+	static const char *hash_str[];
 	Type_t type;
 	double error_rate;
 	unsigned int capacity;
@@ -64,6 +96,14 @@ private:
 		struct counting_bloomfilter *cbf;
 		unsigned char *raw;
 	};
+	bool scalable;
+	/* Slices added to a scalable bloomfilter, oldest first */
+	List<Bloomfilter *> slices;
+	bool isFull() const;
+	Bloomfilter *newSlice() const;
+	/* Checks only this filter, not the slices added to it */
+	bool sliceHas(const unsigned char *blob, size_t len) const;
+	Metadata *toMetadataNamed(const char *name, bool keep_counting) const;
 	/*
 	  Creates a bloomfilter with the given error rate and capacity.
 	*/
@@ -101,6 +141,52 @@ public:
 	static double getDefaultErrorRate() { return default_error_rate; }
 	static void setDefaultCapacity(unsigned int capacity) { if (capacity > 0) default_capacity = capacity; }
 	static unsigned int getDefaultCapacity() { return default_capacity; }
+	static void setDefaultHash(Hash_t hash) { if (hash != HASH_UNDEFINED) default_hash = hash; }
+	static Hash_t getDefaultHash() { return default_hash; }
+	static const char *hashToStr(Hash_t hash) { return hash_str[hash]; }
+	static Hash_t strToHash(const char *str);
+	Hash_t getHash() const;
+	
+	/**
+		A scalable bloomfilter grows by adding slices instead of letting
+		the error rate climb once it holds more data objects than its
+		capacity.
+	*/
+	void setScalable(bool _scalable) { scalable = _scalable; }
+	bool isScalable() const { return scalable; }
+	unsigned int numSlices() const { return slices.size(); }
+	/**
+		Adds a slice, e.g., one read from a node description. The 
+		bloomfilter takes ownership of the slice.
+	*/
+	bool addSlice(Bloomfilter *slice);
+	/**
+		Returns the non-counting metadata of slice number i.
+	*/
+	Metadata *sliceToMetadata(unsigned int i) const;
+	/**
+		Returns the raw slices concatenated in a newly allocated buffer,
+		or NULL if there are no slices.
+	*/
+	unsigned char *getSlicesRawAlloc(size_t *len) const;
+	/**
+		Replaces the slices with those in a buffer returned by 
+		getSlicesRawAlloc().
+	*/
+	bool setSlicesRaw(const unsigned char *raw, size_t len);
+	/**
+		Returns the total size in bytes of the bloomfilter and its slices.
+	*/
+	size_t getTotalRawLen() const;
+	/**
+		Returns the false positive rate estimated from the number of 
+		inserted data objects.
+	*/
+	double estimatedErrorRate() const;
+	/**
+		Returns true if the bloomfilters and their slices are identical.
+	*/
+	bool equals(const Bloomfilter& bf) const;
 
 	bool add(const unsigned char *blob, size_t len);
 	bool add(const DataObjectId_t& id);
@@ -113,6 +199,11 @@ public:
 	   Removes the given blob from the bloomfilter. Only works on 
 	   counting bloomfilters. For non-counting bloomfilters, this function 
 	   does nothing.
+
+	   A scalable bloomfilter does not know which slice a blob was
+	   added to. It only removes the blob if exactly one slice has
+	   it, since a false positive in another slice would otherwise
+	   make it decrement the wrong counters.
 	 */
 
 	bool remove(const unsigned char *blob, size_t len);
@@ -133,6 +224,14 @@ public:
 		Returns true iff the data object is in the bloomfilter.
 	*/	
 	bool has(const DataObjectRef &dObj) const;
+	/**
+		Checks all data objects in the list at once. If results is not
+		NULL, it must have room for one entry per data object, and is set 
+		to true for each data object in the bloomfilter.
+		
+		Returns the number of data objects in the bloomfilter.
+	*/
+	unsigned long hasMany(const DataObjectRefList& dObjs, bool *results = NULL) const;
 
 	bool merge(const Bloomfilter& bf_merge);
 	
@@ -173,7 +272,29 @@ public:
 	*/
 	string toBase64NonCounting() const;
 	
+	/**
+		Returns a Base64 encoded delta that transforms the given base
+		bloomfilter into this bloomfilter. Only works on non-counting 
+		bloomfilters that share the same parameters (size and salts).
+		
+		Returns an empty string if the delta cannot be computed.
+	*/
+	string toBase64Delta(const Bloomfilter& base) const;
+	/**
+		Applies a Base64 encoded delta computed with toBase64Delta(). 
+		If 'exact' is true, this bloomfilter is assumed to be the base 
+		that the delta was computed against, and bins cleared in the 
+		newer version are also cleared here. Otherwise, only the set 
+		bins are applied.
+	*/
+	bool applyBase64Delta(const string& b64, bool exact = true);
+	
 	Metadata *toMetadata(bool keep_counting = false) const;
+	/**
+		Returns metadata carrying a delta against the given base 
+		bloomfilter, or NULL if the delta cannot be computed.
+	*/
+	Metadata *toMetadataDelta(const Bloomfilter& base) const;
 	static Bloomfilter *fromMetadata(const Metadata& m);
 	/**
 		Returns the number of data objects in the bloomfilter.
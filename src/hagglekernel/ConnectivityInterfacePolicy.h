@@ -63,6 +63,11 @@ public:
 	
 	/**
 		Get the lifetime left for this interface in absolute time.
+
+		A policy that returns a valid lifetime says that the interface
+		is dead once that time has passed, and that aging it does not
+		change this. The interface store does not age such interfaces,
+		it only checks them when their lifetime has passed.
 	 */
 	virtual Timeval lifetime() const = 0;
 	/**
@@ -125,7 +125,7 @@ void DataHelper::cleanup()
 DataManager::DataManager(HaggleKernel * _kernel, const bool _setCreateTimeOnBloomfilterUpdate) : 
 	Manager("DataManager", _kernel), localBF(NULL), 
 	setCreateTimeOnBloomfilterUpdate(_setCreateTimeOnBloomfilterUpdate), 
-	keepInBloomfilterOnAging(true)
+	keepInBloomfilterOnAging(true), scalableBloomfilter(false)
 {	
 	if (setCreateTimeOnBloomfilterUpdate) {
 		HAGGLE_DBG("Will set create time in node description when updating bloomfilter\n");
@@ -201,9 +201,13 @@ bool DataManager::init_derived()
 		HAGGLE_ERR("Could not create data manager bloomfilter\n");
 		return false;
 	}
+	localBF->setScalable(scalableBloomfilter);
 	onGetLocalBFCallback = newEventCallback(onGetLocalBF);
 	RepositoryEntryRef lbf = new RepositoryEntry(getName(), "Bloomfilter");
 	kernel->getDataStore()->readRepository(lbf, onGetLocalBFCallback);
+	// The slices of a scalable bloomfilter are read after the filter
+	lbf = new RepositoryEntry(getName(), "Bloomfilter slices");
+	kernel->getDataStore()->readRepository(lbf, onGetLocalBFCallback);
 	
 	HAGGLE_DBG("Starting data helper...\n");
 	helper->start();
@@ -243,6 +247,18 @@ void DataManager::onShutdown()
 	
 	kernel->getDataStore()->insertRepository(lbf);
 	
+	size_t slices_len;
+	unsigned char *slices = localBF->getSlicesRawAlloc(&slices_len);
+	
+	if (slices) {
+		lbf = new RepositoryEntry(getName(), "Bloomfilter slices", slices, slices_len);
+		kernel->getDataStore()->insertRepository(lbf);
+		free(slices);
+	} else {
+		lbf = new RepositoryEntry(getName(), "Bloomfilter slices");
+		kernel->getDataStore()->deleteRepository(lbf);
+	}
+	
 	unregisterWithKernel();
 }
 
@@ -290,6 +306,18 @@ void DataManager::onGetLocalBF(Event *e)
 		// Then this is most likely the local bloomfilter:
 		
 		re = qr->detachFirstRepositoryEntry();
+		
+		if (re && strcmp(re->getKey(), "Bloomfilter slices") == 0) {
+			if (localBF->setSlicesRaw(re->getValueBlob(), re->getValueLen())) {
+				HAGGLE_DBG("Retrieved %u bloomfilter slices from data store\n", 
+					   localBF->numSlices());
+				kernel->getThisNode()->setBloomfilter(*localBF, setCreateTimeOnBloomfilterUpdate);
+			} else {
+				HAGGLE_ERR("Bad bloomfilter slices in data store\n");
+			}
+			delete qr;
+			return;
+		}
 		// Was there a repository entry? => was this really what we expected?
 		if (re) {
 			HAGGLE_DBG("Retrieved bloomfilter from data store\n");
@@ -302,6 +330,7 @@ void DataManager::onGetLocalBF(Event *e)
 					delete localBF;
 				
 				localBF = tmpBF;
+				localBF->setScalable(scalableBloomfilter);
 				kernel->getThisNode()->setBloomfilter(*localBF, setCreateTimeOnBloomfilterUpdate);
 			}
 		}
@@ -484,6 +513,11 @@ void DataManager::onIncomingDataObject(Event *e)
 
 void DataManager::handleVerifiedDataObject(DataObjectRef& dObj)
 {
+	// The data object is not modified after verification, so
+	// read-only access no longer needs locking. The stored and
+	// duplicate flags that the data store sets are atomic.
+	dObj.freeze();
+
 	// insert into database (including filtering)
 	if (dObj->isPersistent()) {
 		kernel->getDataStore()->insertDataObject(dObj, onInsertedDataObjectCallback);
@@ -646,6 +680,35 @@ void DataManager::onConfig(Metadata *m)
 			}
 		}
 		
+		param = dm->getParameter("hash");
+		
+		if (param) {
+			Bloomfilter::Hash_t hash = Bloomfilter::strToHash(param);
+			
+			if (hash != Bloomfilter::HASH_UNDEFINED) {
+				Bloomfilter::setDefaultHash(hash);
+				HAGGLE_DBG("config default bloomfilter hash %s\n", 
+					   Bloomfilter::hashToStr(hash));
+				LOG_ADD("# %s: bloomfilter hash=%s\n", getName(), 
+					Bloomfilter::hashToStr(hash));
+				reset_bloomfilter = true;
+			} else {
+				HAGGLE_ERR("Unknown bloomfilter hash '%s'\n", param);
+			}
+		}
+		
+		param = dm->getParameter("scalable");
+		
+		if (param) {
+			if (strcmp(param, "true") == 0) {
+				scalableBloomfilter = true;
+			} else if (strcmp(param, "false") == 0) {
+				scalableBloomfilter = false;
+			}
+			HAGGLE_DBG("config bloomfilter scalable=%s\n", scalableBloomfilter ? "true" : "false");
+			LOG_ADD("# %s: bloomfilter scalable=%s\n", getName(), scalableBloomfilter ? "true" : "false");
+		}
+		
 		if (reset_bloomfilter) {
 			if (localBF)
 				delete localBF;
@@ -656,6 +719,9 @@ void DataManager::onConfig(Metadata *m)
 				HAGGLE_ERR("Could not create data manager bloomfilter\n");
 			}
 		}
+		
+		if (localBF)
+			localBF->setScalable(scalableBloomfilter);
 	}
 
 	dm = m->getMetadata("Aging");
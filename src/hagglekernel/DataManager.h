@@ -76,6 +76,7 @@ class DataManager : public Manager
 	Bloomfilter *localBF;
 	bool setCreateTimeOnBloomfilterUpdate;
 	bool keepInBloomfilterOnAging;
+	bool scalableBloomfilter;
 	unsigned long agingMaxAge;
 	unsigned long agingPeriod;
 #if defined(DEBUG)
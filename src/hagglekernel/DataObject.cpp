@@ -106,10 +106,11 @@ DataObject::DataObject(InterfaceRef _localIface, InterfaceRef _remoteIface, cons
 		storagepath(_storagepath), dataLen(0), createTime(-1), receiveTime(-1), 
                 localIface(_localIface), remoteIface(_remoteIface), rxTime(0), 
                 persistent(true), duplicate(false), stored(false), isNodeDesc(false), 
-		isThisNodeDesc(false), controlMessage(false), putData_data(NULL), 
+		hasDescribedNodeId(false), isThisNodeDesc(false), controlMessage(false), putData_data(NULL), 
 		dataState(DATA_STATE_UNKNOWN)
 {
 	memset(id, 0, sizeof(DataObjectId_t));
+	memset(describedNodeId, 0, sizeof(describedNodeId));
 }
 
 // Copy constructor
@@ -117,6 +118,7 @@ DataObject::DataObject(const DataObject& dObj) :
 #ifdef DEBUG_LEAKS
                 LeakMonitor(LEAK_TYPE_DATAOBJECT),
 #endif
+                RefCounted(),
                 signatureStatus(dObj.signatureStatus),
                 signee(dObj.signee), signature(NULL), signature_len(dObj.signature_len), 
 		num(totNum++), metadata(dObj.metadata ? dObj.metadata->copy() : NULL), 
@@ -126,13 +128,14 @@ DataObject::DataObject(const DataObject& dObj) :
 		receiveTime(dObj.receiveTime), localIface(dObj.localIface), 
 		remoteIface(dObj.remoteIface), rxTime(dObj.rxTime), 
 		persistent(dObj.persistent), duplicate(false), 
-		stored(dObj.stored), isNodeDesc(dObj.isNodeDesc), 
-		isThisNodeDesc(dObj.isThisNodeDesc),
+		stored(atomic_read(&dObj.stored)), isNodeDesc(dObj.isNodeDesc), 
+		hasDescribedNodeId(dObj.hasDescribedNodeId), isThisNodeDesc(dObj.isThisNodeDesc),
 		controlMessage(false), putData_data(NULL), dataState(dObj.dataState)
 {
 	memcpy(id, dObj.id, DATAOBJECT_ID_LEN);
 	memcpy(idStr, dObj.idStr, MAX_DATAOBJECT_ID_STR_LEN);
 	memcpy(dataHash, dObj.dataHash, sizeof(DataHash_t));
+	memcpy(describedNodeId, dObj.describedNodeId, sizeof(describedNodeId));
 	
 	if (dObj.signature && signature_len) {
 		signature = (unsigned char *)malloc(signature_len);
@@ -268,7 +271,7 @@ DataObject *DataObject::create(const unsigned char *raw, size_t len, InterfaceRe
 	*/
 	dObj->filepath = filepath;
 	dObj->filename = filename;
-	dObj->stored = stored;
+	dObj->setStored(stored);
 
 	if (filepath.length()) {
 		if (!dObj->setFilePath(filepath, datalen)) {
@@ -353,7 +356,7 @@ DataObject::~DataObject()
 	if (signature)
 		free(signature);
 
-	if (!stored) {
+	if (!isStored()) {
 		deleteData();
 	}
 }
@@ -1130,9 +1133,26 @@ int DataObject::parseMetadata(bool from_network)
 	// Check if this is a node description. 
 	Metadata *m = metadata->getMetadata(NODE_METADATA);
 
-	if (m)
+	if (m) {
 		isNodeDesc = true;
 
+		// Decode the id of the described node once here, so that
+		// checking whom a node description describes does not
+		// require creating a node from it
+		pval = m->getParameter(NODE_METADATA_ID_PARAM);
+
+		if (pval) {
+			struct base64_decode_context b64_ctx;
+			size_t decodelen = sizeof(describedNodeId);
+
+			base64_decode_ctx_init(&b64_ctx);
+			
+			hasDescribedNodeId = base64_decode(&b64_ctx, pval, strlen(pval), 
+							   (char *)describedNodeId, &decodelen) && 
+				decodelen == sizeof(describedNodeId);
+		}
+	}
+
 	// Check if this is a control message from an application
 	m = metadata->getMetadata(DATAOBJECT_METADATA_APPLICATION);
 
@@ -32,6 +32,7 @@ class DataObjectDataRetriever;
 using namespace haggle;
 
 typedef Reference<DataObject> DataObjectRef;
+typedef ReferenceList<DataObject> DataObjectRefList;
 
 #define DATAOBJECT_ID_LEN SHA_DIGEST_LENGTH
 typedef unsigned char DataObjectId_t[DATAOBJECT_ID_LEN];
@@ -148,18 +149,17 @@ class DataObjectDataRetriever {
    simpler.
 */
 typedef Reference<DataObjectDataRetriever> DataObjectDataRetrieverRef;
-typedef ReferenceList<DataObject> DataObjectRefList;
 
 /** */
 #if OMNETPP
 #include <omnetpp.h>
-class DataObject : public cObject
+class DataObject : public cObject, public RefCounted
 {
 #else
 #ifdef DEBUG_LEAKS
-class DataObject : public LeakMonitor
+class DataObject : public LeakMonitor, public RefCounted
 #else
-class DataObject
+class DataObject : public RefCounted
 #endif
 {
 #endif /* OMNETPP */
@@ -211,9 +211,15 @@ class DataObject
         InterfaceRef remoteIface; // The remote interface from which this data object was sent
         unsigned long rxTime;  // Time taken to transfer/receive the object in milliseconds
         bool persistent; // Determines whether data object should be stored persistently
-        bool duplicate; // Set if the data object was received, but already existed in the data store
-	bool stored; // Set if the data object is stored in the data store
+	// The data store sets these flags after the data object has been
+	// frozen, so they are read and set atomically.
+        atomic_t duplicate; // Set if the data object was received, but already existed in the data store
+	atomic_t stored; // Set if the data object is stored in the data store
 	bool isNodeDesc; // True if this is a node description
+	// The id of the node that a node description describes, decoded
+	// once when the metadata is parsed. Node ids are SHA1 digests.
+	unsigned char describedNodeId[SHA_DIGEST_LENGTH];
+	bool hasDescribedNodeId;
 	bool isThisNodeDesc; // True iff this is the node description for the local node.
 	bool controlMessage; // True if this is a control message from an application
         /*
@@ -329,11 +335,17 @@ public:
 	Timeval getReceiveTime() const { return receiveTime; }
 	void setReceiveTime(Timeval t) { receiveTime = t; }
 	bool isNodeDescription() const { return isNodeDesc; }
+	/**
+	   Returns the id of the node that this node description
+	   describes, or NULL if this is not a node description or it
+	   has no valid id.
+	 */
+	const unsigned char *getDescribedNodeId() const { return hasDescribedNodeId ? describedNodeId : NULL; }
 	void setIsThisNodeDescription(bool yes) { isThisNodeDesc = yes; }
 	bool isThisNodeDescription() const { return isThisNodeDesc; }
 	bool isControlMessage() const { return controlMessage; }
-	void setStored(bool _stored = true) { stored = _stored; }
-	bool isStored() const { return stored; }
+	void setStored(bool _stored = true) { atomic_set(&stored, _stored); }
+	bool isStored() const { return atomic_read(&stored) != 0; }
 
 	// Metadata functions
 	const Metadata *toMetadata() const;
@@ -354,10 +366,10 @@ public:
         void setThumbnail(char *data, long len);
         
         void setDuplicate(bool duplicate = true) {
-                this->duplicate = duplicate;
+                atomic_set(&this->duplicate, duplicate);
         }
         bool isDuplicate() const {
-                return duplicate;
+                return atomic_read(&duplicate) != 0;
         }
         // Data/File functions
         const string &getFilePath() const {
@@ -306,6 +306,16 @@ void DebugManager::dumpTo(SOCKET client_sock, DataStoreDump *dump)
                 }
         }
 	*/
+	const Bloomfilter *bf = kernel->getThisNode()->getBloomfilter();
+	char bfinfo[200];
+	
+	snprintf(bfinfo, sizeof(bfinfo), 
+		 "<BloomfilterInfo num_objects=\"%lu\" num_slices=\"%u\" size=\"%lu\" estimated_error_rate=\"%lf\"/>\n",
+		 bf->numObjects(), bf->numSlices(), (unsigned long)bf->getTotalRawLen(), bf->estimatedErrorRate());
+	
+	if (!sendString(client_sock, bfinfo))
+		return;
+	
         NodeRefList nl;
 	
         kernel->getNodeStore()->retrieveNeighbors(nl);
@@ -328,6 +338,33 @@ void DebugManager::dumpTo(SOCKET client_sock, DataStoreDump *dump)
 	sendString(client_sock, "</HaggleInfo>");
 }
 
+void DebugManager::printBloomfilter()
+{
+	const Bloomfilter *bf = kernel->getThisNode()->getBloomfilter();
+	
+	printf("========== Bloomfilter ==========\n");
+	printf("objects: %lu\n", bf->numObjects());
+	printf("slices: %u%s\n", bf->numSlices(), bf->numSlices() ? "" : " (not grown)");
+	printf("size: %lu bytes\n", (unsigned long)bf->getTotalRawLen());
+	printf("estimated error rate: %lf\n", bf->estimatedErrorRate());
+	printf("=================================\n");
+}
+
+static void printLock(const char *name, RWMutex& m)
+{
+	printf("%s: %lu reads, %lu waited %.3lf s, %lu writes, %lu waited %.3lf s\n", name,
+	       m.getReads(), m.getReadWaits(), m.getReadWaitTime().getTimeAsSecondsDouble(),
+	       m.getWrites(), m.getWriteWaits(), m.getWriteWaitTime().getTimeAsSecondsDouble());
+}
+
+void DebugManager::printStoreLocks()
+{
+	printf("========== Store locks ==========\n");
+	printLock("node store", kernel->getNodeStore()->getMutex());
+	printLock("interface store", kernel->getInterfaceStore()->getMutex());
+	printf("=================================\n");
+}
+
 void DebugManager::onDumpDataStore(Event *e)
 {
 	if (!e || !e->hasData())
@@ -378,6 +415,8 @@ void DebugManager::onDebugReport(Event *e)
 		Timeval::now().getAsString().c_str(), kernel->size()); 
 	kernel->getNodeStore()->print();
 	kernel->getInterfaceStore()->print();
+	printBloomfilter();
+	printStoreLocks();
 
 #ifdef DEBUG_DATASTORE
 	kernel->getDataStore()->print();
@@ -543,11 +582,18 @@ void DebugManager::onWatchableEvent(const Watchable& wbl)
 					free(raw);
 				}
 				break;
+			case 'f':
+				printBloomfilter();
+				break;
+			case 'w':
+				printStoreLocks();
+				break;
 			case 'h':
 			default:
 				printf("========== Console help ==========\n");
 				printf("The keys listed below does the following:\n");
 				printf("c: Certificate list\n");
+				printf("f: Bloomfilter size and estimated error rate\n");
 				printf("b: Node description of \'this node\'\n");		
 #ifdef DEBUG_DATASTORE
 				printf("d: list data store tables\n");
@@ -563,6 +609,7 @@ void DebugManager::onWatchableEvent(const Watchable& wbl)
 				printf("r: Current routing table\n");
 				printf("s: Generate shutdown event (also ctrl-c)\n");
 				printf("t: Print thread registry (running threads)\n");
+				printf("w: Time waited for the node and interface store locks\n");
 				printf("any other key: this help\n");
 				printf("==================================\n");
 				break;
@@ -72,6 +72,8 @@ private:
         EventType debugEType;
 #endif
 	void dumpTo(SOCKET client_sock, DataStoreDump *dump);
+	void printBloomfilter();
+	void printStoreLocks();
 	bool init_derived();
 public:
         DebugManager(HaggleKernel *_kernel = haggleKernel, bool interactive = true);
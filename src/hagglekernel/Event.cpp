@@ -255,7 +255,7 @@ Event::Event(const DebugCmdRef& _dbgCmd, double _delay) :
         
 #endif /* DEBUG */
 
-Event::Event(EventType _type, const NodeRef& _node, const NodeRefList& _nodes, double _delay) : 
+Event::Event(EventType _type, const NodeRef& _node, const NodeRefList& _nodes, unsigned long _flags, double _delay) : 
 #ifdef DEBUG_LEAKS
 	LeakMonitor(LEAK_TYPE_EVENT),
 #endif
@@ -268,7 +268,7 @@ Event::Event(EventType _type, const NodeRef& _node, const NodeRefList& _nodes, d
 	nodes(_nodes),
 	data(NULL),
 	doesHaveData(_node),
-	flags(0)
+	flags(_flags)
 {
 	if (!EVENT_TYPE(type)) {
                 return;
@@ -704,9 +704,9 @@ string Event::getDescription(void)
 	eventNameStr = getName();
 	
 	// Set up the flags field:
-	// Note: for now, only the lowest bit is ever set, so this "loop" only goes
-	// around once. If more flag bits are ever used, please adjust this loop.
-	for (unsigned int i = 0; i < 1; i++) {
+	// Note: most events only use the lowest bit, so this loop lists at least
+	// that bit, and any higher bits up to the highest one that is set.
+	for (unsigned int i = 0; i < 1 || (i < 8 * sizeof(flags) && (flags >> i)); i++) {
 		if ((flags >> i) & 1)
 			flagsStr = "1" + flagsStr;
 		else
@@ -30,6 +30,7 @@ typedef int EventType;
 
 #include <libcpphaggle/Heap.h>
 #include <libcpphaggle/Timeval.h>
+#include <libcpphaggle/Pool.h>
 
 #include "DataObject.h"
 #include "Interface.h"
@@ -81,6 +82,13 @@ typedef int EventType;
 	
 	EVENT_TYPE_NODE_UPDATED:
 	This event occurs when a neighbor node's node description is updated.
+
+	Flag bits (NODE_CHANGED_* in Node.h) say what the node description
+	changed, compared to the one it replaced:
+	1         The interests, or how the node wants them matched.
+	2         The bloomfilter.
+	4         The interfaces.
+	All bits are set if there was no previous node description.
 	
 	EVENT_TYPE_NODE_DESCRIPTION_SEND:
 	This event can be sent by a manager to trigger the local node's node 
@@ -413,7 +421,7 @@ public:
 #ifdef DEBUG
         Event(const DebugCmdRef& _dbgCmdRef, double _delay = 0.0);
 #endif
-        Event(EventType _type, const NodeRef& _node, const NodeRefList& _nodes, double _delay = 0.0);
+        Event(EventType _type, const NodeRef& _node, const NodeRefList& _nodes, unsigned long flags = 0, double _delay = 0.0);
         Event(EventType _type, const DataObjectRef& _dObj, const NodeRefList& _nodes, double _delay = 0.0);
 	Event(EventType _type, const DataObjectRef& _dObj, const NodeRef& _node, const NodeRefList& _nodes, double _delay = 0.0);
         Event(EventType _type, const DataObjectRefList&  _dObjs, unsigned long flags = 0, double _delay = 0.0);
@@ -432,6 +440,11 @@ public:
         const Event& operator=(const Event &);
         ~Event();
 
+	// Events come from a pool, as the kernel creates and deletes one 
+	// for every event it dispatches
+	static void *operator new(size_t n) throw() { return Pool<POOL_SIZE(sizeof(Event))>::alloc(n); }
+	static void operator delete(void *p, size_t n) { Pool<POOL_SIZE(sizeof(Event))>::free(p, n); }
+
 	EventType getType() const {
                 return type;
         }
@@ -15,7 +15,7 @@
 
 #include "Forwarder.h"
 
-DataObjectRef Forwarder::createRoutingInformationDataObject()
+DataObjectRef Forwarder::createRoutingInformationDataObject(const NodeRef& neighbor)
 {
 	// No need to have a reference in this function because it won't be 
 	// visible outside until this function is done with it.
@@ -33,7 +33,7 @@ DataObjectRef Forwarder::createRoutingInformationDataObject()
 	md = md->addMetadata(getName());
 	md->setParameter("node_id", getKernel()->getThisNode()->getIdStr());
 	
-	if (!addRoutingInformation(dObj, md)) {
+	if (!addRoutingInformation(dObj, md, neighbor)) {
 		HAGGLE_ERR("Could not add routing information\n");
 		return NULL;
 	}
@@ -56,7 +56,11 @@ public:
 	// Only useful for asynchronous modules
 	virtual void quit() {}
 
-	DataObjectRef createRoutingInformationDataObject();
+	/**
+		Creates a data object with this module's routing information, to
+		be sent to the given neighbor.
+	*/
+	DataObjectRef createRoutingInformationDataObject(const NodeRef& neighbor);
 	
 	/**
 	 This function determines if the given data object contains routing information
@@ -95,9 +99,11 @@ public:
 	/**
 		A forwarding module should implement addRoutingInformation() in order
 		to generate the Metadata containing routing information which is specific
-		for that forwarding module.
+		for that forwarding module. The neighbor is the node that the routing
+		information will be sent to, so that a module can send only what has
+		changed since it last sent routing information to it.
 	 */
-	virtual bool addRoutingInformation(DataObjectRef& dObj, Metadata *m) { return false; }
+	virtual bool addRoutingInformation(DataObjectRef& dObj, Metadata *m, const NodeRef& neighbor) { return false; }
 
 	/*
 		The following functions are called by the forwarding manager as part of
@@ -160,6 +166,28 @@ public:
 	
 	virtual void generateRoutingInformationDataObject(const NodeRef& neighbor, const NodeRefList *trigger_list = NULL) {}
 	
+	/**
+		Called by the forwarding manager before it sends a data object
+		directly to targets that are neighbors, so that a forwarding module
+		can send a modified copy of it, e.g., with other forwarding metadata.
+		
+		Returns: the data object to send, or NULL if it should not be sent.
+	*/
+	virtual DataObjectRef dataObjectForTargets(const DataObjectRef& dObj) { return dObj; }
+	
+	/**
+		Called when a data object is deleted from the data store, so that
+		a forwarding module can drop any state it keeps for it.
+	*/
+	virtual void dataObjectDeleted(const DataObjectRef& dObj) {}
+	
+	/**
+		Called when routing information that the forwarding module created
+		for a neighbor has been sent to it, or could not be sent, so that
+		a forwarding module can keep track of what the neighbor has got.
+	*/
+	virtual void routingInformationSendResult(const DataObjectRef& dObj, const NodeRef& neighbor, bool success) {}
+	
 	virtual size_t getSaveState(RepositoryEntryList& rel) { return 0; }
 	virtual bool setSaveState(RepositoryEntryRef& e) { return false; }
 	
@@ -83,6 +83,22 @@ void ForwarderAsynchronous::generateRoutingInformationDataObject(const NodeRef&
 	taskQ.insert(new ForwardingTask(FWD_TASK_GENERATE_ROUTING_INFO_DATA_OBJECT, node, trigger_list));
 }
 
+void ForwarderAsynchronous::dataObjectDeleted(const DataObjectRef &dObj)
+{
+	if (!dObj)
+		return;
+	
+	taskQ.insert(new ForwardingTask(FWD_TASK_DATAOBJECT_DELETED, dObj));
+}
+
+void ForwarderAsynchronous::routingInformationSendResult(const DataObjectRef &dObj, const NodeRef &neighbor, bool success)
+{
+	if (!dObj || !neighbor)
+		return;
+	
+	taskQ.insert(new ForwardingTask(success ? FWD_TASK_ROUTING_INFO_SENT : FWD_TASK_ROUTING_INFO_SEND_FAILED, dObj, neighbor));
+}
+
 #ifdef DEBUG
 void ForwarderAsynchronous::printRoutingTable(void)
 {
@@ -143,10 +159,19 @@ bool ForwarderAsynchronous::run(void)
 						_generateDelegatesFor(task->getDataObject(), task->getNode(), task->getNodeList());
 						break;
 					case FWD_TASK_GENERATE_ROUTING_INFO_DATA_OBJECT:
-						task->setDataObject(createRoutingInformationDataObject());
+						task->setDataObject(createRoutingInformationDataObject(task->getNode()));
 						addEvent(new Event(eventType, task));
 						task = NULL;
 						break;
+					case FWD_TASK_DATAOBJECT_DELETED:
+						_dataObjectDeleted(task->getDataObject());
+						break;
+					case FWD_TASK_ROUTING_INFO_SENT:
+						_routingInformationSendResult(task->getDataObject(), task->getNode(), true);
+						break;
+					case FWD_TASK_ROUTING_INFO_SEND_FAILED:
+						_routingInformationSendResult(task->getDataObject(), task->getNode(), false);
+						break;
 #ifdef DEBUG
 					case FWD_TASK_PRINT_RIB:
 						_printRoutingTable();
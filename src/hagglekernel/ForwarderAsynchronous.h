@@ -48,6 +48,12 @@ typedef enum {
 	// Generate the routing information that is sent 
 	// to any new neighbors
 	FWD_TASK_GENERATE_ROUTING_INFO_DATA_OBJECT,
+	// This data object was deleted from the data store
+	FWD_TASK_DATAOBJECT_DELETED,
+	// Routing information was sent to this neighbor
+	FWD_TASK_ROUTING_INFO_SENT,
+	// Routing information could not be sent to this neighbor
+	FWD_TASK_ROUTING_INFO_SEND_FAILED,
 #ifdef DEBUG
 	// Print the routing table:
 	FWD_TASK_PRINT_RIB,
@@ -124,6 +130,16 @@ protected:
 		Does the actual work of getDelegatesFor.
 	*/
 	virtual void _generateDelegatesFor(const DataObjectRef &dObj, const NodeRef &target, const NodeRefList *other_targets) {}
+	
+	/**
+		Does the actual work of dataObjectDeleted.
+	*/
+	virtual void _dataObjectDeleted(const DataObjectRef &dObj) {}
+	
+	/**
+		Does the actual work of routingInformationSendResult.
+	*/
+	virtual void _routingInformationSendResult(const DataObjectRef &dObj, const NodeRef &neighbor, bool success) {}
 		
 #ifdef DEBUG
 	/**
@@ -162,6 +178,10 @@ public:
 	/** See the parent class function with the same name. */
 	void generateDelegatesFor(const DataObjectRef &dObj, const NodeRef &target, const NodeRefList *other_targets);
 	void generateRoutingInformationDataObject(const NodeRef &neighbor, const NodeRefList *trigger_list = NULL);
+	/** See the parent class function with the same name. */
+	void dataObjectDeleted(const DataObjectRef &dObj);
+	/** See the parent class function with the same name. */
+	void routingInformationSendResult(const DataObjectRef &dObj, const NodeRef &neighbor, bool success);
 #ifdef DEBUG
 	/** See the parent class function with the same name. */
 	void printRoutingTable(void);
@@ -18,6 +18,7 @@
 #include "XMLMetadata.h"
 
 #include <math.h>
+#include <haggleutils.h>
 
 // Prophet constants (as per draft v4):
 #define PROPHET_P_ENCOUNTER_DEFAULT (0.75)
@@ -26,6 +27,27 @@
 #define PROPHET_GAMMA_DEFAULT (0.999)
 #define PROPHET_AGING_TIME_UNIT_DEFAULT (10*60) // 10 minutes
 #define PROPHET_AGING_CONSTANT_DEFAULT (0.1)
+#define PROPHET_DELTA_EPSILON_DEFAULT (0.01)
+
+/*
+	Parameters of the routing information metadata. Routing information
+	without the encoding parameter is in the old text format, with one
+	Metric element per node. A node that can decode binary routing 
+	information says so in the accept parameter of the text format.
+*/
+#define PROPHET_METADATA_ENCODING_PARAM "encoding"
+#define PROPHET_METADATA_ENCODING_BINARY "binary"
+#define PROPHET_METADATA_SYNC_PARAM "sync"
+#define PROPHET_METADATA_SYNC_FULL "full"
+#define PROPHET_METADATA_SYNC_DELTA "delta"
+#define PROPHET_METADATA_SEQ_PARAM "seq"
+#define PROPHET_METADATA_RESYNC_PARAM "resync"
+#define PROPHET_METADATA_BASE_PARAM "base"
+#define PROPHET_METADATA_ACCEPT_PARAM "accept"
+
+// The number of binary routing information data objects that a neighbor
+// may not have got before it is sent a full RIB again
+#define PROPHET_MAX_PENDING_UPDATES 8
 
 ForwarderProphet::ForwarderProphet(ForwardingManager *m, const EventType type, 
 				   ForwardingStrategy *_forwarding_strategy) :
@@ -36,8 +58,11 @@ ForwarderProphet::ForwarderProphet(ForwardingManager *m, const EventType type,
 	gamma(PROPHET_GAMMA_DEFAULT),
 	aging_time_unit(PROPHET_AGING_TIME_UNIT_DEFAULT),
 	aging_constant(PROPHET_AGING_CONSTANT_DEFAULT),
+	delta_epsilon(PROPHET_DELTA_EPSILON_DEFAULT),
 	kernel(getManager()->getKernel()), next_id_number(1),
-	rib_timestamp(Timeval::now()), forwarding_strategy(_forwarding_strategy)
+	rib(PROPHET_GAMMA_DEFAULT, PROPHET_AGING_TIME_UNIT_DEFAULT), rib_timestamp(Timeval::now()), stat_contacts(0), stat_bytes_sent(0),
+	stat_bytes_received(0), stat_full_sent(0), stat_delta_sent(0),
+	forwarding_strategy(_forwarding_strategy)
 {
 	// Ensure that the local node's forwarding id is 1:
 	id_for_string(kernel->getThisNode()->getIdStr());
@@ -54,11 +79,16 @@ ForwarderProphet::~ForwarderProphet()
 
 size_t ForwarderProphet::getSaveState(RepositoryEntryList& rel)
 {
-	for (prophet_rib_t::iterator it = rib.begin(); it != rib.end(); it++) {
+	age_rib();
+	
+	for (prophet_node_id_t id = 0; id < rib.end(); id++) {
+		if (rib.get(id) == 0.0)
+			continue;
+		
 		char value[256];
-		snprintf(value, 256, "%lf:%s", (*it).second.first, (*it).second.second.getAsString().c_str());
+		snprintf(value, 256, "%lf:%s", rib.get(id), rib.getAgedTime(id).getAsString().c_str());
 		//printf("Repository value is %s\n", value);
-		rel.push_back(new RepositoryEntry(getName(), id_number_to_nodeid[(*it).first].c_str(), value));
+		rel.push_back(new RepositoryEntry(getName(), id_number_to_nodeid[id].c_str(), value));
 	}
 	
 	return rel.size();
@@ -74,17 +104,12 @@ bool ForwarderProphet::setSaveState(RepositoryEntryRef& e)
 	// Find the separating ':' character in the string
 	size_t pos = value.find(':');
 	
-	prophet_metric_t& metric = rib[id_for_string(e->getKey())];
-	
-	// The first part of the value is the P_ab metric
-	metric.first = strtod(value.substr(0, pos).c_str(), NULL);
-	// The second part is the timeval string
-	metric.second = Timeval(value.substr(pos + 1));
+	// The first part of the value is the P_ab metric, and the second
+	// part is the timeval string
+	if (!rib.set(id_for_string(e->getKey()), strtod(value.substr(0, pos).c_str(), NULL), 
+		     Timeval(value.substr(pos + 1))))
+		return false;
 	
-	/*
-	 printf("orig string=%s metric2=%lf, timeval2=%s\n", 
-		e->getValue(), metric.first, metric.second.getAsString().c_str());
-	*/
 	rib_timestamp = Timeval::now();
 	
 	return true;
@@ -101,45 +126,101 @@ prophet_node_id_t ForwarderProphet::id_for_string(const string& nodeid)
 	}
 	return retval;
 }
+
 /*
- This function takes a metric and ages it if the time since the last aging is
- larger than PROPHET_AGING_TIME_UNIT.
- Typically, this function is called every time a metric is accessed.
+ Conversions between the node id strings that the RIBs are indexed by and 
+ the raw node ids of the binary routing information.
  */
-prophet_metric_t& ForwarderProphet::age_metric(prophet_metric_t& metric, bool force)
+static bool node_id_from_str(const string& str, unsigned char *id)
 {
-	Timeval now = Timeval::now();
-	
-	if (metric.second == 0) {
-		/* The metric is new, so we do not age it, but instead
-		   we set its age timestamp to the current time.
-		 */
-		metric.second = now;
-		return metric;
-	}
-		
-	long K = (long)((now - metric.second).getSeconds() / PROPHET_AGING_TIME_UNIT);
+	if (str.length() != 2 * NODE_ID_LEN)
+		return false;
 	
-	if (K > 0) {
-		double &P_ab = metric.first;
-		/*
-		 Age according to the Prophet draft:
-		 
-			P_(A,B) = P_(A,B)_old * gamma^K (2)
-		 */
-		P_ab = P_ab * pow(PROPHET_GAMMA, K);
+	for (int i = 0; i < NODE_ID_LEN; i++) {
+		unsigned int byte;
 		
-		if (P_ab < 0.000001) {
-			// Let's say it's 0:
-			P_ab = 0.0;
-		}
+		if (sscanf(str.c_str() + 2 * i, "%2x", &byte) != 1)
+			return false;
 		
-		metric.second = now;
+		id[i] = (unsigned char)byte;
 	}
+	return true;
+}
+
+static string node_id_to_str(const unsigned char *id)
+{
+	char str[MAX_NODE_ID_STR_LEN];
 	
-	rib_timestamp = Timeval::now();
+	for (int i = 0; i < NODE_ID_LEN; i++)
+		sprintf(str + 2 * i, "%02x", id[i]);
 	
-	return metric;
+	return string(str);
+}
+
+prophet_wire_metric_t prophet_metric_to_wire(double P)
+{
+	if (P <= 0.0)
+		return 0;
+	if (P >= 1.0)
+		return PROPHET_WIRE_METRIC_MAX;
+	
+	return (prophet_wire_metric_t)(P * PROPHET_WIRE_METRIC_MAX + 0.5);
+}
+
+double prophet_metric_from_wire(prophet_wire_metric_t q)
+{
+	return (double)q / PROPHET_WIRE_METRIC_MAX;
+}
+
+bool prophet_wire_put_entry(unsigned char *entry, const string& node_id, prophet_wire_metric_t q)
+{
+	if (!node_id_from_str(node_id, entry))
+		return false;
+	
+	q = htons(q);
+	memcpy(entry + NODE_ID_LEN, &q, sizeof(q));
+	
+	return true;
+}
+
+void prophet_wire_get_entry(const unsigned char *entry, string& node_id, prophet_wire_metric_t& q)
+{
+	memcpy(&q, entry + NODE_ID_LEN, sizeof(q));
+	q = ntohs(q);
+	node_id = node_id_to_str(entry);
+}
+
+bool prophet_wire_decode(const string& b64, unsigned char **entries, size_t *len)
+{
+	struct base64_decode_context b64_ctx;
+	
+	*entries = NULL;
+	*len = 0;
+	
+	base64_decode_ctx_init(&b64_ctx);
+	
+	if (!base64_decode_alloc(&b64_ctx, b64.c_str(), b64.length(), (char **)entries, len) || 
+	    *len % PROPHET_WIRE_ENTRY_LEN != 0) {
+		if (*entries)
+			free(*entries);
+		
+		*entries = NULL;
+		*len = 0;
+		
+		return false;
+	}
+	return true;
+}
+
+/*
+ This function ages all metrics in the RIB whose last aging was longer than
+ PROPHET_AGING_TIME_UNIT ago. It is called before the RIB is used, and is
+ cheap when no metric needs aging.
+ */
+void ForwarderProphet::age_rib()
+{
+	if (rib.age() > 0)
+		rib_timestamp = Timeval::now();
 }
 /*
  This function is called every time new routing information is received from
@@ -159,19 +240,128 @@ bool ForwarderProphet::newRoutingInformation(const Metadata *m)
 		   getName(),
 		   m->getParameter("node_id"));
 	
-	const Metadata *mm = m->getMetadata("Metric");
+	const char *encoding = m->getParameter(PROPHET_METADATA_ENCODING_PARAM);
+	prophet_peer_sync_t &sync = peer_sync[node_b_id];
 	
-	while (mm) {
-		prophet_node_id_t node_c_id = id_for_string(mm->getParameter("node_id"));
-		double &P_bc = neighbor_rib[node_c_id].first;
-		// Read the metric from the neighbor's metadata:
-		sscanf(mm->getContent().c_str(), "%lf", &P_bc);
+	if (encoding && strcmp(encoding, PROPHET_METADATA_ENCODING_BINARY) == 0) {
+		const char *param = m->getParameter(PROPHET_METADATA_SEQ_PARAM);
+		unsigned long seq = param ? strtoul(param, NULL, 10) : 0;
+		bool full = false;
+		
+		sync.binary = true;
+		
+		param = m->getParameter(PROPHET_METADATA_SYNC_PARAM);
 		
-		//printf("node_c_str=%s node_c_id=%u P_bc=%lf\n", mm->getParameter("node_id"), node_c_id, P_bc);
+		if (param && strcmp(param, PROPHET_METADATA_SYNC_FULL) == 0)
+			full = true;
+		
+		param = m->getParameter(PROPHET_METADATA_RESYNC_PARAM);
+		
+		if (param && strcmp(param, "true") == 0) {
+			// The neighbor does not have what we think we sent it, so
+			// the next routing information we send it is a full RIB
+			HAGGLE_DBG("Node [id=%s] asks for a full RIB\n", m->getParameter("node_id"));
+			sync.reset();
+		}
+		
+		param = m->getParameter(PROPHET_METADATA_BASE_PARAM);
+		
+		unsigned long base = param ? strtoul(param, NULL, 10) : 0;
+		
+		if (full) {
+			neighbor_rib.clear();
+			sync.recv_seq = seq;
+			sync.need_full = false;
+		} else if (seq <= sync.recv_seq) {
+			// A delta that we already have the metrics of, from a 
+			// later one
+			HAGGLE_DBG("Routing information %lu from node [id=%s] is older than %lu\n", 
+				   seq, m->getParameter("node_id"), sync.recv_seq);
+			return true;
+		} else if (base == 0 || base > sync.recv_seq) {
+			// We do not have what the delta is from. It is still 
+			// newer than what we have, so we apply it, but ask for a 
+			// full RIB to get back in sync.
+			HAGGLE_DBG("Routing information %lu from node [id=%s] is a delta from %lu, but we have %lu\n", 
+				   seq, m->getParameter("node_id"), base, sync.recv_seq);
+			sync.need_full = true;
+		} else {
+			sync.recv_seq = seq;
+		}
+		
+		unsigned char *rib_data = NULL;
+		size_t rib_len = 0;
+		
+		if (!prophet_wire_decode(m->getContent(), &rib_data, &rib_len)) {
+			HAGGLE_ERR("Could not decode %s routing information\n", getName());
+			
+			sync.need_full = true;
+			
+			return false;
+		}
+		
+		stat_bytes_received += m->getContent().length();
+		
+		for (size_t i = 0; i < rib_len; i += PROPHET_WIRE_ENTRY_LEN) {
+			prophet_wire_metric_t q;
+			string node_c_str;
+			
+			prophet_wire_get_entry(rib_data + i, node_c_str, q);
+			
+			prophet_node_id_t node_c_id = id_for_string(node_c_str);
+			
+			// A zero metric in a delta means that the neighbor no
+			// longer has a metric for the node
+			if (q == 0)
+				neighbor_rib.erase(node_c_id);
+			else
+				neighbor_rib[node_c_id].first = prophet_metric_from_wire(q);
+		}
+		
+		if (rib_data)
+			free(rib_data);
+	} else {
+		const char *accept = m->getParameter(PROPHET_METADATA_ACCEPT_PARAM);
+		
+		// The neighbor does not know that we can send it binary 
+		// routing information, e.g., since it restarted, or it cannot
+		// decode it, so it does not have what we may have sent it in 
+		// binary
+		sync.binary = accept && strcmp(accept, PROPHET_METADATA_ENCODING_BINARY) == 0;
+		sync.reset();
+		
+		const Metadata *mm = m->getMetadata("Metric");
+		
+		while (mm) {
+			prophet_node_id_t node_c_id = id_for_string(mm->getParameter("node_id"));
+			double &P_bc = neighbor_rib[node_c_id].first;
+			// Read the metric from the neighbor's metadata:
+			sscanf(mm->getContent().c_str(), "%lf", &P_bc);
+			
+			//printf("node_c_str=%s node_c_id=%u P_bc=%lf\n", mm->getParameter("node_id"), node_c_id, P_bc);
+			
+			mm = m->getNextMetadata();
+		}
+	}
+	
+	/*
+	 The neighbor's RIB now holds all its metrics, also the ones that did
+	 not change, so the transitive update covers the whole RIB just as 
+	 when full RIBs were exchanged every time.
+	 */
+	age_rib();
+	
+	double P_ab = rib.get(node_b_id);
+	
+	for (prophet_rib_t::iterator it = neighbor_rib.begin(); it != neighbor_rib.end(); it++) {
+		prophet_node_id_t node_c_id = it->first;
 		
 		if (node_c_id != this_node_id) {
-			double &P_ab = age_metric(rib[node_b_id]).first;
-			double &P_ac = age_metric(rib[node_c_id]).first;
+			double &P_bc = it->second.first;
+			double *P_ac = rib.metric(node_c_id);
+			
+			if (!P_ac)
+				break;
 		
 			/* 
 			 Compute the transitative increase in metric.
@@ -184,10 +374,8 @@ bool ForwarderProphet::newRoutingInformation(const Metadata *m)
 			 As a special case, the P-value for a node itself is always defined to
 			 be 1 (i.e., P_(A,A)=1).
 			*/
-			P_ac = P_ac + (1 - P_ac) * P_ab * P_bc * PROPHET_BETA;
+			*P_ac = *P_ac + (1 - *P_ac) * P_ab * P_bc * PROPHET_BETA;
 		}
-		
-		mm = m->getNextMetadata();
 	}
 	
 	rib_timestamp = Timeval::now();
@@ -199,8 +387,12 @@ bool ForwarderProphet::newRoutingInformation(const Metadata *m)
  Add routing information to a data object.
  The parameter "parent" is the location in the data object where the routing 
  information should be inserted.
+ 
+ Neighbors that can decode it get the RIB in binary, everyone else gets the 
+ text format, which also tells them that we can decode binary routing 
+ information.
  */ 
-bool ForwarderProphet::addRoutingInformation(DataObjectRef& dObj, Metadata *parent)
+bool ForwarderProphet::addRoutingInformation(DataObjectRef& dObj, Metadata *parent, const NodeRef& neighbor)
 {
 	if (!dObj || !parent)
 		return false;
@@ -208,23 +400,232 @@ bool ForwarderProphet::addRoutingInformation(DataObjectRef& dObj, Metadata *pare
 	// Add first our own node ID.
 	parent->setParameter("node_id", kernel->getThisNode()->getIdStr());
 	
-	prophet_rib_t::iterator it;
+	age_rib();
 	
-	for (it = rib.begin(); it != rib.end(); it++) {
-		if (it->second.first != 0.0) {
-			char metric[32];
-			sprintf(metric, "%lf", age_metric(it->second).first);
-			Metadata *mm = parent->addMetadata("Metric", metric);
-			// Mark which node this metric was for.
-			mm->setParameter("node_id", id_number_to_nodeid[it->first]);
+	if (neighbor) {
+		prophet_peer_sync_t &sync = peer_sync[id_for_string(neighbor->getIdStr())];
+		
+		if (sync.binary) {
+			if (!addBinaryRoutingInformation(parent, sync))
+				return false;
+			
+			dObj->setCreateTime(rib_timestamp);
+			
+			return true;
 		}
 	}
 	
+	if (!addTextRoutingInformation(parent))
+		return false;
+	
 	dObj->setCreateTime(rib_timestamp);
+	
+	return true;
+}
+
+bool ForwarderProphet::addTextRoutingInformation(Metadata *parent)
+{
+	parent->setParameter(PROPHET_METADATA_ACCEPT_PARAM, PROPHET_METADATA_ENCODING_BINARY);
+	
+	for (prophet_node_id_t id = 0; id < rib.end(); id++) {
+		double P = rib.get(id);
 		
+		if (P == 0.0)
+			continue;
+		
+		char metric[32];
+		snprintf(metric, 32, "%lf", P);
+		Metadata *mm = parent->addMetadata("Metric", metric);
+		
+		if (!mm)
+			return false;
+		
+		// Mark which node this metric was for.
+		mm->setParameter("node_id", id_number_to_nodeid[id]);
+		
+		stat_bytes_sent += strlen(metric) + id_number_to_nodeid[id].length();
+	}
+	
+	stat_full_sent++;
+	
+	return true;
+}
+
+/*
+ The RIB is sent in binary, as the raw id of each node followed by the metric
+ for it as a 16 bit fixed point number in network byte order, base64 encoded.
+ 
+ Until we know that the neighbor got a full RIB from us, every routing
+ information we send it is a full RIB. After that, it is a delta from the
+ last one we know it got, with the metrics that changed by more than 
+ PROPHET_DELTA_EPSILON since then, and all the metrics in the routing 
+ information we sent after it, since the neighbor might have got that too. 
+ Metrics that dropped to zero are sent as zero. Nothing is committed to the
+ state of the neighbor until it has got the routing information.
+ */
+bool ForwarderProphet::addBinaryRoutingInformation(Metadata *parent, prophet_peer_sync_t& sync)
+{
+	prophet_wire_metric_t epsilon = prophet_metric_to_wire(PROPHET_DELTA_EPSILON);
+	Map<prophet_node_id_t, prophet_wire_metric_t> unacked;
+	unsigned char *rib_data;
+	size_t rib_len = 0;
+	
+	// Give up on deltas when the neighbor does not seem to get what we 
+	// send it
+	if (sync.pending.size() >= PROPHET_MAX_PENDING_UPDATES)
+		sync.reset();
+	
+	bool full = (sync.acked_seq == 0);
+	
+	for (Map<unsigned long, prophet_rib_update_t>::iterator it = sync.pending.begin(); it != sync.pending.end(); it++) {
+		for (Map<prophet_node_id_t, prophet_wire_metric_t>::iterator jt = it->second.metrics.begin(); 
+		     jt != it->second.metrics.end(); jt++)
+			unacked[jt->first] = jt->second;
+	}
+	
+	rib_data = (unsigned char *)malloc(rib.end() * PROPHET_WIRE_ENTRY_LEN + 1);
+	
+	if (!rib_data)
+		return false;
+	
+	unsigned long seq = ++sync.sent_seq;
+	prophet_rib_update_t &update = sync.pending[seq];
+	
+	update.full = full;
+	
+	for (prophet_node_id_t id = 0; id < rib.end(); id++) {
+		prophet_wire_metric_t q = prophet_metric_to_wire(rib.get(id));
+		
+		if (full) {
+			if (q == 0)
+				continue;
+		} else if (unacked.find(id) == unacked.end()) {
+			Map<prophet_node_id_t, prophet_wire_metric_t>::iterator jt = sync.sent.find(id);
+			prophet_wire_metric_t last = jt == sync.sent.end() ? 0 : jt->second;
+			prophet_wire_metric_t diff = q > last ? q - last : last - q;
+			
+			// Metrics that dropped to zero are always sent, so that
+			// the neighbor can remove them
+			if (diff <= epsilon && (q != 0 || diff == 0))
+				continue;
+		}
+		
+		if (!prophet_wire_put_entry(rib_data + rib_len, id_number_to_nodeid[id], q))
+			continue;
+		
+		update.metrics[id] = q;
+		rib_len += PROPHET_WIRE_ENTRY_LEN;
+	}
+	
+	char *b64 = NULL;
+	
+	if (rib_len)
+		base64_encode_alloc((char *)rib_data, rib_len, &b64);
+	
+	free(rib_data);
+	
+	if (rib_len && !b64) {
+		HAGGLE_ERR("Could not encode %s routing information\n", getName());
+		sync.pending.erase(seq);
+		return false;
+	}
+	
+	char str[32];
+	
+	parent->setParameter(PROPHET_METADATA_ENCODING_PARAM, PROPHET_METADATA_ENCODING_BINARY);
+	parent->setParameter(PROPHET_METADATA_SYNC_PARAM, full ? PROPHET_METADATA_SYNC_FULL : PROPHET_METADATA_SYNC_DELTA);
+	snprintf(str, 32, "%lu", seq);
+	parent->setParameter(PROPHET_METADATA_SEQ_PARAM, str);
+	
+	if (!full) {
+		snprintf(str, 32, "%lu", sync.acked_seq);
+		parent->setParameter(PROPHET_METADATA_BASE_PARAM, str);
+	}
+	
+	// We ask for a full RIB until we get one
+	if (sync.need_full)
+		parent->setParameter(PROPHET_METADATA_RESYNC_PARAM, "true");
+	
+	if (b64) {
+		parent->setContent(b64);
+		stat_bytes_sent += strlen(b64);
+		free(b64);
+	}
+	
+	if (full)
+		stat_full_sent++;
+	else
+		stat_delta_sent++;
+	
 	return true;
 }
 
+/*
+ Once the neighbor has got routing information from us, what it has is the
+ metrics that it had got from us before that routing information was 
+ created, updated with the ones in it, since it has all the metrics of the 
+ routing information sent before it that we did not know it got. 
+ 
+ If the routing information could not be sent, it is kept as pending, since
+ it may still be resent, or have got there anyway.
+ */
+void ForwarderProphet::_routingInformationSendResult(const DataObjectRef &dObj, const NodeRef &neighbor, bool success)
+{
+	const Metadata *m = getRoutingInformation(dObj);
+	
+	if (!m || !success)
+		return;
+	
+	const char *param = m->getParameter(PROPHET_METADATA_SEQ_PARAM);
+	
+	// Routing information in the text format is always a full RIB, 
+	// and not part of the exchange of deltas
+	if (!param)
+		return;
+	
+	Map<string, prophet_node_id_t>::iterator idit = nodeid_to_id_number.find(neighbor->getIdStr());
+	
+	if (idit == nodeid_to_id_number.end())
+		return;
+	
+	Map<prophet_node_id_t, prophet_peer_sync_t>::iterator it = peer_sync.find(idit->second);
+	
+	if (it == peer_sync.end())
+		return;
+	
+	prophet_peer_sync_t &sync = it->second;
+	unsigned long seq = strtoul(param, NULL, 10);
+	Map<unsigned long, prophet_rib_update_t>::iterator jt = sync.pending.find(seq);
+	
+	// Either a later one was already known to have got there, or the 
+	// neighbor has asked for a full RIB since this was sent
+	if (jt == sync.pending.end())
+		return;
+	
+	prophet_rib_update_t &update = jt->second;
+	bool full = update.full;
+	
+	if (full)
+		sync.sent.clear();
+	
+	for (Map<prophet_node_id_t, prophet_wire_metric_t>::iterator kt = update.metrics.begin(); kt != update.metrics.end(); kt++) {
+		if (kt->second == 0)
+			sync.sent.erase(kt->first);
+		else
+			sync.sent[kt->first] = kt->second;
+	}
+	
+	sync.acked_seq = seq;
+	
+	// Drop this and earlier routing information, since the neighbor has
+	// the metrics in them now
+	while (!sync.pending.empty() && sync.pending.begin()->first <= seq)
+		sync.pending.erase(sync.pending.begin());
+	
+	HAGGLE_DBG("Node [id=%s] got %s routing information %lu\n", 
+		   neighbor->getIdStr(), full ? "full" : "delta", seq);
+}
+
 void ForwarderProphet::_newNeighbor(const NodeRef &neighbor)
 {
 	// We don't handle routing to anything but other haggle nodes:
@@ -234,11 +635,16 @@ void ForwarderProphet::_newNeighbor(const NodeRef &neighbor)
 	// Update our private metric regarding this node:
 	prophet_node_id_t neighbor_id = id_for_string(neighbor->getIdStr());
 	
-	// Remember that rib[neighbor_id] is an log(n) operation - do it 
-	// sparingly:
-	double &P_ab = rib[neighbor_id].first;
+	age_rib();
+	
+	double *P_ab = rib.metric(neighbor_id);
+	
+	if (!P_ab)
+		return;
+	
+	*P_ab = *P_ab + (1 - *P_ab) * PROPHET_P_ENCOUNTER;
 	
-	P_ab = P_ab + (1 - P_ab) * PROPHET_P_ENCOUNTER;
+	stat_contacts++;
 	
 	rib_timestamp = Timeval::now();
 }
@@ -252,10 +658,9 @@ void ForwarderProphet::_endNeighbor(const NodeRef &neighbor)
 	// Update our private metric regarding this node:
 	prophet_node_id_t neighbor_id = id_for_string(neighbor->getIdStr());
 	
-	// Remember that rib[neighbor_id] is an log(n) operation - do it 
-	// sparingly:
-	prophet_metric_t &metric = rib[neighbor_id];
-	double &P_ab = metric.first;
+	age_rib();
+	
+	double P_ab = rib.get(neighbor_id);
 	
 	/* 
 	 Age by one time interval when neigbhors go away 
@@ -270,30 +675,21 @@ void ForwarderProphet::_endNeighbor(const NodeRef &neighbor)
                 // Let's say it's 0:
                 P_ab = 0.0;
         }
-	metric.second = Timeval::now();
-	rib_timestamp = metric.second;
-}
-
-static void sortedNodeListInsert(List<Pair<NodeRef, double> >& list, NodeRef& node, double metric)
-{
-	List<Pair<NodeRef,double> >::iterator it = list.begin();
-	
-	for (; it != list.end(); it++) {
-		if (metric > (*it).second)
-			break;
-	}
-	list.insert(it, make_pair(node, metric));
+	rib_timestamp = Timeval::now();
+	rib.set(neighbor_id, P_ab, rib_timestamp);
 }
 
 void ForwarderProphet::_generateTargetsFor(const NodeRef &neighbor)
 {
-	List<Pair<NodeRef, double> > sorted_target_list;
+	ProphetTopK best_targets(max_generated_targets);
 	// Figure out which forwarding table to look in:
 	prophet_node_id_t neighbor_id = id_for_string(neighbor->getIdStr());
 	prophet_rib_t &neighbor_rib = neighbor_ribs[neighbor_id];
 	
 	HAGGLE_DBG("%s: Finding targets for which neighbor '%s' is a good delegate\n", 
 		   getName(), neighbor->getName().c_str());
+	
+	age_rib();
 		   
 	// Go through the neighbor's forwarding table:
 	for (prophet_rib_t::iterator it = neighbor_rib.begin(); it != neighbor_rib.end(); it++) {
@@ -303,32 +699,33 @@ void ForwarderProphet::_generateTargetsFor(const NodeRef &neighbor)
 			// Does the neighbor node have a better chance of forwarding to this
 			// node target than we do?
 			// In other words, as the Prophet draft puts it, is P_bd > P_ad?
-			double &P_ad = age_metric(rib[it->first]).first;
-			double &P_bd = it->second.first;
+			double P_ad = rib.get(it->first);
+			double P_bd = it->second.first;
 			
 			if ((*forwarding_strategy)(P_ad, P_bd)) {
-				// Yes: insert this node into the list of targets for this 
-				// delegate forwarder.
-				
-				NodeRef target = Node::create_with_id(Node::TYPE_PEER, id_number_to_nodeid[it->first].c_str(), "PRoPHET target node");
-                                
-				if (target) {
-					sortedNodeListInsert(sorted_target_list, target, P_bd);
-                                        HAGGLE_DBG("Neighbor '%s' is a good delegate for target '%s' [my_metric=%lf, neighbor_metric=%lf]\n", neighbor->getName().c_str(), target->getName().c_str(), P_ad, P_bd);
-                                }
+				// Yes: this node is a target for this delegate 
+				// forwarder, if it is among the best ones.
+				best_targets.insert(it->first, P_bd);
 			}
 		}
 	}
 	
-	if (!sorted_target_list.empty()) {
+	if (best_targets.size()) {
 		NodeRefList targets;
-		unsigned long num_targets = max_generated_targets;
 		
-		while (num_targets && sorted_target_list.size()) {
-			NodeRef target = sorted_target_list.front().first;
-			sorted_target_list.pop_front();
-			targets.push_back(target);
-			num_targets--;
+		// Only create nodes for the targets that we generate, in order 
+		// of decreasing metric
+		best_targets.sort();
+		
+		for (unsigned long i = 0; i < best_targets.size(); i++) {
+			NodeRef target = Node::create_with_id(Node::TYPE_PEER, id_number_to_nodeid[best_targets.getId(i)].c_str(), "PRoPHET target node");
+			
+			if (target) {
+				targets.push_back(target);
+				HAGGLE_DBG("Neighbor '%s' is a good delegate for target '%s' [my_metric=%lf, neighbor_metric=%lf]\n", 
+					   neighbor->getName().c_str(), target->getName().c_str(), 
+					   rib.get(best_targets.getId(i)), best_targets.getMetric(i));
+			}
 		}
 		HAGGLE_DBG("Generated %lu targets for neighbor %s\n", 
 			   targets.size(), neighbor->getName().c_str());
@@ -338,51 +735,71 @@ void ForwarderProphet::_generateTargetsFor(const NodeRef &neighbor)
 
 void ForwarderProphet::_generateDelegatesFor(const DataObjectRef &dObj, const NodeRef &target, const NodeRefList *other_targets)
 {
-	List<Pair<NodeRef, double> > sorted_delegate_list;
+	ProphetTopK best_delegates(max_generated_delegates);
+	Map<prophet_node_id_t, NodeRef> candidates;
+	NodeRefList neighbors;
 	// Figure out which node to look for:
 	prophet_node_id_t target_id = id_for_string(target->getIdStr());
 	
-	// Retreive this value once, since it is an O(log(n)) operation to do:
-	// We age the metric first since the target is not a neighbor
-	double &P_ad = age_metric(rib[target_id]).first;
+	// We age the metrics first since the target is not a neighbor
+	age_rib();
 	
-	// Go through the neighbor's forwarding table:
-	for (Map<prophet_node_id_t, prophet_rib_t>::iterator it = neighbor_ribs.begin(); it != neighbor_ribs.end(); it++) {
+	double P_ad = rib.get(target_id);
+	
+	// Only current neighbors can be delegates, so we only look in the 
+	// forwarding tables of those we have
+	kernel->getNodeStore()->retrieveNeighbors(neighbors);
+	
+	for (NodeRefList::iterator it = neighbors.begin(); it != neighbors.end(); it++) {
+		NodeRef& delegate = *it;
+		
+		if (delegate->getType() != Node::TYPE_PEER)
+			continue;
+		
+		Map<string, prophet_node_id_t>::iterator idit = nodeid_to_id_number.find(delegate->getIdStr());
+		
+		if (idit == nodeid_to_id_number.end())
+			continue;
+		
+		prophet_node_id_t delegate_id = idit->second;
+		
 		// Exclude ourselves and the target node from the list of good delegate
 		// forwarders:
-		if (it->first != this_node_id && it->first != target_id) {
-			NodeRef delegate = kernel->getNodeStore()->retrieve(id_number_to_nodeid[it->first], true);
+		if (delegate_id == this_node_id || delegate_id == target_id || 
+		    isTarget(delegate, other_targets))
+			continue;
+		
+		Map<prophet_node_id_t, prophet_rib_t>::iterator ribit = neighbor_ribs.find(delegate_id);
+		
+		if (ribit == neighbor_ribs.end())
+			continue;
+		
+		// Do not age P_bc since the metric is for a current neighbor... or should we?
+		// The draft is not really clear on how to age metrics for neighbors 
+		prophet_rib_t::iterator jt = ribit->second.find(target_id);
+		double P_bd = jt != ribit->second.end() ? jt->second.first : 0.0;
+		
+		// Would this be a good delegate?
+		if ((*forwarding_strategy)(P_ad, P_bd)) {
+			// Yes: this node is a delegate forwarder for this target,
+			// if it is among the best ones.
+			if (best_delegates.insert(delegate_id, P_bd))
+				candidates[delegate_id] = delegate;
 			
-			if (delegate && !isTarget(delegate, other_targets)) {
-				// Do not age P_bc since the metric is for a current neighbor... or should we?
-				// The draft is not really clear on how to age metrics for neighbors 
-				double &P_bd = it->second[target_id].first;
-				
-				// Would this be a good delegate?
-				if ((*forwarding_strategy)(P_ad, P_bd)) {
-					// Yes: insert this node into the list of delegate forwarders 
-					// for this target.
-					sortedNodeListInsert(sorted_delegate_list, delegate, P_bd);
-				
-					HAGGLE_DBG("Node '%s' is a good delegate for target '%s' [my_metric=%lf, neighbor_metric=%lf]\n", delegate->getName().c_str(), target->getName().c_str(), P_ad, P_bd);
-					
-				} else {
-					HAGGLE_DBG("Node '%s' is NOT a good delegate for target '%s' [my_metric=%lf, neighbor_metric=%lf]\n", delegate->getName().c_str(), target->getName().c_str(), P_ad, P_bd);
-				}
-			}
+			HAGGLE_DBG("Node '%s' is a good delegate for target '%s' [my_metric=%lf, neighbor_metric=%lf]\n", delegate->getName().c_str(), target->getName().c_str(), P_ad, P_bd);
+		} else {
+			HAGGLE_DBG("Node '%s' is NOT a good delegate for target '%s' [my_metric=%lf, neighbor_metric=%lf]\n", delegate->getName().c_str(), target->getName().c_str(), P_ad, P_bd);
 		}
 	}
 	// Add up to max_generated_delegates delegates to the result in order of decreasing metric
-	if (!sorted_delegate_list.empty()) {
+	if (best_delegates.size()) {
 		NodeRefList delegates;
-		unsigned long num_delegates = max_generated_delegates;
 		
-		while (num_delegates && sorted_delegate_list.size()) {
-			NodeRef delegate = sorted_delegate_list.front().first;
-			sorted_delegate_list.pop_front();
-			delegates.push_back(delegate);
-			num_delegates--;
-		}
+		best_delegates.sort();
+		
+		for (unsigned long i = 0; i < best_delegates.size(); i++)
+			delegates.push_back(candidates[best_delegates.getId(i)]);
+		
 		kernel->addEvent(new Event(EVENT_TYPE_DELEGATE_NODES, dObj, target, delegates));
 		HAGGLE_DBG("Generated %lu delegates for target %s\n", delegates.size(), target->getName().c_str());
 	} else {
@@ -456,6 +873,7 @@ void ForwarderProphet::_onForwarderConfig(const Metadata& m)
 		if (ptr && ptr != param && *ptr == '\0') {
 			HAGGLE_DBG("%s: Setting gamma to %lf\n", getName(), p);
 			gamma = p;
+			rib.setAging(gamma, aging_time_unit);
 		}
 	}
 	
@@ -468,6 +886,7 @@ void ForwarderProphet::_onForwarderConfig(const Metadata& m)
 		if (ptr && ptr != param && *ptr == '\0') {
 			HAGGLE_DBG("%s: Setting aging_time_unit to %lf\n", getName(), p);
 			aging_time_unit = p;
+			rib.setAging(gamma, aging_time_unit);
 		}
 	}
 	
@@ -482,6 +901,18 @@ void ForwarderProphet::_onForwarderConfig(const Metadata& m)
 			aging_constant = p;
 		}
 	}
+	
+	param = m.getParameter("delta_epsilon");
+	
+	if (param) {
+		char *ptr = NULL;
+		double p = strtod(param, &ptr);
+		
+		if (ptr && ptr != param && *ptr == '\0' && p >= 0.0) {
+			HAGGLE_DBG("%s: Setting delta_epsilon to %lf\n", getName(), p);
+			delta_epsilon = p;
+		}
+	}
 }
 
 #ifdef DEBUG
@@ -494,17 +925,15 @@ void ForwarderProphet::_printRoutingTable(void)
 		printf("%ld: %s\n", it->first, it->second.c_str());
 	}
 		
+	age_rib();
+	
 	printf("internal: {");
-	prophet_rib_t::iterator jt = rib.begin();
 	
-	while (jt != rib.end()) {
-		// Only age metrics if the node is not a neighbor
-		bool isNeighbor = getKernel()->getNodeStore()->stored(id_number_to_nodeid[jt->first], true);
+	for (prophet_node_id_t id = 0, n = 0; id < rib.end(); id++) {
+		if (rib.get(id) == 0.0)
+			continue;
 		
-		printf("%ld: %lf", jt->first, isNeighbor ? jt->second.first : age_metric(jt->second).first);
-		jt++;
-		if (jt != rib.end())
-			printf(", ");
+		printf("%s%ld: %lf", n++ ? ", " : "", id, rib.get(id));
 	}
 	printf("}\n");
 	
@@ -520,6 +949,14 @@ void ForwarderProphet::_printRoutingTable(void)
 		}
 		printf("}\n");
 	}
+	
+	printf("routing information: %lu full, %lu delta, %lu bytes sent, %lu bytes received, %lu contacts",
+	       stat_full_sent, stat_delta_sent, stat_bytes_sent, stat_bytes_received, stat_contacts);
+	
+	if (stat_contacts)
+		printf(", %.1lf bytes/contact", (double)(stat_bytes_sent + stat_bytes_received) / stat_contacts);
+	
+	printf("\n");
 }
 #endif
 
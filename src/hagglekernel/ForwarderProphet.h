@@ -23,23 +23,98 @@
 class ForwarderProphet;
 
 #include "ForwarderAsynchronous.h"
+#include "ProphetRIB.h"
 
 #include <libcpphaggle/Map.h>
 #include <libcpphaggle/String.h>
 
 using namespace haggle;
+
+typedef Pair<double, Timeval> prophet_metric_t;
+typedef Map<prophet_node_id_t, prophet_metric_t> prophet_rib_t;
+
+/*
+	Metrics are sent as 16 bit fixed point numbers, following the node id
+	of the node they are for, in the binary encoding of the RIB.
+*/
+typedef u_int16_t prophet_wire_metric_t;
+#define PROPHET_WIRE_METRIC_MAX 0xffff
+#define PROPHET_WIRE_ENTRY_LEN (NODE_ID_LEN + sizeof(prophet_wire_metric_t))
+
 /**
-	Prophet forwarding ids are only used internally in the forwarderprophet 
-	manager module, but for technical reasons it needs to be defined here.
+	Converts a metric to and from its 16 bit fixed point wire format.
 */
-typedef unsigned long prophet_node_id_t;
+prophet_wire_metric_t prophet_metric_to_wire(double P);
+double prophet_metric_from_wire(prophet_wire_metric_t q);
 
-// Symbolic constant for the local node.
-#define this_node_id ((prophet_node_id_t) 1)
+/**
+	Writes the entry for a node to the binary RIB. The entry is the raw
+	node id, followed by the metric in network byte order. Returns false
+	if the node id string is not a valid node id.
+*/
+bool prophet_wire_put_entry(unsigned char *entry, const string& node_id, prophet_wire_metric_t q);
 
-typedef Pair<double, Timeval> prophet_metric_t;
-typedef Map<prophet_node_id_t, prophet_metric_t> prophet_rib_t;
+/**
+	Reads the node id string and metric of an entry in the binary RIB.
+*/
+void prophet_wire_get_entry(const unsigned char *entry, string& node_id, prophet_wire_metric_t& q);
+
+/**
+	Decodes base64 encoded binary RIB entries. The entries are allocated,
+	and should be freed with free(). Returns false if the data is not
+	valid base64, or is not a whole number of entries.
+*/
+bool prophet_wire_decode(const string& b64, unsigned char **entries, size_t *len);
+
+/*
+	The metrics in a routing information data object that we sent to a
+	neighbor, kept until we know whether it got there.
+*/
+struct prophet_rib_update_t {
+	// True if the update is a full RIB
+	bool full;
+	// The metrics in the update. A zero metric removes the node.
+	Map<prophet_node_id_t, prophet_wire_metric_t> metrics;
+	prophet_rib_update_t() : full(false) {}
+};
+
+/*
+	The state of the routing information exchange with a neighbor.
 
+	A neighbor that can decode binary routing information tells us so in
+	the routing information it sends us, and all other neighbors get the
+	text format. After a full binary RIB has been sent to a neighbor, we
+	only send the metrics that changed by more than an epsilon since the
+	last routing information that we know it got, and the ones that are
+	still in routing information that we have sent but not heard about.
+	Each binary routing information data object to a neighbor has a
+	sequence number, and the sequence number of the one it is a delta
+	from, so that the neighbor can tell when it does not have that one,
+	e.g., since it restarted. It then asks for a full RIB in the next 
+	routing information it sends us.
+*/
+struct prophet_peer_sync_t {
+	// True if the neighbor can decode binary routing information
+	bool binary;
+	// The sequence number of the last routing information we sent
+	// to the neighbor
+	unsigned long sent_seq;
+	// The sequence number of the last routing information that we
+	// know the neighbor got. Zero means that the next one is a full RIB.
+	unsigned long acked_seq;
+	// The sequence number of the last one we got from it
+	unsigned long recv_seq;
+	// True if we missed routing information from the neighbor, and
+	// should ask it for a full RIB
+	bool need_full;
+	// The metrics that the neighbor has got from us
+	Map<prophet_node_id_t, prophet_wire_metric_t> sent;
+	// The routing information sent after acked_seq, by sequence number
+	Map<unsigned long, prophet_rib_update_t> pending;
+	prophet_peer_sync_t() : binary(false), sent_seq(0), acked_seq(0), recv_seq(0), need_full(false) {}
+	// Makes the next routing information to the neighbor a full RIB
+	void reset() { sent.clear(); pending.clear(); acked_seq = 0; }
+};
 
 #define NF_max (5) // Not sure what a good number is here...
 
@@ -91,12 +166,16 @@ private:
 	double gamma;
 	double aging_time_unit;
 	double aging_constant;
+	// Metrics that change less than this are not sent to neighbors
+	// that already have them
+	double delta_epsilon;
 #define PROPHET_P_ENCOUNTER ForwarderProphet::P_encounter
 #define PROPHET_ALPHA ForwarderProphet::alpha
 #define PROPHET_BETA ForwarderProphet::beta
 #define PROPHET_GAMMA ForwarderProphet::gamma
 #define PROPHET_AGING_TIME_UNIT ForwarderProphet::aging_time_unit
 #define PROPHET_AGING_CONSTANT ForwarderProphet::aging_constant
+#define PROPHET_DELTA_EPSILON ForwarderProphet::delta_epsilon
 
 	HaggleKernel *kernel;
         
@@ -124,13 +203,24 @@ private:
 	/**
 		This is the local node's internal PRoPHET metrics.
 	*/
-	prophet_rib_t rib;
+	ProphetRIB rib;
 	Timeval rib_timestamp;
 	/**
 		This is a mapping of id numbers (of other nodes) to those nodes' public
 		metrics.
 	*/
 	Map<prophet_node_id_t, prophet_rib_t> neighbor_ribs;
+	/**
+		The state of the routing information exchange with each neighbor.
+	*/
+	Map<prophet_node_id_t, prophet_peer_sync_t> peer_sync;
+	
+	// Statistics of the routing information exchange
+	unsigned long stat_contacts;
+	unsigned long stat_bytes_sent;
+	unsigned long stat_bytes_received;
+	unsigned long stat_full_sent;
+	unsigned long stat_delta_sent;
 	
 	size_t getSaveState(RepositoryEntryList& rel);
 	bool setSaveState(RepositoryEntryRef& e);
@@ -143,11 +233,30 @@ private:
 	 */
 	prophet_node_id_t id_for_string(const string& nodeid);
 	
-	prophet_metric_t& age_metric(prophet_metric_t& metric, bool force = false);
+	/**
+		Ages the local node's metrics, if it is time to do so.
+	*/
+	void age_rib();
 	
 	bool newRoutingInformation(const Metadata *m);
 	
-	bool addRoutingInformation(DataObjectRef& dObj, Metadata *parent);
+	bool addRoutingInformation(DataObjectRef& dObj, Metadata *parent, const NodeRef& neighbor);
+	
+	/**
+		Adds the RIB to the routing information in the text format.
+	*/
+	bool addTextRoutingInformation(Metadata *parent);
+	
+	/**
+		Adds the RIB, or what changed in it, to the routing information
+		in the binary format.
+	*/
+	bool addBinaryRoutingInformation(Metadata *parent, prophet_peer_sync_t& sync);
+	
+	/**
+		Does the actual work of routingInformationSendResult.
+	*/
+	void _routingInformationSendResult(const DataObjectRef &dObj, const NodeRef &neighbor, bool success);
 	/**
 		Does the actual work of newNeighbor.
 	*/
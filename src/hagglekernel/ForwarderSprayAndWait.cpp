@@ -0,0 +1,338 @@
+/* Copyright 2009 Uppsala University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <libcpphaggle/Platform.h>
+#include "ForwarderSprayAndWait.h"
+
+#include <haggleutils.h>
+
+ForwarderSprayAndWait::ForwarderSprayAndWait(ForwardingManager *m, const EventType type) :
+	ForwarderAsynchronous(m, type, SPRAY_AND_WAIT_NAME),
+	kernel(getManager()->getKernel()),
+	initial_copies(SPRAY_AND_WAIT_COPIES_DEFAULT),
+	stat_sprayed(0), stat_copies_handed_out(0)
+{
+	HAGGLE_DBG("Forwarding module \'%s\' initialized with %lu copies\n",
+		   getName(), initial_copies);
+}
+
+ForwarderSprayAndWait::~ForwarderSprayAndWait()
+{
+}
+
+size_t ForwarderSprayAndWait::getSaveState(RepositoryEntryList& rel)
+{
+	for (Map<string, spray_state_t>::iterator it = spray_states.begin();
+	     it != spray_states.end(); it++) {
+		char value[32];
+		snprintf(value, 32, "%lu", it->second.copies);
+		rel.push_back(new RepositoryEntry(getName(), it->first.c_str(), value));
+
+		// Only the copies are saved, so the references are not needed
+		// anymore
+		it->second.dObj = NULL;
+		it->second.target = NULL;
+	}
+
+	return rel.size();
+}
+
+bool ForwarderSprayAndWait::setSaveState(RepositoryEntryRef& e)
+{
+	if (strcmp(e->getAuthority(), getName()) != 0)
+		return false;
+
+	char *endptr = NULL;
+	unsigned long copies = strtoul(e->getValueStr(), &endptr, 10);
+
+	if (!endptr || endptr == e->getValueStr())
+		return false;
+
+	// The data object is picked up again when delegates are generated
+	// for it
+	spray_state_t state;
+	state.copies = copies;
+	spray_states[e->getKey()] = state;
+
+	return true;
+}
+
+unsigned long ForwarderSprayAndWait::getCopies(const DataObjectRef& dObj, const string& managerName)
+{
+	const Metadata *m = dObj->getMetadata();
+
+	if (!m)
+		return 0;
+
+	m = m->getMetadata(managerName);
+
+	if (!m)
+		return 0;
+
+	m = m->getMetadata(SPRAY_AND_WAIT_NAME);
+
+	if (!m)
+		return 0;
+
+	const char *param = m->getParameter(SPRAY_AND_WAIT_METADATA_COPIES_PARAM);
+
+	if (!param)
+		return 0;
+
+	char *endptr = NULL;
+	unsigned long copies = strtoul(param, &endptr, 10);
+
+	if (!endptr || endptr == param)
+		return 0;
+
+	return copies;
+}
+
+bool ForwarderSprayAndWait::canCarryCopies(const DataObjectRef& dObj)
+{
+	/*
+		A copy of a data object that is not in the data store would
+		delete the data object's file when it is deleted, and the data
+		object would delete it under the copy.
+	*/
+	return dObj->isStored() || dObj->getDataLen() == 0;
+}
+
+DataObjectRef ForwarderSprayAndWait::setCopies(const DataObjectRef& dObj, unsigned long copies, const string& managerName)
+{
+	if (!canCarryCopies(dObj)) {
+		HAGGLE_DBG("Data object [%s] is not stored, cannot copy it\n", dObj->getIdStr());
+		return NULL;
+	}
+
+	DataObjectRef dObjCopy = dObj->copy();
+
+	if (!dObjCopy || !dObjCopy->getMetadata())
+		return NULL;
+
+	Metadata *fm = dObjCopy->getMetadata()->getMetadata(managerName);
+
+	if (!fm) {
+		fm = dObjCopy->getMetadata()->addMetadata(managerName);
+
+		if (!fm)
+			return NULL;
+	}
+
+	Metadata *m = fm->getMetadata(SPRAY_AND_WAIT_NAME);
+
+	if (!m) {
+		m = fm->addMetadata(SPRAY_AND_WAIT_NAME);
+
+		if (!m)
+			return NULL;
+	}
+
+	m->setParameter(SPRAY_AND_WAIT_METADATA_COPIES_PARAM, (unsigned int)copies);
+
+	return dObjCopy;
+}
+
+ForwarderSprayAndWait::spray_state_t& ForwarderSprayAndWait::getSprayState(const DataObjectRef& dObj)
+{
+	Map<string, spray_state_t>::iterator it = spray_states.find(dObj->getIdStr());
+
+	if (it != spray_states.end())
+		return it->second;
+
+	spray_state_t state;
+
+	state.copies = getCopies(dObj, getManager()->getName());
+
+	// Data objects created on this node, or forwarded by nodes that
+	// do not use Spray and Wait, have no copies in their metadata
+	if (state.copies == 0)
+		state.copies = initial_copies;
+
+	return spray_states.insert(make_pair(string(dObj->getIdStr()), state)).first->second;
+}
+
+bool ForwarderSprayAndWait::spray(spray_state_t& state, const NodeRef& neighbor)
+{
+	if (state.copies <= 1 || !state.dObj)
+		return false;
+
+	unsigned long copies = state.copies;
+	unsigned long handed_out = splitCopies(copies);
+	DataObjectRef dObjCopy = setCopies(state.dObj, handed_out, getManager()->getName());
+
+	if (!dObjCopy)
+		return false;
+
+	NodeRefList delegates;
+
+	delegates.push_back(neighbor);
+
+	kernel->addEvent(new Event(EVENT_TYPE_DELEGATE_NODES, dObjCopy, state.target, delegates));
+
+	HAGGLE_DBG("Handing out %lu of %lu copies of data object [%s] to neighbor %s\n",
+		   handed_out, state.copies, state.dObj->getIdStr(), neighbor->getName().c_str());
+
+	state.copies = copies;
+	stat_sprayed++;
+	stat_copies_handed_out += handed_out;
+
+	// Once we are down to one copy, we only wait for the target
+	if (state.copies <= 1) {
+		state.dObj = NULL;
+		state.target = NULL;
+	}
+
+	return true;
+}
+
+void ForwarderSprayAndWait::_newNeighbor(const NodeRef &neighbor)
+{
+	if (neighbor->getType() != Node::TYPE_PEER)
+		return;
+
+	// Spray the data objects that we still have copies to hand out of
+	for (Map<string, spray_state_t>::iterator it = spray_states.begin();
+	     it != spray_states.end(); it++) {
+		spray_state_t& state = it->second;
+
+		if (!state.dObj)
+			continue;
+
+		// The forwarding manager sends data objects directly to targets
+		if (state.target && strcmp(state.target->getIdStr(), neighbor->getIdStr()) == 0)
+			continue;
+
+		if (neighbor->getBloomfilter()->has(state.dObj))
+			continue;
+
+		spray(state, neighbor);
+	}
+}
+
+void ForwarderSprayAndWait::_generateDelegatesFor(const DataObjectRef &dObj, const NodeRef &target, const NodeRefList *other_targets)
+{
+	NodeRefList neighbors;
+	unsigned long num_delegates = 0;
+
+	// A data object that is not stored, e.g., one that is not
+	// persistent, is not sprayed, since its copies could not carry the
+	// number of copies. It is delivered when we meet the target.
+	if (!canCarryCopies(dObj)) {
+		HAGGLE_DBG("Data object [%s] is not stored, waiting for target %s\n",
+			   dObj->getIdStr(), target->getName().c_str());
+		return;
+	}
+
+	spray_state_t& state = getSprayState(dObj);
+
+	if (state.copies <= 1) {
+		HAGGLE_DBG("Data object [%s] has one copy left, waiting for target %s\n",
+			   dObj->getIdStr(), target->getName().c_str());
+		return;
+	}
+
+	// Remember the data object, so that it can be sprayed to neighbors
+	// that we meet later
+	state.dObj = dObj;
+	state.target = target;
+
+	kernel->getNodeStore()->retrieveNeighbors(neighbors);
+
+	for (NodeRefList::iterator it = neighbors.begin();
+	     it != neighbors.end() && num_delegates < max_generated_delegates; it++) {
+		NodeRef& delegate = *it;
+
+		if (delegate->getType() != Node::TYPE_PEER)
+			continue;
+
+		// Exclude the target nodes, and neighbors that already have the
+		// data object
+		if (strcmp(delegate->getIdStr(), target->getIdStr()) == 0 ||
+		    isTarget(delegate, other_targets) ||
+		    delegate->getBloomfilter()->has(dObj))
+			continue;
+
+		if (!spray(state, delegate))
+			break;
+
+		num_delegates++;
+	}
+
+	HAGGLE_DBG("Generated %lu delegates for target %s\n", num_delegates, target->getName().c_str());
+}
+
+DataObjectRef ForwarderSprayAndWait::dataObjectForTargets(const DataObjectRef& dObj)
+{
+	// A target gets a single copy, so that it does not spray the data
+	// object any further
+	DataObjectRef dObjCopy = setCopies(dObj, 1, getManager()->getName());
+
+	// A data object that cannot carry the copy is sent unchanged, so
+	// that it is still delivered
+	if (!dObjCopy)
+		return dObj;
+
+	return dObjCopy;
+}
+
+void ForwarderSprayAndWait::_dataObjectDeleted(const DataObjectRef &dObj)
+{
+	Map<string, spray_state_t>::iterator it = spray_states.find(dObj->getIdStr());
+
+	if (it == spray_states.end())
+		return;
+
+	HAGGLE_DBG("Data object [%s] deleted, dropping its %lu copies\n",
+		   dObj->getIdStr(), it->second.copies);
+
+	spray_states.erase(it);
+}
+
+void ForwarderSprayAndWait::_onForwarderConfig(const Metadata& m)
+{
+	if (strcmp(getName(), m.getName().c_str()) != 0)
+		return;
+
+	HAGGLE_DBG("Spray and Wait forwarder configuration\n");
+
+	const char *param = m.getParameter(SPRAY_AND_WAIT_METADATA_COPIES_PARAM);
+
+	if (param) {
+		char *ptr = NULL;
+		unsigned long copies = strtoul(param, &ptr, 10);
+
+		if (ptr && ptr != param && *ptr == '\0' && copies > 0) {
+			HAGGLE_DBG("%s: Setting copies to %lu\n", getName(), copies);
+			initial_copies = copies;
+		}
+	}
+}
+
+#ifdef DEBUG
+void ForwarderSprayAndWait::_printRoutingTable(void)
+{
+	printf("%s copies (initial %lu):\n", getName(), initial_copies);
+
+	for (Map<string, spray_state_t>::iterator it = spray_states.begin();
+	     it != spray_states.end(); it++) {
+		printf("[%s]: %lu%s\n", it->first.c_str(), it->second.copies,
+		       it->second.dObj ? " (spraying)" : "");
+	}
+
+	printf("%lu copies handed out to %lu delegates\n",
+	       stat_copies_handed_out, stat_sprayed);
+}
+#endif
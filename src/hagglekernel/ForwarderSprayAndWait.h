@@ -0,0 +1,164 @@
+/* Copyright 2009 Uppsala University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef _FORWARDERSPRAYANDWAIT_H
+#define _FORWARDERSPRAYANDWAIT_H
+
+/*
+	Forward declarations of all data types declared in this file. This is to
+	avoid circular dependencies. If/when a data type is added to this file,
+	remember to add it here.
+*/
+class ForwarderSprayAndWait;
+
+#include "ForwarderAsynchronous.h"
+
+#include <libcpphaggle/Map.h>
+#include <libcpphaggle/String.h>
+
+using namespace haggle;
+
+#define SPRAY_AND_WAIT_NAME "SprayAndWait"
+#define SPRAY_AND_WAIT_COPIES_DEFAULT 8
+
+/*
+	The number of copies that a node gets of a data object is carried in the
+	data object's metadata, as
+
+	<ForwardingManager><SprayAndWait copies="N"/></ForwardingManager>
+
+	This is not part of the data object's id.
+*/
+#define SPRAY_AND_WAIT_METADATA_COPIES_PARAM "copies"
+
+/**
+	Binary Spray and Wait forwarding module.
+
+	The node that a data object is created on has a number of copies of it
+	to hand out. A node with more than one copy gives half of them to each
+	neighbor it meets that does not have the data object (spray phase).
+	A node with only one copy waits until it meets a target, and delivers
+	the data object directly to it (wait phase).
+
+	A target that gets a data object directly gets a single copy, so that
+	it does not spray the data object further.
+
+	Data objects with data that are not in the data store, such as those
+	that are not persistent, are not sprayed. Their copies could not
+	carry the number of copies without owning the data file, so they are
+	only sent, unchanged, to their targets.
+*/
+class ForwarderSprayAndWait : public ForwarderAsynchronous {
+	typedef struct {
+		unsigned long copies;
+		// The data object and the target it was last delegated for, as
+		// long as there are copies to hand out
+		DataObjectRef dObj;
+		NodeRef target;
+	} spray_state_t;
+
+	HaggleKernel *kernel;
+	// The number of copies a data object created on this node has
+	unsigned long initial_copies;
+	// The copies we have of each data object, by data object id
+	Map<string, spray_state_t> spray_states;
+	// Statistics
+	unsigned long stat_sprayed;
+	unsigned long stat_copies_handed_out;
+
+	size_t getSaveState(RepositoryEntryList& rel);
+	bool setSaveState(RepositoryEntryRef& e);
+
+	/**
+		Returns the state for a data object, which is created with the
+		number of copies in its metadata, or initial_copies if there is
+		none.
+	*/
+	spray_state_t& getSprayState(const DataObjectRef& dObj);
+
+	/**
+		Hands out half of the copies to the neighbor, by creating a copy
+		of the data object carrying that number of copies, and delegating
+		it to the neighbor. Returns false if there were no copies to hand
+		out.
+	*/
+	bool spray(spray_state_t& state, const NodeRef& neighbor);
+
+	/**
+		Does the actual work of newNeighbor.
+	*/
+	void _newNeighbor(const NodeRef &neighbor);
+
+	/**
+		Does the actual work of getDelegatesFor.
+	*/
+	void _generateDelegatesFor(const DataObjectRef &dObj, const NodeRef &target, const NodeRefList *other_targets);
+
+	/**
+		Does the actual work of dataObjectDeleted.
+	*/
+	void _dataObjectDeleted(const DataObjectRef &dObj);
+#ifdef DEBUG
+	/**
+		Does the actual work or printRoutingTable().
+	*/
+	void _printRoutingTable(void);
+#endif
+	void _onForwarderConfig(const Metadata& m);
+public:
+	ForwarderSprayAndWait(ForwardingManager *m = NULL, const EventType type = -1);
+	~ForwarderSprayAndWait();
+
+	/**
+		Returns the number of copies to hand out to the receiver, when the
+		holder has the given number of copies, and updates the number that
+		the holder keeps. The holder keeps the larger half.
+	*/
+	static unsigned long splitCopies(unsigned long& copies)
+	{
+		unsigned long handed_out = copies / 2;
+
+		copies -= handed_out;
+
+		return handed_out;
+	}
+
+	/**
+		Returns the number of copies in the metadata of a data object, or
+		zero if there is none. The copies are looked for under the given
+		forwarding manager name.
+	*/
+	static unsigned long getCopies(const DataObjectRef& dObj, const string& managerName);
+
+	/**
+		Returns true if the data object can be copied to carry a number
+		of copies, which it cannot if it has data but is not stored.
+	*/
+	static bool canCarryCopies(const DataObjectRef& dObj);
+
+	/**
+		Returns a copy of the data object, with the given number of copies
+		in its metadata, or NULL if the data object cannot be copied.
+	*/
+	static DataObjectRef setCopies(const DataObjectRef& dObj, unsigned long copies, const string& managerName);
+
+	/**
+		Spray and Wait has no routing information to exchange.
+	*/
+	void generateRoutingInformationDataObject(const NodeRef& neighbor, const NodeRefList *trigger_list = NULL) {}
+	/** See the parent class function with the same name. */
+	DataObjectRef dataObjectForTargets(const DataObjectRef& dObj);
+};
+
+#endif /* _FORWARDERSPRAYANDWAIT_H */
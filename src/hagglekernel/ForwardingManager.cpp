@@ -16,6 +16,7 @@
 #include <libcpphaggle/Platform.h>
 #include "ForwardingManager.h"
 #include "ForwarderProphet.h"
+#include "ForwarderSprayAndWait.h"
 
 #define ENABLE_FORWARDING_METADATA 1
 
@@ -33,7 +34,8 @@ ForwardingManager::ForwardingManager(HaggleKernel * _kernel) :
 #if defined(ENABLE_RECURSIVE_ROUTING_UPDATES)
 	recursiveRoutingUpdates(false),
 #endif	
-	doQueryOnNewDataObject(true)
+	doQueryOnNewDataObject(true),
+	numRematchesAvoided(0)
 {
 }
 
@@ -50,6 +52,12 @@ bool ForwardingManager::init_derived()
 	}
 	ret = setEventHandler(EVENT_TYPE_DATAOBJECT_NEW, onNewDataObject);
 	
+	if (ret < 0) {
+		HAGGLE_ERR("Could not register event handler\n");
+		return false;
+	}
+	ret = setEventHandler(EVENT_TYPE_DATAOBJECT_DELETED, onDeletedDataObject);
+	
 	if (ret < 0) {
 		HAGGLE_ERR("Could not register event handler\n");
 		return false;
@@ -154,9 +162,9 @@ ForwardingManager::~ForwardingManager()
 		delete dataObjectQueryCallback;
 	
 	// Empty the list of forwarded data objects.
-	while (!forwardedObjects.empty()) {
-		HAGGLE_ERR("Clearing unsent data object.\n");
-		forwardedObjects.pop_front();
+	if (!forwardedObjects.empty()) {
+		HAGGLE_ERR("Clearing %lu unsent data objects.\n", forwardedObjects.size());
+		forwardedObjects.clear();
 	}
 	if (nodeQueryCallback)
 		delete nodeQueryCallback;
@@ -269,6 +277,9 @@ void ForwardingManager::setForwardingModule(Forwarder *f, bool deRegisterEvents)
 
 void ForwardingManager::onShutdown()
 {
+	LOG_ADD("# %s: %lu data objects in send list\n", getName(), getSendListSize());
+	LOG_ADD("# %s: %lu node updates not matched again\n", getName(), numRematchesAvoided);
+
 	// Set the current forwarding module to none. See setForwardingModule().
 	unregisterWithKernel();
 }
@@ -396,6 +407,9 @@ void ForwardingManager::onDebugCmd(Event *e)
 				forwardingModule->printRoutingTable();
 			else
 				printf("No forwarding module");
+
+			printf("Send list: %lu data objects\n", getSendListSize());
+			printf("Node updates not matched again: %lu\n", numRematchesAvoided);
 		}
 	}
 }
@@ -439,27 +453,99 @@ bool ForwardingManager::isNeighbor(const NodeRef& node)
    the data object.
  */
 
-bool ForwardingManager::addToSendList(DataObjectRef& dObj, const NodeRef& node, int repeatCount)
+/*
+	Returns the part of a send list key that identifies the node.
+*/
+static string send_list_node_key(const NodeRef& node)
 {
+	if (node->getType() != Node::TYPE_UNDEFINED)
+		return node->getIdStr();
+
+	// Undefined nodes all have the same id, so they are told apart 
+	// by their interfaces instead
+	string key;
+
+	node.lock();
+
+	const InterfaceRefList *ifaces = node->getInterfaces();
+
+	for (InterfaceRefList::const_iterator it = ifaces->begin(); it != ifaces->end(); it++) {
+		key += string((*it)->getTypeStr()) + "/" + (*it)->getIdentifierStr() + ",";
+	}
+	node.unlock();
+
+	return key;
+}
+
+static string send_list_key(const DataObjectRef& dObj, const NodeRef& node)
+{
+	return string(dObj->getIdStr()) + ":" + send_list_node_key(node);
+}
+
+void ForwardingManager::rekeySendList(const NodeRef& undefined, const NodeRef& node)
+{
+	string suffix = ":" + send_list_node_key(undefined);
+	List<Pair<string, int> > moved;
+	forwardingMap::iterator it = forwardedObjects.begin();
+
+	while (it != forwardedObjects.end()) {
+		const string& key = (*it).first;
+
+		if (key.length() > suffix.length() && 
+		    key.substr(key.length() - suffix.length()) == suffix) {
+			moved.push_back(make_pair(key.substr(0, key.length() - suffix.length()), (*it).second));
+			forwardingMap::iterator it_erase = it++;
+			forwardedObjects.erase(it_erase);
+		} else {
+			it++;
+		}
+	}
+
+	for (List<Pair<string, int> >::iterator mit = moved.begin(); mit != moved.end(); mit++) {
+		forwardedObjects.insert(make_pair((*mit).first + ":" + send_list_node_key(node), (*mit).second));
+	}
+	
+	if (!moved.empty()) {
+		HAGGLE_DBG("Moved %lu send list entries of undefined node to node %s\n", 
+			   moved.size(), node->getName().c_str());
+	}
+}
+
+bool ForwardingManager::addToSendList(const DataObjectRef& dObj, const NodeRef& node, int repeatCount)
+{
+	string key = send_list_key(dObj, node);
+
  	// Check if the data object/node pair is already in our send list:
-        for (forwardingList::iterator it = forwardedObjects.begin();
-             it != forwardedObjects.end(); it++) {
-                // Is this it?
-                if ((*it).first.first == dObj &&
-                    (*it).first.second == node) {
-                        // Yep. Do not forward this.
-                        HAGGLE_DBG("Data object already in send list for node '%s'\n",
-                                   node->getName().c_str());
-                        return false;
-                }
-        }
+	if (forwardedObjects.find(key) != forwardedObjects.end()) {
+		// Yep. Do not forward this.
+		HAGGLE_DBG("Data object already in send list for node '%s'\n",
+			   node->getName().c_str());
+		return false;
+	}
 	
         // Remember that we tried to send this:
-        forwardedObjects.push_front(Pair< Pair<const DataObjectRef, const NodeRef>,int>(Pair<const DataObjectRef, const NodeRef>(dObj,node), repeatCount));
+	forwardedObjects.insert(make_pair(key, repeatCount));
         
         return true;
 }
 
+/*
+	A node description with a bloomfilter delta can only be applied by
+	the neighbor that it was sent to. The node manager stores the node
+	description with the resulting bloomfilter in its place.
+*/
+static bool hasBloomfilterDelta(const DataObjectRef& dObj)
+{
+	const Metadata *nm;
+
+	if (!dObj->isNodeDescription())
+		return false;
+
+	nm = dObj->getMetadata()->getMetadata(NODE_METADATA);
+
+	return nm && nm->getMetadata(BLOOMFILTER_DELTA_METADATA);
+}
+
 bool ForwardingManager::shouldForward(const DataObjectRef& dObj, const NodeRef& node)
 {
         NodeRef peer;
@@ -469,17 +555,17 @@ bool ForwardingManager::shouldForward(const DataObjectRef& dObj, const NodeRef&
 		return false;
 	}
 	
-	if (dObj->isNodeDescription()) {
-		NodeRef descNode = Node::create(Node::TYPE_PEER, dObj);
-		
-		if (descNode) {
-			if (descNode == node) {
-				// Do not send the peer its own node description
-				HAGGLE_DBG("Data object [%s] is peer %s's node description. - not sending!\n", 
-					dObj->getIdStr(), node->getName().c_str());
-				return false;
-			}
-		}
+	if (node->isDescribedBy(dObj)) {
+		// Do not send the peer its own node description
+		HAGGLE_DBG("Data object [%s] is peer %s's node description. - not sending!\n", 
+			dObj->getIdStr(), node->getName().c_str());
+		return false;
+	}
+
+	if (hasBloomfilterDelta(dObj)) {
+		HAGGLE_DBG("Data object [%s] is a node description with a bloomfilter delta - not sending!\n", 
+			dObj->getIdStr());
+		return false;
 	}
 	
 	HAGGLE_DBG("%s Checking if data object %s should be forwarded to node %s (%s num=%lu)\n", 
@@ -503,7 +589,48 @@ bool ForwardingManager::shouldForward(const DataObjectRef& dObj, const NodeRef&
 	return false;
 }
 
-void ForwardingManager::forwardByDelegate(DataObjectRef &dObj, const NodeRef &target, 
+void ForwardingManager::shouldForward(const DataObjectRefList& dObjs, const NodeRef& node, bool *forward)
+{
+        NodeRef peer;
+	unsigned long i = 0;
+
+	if (!node) {
+		HAGGLE_ERR("node is NULL\n");
+		
+		for (i = 0; i < dObjs.size(); i++)
+			forward[i] = false;
+		return;
+	}
+
+        // Make sure we use the node in the node store
+        peer = kernel->getNodeStore()->retrieve(node, false);
+
+	if (!peer) {
+		peer = node;
+	} 
+
+	// Check all the data objects against the bloomfilter at once
+	peer->getBloomfilter()->hasMany(dObjs, forward);
+
+	for (DataObjectRefList::const_iterator it = dObjs.begin(); it != dObjs.end(); it++, i++) {
+		if (forward[i]) {
+			HAGGLE_DBG("%s node %s [%s] already has data object [%s]\n", 
+				   getName(), peer->getName().c_str(), peer->getIdStr(), (*it)->getIdStr());
+			forward[i] = false;
+		} else if (node->isDescribedBy(*it)) {
+			// Do not send the peer its own node description
+			HAGGLE_DBG("Data object [%s] is peer %s's node description. - not sending!\n", 
+				   (*it)->getIdStr(), node->getName().c_str());
+		} else if (hasBloomfilterDelta(*it)) {
+			HAGGLE_DBG("Data object [%s] is a node description with a bloomfilter delta - not sending!\n", 
+				   (*it)->getIdStr());
+		} else {
+			forward[i] = true;
+		}
+	}
+}
+
+void ForwardingManager::forwardByDelegate(const DataObjectRef &dObj, const NodeRef &target, 
 					  const NodeRefList *other_targets)
 {
 	if (forwardingModule)
@@ -513,7 +640,7 @@ void ForwardingManager::forwardByDelegate(DataObjectRef &dObj, const NodeRef &ta
 void ForwardingManager::onDataObjectForward(Event *e)
 {
 	// Get the data object:
-	DataObjectRef dObj = e->getDataObject();
+	const DataObjectRef dObj = e->getDataObject();
 
 	if (!dObj) {
 		HAGGLE_ERR("EVENT_TYPE_DATAOBJECT_FORWARD without a data object.\n");
@@ -538,10 +665,12 @@ void ForwardingManager::onDataObjectForward(Event *e)
 		// object is sent directly to the target, otherwise
 		// ask the forwarding module to generate delegates.
 		if (isNeighbor(target)) {
-			if (addToSendList(dObj, target)) {
+			DataObjectRef dObjForTarget = forwardingModule ? forwardingModule->dataObjectForTargets(dObj) : dObj;
+
+			if (dObjForTarget && addToSendList(dObjForTarget, target)) {
 				HAGGLE_DBG("Sending data object %s directly to target neighbor %s\n", 
 					dObj->getIdStr(), target->getName().c_str());
-				kernel->addEvent(new Event(EVENT_TYPE_DATAOBJECT_SEND, dObj, target));
+				kernel->addEvent(new Event(EVENT_TYPE_DATAOBJECT_SEND, dObjForTarget, target));
 			}
 		} else {
 			HAGGLE_DBG("Trying to find delegates for data object %s bound for target %s\n", 
@@ -553,48 +682,61 @@ void ForwardingManager::onDataObjectForward(Event *e)
 
 void ForwardingManager::onSendDataObjectResult(Event *e)
 {
-	DataObjectRef& dObj = e->getDataObject();
+	const DataObjectRef& dObj = e->getDataObject();
 	NodeRef& node = e->getNode();
 
         HAGGLE_DBG("Checking data object results\n");
 
 	// Find the data object in our send list:
-	for (forwardingList::iterator it = forwardedObjects.begin();
-		it != forwardedObjects.end(); it++) {
-		
-		if ((*it).first.first == dObj && (*it).first.second == node) {
-			if (e->getType() == EVENT_TYPE_DATAOBJECT_SEND_SUCCESSFUL) {
-				// Remove the data object - it has been forwarded.
-				forwardedObjects.erase(it);
-			} else if (e->getType() == EVENT_TYPE_DATAOBJECT_SEND_FAILURE) {
-				int repeatCount;
-				repeatCount = (*it).second + 1;
-				// Remove this from the list. It may be reinserted later.
-				forwardedObjects.erase(it);
-				switch (repeatCount) {
-					case 1:
-						// This was the first attempt. Try resending the 
-						// data object:
-						if (isNeighbor(node) && shouldForward(dObj, node) && addToSendList(dObj, node, repeatCount)) {
-							kernel->addEvent(new Event(EVENT_TYPE_DATAOBJECT_SEND, dObj, node));
-						}
-					break;
-					
-					default:
-						// Do nothing. This object has already failed once 
-						// before - give up.
-					break;
+	forwardingMap::iterator it = forwardedObjects.find(send_list_key(dObj, node));
+
+	// If the node became defined while the data object was being sent,
+	// its entry was moved to the defined node
+	NodeRef defined = node;
+
+	if (it == forwardedObjects.end() && node->getType() == Node::TYPE_UNDEFINED) {
+		defined = kernel->getNodeStore()->retrieve(node);
+
+		if (defined && defined->getType() != Node::TYPE_UNDEFINED)
+			it = forwardedObjects.find(send_list_key(dObj, defined));
+		else
+			defined = node;
+	}
+
+	// Tell the forwarding module whether the neighbor got the routing
+	// information it created for it
+	if (forwardingModule && forwardingModule->hasRoutingInformation(dObj))
+		forwardingModule->routingInformationSendResult(dObj, defined,
+							       e->getType() == EVENT_TYPE_DATAOBJECT_SEND_SUCCESSFUL);
+
+	if (it == forwardedObjects.end()) {
+		HAGGLE_DBG("Data object result done\n");
+		return;
+	}
+
+	if (e->getType() == EVENT_TYPE_DATAOBJECT_SEND_SUCCESSFUL) {
+		// Remove the data object - it has been forwarded.
+		forwardedObjects.erase(it);
+	} else if (e->getType() == EVENT_TYPE_DATAOBJECT_SEND_FAILURE) {
+		int repeatCount;
+		repeatCount = (*it).second + 1;
+		// Remove this from the list. It may be reinserted later.
+		forwardedObjects.erase(it);
+		switch (repeatCount) {
+			case 1:
+				// This was the first attempt. Try resending the 
+				// data object:
+				if (isNeighbor(node) && shouldForward(dObj, node) && addToSendList(dObj, node, repeatCount)) {
+					kernel->addEvent(new Event(EVENT_TYPE_DATAOBJECT_SEND, dObj, node));
 				}
-			}
-			// No need to search this list further (the "it" variable is 
-			// garbage anyway...)
-			goto found_it;
+			break;
+			
+			default:
+				// Do nothing. This object has already failed once 
+				// before - give up.
+			break;
 		}
 	}
-
-        HAGGLE_DBG("Data object result done\n");
-found_it:;
-	// Done.
 }
 
 void ForwardingManager::onDataObjectQueryResult(Event *e)
@@ -615,9 +757,24 @@ void ForwardingManager::onDataObjectQueryResult(Event *e)
 	
 	HAGGLE_DBG("Got dataobject query result for target node %s\n", target->getIdStr());
 	
+	DataObjectRefList dObjs;
 	DataObjectRef dObj;
 
-	while (dObj = qr->detachFirstDataObject()) {		
+	while (dObj = qr->detachFirstDataObject())
+		dObjs.push_back(dObj);
+
+	// Does this target already have these data objects, or is one of
+	// them its node description? shouldForward() tells us.
+	bool *forward = new bool[dObjs.size()];
+	unsigned long i = 0;
+
+	shouldForward(dObjs, target, forward);
+
+	for (DataObjectRefList::iterator it = dObjs.begin(); it != dObjs.end(); it++, i++) {
+		dObj = *it;
+
+		if (!forward[i])
+			continue;
 #if defined(ENABLE_FORWARDING_METADATA)
 		Metadata *m = dObj->getMetadata()->getMetadata(getName());
 		unsigned long count = 0;
@@ -626,7 +783,7 @@ void ForwardingManager::onDataObjectQueryResult(Event *e)
 			m = dObj->getMetadata()->addMetadata(getName());
 			
 			if (!m)
-				return;
+				break;
 		} else {
 			char *endptr = NULL;
 			const char *param = m->getParameter("hop_count");
@@ -648,27 +805,28 @@ void ForwardingManager::onDataObjectQueryResult(Event *e)
 			m->setParameter("hop_num", countstr);
 		}
 #endif
-		// Does this target already have this data object, or
-		// is the data object its node description? shouldForward() tells us.
-		if (shouldForward(dObj, target)) {
-			// Is this node a currently available neighbor node?
-			if (isNeighbor(target)) {
-				// Yes: it is it's own best delegate,
-				// so start "forwarding" the object:
-				
-				if (addToSendList(dObj, target)) {
-					kernel->addEvent(new Event(EVENT_TYPE_DATAOBJECT_SEND, dObj, target));
-					HAGGLE_DBG("Sending data object %s directly to target neighbor %s\n", 
-						   dObj->getIdStr(), target->getName().c_str());
-				}
-			} else { 
-				HAGGLE_DBG("Trying to find delegates for data object %s bound for target %s\n", 
+		// Is this node a currently available neighbor node?
+		if (isNeighbor(target)) {
+			// Yes: it is it's own best delegate,
+			// so start "forwarding" the object.
+			// The data object is not modified after this.
+			dObj.freeze();
+			
+			DataObjectRef dObjForTarget = forwardingModule ? forwardingModule->dataObjectForTargets(dObj) : dObj;
+			
+			if (dObjForTarget && addToSendList(dObjForTarget, target)) {
+				kernel->addEvent(new Event(EVENT_TYPE_DATAOBJECT_SEND, dObjForTarget, target));
+				HAGGLE_DBG("Sending data object %s directly to target neighbor %s\n", 
 					   dObj->getIdStr(), target->getName().c_str());
-				forwardByDelegate(dObj, target);
 			}
+		} else { 
+			HAGGLE_DBG("Trying to find delegates for data object %s bound for target %s\n", 
+				   dObj->getIdStr(), target->getName().c_str());
+			forwardByDelegate(dObj, target);
 		}
 	}
         
+	delete [] forward;
 	delete qr;
 }
 
@@ -678,7 +836,7 @@ void ForwardingManager::onNodeQueryResult(Event *e)
 		return;
 	
 	DataStoreQueryResult *qr = static_cast < DataStoreQueryResult * >(e->getData());
-	DataObjectRef dObj = qr->detachFirstDataObject();
+	const DataObjectRef dObj = qr->detachFirstDataObject();
 	const NodeRefList *targets = qr->getNodeList();
 
 	if (!dObj) {
@@ -719,8 +877,11 @@ void ForwardingManager::onNodeQueryResult(Event *e)
 	}
 
 	if (!target_neighbors.empty()) {
-		kernel->addEvent(new Event(EVENT_TYPE_DATAOBJECT_SEND, dObj, 
-					   target_neighbors));
+		DataObjectRef dObjForTargets = forwardingModule ? forwardingModule->dataObjectForTargets(dObj) : dObj;
+		
+		if (dObjForTargets)
+			kernel->addEvent(new Event(EVENT_TYPE_DATAOBJECT_SEND, dObjForTargets, 
+						   target_neighbors));
 	}
 	
 	delete qr;
@@ -868,33 +1029,57 @@ void ForwardingManager::onNodeUpdated(Event *e)
 	// Did this updated node replace an undefined node?
 	// Go through the replaced nodes to find out...
 	NodeRefList::iterator it = replaced.begin();
+	bool new_neighbor = false;
 	
 	while (it != replaced.end()) {
 		// Was this undefined?
-		if ((*it)->getType() == Node::TYPE_UNDEFINED && node->isNeighbor()) {
-			// Yep. Tell the forwarding module that we've got a new neighbor:
-			if (forwardingModule) {
-				forwardingModule->newNeighbor(node);
-				forwardingModule->generateRoutingInformationDataObject(node);
-			}
+		if ((*it)->getType() == Node::TYPE_UNDEFINED) {
+			// Data objects sent to the undefined node are now sent
+			// to this node
+			rekeySendList(*it, node);
 			
-			break;
+			if (node->isNeighbor())
+				new_neighbor = true;
 		}
 		it++;
 	}
 	
+	// Tell the forwarding module that we've got a new neighbor:
+	if (new_neighbor && forwardingModule) {
+		forwardingModule->newNeighbor(node);
+		forwardingModule->generateRoutingInformationDataObject(node);
+	}
+	
 	// Check if there are any pending node queries that have been
 	// initiated by a previous new node contact event (in
 	// onNewNeighbor). In that case, remove the node from the
 	// pendingQueryList so that we do not generate the query
 	// twice.
+	bool pending = false;
+
 	for (List<NodeRef>::iterator it = pendingQueryList.begin(); 
 	     it != pendingQueryList.end(); it++) {
 		if (node == *it) {
 			pendingQueryList.erase(it);
+			pending = true;
 			break;
 		}
 	}
+
+	// The data objects that match the node depend on its
+	// interests, and on its bloomfilter, since the data store
+	// leaves out the data objects that the node already has
+	// before it limits the number of matches. A node that got
+	// some of its matches can therefore be given more when its
+	// bloomfilter changes. If the update changed only the
+	// interfaces, we do not match the node again, unless a query
+	// is pending.
+	if (!pending && !(e->getFlags() & (NODE_CHANGED_INTERESTS | NODE_CHANGED_BLOOMFILTER))) {
+		numRematchesAvoided++;
+		HAGGLE_DBG("%s - interests and bloomfilter of node %s [id=%s] did not change, not matching it again (flags=%lu)\n", 
+			   getName(), node->getName().c_str(), node->getIdStr(), e->getFlags());
+		return;
+	}
 	findMatchingDataObjectsAndTargets(node);
 }
 
@@ -1119,6 +1304,18 @@ void ForwardingManager::onNewDataObject(Event *e)
 	} 
 }
 
+void ForwardingManager::onDeletedDataObject(Event *e)
+{
+	if (!e || !e->hasData() || !forwardingModule)
+		return;
+	
+	DataObjectRefList dObjs = e->getDataObjectList();
+	
+	for (DataObjectRefList::iterator it = dObjs.begin(); it != dObjs.end(); it++) {
+		forwardingModule->dataObjectDeleted(*it);
+	}
+}
+
 void ForwardingManager::onTargetNodes(Event * e)
 {
 	const NodeRef &delegate_node = e->getNode();
@@ -1172,7 +1369,9 @@ void ForwardingManager::onDelegateNodes(Event * e)
 
 	if (!ns.empty()) {
 #if defined(ENABLE_FORWARDING_METADATA)
-		Metadata *m = dObj->getMetadata()->getMetadata(getName());
+		// A frozen data object may already be read without locking,
+		// so its hops are left as they are
+		Metadata *m = dObj.isFrozen() ? NULL : dObj->getMetadata()->getMetadata(getName());
 
 		if (m) {
 			Metadata *hop = m->getMetadata("Hop");
@@ -1185,6 +1384,8 @@ void ForwardingManager::onDelegateNodes(Event * e)
 			}
 		}
 #endif
+		// The data object is not modified after this
+		dObj.freeze();
 		kernel->addEvent(new Event(EVENT_TYPE_DATAOBJECT_SEND, dObj, ns));
 	}
 	
@@ -1234,6 +1435,7 @@ void ForwardingManager::onSendRoutingInformation(Event * e)
  handled configurations:
  - <ForwardingModule>noResolution</ForwardingModule>	(no resolution, nothing!)
  - <ForwardingModule>Prophet</ForwardingModule>		(Prophet)
+ - <ForwardingModule>SprayAndWait</ForwardingModule>	(binary Spray and Wait)
  - <ForwardingModule>noForward</ForwardingModule>	(no forwarding)
  
  default forwarding is defined in ForwardingManager::init_derived(), at the moment Prophet 
@@ -1312,7 +1514,9 @@ void ForwardingManager::onConfig(Metadata *m)
 					// clean up current forwardingModule
 					setForwardingModule(NULL, true);
 				} else if (protocol.compare(PROPHET_NAME) == 0) {
-					setForwardingModule(new ForwarderProphet(this));
+					setForwardingModule(new ForwarderProphet(this, moduleEventType));
+				} else if (protocol.compare(SPRAY_AND_WAIT_NAME) == 0) {
+					setForwardingModule(new ForwarderSprayAndWait(this, moduleEventType));
 				} else if (protocol.compare("noForward") == 0) {
 					setForwardingModule(NULL);
 				} else {
@@ -24,6 +24,8 @@ class ForwardingManager;
 
 #include <libcpphaggle/List.h>
 #include <libcpphaggle/Pair.h>
+#include <libcpphaggle/HashMap.h>
+#include <libcpphaggle/String.h>
 
 using namespace haggle;
 
@@ -36,7 +38,13 @@ using namespace haggle;
 #define MAX_NODES_TO_FIND_FOR_NEW_DATAOBJECTS	(10)
 #define ENABLE_RECURSIVE_ROUTING_UPDATES 1
 
-typedef List< Pair< Pair<const DataObjectRef, const NodeRef>, int> > forwardingList;
+/*
+	The data objects that we have asked to send, and to which node. The key
+	is the data object's id and the node's id, or the node's interfaces if
+	the node is undefined, and the value is the number of failed attempts
+	so far.
+*/
+typedef HashMap<string, int> forwardingMap;
 
 /** */
 class ForwardingManager : public Manager
@@ -53,13 +61,16 @@ class ForwardingManager : public Manager
 	
 	Event *periodicDataObjectQueryEvent;
 	unsigned long periodicDataObjectQueryInterval;
-	forwardingList forwardedObjects;
+	forwardingMap forwardedObjects;
 	Forwarder *forwardingModule;
 	List<NodeRef> pendingQueryList;
 #if defined(ENABLE_RECURSIVE_ROUTING_UPDATES)
 	bool recursiveRoutingUpdates;
 #endif
 	bool doQueryOnNewDataObject;
+	// The number of node updates after which the node was not matched
+	// again, since neither its interests nor its bloomfilter changed
+	unsigned long numRematchesAvoided;
 	// Period in seconds to do periodic node queries during node
 	// contacts. Zero to disable.
 	
@@ -68,7 +79,13 @@ class ForwardingManager : public Manager
 	
         // See comment in ForwardingManager.cpp about isNeighbor()
         bool isNeighbor(const NodeRef& node);
-        bool addToSendList(DataObjectRef& dObj, const NodeRef& node, int repeatCount = 0);
+        bool addToSendList(const DataObjectRef& dObj, const NodeRef& node, int repeatCount = 0);
+	/**
+		Moves the send list entries of an undefined node to the node that
+		it turned out to be, so that they are removed when the send
+		results for that node come back.
+	*/
+	void rekeySendList(const NodeRef& undefined, const NodeRef& node);
 	/**
 		This function changes out the current forwarding module (initially none)
 		to the given forwarding module.
@@ -89,7 +106,13 @@ class ForwardingManager : public Manager
 
 	Forwarder *getForwarder() { return forwardingModule; }
 	bool shouldForward(const DataObjectRef& dObj, const NodeRef& node);
-	void forwardByDelegate(DataObjectRef &dObj, const NodeRef &target, const NodeRefList *other_targets = NULL);
+	/**
+		Like shouldForward() for each of the data objects, but checks
+		the node's bloomfilter for all of them at once. Sets forward[i]
+		to whether the i:th data object should be forwarded.
+	*/
+	void shouldForward(const DataObjectRefList& dObjs, const NodeRef& node, bool *forward);
+	void forwardByDelegate(const DataObjectRef &dObj, const NodeRef &target, const NodeRefList *other_targets = NULL);
 	void onShutdown();
 	void onForwardingTaskComplete(Event *e);
 	void onDataObjectForward(Event *e);
@@ -99,6 +122,7 @@ class ForwardingManager : public Manager
 	void onNodeUpdated(Event *e);
 	void onRoutingInformation(Event *e);
 	void onNewDataObject(Event *e);
+	void onDeletedDataObject(Event *e);
 	void onNewNeighbor(Event *e);
 	void onEndNeighbor(Event *e);
 	void onRepositoryData(Event *e);
@@ -119,6 +143,11 @@ class ForwardingManager : public Manager
 public:
 	ForwardingManager(HaggleKernel *_kernel = haggleKernel);
 	~ForwardingManager();
+	/**
+		Returns the number of data object/node pairs that we have
+		asked to send, and have not yet got a result for.
+	*/
+	unsigned long getSendListSize() const { return forwardedObjects.size(); }
 };
 
 #endif /* _FORWARDINGMANAGER_H */
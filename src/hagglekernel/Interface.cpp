@@ -66,6 +66,7 @@ Interface::Interface(const Interface &iface) :
 #ifdef DEBUG_LEAKS
 	LeakMonitor(LEAK_TYPE_INTERFACE),
 #endif
+	RefCounted(),
 	type(iface.type), name(iface.name), identifier(NULL), 
 	identifier_len(iface.identifier_len), flags(iface.flags & (IFFLAG_ALL ^ IFFLAG_STORED)),  
 	identifier_str(iface.identifier_str), addresses(iface.addresses)
@@ -76,6 +77,7 @@ Interface::Interface(const Interface &iface, const void *_identifier) :
 #ifdef DEBUG_LEAKS
 	LeakMonitor(LEAK_TYPE_INTERFACE),
 #endif
+	RefCounted(),
 	type(iface.type), name(iface.name), identifier(static_cast<const unsigned char *>(_identifier)), 
 	identifier_len(iface.identifier_len), flags(iface.flags & (IFFLAG_ALL ^ IFFLAG_STORED)),  
 	identifier_str(iface.identifier_str), addresses(iface.addresses)
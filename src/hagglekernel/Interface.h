@@ -60,9 +60,9 @@ using namespace haggle;
 	This is the class that keeps interface information. 
  */
 #ifdef DEBUG_LEAKS
-class Interface : public LeakMonitor
+class Interface : public LeakMonitor, public RefCounted
 #else
-class Interface
+class Interface : public RefCounted
 #endif
 {
 public:
@@ -12,10 +12,90 @@
  * See the License for the specific language governing permissions and
  * limitations under the License.
  */
+#include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+
 #include "InterfaceStore.h"
 #include "Trace.h"
 
-InterfaceStore::InterfaceStore()
+/*
+	The key of an interface in the identifier index. Interfaces are equal
+	if they have the same type and identifier.
+*/
+static string iface_key(Interface::Type_t type, const unsigned char *identifier, size_t len)
+{
+	char *key = (char *)malloc(2 * len + 16);
+	string ret;
+	int n;
+
+	if (!key)
+		return ret;
+
+	n = sprintf(key, "%d:", type);
+
+	for (size_t i = 0; i < len; i++)
+		n += sprintf(key + n, "%02x", identifier[i] & 0xff);
+
+	ret = key;
+	free(key);
+
+	return ret;
+}
+
+static inline string iface_key(const Interface &iface)
+{
+	return iface_key(iface.getType(), iface.getIdentifier(), iface.getIdentifierLen());
+}
+
+/*
+	The length of an identifier of the given type, as Interface::create()
+	reads it. Returns zero for unknown types.
+*/
+static size_t identifier_len(Interface::Type_t type, const unsigned char *identifier)
+{
+	switch (type) {
+	case Interface::TYPE_APPLICATION_PORT:
+		return sizeof(unsigned short);
+	case Interface::TYPE_APPLICATION_LOCAL:
+	case Interface::TYPE_MEDIA:
+		return strlen((const char *)identifier);
+	case Interface::TYPE_ETHERNET:
+	case Interface::TYPE_WIFI:
+		return ETH_MAC_LEN;
+	case Interface::TYPE_BLUETOOTH:
+		return BT_MAC_LEN;
+	default:
+		break;
+	}
+	return 0;
+}
+
+/*
+	The key of an address in the address index. Addresses that are equal
+	have the same key, but the transport is not part of it.
+*/
+static string addr_key(const Address &add)
+{
+	char type[16];
+
+	snprintf(type, sizeof(type), "%d:", add.getType());
+
+	return string(type) + add.getStr();
+}
+
+static void index_erase(HashMap<string, InterfaceRecord *>& index, const string& key, InterfaceRecord *ir)
+{
+	for (HashMap<string, InterfaceRecord *>::iterator it = index.find(key); 
+	     it != index.end() && (*it).first == key; it++) {
+		if ((*it).second == ir) {
+			index.erase(it);
+			return;
+		}
+	}
+}
+
+InterfaceStore::InterfaceStore() : num_added(0)
 {
 }
 
@@ -30,30 +110,205 @@ InterfaceStore::~InterfaceStore()
 		delete ir;
 		n++;
 	}
+
+	for (expiry_index_t::iterator it = expiry_index.begin(); it != expiry_index.end(); it++)
+		delete (*it).second;
+
 	HAGGLE_DBG("Deleted %d interface records in interface store\n", n);
 }
 
+InterfaceRecord *InterfaceStore::_add(const InterfaceRef &iface, const InterfaceRef &parent, ConnectivityInterfacePolicy *policy)
+{
+	InterfaceRecord *ir = new InterfaceRecord(iface, parent, policy);
+
+	if (!ir)
+		return NULL;
+
+	ir->seq = num_added++;
+	ir->pos = insert(end(), ir);
+	ir->key = iface_key(*iface.getObj());
+	id_index.insert(make_pair(ir->key, ir));
+
+	if (parent)
+		ir->parent_key = iface_key(*parent.getObj());
+
+	const Addresses *addrs = iface->getAddresses();
+
+	for (Addresses::const_iterator it = addrs->begin(); it != addrs->end(); it++) {
+		string key = addr_key(**it);
+		ir->addr_keys.push_back(key);
+		addr_index.insert(make_pair(key, ir));
+	}
+
+	_schedule(ir);
+
+	return ir;
+}
+
+void InterfaceStore::_update(InterfaceRecord *ir, const InterfaceRef &parent, ConnectivityInterfacePolicy *policy)
+{
+	// The record may move between the heap and the walked records
+	_unschedule(ir);
+
+	if (ir->cip) 
+		delete ir->cip;
+	
+	ir->cip = policy;
+	
+	if (ir->iface->isSnooped()) {
+		ir->iface->resetFlag(IFFLAG_SNOOPED);
+		ir->parent = parent;
+		ir->parent_key = parent ? iface_key(*parent.getObj()) : string();
+	}
+
+	if (ir->cip) 
+		ir->cip->update();
+
+	_schedule(ir);
+}
+
+void InterfaceStore::_remove(InterfaceRecord *ir)
+{
+	erase(ir->pos);
+	_unschedule(ir);
+	index_erase(id_index, ir->key, ir);
+
+	for (List<string>::iterator it = ir->addr_keys.begin(); it != ir->addr_keys.end(); it++)
+		index_erase(addr_index, *it, ir);
+
+	ir->iface->resetFlag(IFFLAG_STORED);
+	delete ir;
+}
+
+/*
+	Puts a record in the heap of its parent if its policy gives it a
+	lifetime, or in the walked records otherwise. Local and snooped
+	interfaces are not aged as children of their parent, so they are
+	always walked.
+*/
+void InterfaceStore::_schedule(InterfaceRecord *ir)
+{
+	if (ir->cip && ir->parent && !ir->iface->isLocal() && !ir->iface->isSnooped()) {
+		Timeval expiry = ir->cip->lifetime();
+
+		if (expiry.isValid()) {
+			expiry_index_t::iterator it = expiry_index.find(ir->parent_key);
+			Heap *heap;
+
+			if (it != expiry_index.end()) {
+				heap = (*it).second;
+			} else {
+				heap = new Heap();
+				expiry_index.insert(make_pair(ir->parent_key, heap));
+			}
+
+			ir->expiry = expiry;
+
+			if (heap->insert(ir)) {
+				ir->heap = heap;
+				return;
+			}
+		}
+	}
+
+	ir->heap = NULL;
+	ir->walked_pos = walked.insert(walked.end(), ir);
+}
+
+void InterfaceStore::_unschedule(InterfaceRecord *ir)
+{
+	if (ir->heap) {
+		ir->heap->remove(ir);
+		ir->heap = NULL;
+	} else {
+		walked.erase(ir->walked_pos);
+	}
+}
+
+InterfaceRecord *InterfaceStore::_find(const Interface &iface)
+{
+	index_t::iterator it = id_index.find(iface_key(iface));
+
+	return it != id_index.end() ? (*it).second : NULL;
+}
+
+InterfaceRecord *InterfaceStore::_find(Interface::Type_t type, const unsigned char *identifier)
+{
+	size_t len = identifier_len(type, identifier);
+
+	if (len == 0) {
+		for (InterfaceStore::iterator it = begin(); it != end(); it++) {
+			if ((*it)->iface->equal(type, identifier))
+				return *it;
+		}
+		return NULL;
+	}
+
+	index_t::iterator it = id_index.find(iface_key(type, identifier, len));
+
+	return it != id_index.end() ? (*it).second : NULL;
+}
+
+InterfaceRecord *InterfaceStore::_find(const Address &add)
+{
+	InterfaceRecord *found = NULL;
+	string key = addr_key(add);
+
+	// Return the interface that was stored first, as a walk of the
+	// store would
+	for (index_t::iterator it = addr_index.find(key); it != addr_index.end() && (*it).first == key; it++) {
+		InterfaceRecord *ir = (*it).second;
+
+		if ((!found || ir->seq < found->seq) && ir->iface->hasAddress(add))
+			found = ir;
+	}
+
+	return found;
+}
+
 InterfaceStore::size_type InterfaceStore::remove_children(const InterfaceRef &parent, InterfaceRefList *ifl)
 {
-	InterfaceStore::iterator it = begin();
+	InterfaceRecord *ir;
 	InterfaceRefList children;
-        int removed = 0;
+	size_type removed = 0;
 
-	while (it != end()) {
-		InterfaceRecord *ir = *it;
+	if (!parent)
+		return 0;
 
-		if (ir->parent && ir->parent == parent) {
-                        if (ifl)
-                                ifl->add(ir->iface);
+	string key = iface_key(*parent.getObj());
+	List<InterfaceRecord *>::iterator it = walked.begin();
+
+	while (it != walked.end()) {
+		ir = *it;
+		it++;
+
+		if (ir->parent && ir->parent_key == key) {
+			if (ifl)
+				ifl->add(ir->iface);
 
-			ir->iface->resetFlag(IFFLAG_STORED);
 			children.push_front(ir->iface);
-			it = erase(it);
-			delete ir;
-                        removed++;
-			continue;
+			_remove(ir);
+			removed++;
 		}
-		it++;
+	}
+
+	expiry_index_t::iterator jt = expiry_index.find(key);
+
+	if (jt != expiry_index.end()) {
+		Heap *heap = (*jt).second;
+
+		while (!heap->empty()) {
+			ir = static_cast<InterfaceRecord *>(heap->front());
+
+			if (ifl)
+				ifl->add(ir->iface);
+
+			children.push_front(ir->iface);
+			_remove(ir);
+			removed++;
+		}
+		expiry_index.erase(jt);
+		delete heap;
 	}
 	
 	while (!children.empty()) {
@@ -65,50 +320,29 @@ InterfaceStore::size_type InterfaceStore::remove_children(const InterfaceRef &pa
 
 bool InterfaceStore::stored(const Interface &iface)
 {
-        Mutex::AutoLocker l(mutex);
+        RWMutex::ReadLocker l(mutex);
 	
-	for (InterfaceStore::iterator it = begin(); it != end(); it++) {
-		InterfaceRecord *ir = *it;
-
-		if (ir->iface == iface) 
-			return true;
-	}
-
-	return false;
+	return _find(iface) != NULL;
 }
 
 bool InterfaceStore::stored(const InterfaceRef &iface)
 {
-        Mutex::AutoLocker l(mutex);
+        RWMutex::ReadLocker l(mutex);
 
 	if (!iface)
 		return false;
 	
-	for (InterfaceStore::iterator it = begin(); it != end(); it++) {
-		InterfaceRecord *ir = *it;
-
-		if (ir->iface == iface)
-			return true;
-	}
-
-	return false;
+	return _find(*iface.getObj()) != NULL;
 }
 
 bool InterfaceStore::stored(Interface::Type_t type, const unsigned char *identifier)
 {
-        Mutex::AutoLocker l(mutex);
+        RWMutex::ReadLocker l(mutex);
 
 	if (!identifier)
 		return false;
 	
-	for (InterfaceStore::iterator it = begin(); it != end(); it++) {
-		InterfaceRecord *ir = *it;
-
-		if (ir->iface->equal(type, identifier))
-			return true;
-	}
-
-	return false;
+	return _find(type, identifier) != NULL;
 }
 
 InterfaceRef InterfaceStore::addupdate(InterfaceRef &iface, const InterfaceRef& parent, ConnectivityInterfacePolicy *policy, bool *was_added)
@@ -131,32 +365,17 @@ InterfaceRef InterfaceStore::addupdate(InterfaceRef &iface, const InterfaceRef&
 			return NULL;
 	}
 	
-        Mutex::AutoLocker l(mutex);
-
-	for (InterfaceStore::iterator it = begin(); it != end(); it++) {
-		InterfaceRecord *ir = *it;
-		InterfaceRef& ifaceStore = ir->iface;
-
-		if (ir->iface == iface) {
-			if (ir->cip) 
-				delete ir->cip;
-			
-			ir->cip = policy;
-			
-			if (ir->iface->isSnooped()) {
-				ir->iface->resetFlag(IFFLAG_SNOOPED);
-				ir->parent = parentStore;
-			}
+        RWMutex::WriteLocker l(mutex);
 
-			if (ir->cip) 
-				ir->cip->update();
+	InterfaceRecord *ir = _find(*iface.getObj());
 
-			return ifaceStore;
-		}
+	if (ir) {
+		_update(ir, parentStore, policy);
+		return ir->iface;
 	}
 
-	InterfaceRecord *ir = new InterfaceRecord(iface, parentStore, policy);
-	push_back(ir);
+	if (!_add(iface, parentStore, policy))
+		return NULL;
 	
 	if (was_added) {
 		iface->setFlag(IFFLAG_STORED);
@@ -180,34 +399,20 @@ InterfaceRef InterfaceStore::addupdate(Interface *iface, const InterfaceRef &par
 	if (parent)
 		parentRef = retrieve(parent);
 
-        Mutex::AutoLocker l(mutex);
-
-	for (InterfaceStore::iterator it = begin(); it != end(); it++) {
-		InterfaceRecord *ir = *it;
-		InterfaceRef& ifaceInStore = ir->iface;
-
-		if (ir->iface == *iface) {
-			if (ir->cip) 
-				delete ir->cip;
-			
-			ir->cip = policy;
-			
-			if (ir->iface->isSnooped()) {
-				ir->iface->resetFlag(IFFLAG_SNOOPED);
-				ir->parent = parentRef;
-			}
+        RWMutex::WriteLocker l(mutex);
 
-			if (ir->cip) 
-				ir->cip->update();
+	InterfaceRecord *ir = _find(*iface);
 
-			return ifaceInStore;
-		}
+	if (ir) {
+		_update(ir, parentRef, policy);
+		return ir->iface;
 	}
 
 	InterfaceRef ifaceRef = iface->copy();
 	ifaceRef->setFlag(IFFLAG_STORED);
-	InterfaceRecord *ir = new InterfaceRecord(ifaceRef, parentRef, policy);
-	push_back(ir);
+
+	if (!_add(ifaceRef, parentRef, policy))
+		return NULL;
 	
 	if (was_added)
 		*was_added = true;
@@ -235,33 +440,19 @@ InterfaceRef InterfaceStore::addupdate(Interface *iface, const Interface *parent
 			return NULL;
 	}
 
-        Mutex::AutoLocker l(mutex);
-
-	for (InterfaceStore::iterator it = begin(); it != end(); it++) {
-		InterfaceRecord *ir = *it;
-		InterfaceRef& ifaceStore = ir->iface;
-
-		if (ir->iface == *iface) {
-			if (ir->cip) 
-				delete ir->cip;
-			
-			ir->cip = policy;
-			
-			if (ir->iface->isSnooped()) {
-				ir->iface->resetFlag(IFFLAG_SNOOPED);
-				ir->parent = parentStore;
-			}
+        RWMutex::WriteLocker l(mutex);
 
-			if (ir->cip) 
-				ir->cip->update();
+	InterfaceRecord *ir = _find(*iface);
 
-			return ifaceStore;
-		}
+	if (ir) {
+		_update(ir, parentStore, policy);
+		return ir->iface;
 	}
 
 	InterfaceRef ifaceRef = iface->copy();
-	InterfaceRecord *ir = new InterfaceRecord(ifaceRef, parentStore, policy);
-	push_back(ir);
+
+	if (!_add(ifaceRef, parentStore, policy))
+		return NULL;
 	
 	if (was_added) {
 		ifaceRef->setFlag(IFFLAG_STORED);
@@ -273,75 +464,50 @@ InterfaceRef InterfaceStore::addupdate(Interface *iface, const Interface *parent
 
 InterfaceRef InterfaceStore::retrieve(const InterfaceRef &iface)
 {
-        Mutex::AutoLocker l(mutex);
+        RWMutex::ReadLocker l(mutex);
 
 	if (!iface)
 		return NULL;
 	
-	for (InterfaceStore::iterator it = begin(); it != end(); it++) {
-		InterfaceRecord *ir = *it;
-		InterfaceRef &ifaceStore = ir->iface;
-
-		if (ifaceStore == iface)
-			return ifaceStore;
-	}
+	InterfaceRecord *ir = _find(*iface.getObj());
 
-	return NULL;
+	return ir ? ir->iface : InterfaceRef();
 }
 
 InterfaceRef InterfaceStore::retrieve(const Interface &iface)
 {
-        Mutex::AutoLocker l(mutex);
+        RWMutex::ReadLocker l(mutex);
 	
-	for (InterfaceStore::iterator it = begin(); it != end(); it++) {
-		InterfaceRecord *ir = *it;
-		InterfaceRef &ifaceRef = ir->iface;
+	InterfaceRecord *ir = _find(iface);
 
-		if (ifaceRef == iface) {
-			return ifaceRef;
-		}
-	}
-
-	return NULL;
+	return ir ? ir->iface : InterfaceRef();
 }
 
 InterfaceRef InterfaceStore::retrieve(const Address &add)
 {
-        Mutex::AutoLocker l(mutex);
+        RWMutex::ReadLocker l(mutex);
 	
-	for (InterfaceStore::iterator it = begin(); it != end(); it++) {
-		InterfaceRecord *ir = *it;
-		InterfaceRef &ifaceRef = ir->iface;
-		
-		if (ifaceRef->hasAddress(add))
-			return ifaceRef;
-	}
+	InterfaceRecord *ir = _find(add);
 
-	return NULL;
+	return ir ? ir->iface : InterfaceRef();
 }
 
 
 InterfaceRef InterfaceStore::retrieve(Interface::Type_t type, const unsigned char *identifier)
 {
-        Mutex::AutoLocker l(mutex);
+        RWMutex::ReadLocker l(mutex);
 
 	if (!identifier)
 		return NULL;
 	
-	for (InterfaceStore::iterator it = begin(); it != end(); it++) {
-		InterfaceRecord *ir = *it;
-		InterfaceRef &iface = ir->iface;
+	InterfaceRecord *ir = _find(type, identifier);
 
-		if (iface->equal(type, identifier)) 
-			return iface;
-	}
-
-	return NULL;
+	return ir ? ir->iface : InterfaceRef();
 }
 
 InterfaceStore::size_type InterfaceStore::retrieve(const Criteria crit, InterfaceRefList& ifl)
 {
-        Mutex::AutoLocker l(mutex);
+        RWMutex::ReadLocker l(mutex);
         size_type n = 0;
 
 	for (InterfaceStore::iterator it = begin(); it != end(); it++) {
@@ -358,36 +524,29 @@ InterfaceStore::size_type InterfaceStore::retrieve(const Criteria crit, Interfac
 
 InterfaceStore::size_type InterfaceStore::remove(const string name, InterfaceRefList *ifl)
 {
-        Mutex::AutoLocker l(mutex);
-        size_type removed = 0;
-
-	InterfaceStore::iterator it = begin();
+        RWMutex::WriteLocker l(mutex);
 
-	while (it != end()) {
+	for (InterfaceStore::iterator it = begin(); it != end(); it++) {
 		InterfaceRecord *ir = *it;
 		
 		if (ir->iface->getName() == name) {	
-			it = erase(it);	
-                      
+			InterfaceRef iface = ir->iface;
+
                         if (ifl)
-                                ifl->add(ir->iface);
+                                ifl->add(iface);
 
-			removed += remove_children(ir->iface, ifl) + 1;
+			_remove(ir);
 
-			ir->iface->resetFlag(IFFLAG_STORED);
-			delete ir;
-			return removed;
+			return remove_children(iface, ifl) + 1;
 		}
-		it++;
 	}
 	
-	return removed;
+	return 0;
 }
 
 InterfaceStore::size_type InterfaceStore::remove(const Interface *iface, InterfaceRefList *ifl)
 {
-        Mutex::AutoLocker l(mutex);
-        size_type removed = 0;
+        RWMutex::WriteLocker l(mutex);
 
 	if (!iface) {
 		// This must be a request to remove children discovered by 
@@ -395,33 +554,24 @@ InterfaceStore::size_type InterfaceStore::remove(const Interface *iface, Interfa
 		return remove_children(NULL, ifl);
 	}
 
-	InterfaceStore::iterator it = begin();
+	InterfaceRecord *ir = _find(*iface);
 
-	while (it != end()) {
-		InterfaceRecord *ir = *it;
-		
-		if (ir->iface == *iface) {			
-			it = erase(it);	
+	if (!ir)
+		return 0;
 
-			if (ifl)
-                                ifl->add(ir->iface);
+	InterfaceRef ifaceStore = ir->iface;
 
-			removed += remove_children(ir->iface, ifl) + 1;
+	if (ifl)
+		ifl->add(ifaceStore);
 
-			ir->iface->resetFlag(IFFLAG_STORED);
-			delete ir;
-			return removed;
-		}
-		it++;
-	}
+	_remove(ir);
 
-	return removed;
+	return remove_children(ifaceStore, ifl) + 1;
 }
 
 InterfaceStore::size_type InterfaceStore::remove(const InterfaceRef &iface, InterfaceRefList *ifl)
 {
-        Mutex::AutoLocker l(mutex);
-        size_type removed = 0;
+        RWMutex::WriteLocker l(mutex);
 
 	if (!iface) {
 		// This must be a request to remove children discovered by 
@@ -429,32 +579,24 @@ InterfaceStore::size_type InterfaceStore::remove(const InterfaceRef &iface, Inte
 		return remove_children(iface, ifl);
 	}
 
-	InterfaceStore::iterator it = begin();
+	InterfaceRecord *ir = _find(*iface.getObj());
 
-	while (it != end()) {
-		InterfaceRecord *ir = *it;
-		
-		if (ir->iface == iface) {	
-			it = erase(it);	
+	if (!ir)
+		return 0;
 
-                        if (ifl)
-                                ifl->add(ir->iface);
+	InterfaceRef ifaceStore = ir->iface;
 
-			removed += remove_children(ir->iface, ifl) + 1;
+	if (ifl)
+		ifl->add(ifaceStore);
 
-			ir->iface->resetFlag(IFFLAG_STORED);
-			delete ir;
-			return removed;
-		}
-		it++;
-	}
+	_remove(ir);
 
-	return removed;
+	return remove_children(ifaceStore, ifl) + 1;
 }
 
 InterfaceStore::size_type InterfaceStore::remove(Interface::Type_t type, const unsigned char *identifier, InterfaceRefList *ifl)
 {
-        Mutex::AutoLocker l(mutex);
+        RWMutex::WriteLocker l(mutex);
         size_type removed = 0;
 
 	if (!identifier) {
@@ -462,57 +604,56 @@ InterfaceStore::size_type InterfaceStore::remove(Interface::Type_t type, const u
 		// a local connectivity, i.e., local interfaces.
 		return remove_children(NULL, ifl);
 	}
-	InterfaceStore::iterator it = begin();
 
-	while (it != end()) {
-		InterfaceRecord *ir = *it;
-		
-		if (ir->iface->equal(type, identifier)) {
-			it = erase(it);	
+	InterfaceRecord *ir = _find(type, identifier);
 
-			removed += remove_children(ir->iface, ifl) + 1;
+	if (!ir)
+		return 0;
 
-                        if (ifl)
-                                ifl->add(ir->iface);
+	InterfaceRef ifaceStore = ir->iface;
 
-			ir->iface->resetFlag(IFFLAG_STORED);
-			delete ir;
-			return removed;
-		}
-		it++;
-	}
+	_remove(ir);
+
+	removed = remove_children(ifaceStore, ifl) + 1;
+
+	if (ifl)
+		ifl->add(ifaceStore);
 
 	return removed;
 }
 
-InterfaceStore::size_type InterfaceStore::age(const Interface *parent, InterfaceRefList *ifl, Timeval *lifetime)
+/*
+	Ages the children of the parent with the given key, or the local
+	interfaces if there is no key. The walked records are aged one by one,
+	while only the children in the parent's heap that have expired are
+	touched.
+*/
+InterfaceStore::size_type InterfaceStore::_age(const string *parent_key, InterfaceRefList *ifl, Timeval *lifetime)
 {
-        Mutex::AutoLocker l(mutex);
 	InterfaceRefList children;
+	InterfaceRecord *ir;
         size_type removed = 0;
 	
 	// Initialize the lifetime to an "invalid" number
 	if (lifetime)
 		*lifetime = Timeval(-1);
 
-	InterfaceStore::iterator it = begin();
+	List<InterfaceRecord *>::iterator it = walked.begin();
 
-	while (it != end()) {
-		InterfaceRecord *ir = *it;
+	while (it != walked.end()) {
+		ir = *it;
+		it++;
 		
-		if ((ir->iface->isLocal() && !parent) || 
-		    (parent && ir->parent && ir->parent == parent && !ir->iface->isSnooped())) {
+		if ((ir->iface->isLocal() && !parent_key) || 
+		    (parent_key && ir->parent && ir->parent_key == *parent_key && !ir->iface->isSnooped())) {
 			
 			if (ir->cip->isDead()) {
 				if (ifl)
                                         ifl->add(ir->iface);
                                 removed++;
 
-				ir->iface->resetFlag(IFFLAG_STORED);
-				it = erase(it);	
 				children.push_front(ir->iface);
-				
-				delete ir;
+				_remove(ir);
 				continue;
 			}
 			ir->cip->age();
@@ -523,55 +664,31 @@ InterfaceStore::size_type InterfaceStore::age(const Interface *parent, Interface
 				}
 			}
 		}
-		it++;
-	}
-	
-	while (!children.empty()) {
-		removed += remove_children(children.pop(), ifl);
 	}
 
-	return removed;
-}
+	if (parent_key) {
+		expiry_index_t::iterator jt = expiry_index.find(*parent_key);
 
-InterfaceStore::size_type InterfaceStore::age(Interface::Type_t type, const unsigned char *identifier, InterfaceRefList *ifl, Timeval *lifetime)
-{
-        Mutex::AutoLocker l(mutex);
-	InterfaceRefList children;
-        size_type removed = 0;
+		if (jt != expiry_index.end()) {
+			Heap *heap = (*jt).second;
 
-	// Initialize the lifetime to an "invalid" number
-	if (lifetime)
-		*lifetime = Timeval(-1);
-	
-	InterfaceStore::iterator it = begin();
+			while (!heap->empty()) {
+				ir = static_cast<InterfaceRecord *>(heap->front());
 
-	while (it != end()) {
-		InterfaceRecord *ir = *it;
+				if (!ir->cip->isDead()) {
+					if (lifetime && (!lifetime->isValid() || ir->expiry < *lifetime))
+						*lifetime = ir->expiry;
+					break;
+				}
 
-		if ((ir->iface->isLocal() && !identifier) || 
-		    ((identifier && ir->parent) && ir->parent->equal(type, identifier) && !ir->iface->isSnooped())) {
-			
-			if (ir->cip->isDead()) {
 				if (ifl)
-                                        ifl->add(ir->iface);
-                                
-                                removed++;
-				ir->iface->resetFlag(IFFLAG_STORED);
-				it = erase(it);
+					ifl->add(ir->iface);
+				removed++;
+
 				children.push_front(ir->iface);
-				
-				delete ir;
-				continue;
-			}
-			ir->cip->age();
-			
-			if (lifetime && ir->cip->lifetime().isValid()) {
-				if (!lifetime->isValid() || ir->cip->lifetime() < *lifetime) {
-					*lifetime = ir->cip->lifetime();
-				}
+				_remove(ir);
 			}
 		}
-		it++;
 	}
 	
 	while (!children.empty()) {
@@ -581,58 +698,53 @@ InterfaceStore::size_type InterfaceStore::age(Interface::Type_t type, const unsi
 	return removed;
 }
 
+InterfaceStore::size_type InterfaceStore::age(const Interface *parent, InterfaceRefList *ifl, Timeval *lifetime)
+{
+        RWMutex::WriteLocker l(mutex);
 
-InterfaceStore::size_type InterfaceStore::age(const InterfaceRef &parent, InterfaceRefList *ifl, Timeval *lifetime)
+	if (!parent)
+		return _age(NULL, ifl, lifetime);
+
+	string key = iface_key(*parent);
+
+	return _age(&key, ifl, lifetime);
+}
+
+InterfaceStore::size_type InterfaceStore::age(Interface::Type_t type, const unsigned char *identifier, InterfaceRefList *ifl, Timeval *lifetime)
 {
-        Mutex::AutoLocker l(mutex);
-	InterfaceRefList children;
-        size_type removed = 0;
-	
-	// Initialize the lifetime to an "invalid" number
-	if (lifetime)
-		*lifetime = Timeval(-1);
-	
-	InterfaceStore::iterator it = begin();
+        RWMutex::WriteLocker l(mutex);
 
-	while (it != end()) {
-		InterfaceRecord *ir = *it;
+	if (!identifier)
+		return _age(NULL, ifl, lifetime);
 
-		if ((ir->iface->isLocal() && !parent) || 
-		    (parent && ir->parent && ir->parent == parent && !ir->iface->isSnooped())) {
-			
-			if (ir->cip->isDead()) {
-				if (ifl)
-                                        ifl->add(ir->iface);
+	InterfaceRecord *ir = _find(type, identifier);
+	string key;
 
-                                removed++;
-				ir->iface->resetFlag(IFFLAG_STORED);
-				it = erase(it);
-				children.push_front(ir->iface);
-				
-				delete ir;
-				continue;
-			}
-			ir->cip->age();
-			
-			if (lifetime && ir->cip->lifetime().isValid()) {
-				if (!lifetime->isValid() || ir->cip->lifetime() < *lifetime) {
-					*lifetime = ir->cip->lifetime();
-				}
-			}
-		}
-		it++;
-	}
-	
-	while (!children.empty()) {
-		removed += remove_children(children.pop(), ifl);
-	}
+	// A parent that is not in the store may still have children in it
+	if (ir)
+		key = ir->key;
+	else if (identifier_len(type, identifier))
+		key = iface_key(type, identifier, identifier_len(type, identifier));
 
-	return removed;
+	return _age(&key, ifl, lifetime);
+}
+
+InterfaceStore::size_type InterfaceStore::age(const InterfaceRef &parent, InterfaceRefList *ifl, Timeval *lifetime)
+{
+        RWMutex::WriteLocker l(mutex);
+
+	if (!parent)
+		return _age(NULL, ifl, lifetime);
+
+	string key = iface_key(*parent.getObj());
+
+	return _age(&key, ifl, lifetime);
 }
 
 void InterfaceStore::print()
 {
-        Mutex::AutoLocker l(mutex);
+	// Writing, since the policies format their age in a shared buffer
+        RWMutex::WriteLocker l(mutex);
 	InterfaceStore::iterator it = begin();
 
 	printf("====== Interfaces ======\n");
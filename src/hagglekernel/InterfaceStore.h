@@ -16,7 +16,10 @@
 #define _INTERFACESTORE_H
 
 #include <libcpphaggle/List.h>
-#include <libcpphaggle/Mutex.h>
+#include <libcpphaggle/HashMap.h>
+#include <libcpphaggle/Heap.h>
+#include <libcpphaggle/String.h>
+#include <libcpphaggle/RWMutex.h>
 
 using namespace haggle;
 
@@ -25,11 +28,50 @@ using namespace haggle;
 
 class InterfaceRecord;
 
-/** */
+/**
+ The interface store keeps indexes of its interfaces, by type and identifier
+ and by address, so that an interface can be looked up without walking the
+ store. The indexes are protected by the store mutex. The addresses of an
+ interface are indexed as they are when the interface is added to the store.
+
+ The store mutex is a reader-writer mutex. Functions that only look at the
+ store, such as stored() and retrieve(), lock it for reading, so they can run
+ in several threads at once. Functions that change the store, including
+ age(), lock it for writing.
+
+ Interfaces whose policy gives them a lifetime are kept in a heap per parent
+ interface, ordered by when they expire, so that aging the children of a
+ parent only touches the children that have expired. Other interfaces, such
+ as those with a TTL policy, are aged by walking them.
+ */
 class InterfaceStore : protected List<InterfaceRecord *>
 {
 	//friend class ConnectivityManager;
-	Mutex mutex;
+	typedef HashMap<string, InterfaceRecord *> index_t;
+	typedef HashMap<string, Heap *> expiry_index_t;
+	RWMutex mutex;
+	// The number of records that have been added to the store
+	unsigned long num_added;
+	// Type and identifier -> record
+	index_t id_index;
+	// Address -> records of the interfaces that have the address
+	index_t addr_index;
+	// Parent -> heap of the children that expire at a known time
+	expiry_index_t expiry_index;
+	// Records that are aged by walking them
+	List<InterfaceRecord *> walked;
+	/*
+	  Internal, unlocked functions that maintain the indexes.
+	 */
+	InterfaceRecord *_add(const InterfaceRef &iface, const InterfaceRef &parent, ConnectivityInterfacePolicy *policy);
+	void _update(InterfaceRecord *ir, const InterfaceRef &parent, ConnectivityInterfacePolicy *policy);
+	void _remove(InterfaceRecord *ir);
+	void _schedule(InterfaceRecord *ir);
+	void _unschedule(InterfaceRecord *ir);
+	InterfaceRecord *_find(const Interface &iface);
+	InterfaceRecord *_find(Interface::Type_t type, const unsigned char *identifier);
+	InterfaceRecord *_find(const Address &add);
+	size_type _age(const string *parent_key, InterfaceRefList *ifl, Timeval *lifetime);
 	size_type remove_children(const InterfaceRef &parent, InterfaceRefList *ifl = NULL);
 public:
 	InterfaceStore();
@@ -45,10 +87,15 @@ public:
 		}
 		virtual ~Criteria() {}
 	};
-	// Locking
-	void lock() { mutex.lock(); }
+	// Locking. The store is locked for writing.
+	void lock() { mutex.writeLock(); }
 	void unlock() { mutex.unlock(); }
-	bool trylock() { return mutex.trylock(); }
+	bool trylock() { return mutex.tryWriteLock(); }
+	/**
+		Returns the store mutex, so that the time that threads
+		have waited for it can be reported.
+	*/
+	RWMutex& getMutex() { return mutex; }
 	/**
 		Check if an Interface is in the store.
 		Returns: true if it is in the store, otherwise false.
@@ -267,12 +314,27 @@ public:
 
 
 /** */
-class InterfaceRecord 
 #ifdef DEBUG_LEAKS
- : public LeakMonitor
+class InterfaceRecord : public LeakMonitor, public HeapItem
+#else
+class InterfaceRecord : public HeapItem
 #endif
 {
 	friend class InterfaceStore::Criteria;
+	friend class InterfaceStore;
+	// The order in which the interface was added to the store
+	unsigned long seq;
+	// Where the record is in the store, and in the list of walked records
+	List<InterfaceRecord *>::iterator pos;
+	List<InterfaceRecord *>::iterator walked_pos;
+	// The keys the record is indexed by
+	string key;
+	string parent_key;
+	List<string> addr_keys;
+	// The heap the record is in, or NULL if it is aged by walking it
+	Heap *heap;
+	// The lifetime of the interface when the record was put in the heap
+	Timeval expiry;
 public:
 	// The interface 
 	InterfaceRef iface;
@@ -288,9 +350,17 @@ public:
 #ifdef DEBUG_LEAKS
 		LeakMonitor(LEAK_TYPE_INTERFACE_RECORD),
 #endif
-		iface(_iface), parent(_parent), cip(_cip)
+		HeapItem(), seq(0), heap(NULL), iface(_iface), parent(_parent), cip(_cip)
 	{}
 	~InterfaceRecord() { delete cip; }
+	bool compare_less(const HeapItem& i) const
+	{
+		return expiry < static_cast<const InterfaceRecord&>(i).expiry;
+	}
+	bool compare_greater(const HeapItem& i) const
+	{
+		return expiry > static_cast<const InterfaceRecord&>(i).expiry;
+	}
 };
 
 #endif /* _INTERFACESTORE_H */
@@ -1,7 +1,7 @@
 #include "Metadata.h"
 #include <stdio.h>
 
-Metadata::Metadata(const string _name, const string _content, Metadata *_parent) :
+Metadata::Metadata(const string& _name, const string& _content, Metadata *_parent) :
                 parent(_parent), name(_name), content(_content)
 {
 }
@@ -29,7 +29,7 @@ Metadata::~Metadata()
         }
 }
 
-bool Metadata::isName(const string _name) const
+bool Metadata::isName(const string& _name) const
 {
 	return name == _name;
 }
@@ -45,7 +45,7 @@ bool Metadata::_addMetadata(Metadata *m)
 }
 
 
-bool Metadata::removeMetadata(const string name)
+bool Metadata::removeMetadata(const string& name)
 {
         bool ret = false;
         
@@ -62,7 +62,7 @@ bool Metadata::removeMetadata(const string name)
          return ret;
 }
 
-Metadata *Metadata::getMetadata(const string name, unsigned int n)
+Metadata *Metadata::getMetadata(const string& name, unsigned int n)
 {
         r = registry.equal_range(name);
 
@@ -79,7 +79,7 @@ Metadata *Metadata::getMetadata(const string name, unsigned int n)
         return (*r.first).second;
 }
 
-const Metadata *Metadata::getMetadata(const string name, unsigned int n) const
+const Metadata *Metadata::getMetadata(const string& name, unsigned int n) const
 {
         const_cast<Metadata*>(this)->r_const = registry.equal_range(name);
 
@@ -122,7 +122,7 @@ const Metadata *Metadata::getNextMetadata() const
         return (*r_const.first).second;
 }
 
-string& Metadata::setParameter(const string name, const string value)
+string& Metadata::setParameter(const string& name, const string& value)
 {
         Pair<parameter_registry_t::iterator, bool> p;
 
@@ -135,19 +135,19 @@ string& Metadata::setParameter(const string name, const string value)
         return (*p.first).second;
 }
 
-string& Metadata::setParameter(const string name, const unsigned int value)
+string& Metadata::setParameter(const string& name, const unsigned int value)
 {
 	char tmp[32];
 	sprintf(tmp, "%u", value);
 	return setParameter(name, tmp);
 }
 
-bool Metadata::removeParameter(const string name)
+bool Metadata::removeParameter(const string& name)
 {
         return param_registry.erase(name) == 1;
 }
 
-const char *Metadata::getParameter(const string name) const
+const char *Metadata::getParameter(const string& name) const
 {
         parameter_registry_t::const_iterator it;
 
@@ -160,7 +160,7 @@ const char *Metadata::getParameter(const string name) const
 }
 
 
-string& Metadata::setContent(const string _content)
+string& Metadata::setContent(const string& _content)
 {
         content = _content;
         return content;
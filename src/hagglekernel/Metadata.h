@@ -48,7 +48,7 @@ class Metadata
         typedef HashMap<string, Metadata *> registry_t;
         parameter_registry_t param_registry;
         registry_t registry;
-        Metadata(const string _name, const string _content = "", Metadata *_parent = NULL);
+        Metadata(const string& _name, const string& _content = "", Metadata *_parent = NULL);
         Metadata(const Metadata& m);
         // This function should be called by addMetadata() in the
         // derived class
@@ -65,22 +65,21 @@ class Metadata
         // This function should be called by addMetadata() in the
         // derived class
         virtual bool addMetadata(Metadata *m) = 0;
-        virtual Metadata *addMetadata(const string name, const string content = "") = 0;
+        virtual Metadata *addMetadata(const string& name, const string& content = "") = 0;
 	virtual bool initFromRaw(const unsigned char *raw, size_t len) { return false; }
-	bool isName(const string _name) const;
-        string getName() const { return name; }
-        const string& getName() { return name; }
-        bool removeMetadata(const string name);
-        Metadata *getMetadata(const string name, unsigned int n = 0);    
-        const Metadata *getMetadata(const string name, unsigned int n = 0) const;    
+	bool isName(const string& _name) const;
+        const string& getName() const { return name; }
+        bool removeMetadata(const string& name);
+        Metadata *getMetadata(const string& name, unsigned int n = 0);    
+        const Metadata *getMetadata(const string& name, unsigned int n = 0) const;    
 	Metadata *getNextMetadata();	
 	const Metadata *getNextMetadata() const;
 	
-        string& setParameter(const string name, const string value);
-        string& setParameter(const string name, const unsigned int n);
-        bool removeParameter(const string name);
-        const char *getParameter(const string name) const;
-        string& setContent(const string content);
+        string& setParameter(const string& name, const string& value);
+        string& setParameter(const string& name, const unsigned int n);
+        bool removeParameter(const string& name);
+        const char *getParameter(const string& name) const;
+        string& setContent(const string& content);
         const string& getContent() const;
 };
 
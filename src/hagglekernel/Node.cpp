@@ -108,6 +108,10 @@ inline bool Node::init_node(const unsigned char *_id)
 		if (pval)
 			numberOfDataObjectsPerMatch = strtoul(pval, NULL, 10);
 
+		pval = nm->getParameter(NODE_METADATA_BLOOMFILTER_DELTA_PARAM);
+
+		acceptBFDelta = pval && strcmp(pval, "true") == 0;
+
 		/*
 		Should we really override the wish of another node to receive all
 		matching data objects? And in that case, why set it to our rather
@@ -123,6 +127,39 @@ inline bool Node::init_node(const unsigned char *_id)
 				HAGGLE_ERR("Bad bloomfilter metadata\n");
 				return false;
 			}
+			
+			// A scalable bloomfilter sends its slices alongside
+			unsigned int i = 0;
+			
+			while ((bm = nm->getMetadata(BLOOMFILTER_SLICE_METADATA, i++))) {
+				if (!doBF->addSlice(Bloomfilter::fromMetadata(*bm))) {
+					HAGGLE_ERR("Bad bloomfilter slice metadata\n");
+					return false;
+				}
+			}
+			bm = nm->getMetadata(BLOOMFILTER_METADATA);
+			pval = bm->getParameter(BLOOMFILTER_METADATA_VERSION_PARAM);
+
+			if (pval)
+				doBFVersion = strtoul(pval, NULL, 10);
+		} else {
+			bm = nm->getMetadata(BLOOMFILTER_DELTA_METADATA);
+
+			if (bm) {
+				// The delta is applied by the node manager, 
+				// which knows the bloomfilter it is based on.
+				doBFDelta = bm->getContent();
+
+				pval = bm->getParameter(BLOOMFILTER_METADATA_VERSION_PARAM);
+
+				if (pval)
+					doBFVersion = strtoul(pval, NULL, 10);
+
+				pval = bm->getParameter(BLOOMFILTER_DELTA_METADATA_BASE_VERSION_PARAM);
+
+				if (pval)
+					doBFDeltaBaseVersion = strtoul(pval, NULL, 10);
+			}
 		}
 
 		Metadata *im = nm->getMetadata(INTERFACE_METADATA);
@@ -163,7 +200,9 @@ Node::Node(const Type_t _type, const string _name, Timeval _nodeDescriptionCreat
 	LeakMonitor(LEAK_TYPE_NODE),
 #endif
 	type(_type), num(totNum++), name(_name), nodeDescExch(false), 
-	dObj(NULL), doBF(NULL), stored(false), createdFromNodeDescription(false),
+	dObj(NULL), doBF(NULL), doBFVersion(0), doBFDeltaBaseVersion(0),
+	acceptBFDelta(_type == TYPE_LOCAL_DEVICE),
+	stored(false), createdFromNodeDescription(false),
 	nodeDescriptionCreateTime(_nodeDescriptionCreateTime), 
 	createTime(Timeval::now()),
 	lastDataObjectQueryTime(-1, -1),
@@ -177,10 +216,14 @@ Node::Node(const Node& n) :
 #ifdef DEBUG_LEAKS
 	LeakMonitor(LEAK_TYPE_NODE),
 #endif
+	RefCounted(),
 	type(n.type), num(totNum++), name(n.name), 
 	nodeDescExch(n.nodeDescExch), 
 	dObj(NULL), interfaces(n.interfaces), 
 	doBF(doBF ? Bloomfilter::create(*n.doBF) : NULL), 
+	doBFVersion(n.doBFVersion), doBFDelta(n.doBFDelta),
+	doBFDeltaBaseVersion(n.doBFDeltaBaseVersion),
+	acceptBFDelta(n.acceptBFDelta),
 	stored(n.stored), 
         createdFromNodeDescription(n.createdFromNodeDescription),
 	nodeDescriptionCreateTime(n.nodeDescriptionCreateTime),
@@ -518,12 +561,37 @@ Metadata *Node::toMetadata(bool withBloomfilter) const
 			nm->addMetadata(im);
 	}
 
+        if (acceptBFDelta)
+		nm->setParameter(NODE_METADATA_BLOOMFILTER_DELTA_PARAM, "true");
+
         if (withBloomfilter)
-                nm->addMetadata(getBloomfilter()->toMetadata());
+		addBloomfilterMetadata(nm);
 
         return nm;        
 }
 
+bool Node::addBloomfilterMetadata(Metadata *nm) const
+{
+	const Bloomfilter *bf = getBloomfilter();
+	Metadata *bm = bf->toMetadata();
+
+	if (!bm)
+		return false;
+
+	if (doBFVersion)
+		bm->setParameter(BLOOMFILTER_METADATA_VERSION_PARAM, doBFVersion);
+
+	nm->addMetadata(bm);
+	
+	for (unsigned int i = 0; i < bf->numSlices(); i++) {
+		Metadata *sm = bf->sliceToMetadata(i);
+		
+		if (sm)
+			nm->addMetadata(sm);
+	}
+	return true;
+}
+
 /*
    TODO: the fromMetadata() function should ideally exist to adhere to the general
    model of converting Metadata to objects, as used in other classes. However, for 
@@ -958,6 +1026,88 @@ DataObjectRef Node::getDataObject(bool withBloomfilter) const
 	return ndObj;
 }
 
+DataObjectRef Node::getDataObjectBloomfilterDelta(const Bloomfilter& base, unsigned long base_version) const
+{
+	if (createdFromNodeDescription)
+		return NULL;
+
+	Metadata *bm = getBloomfilter()->toMetadataDelta(base);
+
+	if (!bm)
+		return NULL;
+
+	bm->setParameter(BLOOMFILTER_METADATA_VERSION_PARAM, doBFVersion);
+	bm->setParameter(BLOOMFILTER_DELTA_METADATA_BASE_VERSION_PARAM, base_version);
+
+	DataObjectRef ndObj = getDataObject(false);
+
+	if (!ndObj) {
+		delete bm;
+		return NULL;
+	}
+
+	Metadata *nm = ndObj->getMetadata()->getMetadata(NODE_METADATA);
+
+	if (!nm || !nm->addMetadata(bm)) {
+		delete bm;
+		return NULL;
+	}
+
+	return ndObj;
+}
+
+bool Node::applyBloomfilterDelta(const Bloomfilter *base, unsigned long base_version)
+{
+	bool exact = base && base_version != 0 && base_version == doBFDeltaBaseVersion;
+	Bloomfilter *bf = NULL;
+
+	if (!hasBloomfilterDelta())
+		return false;
+
+	// Without a base there is nothing to apply the delta to, and we 
+	// start from an empty bloomfilter.
+	if (base)
+		bf = base->to_noncounting();
+
+	if (!bf || !bf->applyBase64Delta(doBFDelta, exact)) {
+		// The delta is not compatible with the base, e.g., the
+		// node has reset its bloomfilter. Start from an empty 
+		// filter instead, which at worst means that we send some
+		// data objects the node already has.
+		if (bf)
+			delete bf;
+		exact = false;
+		bf = Bloomfilter::create(Bloomfilter::TYPE_NORMAL);
+
+		if (!bf)
+			return false;
+	}
+
+	setBloomfilter(bf);
+	doBFDelta = "";
+
+	// The version is not the one the node numbered, unless we have 
+	// its bloomfilter as it was when the node sent the delta
+	if (!exact)
+		doBFVersion = 0;
+
+	if (dObj) {
+		DataObjectRef ndObj = dObj->copy();
+		Metadata *nm = ndObj->getMetadata()->getMetadata(NODE_METADATA);
+
+		if (nm) {
+			nm->removeMetadata(BLOOMFILTER_DELTA_METADATA);
+			addBloomfilterMetadata(nm);
+
+			// Any signature was for the node description
+			// with the delta
+			ndObj->setSignatureStatus(DataObject::SIGNATURE_MISSING);
+			dObj = ndObj;
+		}
+	}
+
+	return exact;
+}
 
 Bloomfilter *Node::getBloomfilter(void)
 {
@@ -1080,6 +1230,65 @@ void Node::setLastDataObjectQueryTime(Timeval t)
 	lastDataObjectQueryTime = t;
 }
 
+bool Node::isDescribedBy(const DataObjectRef& dObj) const
+{
+	if (!dObj || !dObj->isNodeDescription())
+		return false;
+
+	if (type == TYPE_UNDEFINED) {
+		// We only know this node by its interfaces, which
+		// operator== compares
+		NodeRef descNode = Node::create(TYPE_PEER, dObj);
+
+		return descNode && *descNode.getObj() == *this;
+	}
+
+	const unsigned char *descId = dObj->getDescribedNodeId();
+
+	return descId && memcmp(descId, id, NODE_ID_LEN) == 0;
+}
+
+unsigned long Node::changesFrom(const Node& old) const
+{
+	unsigned long changes = 0;
+
+	if (old.type == TYPE_UNDEFINED || type == TYPE_UNDEFINED)
+		return NODE_CHANGED_ALL;
+
+	const Attributes *attrs = getAttributes();
+	const Attributes *old_attrs = old.getAttributes();
+
+	if (matchThreshold != old.matchThreshold ||
+	    numberOfDataObjectsPerMatch != old.numberOfDataObjectsPerMatch ||
+	    attrs->size() != old_attrs->size()) {
+		changes |= NODE_CHANGED_INTERESTS;
+	} else {
+		for (Attributes::const_iterator it = attrs->begin(); it != attrs->end(); it++) {
+			Attributes::const_iterator jt = old_attrs->find((*it).second);
+
+			if (jt == old_attrs->end() || (*jt).second.getWeight() != (*it).second.getWeight()) {
+				changes |= NODE_CHANGED_INTERESTS;
+				break;
+			}
+		}
+	}
+
+	if (!getBloomfilter()->equals(*old.getBloomfilter()))
+		changes |= NODE_CHANGED_BLOOMFILTER;
+
+	if (interfaces.size() != old.interfaces.size()) {
+		changes |= NODE_CHANGED_INTERFACES;
+	} else {
+		for (InterfaceRefList::const_iterator it = interfaces.begin(); it != interfaces.end(); it++) {
+			if (!old.hasInterface(*it)) {
+				changes |= NODE_CHANGED_INTERFACES;
+				break;
+			}
+		}
+	}
+	return changes;
+}
+
 bool operator==(const Node &n1, const Node &n2)
 {
 	if (n1.type == Node::TYPE_UNDEFINED || n2.type == Node::TYPE_UNDEFINED) {
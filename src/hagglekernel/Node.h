@@ -45,15 +45,22 @@ using namespace haggle;
 #define NODE_METADATA_NAME_PARAM "name"
 #define NODE_METADATA_THRESHOLD_PARAM "resolution_threshold"
 #define NODE_METADATA_MAX_DATAOBJECTS_PARAM "resolution_limit"
+#define NODE_METADATA_BLOOMFILTER_DELTA_PARAM "bloomfilter_delta"
 
 #define NODE_DEFAULT_DATAOBJECTS_PER_MATCH 10
 #define NODE_DEFAULT_MATCH_THRESHOLD 10
 
+/* What differs between two node descriptions of a node, see Node::changesFrom() */
+#define NODE_CHANGED_INTERESTS   0x1 // Interests, their weights, or the matching limits
+#define NODE_CHANGED_BLOOMFILTER 0x2
+#define NODE_CHANGED_INTERFACES  0x4
+#define NODE_CHANGED_ALL         (NODE_CHANGED_INTERESTS | NODE_CHANGED_BLOOMFILTER | NODE_CHANGED_INTERFACES)
+
 /** */
 #ifdef DEBUG_LEAKS
-class Node: public LeakMonitor
+class Node: public LeakMonitor, public RefCounted
 #else
-class Node
+class Node : public RefCounted
 #endif
 {
 public:
@@ -138,6 +145,28 @@ protected:
 		compilation.
 	*/
 	Bloomfilter *doBF;
+	/**
+		The version of the bloomfilter, as numbered by the node that
+		owns it. Zero means that the version is unknown.
+	*/
+	unsigned long doBFVersion;
+	/**
+		A bloomfilter delta received in a node description, which has
+		not yet been applied to a base bloomfilter. See 
+		applyBloomfilterDelta().
+	*/
+	string doBFDelta;
+	unsigned long doBFDeltaBaseVersion;
+	/**
+		True if the node can apply a bloomfilter delta in a node
+		description that we send it. The local device always can.
+	*/
+	bool acceptBFDelta;
+	/**
+		Adds the bloomfilter of the node, and any slices of it, to the
+		node metadata of a node description.
+	*/
+	bool addBloomfilterMetadata(Metadata *nm) const;
 
 	/**
 		A utility function to calculate the node ID based on the information
@@ -259,6 +288,14 @@ public:
 	virtual bool isLocalDevice() const { return false; }
 
         DataObjectRef getDataObject(bool withBloomfilter = true) const;
+	/**
+		Returns a node description where the bloomfilter is encoded as
+		a delta against the given base, which is the version 
+		'base_version' of this node's bloomfilter. Returns NULL if
+		the delta cannot be computed, in which case the full node 
+		description should be used.
+	*/
+	DataObjectRef getDataObjectBloomfilterDelta(const Bloomfilter& base, unsigned long base_version) const;
 		
 	unsigned long getMatchingThreshold() const { return matchThreshold; }
 	unsigned long getMaxDataObjectsInMatch() const { return numberOfDataObjectsPerMatch; }
@@ -281,6 +318,29 @@ public:
 	bool setBloomfilter(const char *base64, const bool set_create_time = false);
 	bool setBloomfilter(Bloomfilter *bf, const bool set_create_time = false);
 	bool setBloomfilter(const Bloomfilter& bf, const bool set_create_time = false);
+	unsigned long getBloomfilterVersion() const { return doBFVersion; }
+	void setBloomfilterVersion(unsigned long version) { doBFVersion = version; }
+	/**
+		Returns true if this node was created from a node description
+		that carried a bloomfilter delta instead of a full bloomfilter.
+	*/
+	bool hasBloomfilterDelta() const { return doBFDelta.length() > 0; }
+	bool acceptsBloomfilterDelta() const { return acceptBFDelta; }
+	unsigned long getBloomfilterDeltaBaseVersion() const { return doBFDeltaBaseVersion; }
+	/**
+		Sets the bloomfilter of this node to the given base bloomfilter
+		with the received delta applied. If the base is NULL, or its 
+		version is not the one the delta was computed against, the 
+		delta is applied only partially (see Bloomfilter::applyBase64Delta()),
+		and the version of the bloomfilter is unknown.
+		
+		The delta in the node description of the node is replaced with
+		the resulting bloomfilter, so that the node description can be
+		stored and passed on to other nodes, which do not have the base.
+		
+		Returns true if the delta was applied exactly.
+	*/
+	bool applyBloomfilterDelta(const Bloomfilter *base, unsigned long base_version);
 	
 	/**
 		Sets the create time of this node. This should only be done (and will 
@@ -299,6 +359,19 @@ public:
 	Timeval getCreateTime() const;
 	Timeval getLastDataObjectQueryTime() const;
 	void setLastDataObjectQueryTime(Timeval t);
+	/**
+		Returns true if the data object is a node description of
+		this node. Compares the node id that the data object decoded
+		when it was parsed, so that no node has to be created from
+		the node description, unless this node's id is unknown.
+	*/
+	bool isDescribedBy(const DataObjectRef& dObj) const;
+	/**
+		Returns the NODE_CHANGED_* flags of what differs between this
+		node and an older version of it. Everything has changed if the
+		older node is undefined, since it has no node description.
+	*/
+	unsigned long changesFrom(const Node& old) const;
         // Operators
         // friend bool operator<(const Node &n1, const Node &n2);
         friend bool operator==(const Node &n1, const Node &n2);
@@ -37,12 +37,18 @@ using namespace haggle;
 
 #define DEFAULT_NODE_DESCRIPTION_RETRY_WAIT (10.0) // Seconds
 #define DEFAULT_NODE_DESCRIPTION_RETRIES (3)
+#define DEFAULT_BLOOMFILTER_DELTA_HISTORY (5)
 
 NodeManager::NodeManager(HaggleKernel * _haggle) : 
 	Manager("NodeManager", _haggle), 
 	thumbnail_size(0), thumbnail(NULL),
 	nodeDescriptionRetries(DEFAULT_NODE_DESCRIPTION_RETRIES),
-	nodeDescriptionRetryWait(DEFAULT_NODE_DESCRIPTION_RETRY_WAIT)
+	nodeDescriptionRetryWait(DEFAULT_NODE_DESCRIPTION_RETRY_WAIT),
+	bloomfilterDelta(false),
+	bloomfilterDeltaHistory(DEFAULT_BLOOMFILTER_DELTA_HISTORY),
+	bloomfilterVersion(0),
+	numBloomfilterFullSent(0), numBloomfilterDeltaSent(0),
+	bloomfilterBytesSaved(0)
 {
 }
 
@@ -56,6 +62,11 @@ NodeManager::~NodeManager()
 
 	if (onInsertedNodeCallback)
 		delete onInsertedNodeCallback;
+
+	while (!bloomfilterHistory.empty()) {
+		delete bloomfilterHistory.front().second;
+		bloomfilterHistory.pop_front();
+	}
 }
 
 bool NodeManager::init_derived()
@@ -101,6 +112,13 @@ bool NodeManager::init_derived()
 		return false;
 	}
 
+	ret = setEventHandler(EVENT_TYPE_NODE_CONTACT_END, onEndNodeContact);
+
+	if (ret < 0) {
+		HAGGLE_ERR("Could not register event handler\n");
+		return false;
+	}
+
 	ret = setEventHandler(EVENT_TYPE_NODE_DESCRIPTION_SEND, onSendNodeDescription);
 
 	if (ret < 0) {
@@ -122,6 +140,15 @@ bool NodeManager::init_derived()
 		return false;
 	}
 
+#if defined(DEBUG)
+	ret = setEventHandler(EVENT_TYPE_DEBUG_CMD, onDebugCmd);
+
+	if (ret < 0) {
+		HAGGLE_ERR("Could not register event handler\n");
+		return false;
+	}
+#endif
+
 	onRetrieveNodeCallback = newEventCallback(onRetrieveNode);
 	onRetrieveThisNodeCallback = newEventCallback(onRetrieveThisNode);
 	onInsertedNodeCallback = newEventCallback(onInsertedNode);
@@ -175,10 +202,26 @@ void NodeManager::onPrepareShutdown()
 	// we next start up.
 	kernel->getDataStore()->insertNode(kernel->getThisNode());
 	
+	if (bloomfilterDelta) {
+		LOG_ADD("# %s: bloomfilter full=%lu delta=%lu bytes_saved=%lu\n", 
+			getName(), numBloomfilterFullSent, numBloomfilterDeltaSent, bloomfilterBytesSaved);
+	}
 	// We're done:
 	signalIsReadyForShutdown();
 }
 
+#if defined(DEBUG)
+void NodeManager::onDebugCmd(Event *e)
+{
+	if (!e || e->getDebugCmd()->getType() != DBG_CMD_PRINT_INTERNAL_STATE)
+		return;
+
+	printf("NodeManager: bloomfilter version=%lu delta=%s full=%lu delta=%lu bytes_saved=%lu\n",
+	       bloomfilterVersion, bloomfilterDelta ? "true" : "false", 
+	       numBloomfilterFullSent, numBloomfilterDeltaSent, bloomfilterBytesSaved);
+}
+#endif
+
 #if defined(ENABLE_METADAPARSER)
 bool NodeManager::onParseMetadata(Metadata *md)
 {         
@@ -218,41 +261,205 @@ bool NodeManager::isInSendList(const NodeRef& node, const DataObjectRef& dObj)
 	return false;
 }
 
+/*
+	Gives the current version of our bloomfilter a new version number if
+	it has changed since the last version we recorded, and keeps a copy
+	of it so that later node descriptions can carry deltas against it.
+*/
+unsigned long NodeManager::updateBloomfilterVersion()
+{
+	NodeRef thisNode = kernel->getThisNode();
+	const Bloomfilter *bf = thisNode->getBloomfilter();
+
+	if (!bloomfilterHistory.empty()) {
+		const Bloomfilter *last = bloomfilterHistory.front().second;
+
+		if (last->equals(*bf)) {
+			thisNode->setBloomfilterVersion(bloomfilterHistory.front().first);
+			return bloomfilterHistory.front().first;
+		}
+	}
+
+	Bloomfilter *copy = bf->to_noncounting();
+
+	if (!copy)
+		return 0;
+	
+	bloomfilterHistory.push_front(make_pair(++bloomfilterVersion, copy));
+
+	while (bloomfilterHistory.size() > bloomfilterDeltaHistory) {
+		BloomfilterHistory_t::iterator it = bloomfilterHistory.end();
+		it--;
+		delete (*it).second;
+		bloomfilterHistory.erase(it);
+	}
+
+	thisNode->setBloomfilterVersion(bloomfilterVersion);
+
+	return bloomfilterVersion;
+}
+
+const Bloomfilter *NodeManager::getBloomfilterVersion(unsigned long version) const
+{
+	for (BloomfilterHistory_t::const_iterator it = bloomfilterHistory.begin(); it != bloomfilterHistory.end(); it++) {
+		if ((*it).first == version)
+			return (*it).second;
+	}
+	return NULL;
+}
+
+/*
+	Asks the neighbors that we could not apply a bloomfilter delta from 
+	for their full bloomfilter.
+*/
+void NodeManager::addBloomfilterRequests(DataObjectRef& dObj) const
+{
+	Metadata *nm = dObj->getMetadata()->getMetadata(NODE_METADATA);
+
+	if (!nm)
+		return;
+
+	for (BloomfilterRequestMap_t::const_iterator it = bloomfilterRequests.begin(); it != bloomfilterRequests.end(); it++) {
+		Metadata *rm = nm->addMetadata(BLOOMFILTER_REQUEST_METADATA);
+
+		if (rm)
+			rm->setParameter(BLOOMFILTER_REQUEST_METADATA_NODE_ID_PARAM, (*it).first);
+	}
+}
+
+/*
+	Returns true if a node description asks us for our full bloomfilter.
+*/
+bool NodeManager::requestsFullBloomfilter(const DataObjectRef& dObj) const
+{
+	const Metadata *nm = dObj->getMetadata()->getMetadata(NODE_METADATA);
+	const Metadata *rm;
+	unsigned int i = 0;
+
+	if (!nm)
+		return false;
+
+	while ((rm = nm->getMetadata(BLOOMFILTER_REQUEST_METADATA, i++))) {
+		const char *id = rm->getParameter(BLOOMFILTER_REQUEST_METADATA_NODE_ID_PARAM);
+
+		if (id && strcmp(id, kernel->getThisNode()->getIdStr()) == 0)
+			return true;
+	}
+	return false;
+}
+
 int NodeManager::sendNodeDescription(NodeRefList& neighList)
 {
-	NodeRefList targetList;
+	// Node descriptions to send, keyed on the bloomfilter version that
+	// they carry a delta against (zero for the full node description)
+	Map<unsigned long, DataObjectRef> dObjs;
+	Map<unsigned long, NodeRefList> targetLists;
+	unsigned long version = 0;
 
 	HAGGLE_DBG("Pushing node description to %lu neighbors\n", neighList.size());
 
+	if (bloomfilterDelta)
+		version = updateBloomfilterVersion();
+
 	DataObjectRef dObj = kernel->getThisNode()->getDataObject();
 
 	if (thumbnail != NULL)
 		dObj->setThumbnail(thumbnail, thumbnail_size);
 	
+	addBloomfilterRequests(dObj);
+
+	dObjs[0] = dObj;
+
 	for (NodeRefList::iterator it = neighList.begin(); it != neighList.end(); it++) {
 		NodeRef& neigh = *it;
-	
-		if (neigh->getBloomfilter()->has(dObj)) {
+		BloomfilterAckMap_t::iterator ait = bloomfilterAcks.end();
+		unsigned long base_version = 0;
+
+		// Deltas are only sent to neighbors that can apply them
+		if (version && neigh->getType() != Node::TYPE_UNDEFINED && neigh->acceptsBloomfilterDelta())
+			ait = bloomfilterAcks.find(neigh->getIdStr());
+
+		if (ait != bloomfilterAcks.end()) {
+			if ((*ait).second.bfVersion == version && 
+			    (*ait).second.createTime == dObj->getCreateTime()) {
+				HAGGLE_DBG("Neighbor %s already has our most recent node description\n", neigh->getName().c_str());
+				continue;
+			}
+			// Only use a delta if we still have the version the 
+			// neighbor has acknowledged
+			if (getBloomfilterVersion((*ait).second.bfVersion))
+				base_version = (*ait).second.bfVersion;
+		}
+
+		if (base_version && dObjs.find(base_version) == dObjs.end()) {
+			const Bloomfilter *base = getBloomfilterVersion(base_version);
+			DataObjectRef ddObj = kernel->getThisNode()->getDataObjectBloomfilterDelta(*base, base_version);
+			const Metadata *bm = NULL;
+			
+			if (ddObj)
+				bm = ddObj->getMetadata()->getMetadata(NODE_METADATA)->getMetadata(BLOOMFILTER_DELTA_METADATA);
+
+			// The base64 encoded full bloomfilter is 4/3 of the raw size
+			size_t full_len = (base->getRawLen() + 2) / 3 * 4;
+
+			if (bm && bm->getContent().length() < full_len) {
+				if (thumbnail != NULL)
+					ddObj->setThumbnail(thumbnail, thumbnail_size);
+
+				addBloomfilterRequests(ddObj);
+
+				dObjs[base_version] = ddObj;
+				HAGGLE_DBG("Bloomfilter delta %lu->%lu is %lu bytes, full bloomfilter %lu bytes\n",
+					   base_version, version, bm->getContent().length(), full_len);
+			} else {
+				// Fall back to the full bloomfilter
+				dObjs[base_version] = dObj;
+			}
+		}
+
+		// Group neighbors that get the full node description together
+		if (dObjs[base_version] == dObj)
+			base_version = 0;
+
+		DataObjectRef& sdObj = dObjs[base_version];
+
+		if (neigh->getBloomfilter()->has(sdObj)) {
 			HAGGLE_DBG("Neighbor %s already has our most recent node description\n", neigh->getName().c_str());
-		} else if (!isInSendList(neigh, dObj)) {
+		} else if (!isInSendList(neigh, sdObj)) {
 			HAGGLE_DBG("Sending node description [%s] to \'%s\', bloomfilter #objs=%lu\n", 
-				   dObj->getIdStr(), neigh->getName().c_str(), kernel->getThisNode()->getBloomfilter()->numObjects());
-			targetList.push_back(neigh);
+				   sdObj->getIdStr(), neigh->getName().c_str(), kernel->getThisNode()->getBloomfilter()->numObjects());
+			targetLists[base_version].push_back(neigh);
 
-			SendEntry_t se = { dObj, 0 };
+			SendEntry_t se = { sdObj, 0, version };
 			// Remember that we tried to send our node description to this node:
 			sendList.push_back(Pair<NodeRef, SendEntry_t>(neigh, se));
 		} else {
 			HAGGLE_DBG("Node description [%s] is already in send list for neighbor %s\n",
-				dObj->getIdStr(), neigh->getName().c_str());
+				sdObj->getIdStr(), neigh->getName().c_str());
 		}
 	}
 	
-	if (targetList.size()) {
-		HAGGLE_DBG("Pushing node description [%s] to %lu neighbors\n", dObj->getIdStr(), targetList.size());
-		kernel->addEvent(new Event(EVENT_TYPE_DATAOBJECT_SEND, dObj, targetList));
-	} else {
+	if (targetLists.empty()) {
 		HAGGLE_DBG("All neighbors already had our most recent node description\n");
+		return 1;
+	}
+
+	for (Map<unsigned long, NodeRefList>::iterator it = targetLists.begin(); it != targetLists.end(); it++) {
+		DataObjectRef& sdObj = dObjs[(*it).first];
+
+		if (sdObj == dObj) {
+			numBloomfilterFullSent += (*it).second.size();
+		} else {
+			const Metadata *bm = sdObj->getMetadata()->getMetadata(NODE_METADATA)->getMetadata(BLOOMFILTER_DELTA_METADATA);
+			size_t full_len = (kernel->getThisNode()->getBloomfilter()->getRawLen() + 2) / 3 * 4;
+			
+			numBloomfilterDeltaSent += (*it).second.size();
+
+			if (bm && bm->getContent().length() < full_len)
+				bloomfilterBytesSaved += (full_len - bm->getContent().length()) * (*it).second.size();
+		}
+		HAGGLE_DBG("Pushing node description [%s] to %lu neighbors\n", sdObj->getIdStr(), (*it).second.size());
+		kernel->addEvent(new Event(EVENT_TYPE_DATAOBJECT_SEND, sdObj, (*it).second));
 	}
 	
 	return 1;
@@ -283,6 +490,12 @@ void NodeManager::onSendResult(Event *e)
 				neigh->setExchangedNodeDescription(true);
 				
 				HAGGLE_DBG("Successfully sent node description [%s] to neighbor %s [%s], after %lu retries\n", dObj->getIdStr(), neigh->getName().c_str(), neigh->getIdStr(), (*it).second.retries);
+
+				if ((*it).second.bfVersion && neigh->getType() != Node::TYPE_UNDEFINED) {
+					BloomfilterAck_t& ack = bloomfilterAcks[neigh->getIdStr()];
+					ack.bfVersion = (*it).second.bfVersion;
+					ack.createTime = dObj->getCreateTime();
+				}
 				//dObj->print();
 				
 				sendList.erase(it);
@@ -445,6 +658,18 @@ void NodeManager::onNewNodeContact(Event *e)
 	sendNodeDescription(neighList);
 }
 
+void NodeManager::onEndNodeContact(Event *e)
+{
+	if (!e || !e->getNode())
+		return;
+
+	// The next time we meet the node, we start over with a full 
+	// bloomfilter, since we do not know what happened to the node's 
+	// copy of it in between.
+	bloomfilterAcks.erase(e->getNode()->getIdStr());
+	bloomfilterRequests.erase(e->getNode()->getIdStr());
+}
+
 // Push our node description to all neighbors
 void NodeManager::onSendNodeDescription(Event *e)
 {
@@ -477,6 +702,9 @@ void NodeManager::onReceiveNodeDescription(Event *e)
 	}
 	
 	DataObjectRefList& dObjs = e->getDataObjectList();
+	// Neighbors that we ask for their full bloomfilter, or that ask us
+	// for ours
+	NodeRefList bloomfilterNeighbors;
 
 	while (dObjs.size()) {
 		bool fromThirdParty = false;
@@ -545,6 +773,54 @@ void NodeManager::onReceiveNodeDescription(Event *e)
 				   node->getName().c_str(), node->getIdStr());
 		}
 	
+		// Resolve a bloomfilter delta against the bloomfilter we have for 
+		// the neighbor, before it is merged or stored
+		if (node->hasBloomfilterDelta()) {
+			const Bloomfilter *base = NULL;
+			unsigned long base_version = 0;
+
+			// Deltas are only sent to neighbors, so one that was
+			// passed on by another node cannot be resolved
+			if (!neighbor) {
+				HAGGLE_DBG("Bloomfilter delta for node %s not received from the node -- ignoring node description\n", 
+					   node->getName().c_str());
+				kernel->getDataStore()->deleteDataObject(dObj);
+				continue;
+			}
+
+			if (neighbor->getType() != Node::TYPE_UNDEFINED) {
+				base = neighbor->getBloomfilter();
+				base_version = neighbor->getBloomfilterVersion();
+			}
+
+			if (node->applyBloomfilterDelta(base, base_version)) {
+				HAGGLE_DBG("Applied bloomfilter delta %lu->%lu for node %s\n", 
+					   base_version, node->getBloomfilterVersion(), node->getName().c_str());
+			} else {
+				HAGGLE_DBG("Bloomfilter delta for node %s based on version %lu, we have %lu -- applied partially, asking for full bloomfilter\n", 
+					   node->getName().c_str(), node->getBloomfilterDeltaBaseVersion(), base_version);
+				bloomfilterRequests[node->getIdStr()] = true;
+				bloomfilterNeighbors.push_back(node);
+			}
+
+			// Store the node description with the resulting 
+			// bloomfilter instead, since no other node can apply 
+			// the delta
+			kernel->getDataStore()->deleteDataObject(dObj, true);
+			dObj = node->getDataObject();
+			kernel->getDataStore()->insertDataObject(dObj);
+		} else if (!fromThirdParty) {
+			bloomfilterRequests.erase(node->getIdStr());
+		}
+
+		// The neighbor could not apply a delta from us, so it gets
+		// our full bloomfilter
+		if (!fromThirdParty && requestsFullBloomfilter(dObj)) {
+			HAGGLE_DBG("Node %s asks for our full bloomfilter\n", node->getName().c_str());
+			bloomfilterAcks.erase(node->getIdStr());
+			bloomfilterNeighbors.push_back(node);
+		}
+
 		// If the existing neighbor node was undefined, we merge the bloomfilters
 		// of the undefined node and the node created from the node description
 		if (neighbor) {
@@ -593,16 +869,37 @@ void NodeManager::onReceiveNodeDescription(Event *e)
 			nodeUpdate(node);
 		}
 	}
+
+	if (!bloomfilterNeighbors.empty()) {
+		NodeRefList neighbors;
+
+		for (NodeRefList::iterator it = bloomfilterNeighbors.begin(); it != bloomfilterNeighbors.end(); it++) {
+			NodeRef neigh = kernel->getNodeStore()->retrieve(*it, true);
+
+			if (neigh)
+				neighbors.push_back(neigh);
+		}
+		// A new node description, so that the neighbors do not
+		// take it for one that they already have
+		kernel->getThisNode()->setNodeDescriptionCreateTime();
+		sendNodeDescription(neighbors);
+	}
 }
 
 void NodeManager::nodeUpdate(NodeRef& node)
 {
 	NodeRefList nl;
+	unsigned long changes = NODE_CHANGED_ALL;
 	
 	// See if this node is already an active neighbor but in an uninitialized state
 	if (kernel->getNodeStore()->update(node, &nl)) {
-		HAGGLE_DBG("Neighbor node %s [id=%s] was updated in node store\n", 
-			   node->getName().c_str(), node->getIdStr());
+		// Tell the other managers what the node description changed, so
+		// that they do not have to redo work for the parts that did not
+		if (nl.size() == 1)
+			changes = node->changesFrom(*nl.front().getObj());
+
+		HAGGLE_DBG("Neighbor node %s [id=%s] was updated in node store, changes=%lu\n", 
+			   node->getName().c_str(), node->getIdStr(), changes);
 	} else {
 		// This is the path for node descriptions received via a third party, i.e.,
 		// the node description does not belong to the neighbor node we received it
@@ -654,7 +951,7 @@ void NodeManager::nodeUpdate(NodeRef& node)
 	// We send the update event for all nodes that we have received a new node description from, even
 	// if they are not neighbors. This is because we want to match data objects against the node although
 	// we might not have direct connectivity to it.
-	kernel->addEvent(new Event(EVENT_TYPE_NODE_UPDATED, node, nl));
+	kernel->addEvent(new Event(EVENT_TYPE_NODE_UPDATED, node, nl, changes));
 }
 
 void NodeManager::onInsertedNode(Event *e)
@@ -706,6 +1003,35 @@ void NodeManager::onConfig(Metadata *m)
 		}
 	}
 
+	nm = m->getMetadata("NodeDescriptionBloomfilter");
+
+	if (nm) {
+		const char *param = nm->getParameter("delta");
+
+		if (param) {
+			if (strcmp(param, "true") == 0) {
+				bloomfilterDelta = true;
+			} else if (strcmp(param, "false") == 0) {
+				bloomfilterDelta = false;
+			}
+			HAGGLE_DBG("Setting bloomfilter delta to %s\n", bloomfilterDelta ? "true" : "false");
+			LOG_ADD("# %s: bloomfilter delta=%s\n", getName(), bloomfilterDelta ? "true" : "false");
+		}
+
+		param = nm->getParameter("delta_history");
+
+		if (param) {
+			char *endptr = NULL;
+			unsigned long history = strtoul(param, &endptr, 10);
+
+			if (endptr && endptr != param && history > 0) {
+				HAGGLE_DBG("Setting bloomfilter delta history to %lu\n", history);
+				bloomfilterDeltaHistory = history;
+				LOG_ADD("# %s: bloomfilter delta history=%lu\n", getName(), bloomfilterDeltaHistory);
+			}
+		}
+	}
+
 	nm = m->getMetadata("NodeDescriptionRetry");
 
 	if (nm) {
@@ -34,19 +34,52 @@ class NodeManager : public Manager
 	typedef struct {
 		DataObjectRef dObj;
 		unsigned long retries;
+		unsigned long bfVersion; // Version of our bloomfilter in dObj
 	} SendEntry_t;
 	typedef List< Pair<NodeRef, SendEntry_t> > SendList_t;
+	/*
+		The most recent version of our bloomfilter that a neighbor
+		has acknowledged (i.e., we successfully sent it a node 
+		description with that version), and the create time of that
+		node description.
+	*/
+	typedef struct {
+		unsigned long bfVersion;
+		Timeval createTime;
+	} BloomfilterAck_t;
+	typedef Map<string, BloomfilterAck_t> BloomfilterAckMap_t;
+	/*
+		The neighbors that we could not apply a bloomfilter delta from,
+		and ask for their full bloomfilter in our node description.
+	*/
+	typedef Map<string, bool> BloomfilterRequestMap_t;
+	// Recent versions of our bloomfilter, most recent first.
+	typedef List< Pair<unsigned long, Bloomfilter *> > BloomfilterHistory_t;
 
 	size_t thumbnail_size;
 	char *thumbnail;
 	unsigned long nodeDescriptionRetries;
 	double nodeDescriptionRetryWait;
 	SendList_t sendList;
+	bool bloomfilterDelta;
+	unsigned long bloomfilterDeltaHistory;
+	unsigned long bloomfilterVersion;
+	BloomfilterHistory_t bloomfilterHistory;
+	BloomfilterAckMap_t bloomfilterAcks;
+	BloomfilterRequestMap_t bloomfilterRequests;
+	// Statistics
+	unsigned long numBloomfilterFullSent;
+	unsigned long numBloomfilterDeltaSent;
+	unsigned long bloomfilterBytesSaved;
 	EventCallback<EventHandler> *onRetrieveNodeCallback;
 	EventCallback<EventHandler> *onRetrieveThisNodeCallback;
 	EventCallback<EventHandler> *onInsertedNodeCallback;
         EventType nodeDescriptionEType;
 	bool isInSendList(const NodeRef& node, const DataObjectRef& dObj);
+	unsigned long updateBloomfilterVersion();
+	const Bloomfilter *getBloomfilterVersion(unsigned long version) const;
+	void addBloomfilterRequests(DataObjectRef& dObj) const;
+	bool requestsFullBloomfilter(const DataObjectRef& dObj) const;
         int sendNodeDescription(NodeRefList& neighList);
         void onApplicationFilterMatchEvent(Event *e);
         void onSendNodeDescription(Event *e);
@@ -56,6 +89,7 @@ class NodeManager : public Manager
         void onNeighborInterfaceUp(Event *e);
         void onNeighborInterfaceDown(Event *e);
         void onNewNodeContact(Event *e);
+	void onEndNodeContact(Event *e);
 	void onSendResult(Event *e);
 	void onRetrieveNode(Event *e);
 	void onRetrieveThisNode(Event *e);
@@ -67,6 +101,9 @@ class NodeManager : public Manager
         bool onParseMetadata(Metadata *md);
 #endif
 	
+#if defined(DEBUG)
+	void onDebugCmd(Event *e);
+#endif
 	void onPrepareShutdown();
 	bool init_derived();
 	void onConfig(Metadata *m);
@@ -13,11 +13,122 @@
  * limitations under the License.
  */
 #include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
 
 #include "NodeStore.h"
 #include "Trace.h"
 
-NodeStore::NodeStore()
+/*
+	The key of an interface in the interface index. Interfaces are equal
+	if they have the same type and identifier.
+*/
+static string iface_key(const InterfaceRef &iface)
+{
+	const unsigned char *identifier = iface->getIdentifier();
+	size_t len = iface->getIdentifierLen();
+	char *key = (char *)malloc(2 * len + 16);
+	string ret;
+	int n;
+
+	if (!key)
+		return ret;
+
+	n = sprintf(key, "%d:", iface->getType());
+
+	for (size_t i = 0; i < len; i++)
+		n += sprintf(key + n, "%02x", identifier[i] & 0xff);
+
+	ret = key;
+	free(key);
+
+	return ret;
+}
+
+static string id_str(const Node::Id_t id)
+{
+	char idStr[MAX_NODE_ID_STR_LEN];
+	int len = 0;
+
+	for (int i = 0; i < NODE_ID_LEN; i++)
+		len += sprintf(idStr + len, "%02x", id[i] & 0xff);
+
+	return idStr;
+}
+
+static inline bool can_be_neighbor(Node::Type_t type)
+{
+	return type == Node::TYPE_PEER || type == Node::TYPE_UNDEFINED || type == Node::TYPE_GATEWAY;
+}
+
+/*
+	Returns the record that comes first in the store, so that the indexes
+	find the same node as a walk of the store would.
+*/
+static inline NodeRecord *first_record(NodeRecord *nr1, NodeRecord *nr2)
+{
+	return (!nr1 || (nr2 && nr2->seq < nr1->seq)) ? nr2 : nr1;
+}
+
+static void index_erase(HashMap<string, NodeRecord *>& index, const string& key, NodeRecord *nr)
+{
+	for (HashMap<string, NodeRecord *>::iterator it = index.find(key); 
+	     it != index.end() && (*it).first == key; it++) {
+		if ((*it).second == nr) {
+			index.erase(it);
+			return;
+		}
+	}
+}
+
+NodeKeys::NodeKeys(const Node &node) : type(node.getType())
+{
+	if (type != Node::TYPE_UNDEFINED)
+		id_key = node.getIdStr();
+
+	const InterfaceRefList *ifaces = node.getInterfaces();
+
+	for (InterfaceRefList::const_iterator it = ifaces->begin(); it != ifaces->end(); it++)
+		iface_keys.push_back(iface_key(*it));
+}
+
+/*
+	Returns true if one of the node's interfaces has one of the keys. The
+	node is locked while its interfaces are read.
+*/
+static bool has_iface_key(const NodeRef& node, const List<string>& keys)
+{
+	bool found = false;
+
+	node.lock();
+
+	const InterfaceRefList *ifaces = node.getObj()->getInterfaces();
+
+	for (InterfaceRefList::const_iterator it = ifaces->begin(); it != ifaces->end() && !found; it++) {
+		string key = iface_key(*it);
+
+		for (List<string>::const_iterator jt = keys.begin(); jt != keys.end(); jt++) {
+			if (*jt == key) {
+				found = true;
+				break;
+			}
+		}
+	}
+	node.unlock();
+
+	return found;
+}
+
+/*
+	Returns true if the record's node is a neighbor. This locks the node,
+	so the caller may not hold a lock on any other node.
+*/
+static inline bool is_neighbor(const NodeRecord *nr)
+{
+	return can_be_neighbor(nr->type) && nr->node->isNeighbor();
+}
+
+NodeStore::NodeStore() : num_added(0)
 {
 }
 
@@ -35,106 +146,219 @@ NodeStore::~NodeStore()
 	HAGGLE_DBG("Deleted %d node records in node store\n", n);
 }
 
-bool NodeStore::_stored(const NodeRef &node, bool mustBeNeighbor)
+NodeRecord *NodeStore::_add(NodeRef &node)
 {
-	for (NodeStore::iterator it = begin(); it != end(); it++) {
-		NodeRecord *nr = *it;
+	NodeRecord *nr = new NodeRecord(node, num_added++);
 
-		if (mustBeNeighbor && !nr->node->isNeighbor())
-			continue;
+	if (!nr)
+		return NULL;
+
+	nr->pos = insert(end(), nr);
+	nr->type = node->getType();
+
+	if (node->getType() != Node::TYPE_UNDEFINED) {
+		nr->id_key = node->getIdStr();
+		id_index.insert(make_pair(nr->id_key, nr));
+	}
+
+	if (node->getType() == Node::TYPE_LOCAL_DEVICE) {
+		unindexed.push_back(nr);
+	} else {
+		const InterfaceRefList *ifaces = node->getInterfaces();
 
-		if (nr->node == node) {
-			return true;
+		for (InterfaceRefList::const_iterator it = ifaces->begin(); it != ifaces->end(); it++) {
+			string key = iface_key(*it);
+			nr->iface_keys.push_back(key);
+			iface_index.insert(make_pair(key, nr));
 		}
 	}
-	return false;
+
+	if (can_be_neighbor(node->getType()))
+		nr->neighbor_pos = neighbors.insert(neighbors.end(), nr);
+
+	node->setStored();
+
+	return nr;
 }
-bool NodeStore::_stored(const Node &node, bool mustBeNeighbor)
+
+void NodeStore::_remove(NodeRecord *nr)
 {
+	erase(nr->pos);
 
-	for (NodeStore::iterator it = begin(); it != end(); it++) {
+	if (can_be_neighbor(nr->type))
+		neighbors.erase(nr->neighbor_pos);
+
+	if (nr->type != Node::TYPE_UNDEFINED)
+		index_erase(id_index, nr->id_key, nr);
+
+	if (nr->type == Node::TYPE_LOCAL_DEVICE)
+		unindexed.remove(nr);
+
+	for (List<string>::iterator it = nr->iface_keys.begin(); it != nr->iface_keys.end(); it++)
+		index_erase(iface_index, *it, nr);
+
+	nr->node->setStored(false);
+	delete nr;
+}
+
+NodeRecord *NodeStore::_find(const NodeKeys &keys, bool mustBeNeighbor)
+{
+	NodeRecord *found = NULL;
+
+	// Defined nodes are equal if they have the same id
+	if (keys.type != Node::TYPE_UNDEFINED) {
+		for (index_t::iterator it = id_index.find(keys.id_key); it != id_index.end() && (*it).first == keys.id_key; it++) {
+			NodeRecord *nr = (*it).second;
+
+			if (mustBeNeighbor && !is_neighbor(nr))
+				continue;
+
+			found = first_record(found, nr);
+		}
+	}
+
+	// Undefined nodes are equal to the nodes they share an interface with
+	for (List<string>::const_iterator it = keys.iface_keys.begin(); it != keys.iface_keys.end(); it++) {
+		for (index_t::iterator jt = iface_index.find(*it); jt != iface_index.end() && (*jt).first == *it; jt++) {
+			NodeRecord *nr = (*jt).second;
+
+			if (keys.type != Node::TYPE_UNDEFINED && nr->type != Node::TYPE_UNDEFINED)
+				continue;
+
+			if (mustBeNeighbor && !is_neighbor(nr))
+				continue;
+
+			found = first_record(found, nr);
+		}
+	}
+
+	for (List<NodeRecord *>::iterator it = unindexed.begin(); it != unindexed.end(); it++) {
 		NodeRecord *nr = *it;
 
-		if (mustBeNeighbor && !nr->node->isNeighbor())
+		if (keys.type != Node::TYPE_UNDEFINED ? nr->id_key != keys.id_key : !has_iface_key(nr->node, keys.iface_keys))
 			continue;
 
-		if (nr->node == node) {
-			return true;
-		}
+		if (mustBeNeighbor && !is_neighbor(nr))
+			continue;
+
+		found = first_record(found, nr);
 	}
-	return false;
+
+	return found;
 }
 
-bool NodeStore::_stored(const Node::Id_t id, bool mustBeNeighbor)
+NodeRecord *NodeStore::_find(const Node &node, bool mustBeNeighbor)
 {
-	for (NodeStore::iterator it = begin(); it != end(); it++) {
-		NodeRecord *nr = *it;
+	return _find(NodeKeys(node), mustBeNeighbor);
+}
+
+NodeRecord *NodeStore::_find(const string &idStr, bool mustBeNeighbor)
+{
+	NodeRecord *found = NULL;
 
-		if (mustBeNeighbor && !nr->node->isNeighbor())
+	for (index_t::iterator it = id_index.find(idStr); it != id_index.end() && (*it).first == idStr; it++) {
+		NodeRecord *nr = (*it).second;
+
+		if (mustBeNeighbor && !is_neighbor(nr))
 			continue;
 
-		if (memcmp(id, nr->node->getId(), NODE_ID_LEN) == 0) {
-			return true;
-		}
+		found = first_record(found, nr);
 	}
-	return false;
+
+	return found;
 }
 
-bool NodeStore::_stored(const string idStr, bool mustBeNeighbor)
+NodeRecord *NodeStore::_find(const InterfaceRef &iface, bool mustBeNeighbor)
 {
-	for (NodeStore::iterator it = begin(); it != end(); it++) {
+	NodeRecord *found = NULL;
+	List<string> keys;
+
+	keys.push_back(iface_key(iface));
+
+	for (index_t::iterator it = iface_index.find(keys.front()); it != iface_index.end() && (*it).first == keys.front(); it++) {
+		NodeRecord *nr = (*it).second;
+
+		if (mustBeNeighbor && !is_neighbor(nr))
+			continue;
+
+		found = first_record(found, nr);
+	}
+
+	for (List<NodeRecord *>::iterator it = unindexed.begin(); it != unindexed.end(); it++) {
 		NodeRecord *nr = *it;
 
-		if (mustBeNeighbor && !nr->node->isNeighbor())
+		if (!has_iface_key(nr->node, keys))
 			continue;
 
-		if (strcmp(idStr.c_str(), nr->node->getIdStr()) == 0) {
-			return true;
-		}
+		if (mustBeNeighbor && !is_neighbor(nr))
+			continue;
+
+		found = first_record(found, nr);
 	}
-	return false;
+
+	return found;
 }
 
-bool NodeStore::stored(const NodeRef& node, bool mustBeNeighbor)
+bool NodeStore::_stored(const NodeRef &node, bool mustBeNeighbor)
 {
-        Mutex::AutoLocker l(mutex);
+	return _find(*node.getObj(), mustBeNeighbor) != NULL;
+}
 
-	bool ret;
-	
+bool NodeStore::_stored(const Node &node, bool mustBeNeighbor)
+{
+	return _find(node, mustBeNeighbor) != NULL;
+}
+
+bool NodeStore::_stored(const Node::Id_t id, bool mustBeNeighbor)
+{
+	return _find(id_str(id), mustBeNeighbor) != NULL;
+}
+
+bool NodeStore::_stored(const string idStr, bool mustBeNeighbor)
+{
+	return _find(idStr, mustBeNeighbor) != NULL;
+}
+
+bool NodeStore::stored(const NodeRef& node, bool mustBeNeighbor)
+{
 	if (!node)
 		return false;
 
+	// Take the keys from the node before locking the store, so that
+	// the node is not locked while the store is searched
 	node.lock();
-	ret = _stored(node, mustBeNeighbor);
+	NodeKeys keys(*node.getObj());
 	node.unlock();
 
-	return ret;
+	RWMutex::ReadLocker l(mutex);
+
+	return _find(keys, mustBeNeighbor) != NULL;
 }
 
 bool NodeStore::stored(const Node &node, bool mustBeNeighbor)
 {
-        Mutex::AutoLocker l(mutex);
+	RWMutex::ReadLocker l(mutex);
 
 	return _stored(node, mustBeNeighbor);
 }
 
 bool NodeStore::stored(const Node::Id_t id, bool mustBeNeighbor)
 {
-        Mutex::AutoLocker l(mutex);
+	RWMutex::ReadLocker l(mutex);
 
 	return (id ? _stored(id, mustBeNeighbor) : false);
 }
 
 bool NodeStore::stored(const string idStr, bool mustBeNeighbor)
 {
-        Mutex::AutoLocker l(mutex);
+	RWMutex::ReadLocker l(mutex);
 
 	return _stored(idStr, mustBeNeighbor);
 }
 
 bool NodeStore::add(NodeRef &node)
 {
-        Mutex::AutoLocker l(mutex);
+	RWMutex::WriteLocker l(mutex);
 
 	if (!node)
 		return false;;
@@ -145,15 +369,13 @@ bool NodeStore::add(NodeRef &node)
 	}
 
 	HAGGLE_DBG("Adding new node to node store %s\n", node->getIdStr());
-	node->setStored();
-	push_back(new NodeRecord(node));
 
-	return true;
+	return _add(node) != NULL;
 }
 
 NodeRef NodeStore::add(Node *node)
 {
-        Mutex::AutoLocker l(mutex);
+	RWMutex::WriteLocker l(mutex);
 
 	if (!node)
 		return NULL;
@@ -166,116 +388,74 @@ NodeRef NodeStore::add(Node *node)
 	HAGGLE_DBG("Adding new node to node store %s\n", node->getIdStr());
 
 	NodeRef nodeRef(node);
-	nodeRef->setStored();
-	push_back(new NodeRecord(nodeRef));
+	
+	if (!_add(nodeRef))
+		return NULL;
 
 	return nodeRef;
 }
 
 NodeRef NodeStore::retrieve(const NodeRef &node, bool mustBeNeighbor)
 {
-        Mutex::AutoLocker l(mutex);
+	RWMutex::ReadLocker l(mutex);
 
 	if (!node)
 		return NULL;
 
-	for (NodeStore::iterator it = begin(); it != end(); it++) {
-		NodeRecord *nr = *it;
+	NodeRecord *nr = _find(*node.getObj(), mustBeNeighbor);
 
-		if (mustBeNeighbor && !nr->node->isNeighbor())
-			continue;
-
-		if (nr->node == node)
-			return nr->node;
-	}
-
-	return NULL;
+	return nr ? nr->node : NodeRef();
 }
 
 NodeRef NodeStore::retrieve(const Node& node, bool mustBeNeighbor)
 {
-        Mutex::AutoLocker l(mutex);
-
-	for (NodeStore::iterator it = begin(); it != end(); it++) {
-		NodeRecord *nr = *it;
+	RWMutex::ReadLocker l(mutex);
 
-		if (mustBeNeighbor && !nr->node->isNeighbor())
-			continue;
-
-		if (nr->node == node)
-			return nr->node;
-	}
+	NodeRecord *nr = _find(node, mustBeNeighbor);
 
-	return NULL;
+	return nr ? nr->node : NodeRef();
 }
 
 NodeRef NodeStore::retrieve(const Node::Id_t id, bool mustBeNeighbor)
 {
-        Mutex::AutoLocker l(mutex);
+	RWMutex::ReadLocker l(mutex);
 
-	for (NodeStore::iterator it = begin(); it != end(); it++) {
-		NodeRecord *nr = *it;
-		NodeRef node = nr->node;
-
-		if (mustBeNeighbor && !node->isNeighbor())
-			continue;
+	NodeRecord *nr = _find(id_str(id), mustBeNeighbor);
 
-		if (memcmp(id, node->getId(), NODE_ID_LEN) == 0) 
-			return node;
-	}
-
-	return NULL;
+	return nr ? nr->node : NodeRef();
 }
 
 NodeRef NodeStore::retrieve(const string &id, bool mustBeNeighbor)
 {
-        Mutex::AutoLocker l(mutex);
+	RWMutex::ReadLocker l(mutex);
 
-	for (NodeStore::iterator it = begin(); it != end(); it++) {
-		NodeRecord *nr = *it;
-		NodeRef node = nr->node;
+	NodeRecord *nr = _find(id, mustBeNeighbor);
 
-		if (mustBeNeighbor && !node->isNeighbor())
-			continue;
-
-		if (memcmp(id.c_str(), node->getIdStr(), MAX_NODE_ID_STR_LEN) == 0) 
-			return node;
-	}
-
-	return NULL;
+	return nr ? nr->node : NodeRef();
 }
 
 NodeRef NodeStore::retrieve(const InterfaceRef &iface, bool mustBeNeighbor)
 {
-        Mutex::AutoLocker l(mutex);
-
-        if (!iface)
-	        return NULL;
-
-	for (NodeStore::iterator it = begin(); it != end(); it++) {
-		NodeRecord *nr = *it;
-		NodeRef node = nr->node;
+	RWMutex::ReadLocker l(mutex);
 
-		if (mustBeNeighbor && !node->isNeighbor())
-			continue;
+	if (!iface)
+		return NULL;
 
-		if (node->hasInterface(iface)) 
-			return node;
-	}
+	NodeRecord *nr = _find(iface, mustBeNeighbor);
 
-	return NULL;
+	return nr ? nr->node : NodeRef();
 }
 
 NodeStore::size_type NodeStore::retrieve(Node::Type_t type, NodeRefList& nl)
 {
-        Mutex::AutoLocker l(mutex);
+	RWMutex::ReadLocker l(mutex);
 	size_type n = 0;
 	
 	for (NodeStore::iterator it = begin(); it != end(); it++) {
 		const NodeRecord *nr = *it;
 
-		if (nr->node->getType() == type) {
-                        n++;
+		if (nr->type == type) {
+			n++;
 			nl.add(nr->node);
 		}
 	}
@@ -285,14 +465,14 @@ NodeStore::size_type NodeStore::retrieve(Node::Type_t type, NodeRefList& nl)
 
 NodeStore::size_type NodeStore::retrieve(const Criteria& crit, NodeRefList& nl)
 {
-        Mutex::AutoLocker l(mutex);
+	RWMutex::ReadLocker l(mutex);
 	size_type n = 0;
 
 	for (NodeStore::iterator it = begin(); it != end(); it++) {
 		const NodeRecord *nr = *it;
 
 		if (crit(nr->node)) {
-                        n++;
+			n++;
 			nl.add(nr->node);
 		}
 	}
@@ -303,14 +483,17 @@ NodeStore::size_type NodeStore::retrieve(const Criteria& crit, NodeRefList& nl)
 
 NodeStore::size_type NodeStore::retrieveNeighbors(NodeRefList& nl)
 {
-        Mutex::AutoLocker l(mutex);
+	RWMutex::ReadLocker l(mutex);
 	size_type n = 0;
 
-	for (NodeStore::iterator it = begin(); it != end(); it++) {
+	// Whether a node is a neighbor depends on the state of its
+	// interfaces, which may change while it is stored, so only the
+	// type of the node is indexed
+	for (List<NodeRecord *>::iterator it = neighbors.begin(); it != neighbors.end(); it++) {
 		const NodeRecord *nr = *it;
 
-		if (nr->node->isNeighbor()) {
-                        n++;
+		if (is_neighbor(nr)) {
+			n++;
 			nl.add(nr->node);
 		}
 	}
@@ -320,106 +503,130 @@ NodeStore::size_type NodeStore::retrieveNeighbors(NodeRefList& nl)
 
 NodeStore::size_type NodeStore::numNeighbors()
 {
-        Mutex::AutoLocker l(mutex);
+	RWMutex::ReadLocker l(mutex);
 	size_type n = 0;
 
-	for (NodeStore::iterator it = begin(); it != end(); it++) {
+	for (List<NodeRecord *>::iterator it = neighbors.begin(); it != neighbors.end(); it++) {
 		const NodeRecord *nr = *it;
 
-		if (nr->node->isNeighbor()) {
-                        n++;
+		if (is_neighbor(nr)) {
+			n++;
 		}
 	}
 
 	return n;
 }
 
+/*
+	Inserts a record in a list of records in the order they were added to 
+	the store, unless it is already in the list.
+*/
+static void insert_in_store_order(List<NodeRecord *>& records, NodeRecord *nr)
+{
+	List<NodeRecord *>::iterator it = records.begin();
+
+	for (; it != records.end(); it++) {
+		if (*it == nr)
+			return;
+
+		if ((*it)->seq > nr->seq)
+			break;
+	}
+	records.insert(it, nr);
+}
+
 bool NodeStore::update(NodeRef &node, NodeRefList *nl)
 {
-        Mutex::AutoLocker l(mutex);
-	bool found = false;
+	RWMutex::WriteLocker l(mutex);
+	List<NodeRecord *> records;
 	
 	if (!node)
 		return false;
 
 	// There may be undefined nodes in the node store that should
 	// be removed/merged with a 'defined' node that we create from a 
-	// node description. We loop through all nodes in the store and
-	// compare their interface lists with the one in the 'defined' node.
-	// If any interfaces match, we remove the matching nodes in the store 
-	// and eventually replace them with the new one.
-	for (NodeStore::iterator it = begin(); it != end();) {
+	// node description. We look up the nodes in the store that have 
+	// any of the interfaces of the 'defined' node, remove them and 
+	// eventually replace them with the new one.
+	const InterfaceRefList *ifaces = node->getInterfaces();
+
+	for (InterfaceRefList::const_iterator it = ifaces->begin(); it != ifaces->end(); it++) {
+		string key = iface_key(*it);
+
+		for (index_t::iterator jt = iface_index.find(key); jt != iface_index.end() && (*jt).first == key; jt++) {
+			if ((*jt).second->node->hasInterface(*it))
+				insert_in_store_order(records, (*jt).second);
+		}
+	}
+
+	for (List<NodeRecord *>::iterator it = unindexed.begin(); it != unindexed.end(); it++) {
+		NodeRecord *nr = *it;
+		const InterfaceRefList *nr_ifaces = nr->node->getInterfaces();
+
+		for (InterfaceRefList::const_iterator jt = nr_ifaces->begin(); jt != nr_ifaces->end(); jt++) {
+			if (node->hasInterface(*jt)) {
+				insert_in_store_order(records, nr);
+				break;
+			}
+		}
+	}
+
+	for (List<NodeRecord *>::iterator it = records.begin(); it != records.end(); it++) {
 		NodeRecord *nr = *it;
-		bool found_now = false;
 		
 		nr->node.lock();
 
-		const InterfaceRefList *ifaces = nr->node->getInterfaces();
+		const InterfaceRefList *nr_ifaces = nr->node->getInterfaces();
 
-		for (InterfaceRefList::const_iterator it2 = ifaces->begin(); it2 != ifaces->end(); it2++) {
+		for (InterfaceRefList::const_iterator it2 = nr_ifaces->begin(); it2 != nr_ifaces->end(); it2++) {
 			InterfaceRef iface = *it2;
 
-			if (node->hasInterface(iface)) {
-				// Transfer all the "up" interface states to the updated node
-				if (iface->isUp())
-					node->setInterfaceUp(iface);
-
-				found_now = true;
-			}
+			// Transfer all the "up" interface states to the updated node
+			if (iface->isUp() && node->hasInterface(iface))
+				node->setInterfaceUp(iface);
 		}
 		nr->node.unlock();
 
-		if (found_now) {
-			if (nl)
-				nl->push_back(nr->node);
-			
-			nr->node->setStored(false);
-
-			node->setExchangedNodeDescription(nr->node->hasExchangedNodeDescription());
-				
-			it = erase(it);
-			delete nr;
-			found = true;
-		} else {
-			it++;
-		}
-	}
-	if (found) {
-		node->setStored(true);
-		push_back(new NodeRecord(node));
+		if (nl)
+			nl->push_back(nr->node);
+		
+		node->setExchangedNodeDescription(nr->node->hasExchangedNodeDescription());
+		
+		_remove(nr);
 	}
 
-	return found;
+	if (records.empty())
+		return false;
+
+	_add(node);
+
+	return true;
 }
 
 
 // Remove neighbor with a specified interface
 NodeRef NodeStore::remove(const InterfaceRef &iface)
 {
-        Mutex::AutoLocker l(mutex);
+	RWMutex::WriteLocker l(mutex);
 
 	if (!iface)
 		return NULL;
 
-	for (NodeStore::iterator it = begin(); it != end(); it++) {
-		NodeRecord *nr = *it;
+	NodeRecord *nr = _find(iface);
 
-		if (nr->node->hasInterface(iface)) {
-			NodeRef node = nr->node;
-			erase(it);
-			node->setStored(false);
-			delete nr;
-			return node;
-		}
-	}
+	if (!nr)
+		return NULL;
+
+	NodeRef node = nr->node;
+	_remove(nr);
 
-	return NULL;
+	return node;
 }
 
 // Remove all nodes of a specific type
 int NodeStore::remove(const Node::Type_t type)
 {
-        Mutex::AutoLocker l(mutex);
+	RWMutex::WriteLocker l(mutex);
 	int n = 0;
 
 	NodeStore::iterator it = begin();
@@ -427,14 +634,12 @@ int NodeStore::remove(const Node::Type_t type)
 	while (it != end()) {
 		NodeRecord *nr = *it;
 
-		if (nr->node->getType() == type) {
-			it = erase(it);
+		it++;
+
+		if (nr->type == type) {
+			_remove(nr);
 			n++;
-			nr->node->setStored(false);
-			delete nr;
-			continue;
 		}
-		it++;
 	}
 
 	return n;
@@ -443,29 +648,25 @@ int NodeStore::remove(const Node::Type_t type)
 // Remove neighbor with a specified interface
 bool NodeStore::remove(const NodeRef &node)
 {
-        Mutex::AutoLocker l(mutex);
+	RWMutex::WriteLocker l(mutex);
 
 	if (!node)
 		return false;
 
-	for (NodeStore::iterator it = begin(); it != end(); it++) {
-		NodeRecord *nr = *it;
+	NodeRecord *nr = _find(*node.getObj());
 
-		if (nr->node == node) {
-			erase(it);
-			nr->node->setStored(false);
-			delete nr;
-			return true;
-		}
-	}
+	if (!nr)
+		return false;
+
+	_remove(nr);
 
-	return false;
+	return true;
 }
 
 #ifdef DEBUG
 void NodeStore::print()
 {
-        Mutex::AutoLocker l(mutex);
+	RWMutex::ReadLocker l(mutex);
 	int n = 0;
 
 	printf("======== Node store list ========\n\n");
@@ -477,14 +678,14 @@ void NodeStore::print()
 	for (NodeStore::iterator it = begin(); it != end(); it++) {
 		const NodeRecord *nr = *it;
 
-                printf("Node: %d type=\'%s\' name=\'%s\' - %s stored=%s\n", 
-                       n++, nr->node->getTypeStr(),
-                       nr->node->getName().c_str(),
-                       (nr->node->isAvailable() && (nr->node->getType() == Node::TYPE_PEER || nr->node->getType() == Node::TYPE_UNDEFINED)) ? "Neighbor" : "Unconfirmed neighbor",
-                       nr->node->isStored() ? "Yes" : "No");
+		printf("Node: %d type=\'%s\' name=\'%s\' - %s stored=%s\n", 
+		       n++, nr->node->getTypeStr(),
+		       nr->node->getName().c_str(),
+		       (nr->node->isAvailable() && (nr->node->getType() == Node::TYPE_PEER || nr->node->getType() == Node::TYPE_UNDEFINED)) ? "Neighbor" : "Unconfirmed neighbor",
+		       nr->node->isStored() ? "Yes" : "No");
 		printf("Num objects in bloomfilter=%lu\n", nr->node->getBloomfilter()->numObjects());
-                printf("id=%s\n", nr->node->getIdStr());
-                printf("");
+		printf("id=%s\n", nr->node->getIdStr());
+		printf("");
 		nr->node->printInterfaces();
 
 		const Attributes *attrs = nr->node->getAttributes();
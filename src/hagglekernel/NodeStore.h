@@ -16,21 +16,49 @@
 #define _NODESTORE_H
 
 #include <libcpphaggle/List.h>
-#include <libcpphaggle/Mutex.h>
+#include <libcpphaggle/HashMap.h>
+#include <libcpphaggle/String.h>
+#include <libcpphaggle/RWMutex.h>
 
 #include "Node.h"
 
 /**
-	The node record only holds a node now, but it may be expanded in the future.
+	The node record holds a node, and where the node is in the node store
+	and its indexes.
 */
 class NodeRecord {
 public:
 	NodeRef node;
-	NodeRecord(const NodeRef &_node) : node(_node) {}
+	// The order in which the node was added to the store, so that a
+	// lookup in the indexes finds the same node as a walk of the store
+	unsigned long seq;
+	// Where the record is in the store, and in its neighbor list
+	List<NodeRecord *>::iterator pos;
+	List<NodeRecord *>::iterator neighbor_pos;
+	// The type of the node, and the keys the record is indexed by. They
+	// are kept here so that the store can be searched without locking
+	// the nodes in it.
+	Node::Type_t type;
+	string id_key;
+	List<string> iface_keys;
+	NodeRecord(const NodeRef &_node, unsigned long _seq = 0) : node(_node), seq(_seq), type(Node::TYPE_UNDEFINED) {}
 	~NodeRecord() {}
 	bool operator==(const NodeRef &n) { return node == n; }
 };
 
+/**
+	The type, id and interface keys of a node that is looked up in the
+	node store. They are taken from the node before the store is searched,
+	so that the node is not locked while the store is.
+*/
+class NodeKeys {
+public:
+	Node::Type_t type;
+	string id_key;
+	List<string> iface_keys;
+	NodeKeys(const Node &node);
+};
+
 /** 
  DEADLOCK WARNING!
 
@@ -88,17 +116,59 @@ public:
  A Good RULE is therefore to never dereference an object in the argument to 
  NodeStore::retreive(), or any other node store function.
 
+ The store mutex is a reader-writer mutex. Functions that only look at
+ the store, such as stored() and retrieve(), lock it for reading, so they
+ can run in several threads at once, while add(), update() and remove()
+ lock it for writing. The rule above applies to both. A thread may not
+ call the node store while it holds the store lock with lock().
+
+ Since several readers can be in the store at once, a reader may not lock
+ two nodes at the same time, or two readers could each wait for a node
+ that the other holds. Lookups therefore compare the keys cached in the
+ node records, and lock at most one stored node at a time.
+
  */
 
+/**
+ The node store keeps secondary indexes of its nodes, by node id and by
+ interface, so that a node can be looked up without walking the store. The
+ indexes are protected by the store mutex, and the same rules apply to them
+ as to the store itself.
+
+ The interfaces of a node are indexed when the node is added to the store,
+ so interfaces should be added to a node before it is stored. The local
+ node is the exception, since it gets its interfaces as they come up, and
+ is therefore not in the interface index.
+ */
 class NodeStore : protected List<NodeRecord *>
 {
-	Mutex mutex;
+	typedef HashMap<string, NodeRecord *> index_t;
+	RWMutex mutex;
+	// The number of records that have been added to the store
+	unsigned long num_added;
+	// Node id -> record. Undefined nodes have no id, and are not in it.
+	index_t id_index;
+	// Interface -> records of the nodes that have the interface
+	index_t iface_index;
+	// Records of nodes that are not in the interface index
+	List<NodeRecord *> unindexed;
+	// Records of nodes of the types that can be neighbors
+	List<NodeRecord *> neighbors;
+	/*
+	  Internal, unlocked functions that maintain the indexes.
+	 */
+	NodeRecord *_add(NodeRef &node);
+	void _remove(NodeRecord *nr);
+	NodeRecord *_find(const NodeKeys &keys, bool mustBeNeighbor = false);
+	NodeRecord *_find(const Node &node, bool mustBeNeighbor = false);
+	NodeRecord *_find(const string &idStr, bool mustBeNeighbor = false);
+	NodeRecord *_find(const InterfaceRef &iface, bool mustBeNeighbor = false);
 	/*
 	  Internal, unlocked versions of functions below.
 	 */
-        bool _stored(const NodeRef &node, bool mustBeNeighbor = false);
-        bool _stored(const Node &node, bool mustBeNeighbor = false);
-        bool _stored(const Node::Id_t id, bool mustBeNeighbor = false);
+	bool _stored(const NodeRef &node, bool mustBeNeighbor = false);
+	bool _stored(const Node &node, bool mustBeNeighbor = false);
+	bool _stored(const Node::Id_t id, bool mustBeNeighbor = false);
 	bool _stored(const string idStr, bool mustBeNeighbor = false);
 public:
 	/**
@@ -119,10 +189,15 @@ public:
 	NodeStore();
 	~NodeStore();
 
-	// Locking for the store
-	void lock() { mutex.lock(); }
+	// Locking for the store. The store is locked for writing.
+	void lock() { mutex.writeLock(); }
 	void unlock() { mutex.unlock(); }
-	bool trylock() { return mutex.trylock(); }
+	bool trylock() { return mutex.tryWriteLock(); }
+	/**
+		Returns the store mutex, so that the time that threads
+		have waited for it can be reported.
+	*/
+	RWMutex& getMutex() { return mutex; }
 	/**
 		Check if a node is currently stored in the store. The caller
 		may optionally specify whether the given node must be marked
@@ -132,7 +207,7 @@ public:
 		DEADLOCK WARNING: the calling thread may not hold the lock on a object 
 		reference or an interface reference while calling this function.
 	*/
-        bool stored(const NodeRef& node, bool mustBeNeighbor = false);
+	bool stored(const NodeRef& node, bool mustBeNeighbor = false);
 	/**
 		Check if a node is currently stored in the store. The caller
 		may optionally specify whether the given node must be marked
@@ -142,7 +217,7 @@ public:
 		DEADLOCK WARNING: the calling thread may not hold the lock on a object 
 		reference or an interface reference while calling this function.
 	*/
-        bool stored(const Node& node, bool mustBeNeighbor = false);
+	bool stored(const Node& node, bool mustBeNeighbor = false);
 	/**
 		Check if a node is currently stored in the store. The caller
 		may optionally specify whether the given node must be marked
@@ -152,7 +227,7 @@ public:
 		DEADLOCK WARNING: the calling thread may not hold the lock on a object 
 		reference or an interface reference while calling this function.
 	*/
-        bool stored(const Node::Id_t id, bool mustBeNeighbor = false);
+	bool stored(const Node::Id_t id, bool mustBeNeighbor = false);
 	/**
 		Check if a node is currently stored in the store. The caller
 		may optionally specify whether the given node must be marked
@@ -169,14 +244,14 @@ public:
 		DEADLOCK WARNING: the calling thread may not hold the lock on a object 
 		reference or an interface reference while calling this function.
 	*/
-        bool add(NodeRef& node);
+	bool add(NodeRef& node);
 	/**
 		Add a new node to the node store.
 		
 		DEADLOCK WARNING: the calling thread may not hold the lock on a object 
 		reference or an interface reference while calling this function.
 	*/
-        NodeRef add(Node *node);
+	NodeRef add(Node *node);
 
 	/**
 		Retrieve a node from the node store. The caller may optionally 
@@ -187,7 +262,7 @@ public:
 		DEADLOCK WARNING: the calling thread may not hold the lock on a object 
 		reference or an interface reference while calling this function.
 	*/
-        NodeRef retrieve(const NodeRef& node, bool mustBeNeighbor = false);
+	NodeRef retrieve(const NodeRef& node, bool mustBeNeighbor = false);
 	/**
 		Retrieve a node from the node store. The caller may optionally 
 		specify to only retrieve current neighbors.
@@ -197,7 +272,7 @@ public:
 		DEADLOCK WARNING: the calling thread may not hold the lock on a object 
 		reference or an interface reference while calling this function.
 	*/
-        NodeRef retrieve(const Node& node, bool mustBeNeighbor = false);
+	NodeRef retrieve(const Node& node, bool mustBeNeighbor = false);
 	/**
 		Retrieve a node from the node store. The caller may optionally 
 		specify to only retrieve current neighbors.
@@ -207,7 +282,7 @@ public:
 		DEADLOCK WARNING: the calling thread may not hold the lock on a object 
 		reference or an interface reference while calling this function.
 	*/
-        NodeRef retrieve(const Node::Id_t id, bool mustBeNeighbor = false);
+	NodeRef retrieve(const Node::Id_t id, bool mustBeNeighbor = false);
 	/**
 		Retrieve a node from the node store. The caller may optionally 
 		specify to only retrieve current neighbors.
@@ -227,7 +302,7 @@ public:
 		DEADLOCK WARNING: the calling thread may not hold the lock on a object 
 		reference or an interface reference while calling this function.
 	*/
-        NodeRef retrieve(const InterfaceRef& iface, bool mustBeNeighbor = false);
+	NodeRef retrieve(const InterfaceRef& iface, bool mustBeNeighbor = false);
 
 	/**
 		Retrieve a list of all nodes matching a specific criteria.
@@ -251,7 +326,7 @@ public:
 	template<typename T>
 	size_type retrieve(ReferenceList<T>& nl)
 	{
-		Mutex::AutoLocker l(mutex);
+		RWMutex::ReadLocker l(mutex);
 		size_type n = 0;
 		
 		for (NodeStore::iterator it = begin(); it != end(); it++) {
@@ -299,7 +374,7 @@ public:
 		DEADLOCK WARNING: the calling thread may not hold the lock on a object 
 		reference or an interface reference while calling this function.
 	*/
-        int remove(const Node::Type_t type);
+	int remove(const Node::Type_t type);
 
 	/**
 		Remove a node that have a specific interface.
@@ -309,7 +384,7 @@ public:
 		DEADLOCK WARNING: the calling thread may not hold the lock on a object 
 		reference or an interface reference while calling this function.
 	*/
-        NodeRef remove(const InterfaceRef& iface);
+	NodeRef remove(const InterfaceRef& iface);
 	/**
 		Update a node in the node store given a "fresher" version
 		of the node. The interfaces of the node given as in-argument is matched
@@ -319,11 +394,11 @@ public:
 		DEADLOCK WARNING: the calling thread may not hold the lock on a object 
 		reference or an interface reference while calling this function.
 	*/
-        bool update(NodeRef &inNode, NodeRefList *nl = NULL);
+	bool update(NodeRef &inNode, NodeRefList *nl = NULL);
 
 	
 #ifdef DEBUG
-        void print();
+	void print();
 #endif
 };
 
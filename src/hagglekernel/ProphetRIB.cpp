@@ -0,0 +1,235 @@
+/* Copyright 2009 Uppsala University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include <stdlib.h>
+#include <math.h>
+
+#include "ProphetRIB.h"
+
+// Metrics below this are set to zero when aged
+#define PROPHET_METRIC_MIN (0.000001)
+
+ProphetRIB::ProphetRIB(double _gamma, double _time_unit) :
+	size(0), capacity(0), metrics(NULL), aged(NULL), gamma(0), time_unit(0),
+	last_aging(Timeval::now().getTimeAsSecondsDouble()), next_aging(0)
+{
+	setAging(_gamma, _time_unit);
+}
+
+ProphetRIB::~ProphetRIB()
+{
+	if (metrics)
+		free(metrics);
+	if (aged)
+		free(aged);
+}
+
+void ProphetRIB::setAging(double _gamma, double _time_unit)
+{
+	gamma = _gamma;
+	time_unit = _time_unit;
+
+	gamma_pow[0] = 1.0;
+
+	for (int K = 1; K < PROPHET_GAMMA_POW_TABLE_SIZE; K++)
+		gamma_pow[K] = gamma_pow[K - 1] * gamma;
+
+	// Let the next pass find out when metrics need aging again
+	next_aging = 0;
+}
+
+bool ProphetRIB::reserve(unsigned long n)
+{
+	if (n <= capacity)
+		return true;
+
+	// Grow in steps, to avoid reallocating for every new id number
+	n = n * 2;
+
+	double *new_metrics = (double *)realloc(metrics, n * sizeof(double));
+
+	if (!new_metrics)
+		return false;
+
+	metrics = new_metrics;
+
+	double *new_aged = (double *)realloc(aged, n * sizeof(double));
+
+	if (!new_aged)
+		return false;
+
+	aged = new_aged;
+	capacity = n;
+
+	return true;
+}
+
+unsigned long ProphetRIB::age(const Timeval& now)
+{
+	double t = now.getTimeAsSecondsDouble();
+	double next = t + time_unit;
+	unsigned long n = 0;
+
+	last_aging = t;
+
+	if (t < next_aging || time_unit <= 0)
+		return 0;
+
+	for (unsigned long i = 0; i < size; i++) {
+		if (metrics[i] == 0.0)
+			continue;
+
+		long K = (long)((t - aged[i]) / time_unit);
+
+		if (K > 0) {
+			/*
+			 Age according to the Prophet draft:
+
+				P_(A,B) = P_(A,B)_old * gamma^K (2)
+
+			 The time the metric was aged is moved ahead by whole time
+			 units, so that the rest of a time unit is not lost.
+			 */
+			metrics[i] *= K < PROPHET_GAMMA_POW_TABLE_SIZE ? gamma_pow[K] : pow(gamma, (double)K);
+			aged[i] += K * time_unit;
+
+			if (metrics[i] < PROPHET_METRIC_MIN) {
+				// Let's say it's 0:
+				metrics[i] = 0.0;
+				continue;
+			}
+			n++;
+		}
+
+		if (aged[i] + time_unit < next)
+			next = aged[i] + time_unit;
+	}
+	next_aging = next;
+
+	return n;
+}
+
+double *ProphetRIB::metric(const prophet_node_id_t id)
+{
+	if (id >= size) {
+		if (!reserve(id + 1))
+			return NULL;
+
+		for (; size <= id; size++) {
+			metrics[size] = 0.0;
+			aged[size] = 0.0;
+		}
+	}
+
+	if (metrics[id] == 0.0) {
+		// The metric is new, so it is aged from the last aging pass
+		aged[id] = last_aging;
+
+		if (next_aging > last_aging + time_unit)
+			next_aging = last_aging + time_unit;
+	}
+
+	return &metrics[id];
+}
+
+bool ProphetRIB::set(const prophet_node_id_t id, double P, const Timeval& aged_time)
+{
+	double *P_ab = metric(id);
+
+	if (!P_ab)
+		return false;
+
+	*P_ab = P;
+	aged[id] = aged_time.getTimeAsSecondsDouble();
+
+	// Let the next pass find out when metrics need aging again
+	next_aging = 0;
+
+	return true;
+}
+
+ProphetTopK::ProphetTopK(unsigned long _k) :
+	k(_k), n(0), heap(NULL)
+{
+	if (k)
+		heap = (candidate_t *)malloc(k * sizeof(candidate_t));
+
+	if (!heap)
+		k = 0;
+}
+
+ProphetTopK::~ProphetTopK()
+{
+	if (heap)
+		free(heap);
+}
+
+void ProphetTopK::sift_down(unsigned long i, unsigned long len)
+{
+	candidate_t c = heap[i];
+
+	while (2 * i + 1 < len) {
+		unsigned long child = 2 * i + 1;
+
+		if (child + 1 < len && heap[child + 1].metric < heap[child].metric)
+			child++;
+
+		if (heap[child].metric >= c.metric)
+			break;
+
+		heap[i] = heap[child];
+		i = child;
+	}
+	heap[i] = c;
+}
+
+bool ProphetTopK::insert(const prophet_node_id_t id, double metric)
+{
+	if (n < k) {
+		// Sift the new candidate up from the bottom of the heap
+		unsigned long i = n++;
+
+		while (i > 0 && metric < heap[(i - 1) / 2].metric) {
+			heap[i] = heap[(i - 1) / 2];
+			i = (i - 1) / 2;
+		}
+		heap[i].id = id;
+		heap[i].metric = metric;
+
+		return true;
+	}
+
+	// Replace the worst selected candidate if this one is better
+	if (k == 0 || metric <= heap[0].metric)
+		return false;
+
+	heap[0].id = id;
+	heap[0].metric = metric;
+	sift_down(0, n);
+
+	return true;
+}
+
+void ProphetTopK::sort()
+{
+	// Move the worst candidate to the end of the heap until it is empty,
+	// which leaves the candidates in order of decreasing metric
+	for (unsigned long len = n; len > 1; len--) {
+		candidate_t c = heap[0];
+
+		heap[0] = heap[len - 1];
+		heap[len - 1] = c;
+		sift_down(0, len - 1);
+	}
+}
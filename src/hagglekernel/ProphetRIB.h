@@ -0,0 +1,142 @@
+/* Copyright 2009 Uppsala University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef _PROPHETRIB_H
+#define _PROPHETRIB_H
+
+/*
+	Forward declarations of all data types declared in this file. This is to
+	avoid circular dependencies. If/when a data type is added to this file,
+	remember to add it here.
+*/
+class ProphetRIB;
+class ProphetTopK;
+
+#include <libcpphaggle/Platform.h>
+#include <libcpphaggle/Timeval.h>
+
+using namespace haggle;
+
+/**
+	Prophet forwarding ids are only used internally in the forwarderprophet
+	manager module, but for technical reasons it needs to be defined here.
+*/
+typedef unsigned long prophet_node_id_t;
+
+// Symbolic constant for the local node.
+#define this_node_id ((prophet_node_id_t) 1)
+
+// The number of powers of gamma that are precomputed
+#define PROPHET_GAMMA_POW_TABLE_SIZE 64
+
+/**
+	The local node's PRoPHET metrics.
+
+	The forwarder hands out id numbers in sequence, so the metrics and the
+	times they were last aged are kept in arrays indexed by id number. All
+	metrics are aged together in one pass over the arrays, which is done at
+	most once per aging time unit, and the metrics can then be read without
+	modifying the RIB.
+*/
+class ProphetRIB {
+	// The number of id numbers that have a slot in the arrays
+	unsigned long size;
+	unsigned long capacity;
+	double *metrics;
+	// The time, in seconds, when each metric was last aged
+	double *aged;
+	double gamma;
+	double time_unit;
+	// gamma_pow[K] = gamma^K
+	double gamma_pow[PROPHET_GAMMA_POW_TABLE_SIZE];
+	// The time of the last aging pass, and of the next one that can age
+	// any metric
+	double last_aging;
+	double next_aging;
+	bool reserve(unsigned long n);
+public:
+	ProphetRIB(double _gamma, double _time_unit);
+	~ProphetRIB();
+	/**
+		Sets the aging parameters, and precomputes the powers of gamma.
+	*/
+	void setAging(double _gamma, double _time_unit);
+	/**
+		Ages all metrics by gamma^K, where K is the number of aging time
+		units since they were last aged. Returns the number of metrics that
+		were aged.
+	*/
+	unsigned long age(const Timeval& now = Timeval::now());
+	/**
+		Returns the metric for an id number, or zero if there is none.
+	*/
+	double get(const prophet_node_id_t id) const { return id < size ? metrics[id] : 0.0; }
+	/**
+		Returns the time the metric for an id number was last aged.
+	*/
+	Timeval getAgedTime(const prophet_node_id_t id) const { return Timeval(id < size ? aged[id] : 0.0); }
+	/**
+		Returns a reference to the metric for an id number, so that it can
+		be updated. A metric that was zero counts as new, and is aged from
+		the time of the last aging pass. Returns NULL if the RIB could not
+		grow to hold the id number.
+	*/
+	double *metric(const prophet_node_id_t id);
+	/**
+		Sets a metric and the time it was last aged, e.g., when restoring
+		the RIB from the repository.
+	*/
+	bool set(const prophet_node_id_t id, double P, const Timeval& aged_time);
+	/**
+		All id numbers below this have a slot in the RIB. Ids without a
+		metric have a metric of zero.
+	*/
+	prophet_node_id_t end() const { return size; }
+};
+
+/**
+	Selects the k id numbers with the highest metrics, e.g., the best
+	targets or delegates, from any number of candidates.
+
+	The selected candidates are kept in a min-heap of at most k entries, so
+	that a candidate only needs to be compared with the worst one selected
+	so far.
+*/
+class ProphetTopK {
+	typedef struct {
+		prophet_node_id_t id;
+		double metric;
+	} candidate_t;
+	unsigned long k;
+	unsigned long n;
+	candidate_t *heap;
+	void sift_down(unsigned long i, unsigned long len);
+public:
+	ProphetTopK(unsigned long _k);
+	~ProphetTopK();
+	/**
+		Adds a candidate. Returns true if it is among the k best so far.
+	*/
+	bool insert(const prophet_node_id_t id, double metric);
+	/**
+		Sorts the selected candidates in order of decreasing metric. No
+		more candidates can be inserted after this.
+	*/
+	void sort();
+	unsigned long size() const { return n; }
+	prophet_node_id_t getId(unsigned long i) const { return heap[i].id; }
+	double getMetric(unsigned long i) const { return heap[i].metric; }
+};
+
+#endif /* _PROPHETRIB_H */
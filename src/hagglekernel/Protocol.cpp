@@ -83,6 +83,10 @@ static inline char *create_name(const char *name, const unsigned long id, const
 Protocol::Protocol(const ProtType_t _type, const string _name, const InterfaceRef& _localIface, 
 		   const InterfaceRef& _peerIface, const int _flags, ProtocolManager *_m, size_t _bufferSize) : 
 	ManagerModule<ProtocolManager>(_m, create_name(_name.c_str(), num + 1,  _flags)),
+	asyncStarted(false), asyncState(ASYNC_STATE_CONNECT_WAIT), asyncConnectTry(0), asyncNumErrors(0),
+	txHeaderSent(false), txCorked(false), txLen(0), txOffset(0), rxBytesRemaining(0), rxHeaderReceived(false),
+	xferBytes(0), ctrlOutLen(0), ctrlInLen(0),
+	statConnections(0), statConnectSecs(0), statDataObjectsSent(0), statFirstByteSecs(0),
 	isRegistered(false), type(_type), id(num++), error(PROT_ERROR_UNKNOWN), flags(_flags), 
 	mode(PROT_MODE_IDLE), localIface(_localIface), peerIface(_peerIface), peerNode(NULL),
 	buffer(NULL), bufferSize(_bufferSize), bufferDataLen(0)
@@ -227,6 +231,7 @@ ProtocolEvent Protocol::waitForEvent(DataObjectRef& dObj, Timeval *timeout, bool
 		return  PROT_EVENT_TIMEOUT;
 	case QUEUE_ELEMENT:
 		dObj = qe->getDataObject();
+		txQueueTime = qe->getQueueTime();
 		delete qe;
 		return PROT_EVENT_TXQ_NEW_DATAOBJECT;
 	default:
@@ -235,6 +240,43 @@ ProtocolEvent Protocol::waitForEvent(DataObjectRef& dObj, Timeval *timeout, bool
 	return PROT_EVENT_ERROR;
 }
 
+void Protocol::connectionSetUp()
+{
+	double secs = (Timeval::now() - connectStart).getTimeAsSecondsDouble();
+
+	statConnections++;
+	statConnectSecs += secs;
+	statConnectLatency.add(secs);
+}
+
+/*
+  Returns the number of milliseconds to back off after the given round of
+  failed connect attempts, counting from one.
+*/
+unsigned long Protocol::getConnectBackoff(unsigned int round)
+{
+	unsigned long msecs = PROT_CONNECT_BACKOFF_MSECS;
+
+	while (--round > 0 && msecs < PROT_CONNECT_BACKOFF_MAX_MSECS)
+		msecs *= 2;
+
+	if (msecs > PROT_CONNECT_BACKOFF_MAX_MSECS)
+		msecs = PROT_CONNECT_BACKOFF_MAX_MSECS;
+
+	return msecs - RANDOM_INT(msecs / 2);
+}
+
+void Protocol::firstByteSent()
+{
+	statDataObjectsSent++;
+	statFirstByteSecs += (Timeval::now() - txQueueTime).getTimeAsSecondsDouble();
+}
+
+unsigned long Protocol::getKeepAliveTime() const
+{
+	return getManager() ? getManager()->getConnectionKeepAlive() : PROT_KEEPALIVE_TIME;
+}
+
 void Protocol::closeConnection()
 {
 	return;
@@ -396,6 +438,29 @@ const char *Protocol::protocolErrorToStr(const ProtocolError e) const
 ProtocolEvent Protocol::startTxRx()
 {
 	if (isClient()) {
+		if (isAsynchronous()) {
+			ProtocolEngine *engine = getManager()->getEngine();
+
+			if (asyncStarted) {
+				// Tell the protocol to check its queue
+				engine->wakeup(this);
+				return PROT_EVENT_SUCCESS;
+			}
+
+			if (isConnected()) {
+				asyncIdle();
+			} else {
+				asyncState = ASYNC_STATE_CONNECT_WAIT;
+				connectStart = Timeval::now();
+			}
+
+			if (!engine->add(this))
+				return PROT_EVENT_ERROR;
+
+			asyncStarted = true;
+
+			return PROT_EVENT_SUCCESS;
+		}
 		if (isRunning()) {
 			return PROT_EVENT_SUCCESS;
 		}
@@ -909,6 +974,7 @@ ProtocolEvent Protocol::sendDataObjectNow(const DataObjectRef& dObj)
 	Timeval t_start = Timeval::now();
 	Timeval waitTimeout;
 	bool hasSentHeader = false;
+	bool corked = false;
 	ssize_t len;
         struct ctrlmsg m;
 
@@ -931,6 +997,11 @@ ProtocolEvent Protocol::sendDataObjectNow(const DataObjectRef& dObj)
 			pEvent = PROT_EVENT_ERROR;
 		} else if (len > 0) {
 			size_t totBytes = 0;
+
+			if (!corked) {
+				hookCork(true);
+				corked = true;
+			}
                         
                         do {
 				size_t bytesSent = 0;
@@ -983,8 +1054,17 @@ ProtocolEvent Protocol::sendDataObjectNow(const DataObjectRef& dObj)
 				}
 			} while ((len - totBytes) && pEvent == PROT_EVENT_SUCCESS);
 
+			if (totBytesSent == 0 && totBytes > 0)
+				firstByteSent();
+
 			totBytesSent += totBytes;
 		}
+
+		// Push out what is written before waiting for the peer
+		if (corked && (len <= 0 || pEvent != PROT_EVENT_SUCCESS)) {
+			hookCork(false);
+			corked = false;
+		}
 		
 		// If we've just finished sending the header:
 		if (len == 0 && !hasSentHeader && pEvent == PROT_EVENT_SUCCESS) {
@@ -1071,6 +1151,8 @@ bool Protocol::run()
 
 	HAGGLE_DBG("Running protocol %s\n", getName());
 
+	connectStart = Timeval::now();
+
 	while (!isDone() && !shouldExit()) {
 		while (!isConnected() && !shouldExit() && !isDone()) {
                         
@@ -1086,9 +1168,16 @@ bool Protocol::run()
 				HAGGLE_DBG("%s successfully connected to %s\n", 
 					   getName(), 
 					   peerDescription().c_str());
+				connectionSetUp();
 			} else if (pEvent == PROT_EVENT_ERROR_FATAL) {
 				setMode(PROT_MODE_DONE);
 				HAGGLE_ERR("Fatal error, protocol done!\n");
+			} else if (isDone() || shouldExit()) {
+				HAGGLE_DBG("%s connect to %s aborted\n", 
+					   getName(), peerDescription().c_str());
+			} else if (nextPeerAddress()) {
+				HAGGLE_DBG("%s trying another address of %s\n", 
+					   getName(), peerDescription().c_str());
 			} else {
 				numConnectTry++;
 				HAGGLE_DBG("%s connect failure %d/%d to %s\n", 
@@ -1103,13 +1192,12 @@ bool Protocol::run()
 					q->close();
 					setMode(PROT_MODE_DONE);
 				} else {
-					unsigned int sleep_secs = 
-						RANDOM_INT(20) + 5;
+					unsigned long msecs = getConnectBackoff(numConnectTry);
 
-					HAGGLE_DBG("%s sleeping %u secs\n", 
-						   getName(), sleep_secs);
+					HAGGLE_DBG("%s backing off %lu msecs\n", 
+						   getName(), msecs);
 
-					cancelableSleep(sleep_secs * 1000);
+					cancelableSleep(msecs);
 				}
 			}
                         // Check to make sure we were not cancelled
@@ -1119,7 +1207,7 @@ bool Protocol::run()
 		}
 
 		Timeval t_start = Timeval::now();
-		Timeval timeout(PROT_WAIT_TIME_BEFORE_DONE);
+		Timeval timeout(getKeepAliveTime());
 		DataObjectRef dObj;
 
 		HAGGLE_DBG("%s Waiting for data object or timeout...\n", 
@@ -1134,8 +1222,10 @@ bool Protocol::run()
 
 		switch (pEvent) {
 			case PROT_EVENT_TIMEOUT:
-				// Timeout expired:
-				setMode(PROT_MODE_DONE);
+				// Timeout expired, unless the protocol manager
+				// queued a data object for us just now
+				if (q->size() == 0)
+					setMode(PROT_MODE_DONE);
 			break;
 			case PROT_EVENT_TXQ_NEW_DATAOBJECT:
 				// Data object to send:
@@ -1271,6 +1361,628 @@ bool Protocol::run()
 	return false;
 }
 
+/*
+  -------------------------------------------------------------------------------
+  Protocol engine code
+
+  A protocol that runs on the protocol engine does what run() does, but as a
+  state machine on a non-blocking socket. Each function below does as much as
+  it can without blocking, and then either moves to another state, or waits for
+  the engine to call onEngineEvent() again.
+*/
+
+Protocol::AsyncResult Protocol::asyncWait(unsigned long secs)
+{
+	deadline = Timeval::now() + Timeval(secs, 0);
+
+	return ASYNC_WAIT;
+}
+
+Protocol::AsyncResult Protocol::asyncIdle()
+{
+	asyncState = ASYNC_STATE_IDLE;
+	deadline = Timeval::now() + Timeval(getKeepAliveTime(), 0);
+
+	return ASYNC_CONTINUE;
+}
+
+ProtocolEvent Protocol::asyncError()
+{
+	switch (getProtocolError()) {
+	case PROT_ERROR_WOULD_BLOCK:
+		return PROT_EVENT_WOULD_BLOCK;
+	case PROT_ERROR_BAD_HANDLE:
+	case PROT_ERROR_NOT_CONNECTED:
+	case PROT_ERROR_NOT_A_SOCKET:
+	case PROT_ERROR_CONNECTION_RESET:
+		HAGGLE_ERR("%s Fatal error : %s\n", getName(), getProtocolErrorStr());
+		return PROT_EVENT_ERROR_FATAL;
+	default:
+		HAGGLE_ERR("%s Protocol error : %s\n", getName(), getProtocolErrorStr());
+		break;
+	}
+	return PROT_EVENT_ERROR;
+}
+
+/*
+  Writes the len bytes at buf, starting at *done, until they are all written or
+  the socket would block.
+*/
+ProtocolEvent Protocol::asyncWrite(const void *buf, size_t len, size_t *done)
+{
+	while (*done < len) {
+		size_t bytes = 0;
+		ProtocolEvent pEvent = sendData((const char *)buf + *done, len - *done, 0, &bytes);
+
+		if (pEvent == PROT_EVENT_ERROR)
+			return asyncError();
+		else if (pEvent != PROT_EVENT_SUCCESS)
+			return pEvent;
+
+		*done += bytes;
+	}
+	return PROT_EVENT_SUCCESS;
+}
+
+/*
+  Reads into the len bytes at buf, starting at *done, until they are all read or
+  the socket would block.
+*/
+ProtocolEvent Protocol::asyncRead(void *buf, size_t len, size_t *done)
+{
+	while (*done < len) {
+		size_t bytes = 0;
+		ProtocolEvent pEvent = receiveData((char *)buf + *done, len - *done, 0, &bytes);
+
+		if (pEvent == PROT_EVENT_ERROR)
+			return asyncError();
+		else if (pEvent != PROT_EVENT_SUCCESS)
+			return pEvent;
+
+		*done += bytes;
+	}
+	return PROT_EVENT_SUCCESS;
+}
+
+Protocol::AsyncResult Protocol::asyncConnect()
+{
+	HAGGLE_DBG("Protocol %s connecting to %s\n", getName(), peerDescription().c_str());
+
+	ProtocolEvent pEvent = connectToPeer();
+
+	if (pEvent == PROT_EVENT_WOULD_BLOCK) {
+		asyncState = ASYNC_STATE_CONNECTING;
+		return asyncWait(PROT_CONNECT_TIMEOUT);
+	}
+	return asyncConnected(pEvent);
+}
+
+Protocol::AsyncResult Protocol::asyncConnected(ProtocolEvent pEvent)
+{
+	if (pEvent == PROT_EVENT_SUCCESS) {
+		HAGGLE_DBG("%s successfully connected to %s\n", getName(), peerDescription().c_str());
+		connectionSetUp();
+		return asyncIdle();
+	} else if (pEvent == PROT_EVENT_ERROR_FATAL) {
+		HAGGLE_ERR("Fatal error, protocol done!\n");
+		return ASYNC_DONE;
+	}
+
+	if (nextPeerAddress()) {
+		HAGGLE_DBG("%s trying another address of %s\n", getName(), peerDescription().c_str());
+		return asyncConnect();
+	}
+
+	asyncConnectTry++;
+
+	HAGGLE_DBG("%s connect failure %d/%d to %s\n", getName(), asyncConnectTry,
+		   PROT_CONNECTION_ATTEMPTS, peerDescription().c_str());
+
+	if (asyncConnectTry == PROT_CONNECTION_ATTEMPTS) {
+		HAGGLE_DBG("%s connect failed to %s\n", getName(), peerDescription().c_str());
+		getQueue()->close();
+		return ASYNC_DONE;
+	}
+
+	unsigned long msecs = getConnectBackoff(asyncConnectTry);
+
+	HAGGLE_DBG("%s backing off %lu msecs\n", getName(), msecs);
+
+	asyncState = ASYNC_STATE_CONNECT_WAIT;
+	deadline = Timeval::now() + Timeval(msecs / 1000, (msecs % 1000) * 1000);
+
+	return ASYNC_WAIT;
+}
+
+Protocol::AsyncResult Protocol::asyncStartSend(const DataObjectRef& dObj)
+{
+	HAGGLE_DBG("%s : Sending data object [%s] to peer \'%s\'\n", 
+		   getName(), dObj->getIdStr(), peerDescription().c_str());
+
+	txDataObject = dObj;
+	txRetriever = dObj->getDataObjectDataRetriever();
+
+	if (!txRetriever || !txRetriever->isValid()) {
+		HAGGLE_ERR("%s unable to start reading data\n", getName());
+		return asyncSendDone(PROT_EVENT_ERROR);
+	}
+	txHeaderSent = false;
+	txLen = txOffset = 0;
+	xferStart = Timeval::now();
+	xferBytes = 0;
+	asyncState = ASYNC_STATE_SENDING;
+
+	return ASYNC_CONTINUE;
+}
+
+Protocol::AsyncResult Protocol::asyncSend()
+{
+	while (true) {
+		if (txOffset == txLen) {
+			ssize_t len = txRetriever->retrieve(buffer, bufferSize, !txHeaderSent);
+
+			if (len < 0) {
+				HAGGLE_ERR("Could not retrieve data from data object\n");
+				return asyncSendDone(PROT_EVENT_ERROR);
+			} else if (len == 0) {
+				// Push out what is written before waiting for the peer
+				if (txCorked) {
+					hookCork(false);
+					txCorked = false;
+				}
+				if (txHeaderSent) {
+					HAGGLE_DBG("Waiting %d seconds for ACK from peer [%s]\n", 
+						   PROTOCOL_RECVSEND_TIMEOUT, peerDescription().c_str());
+					asyncState = ASYNC_STATE_WAIT_ACK;
+				} else {
+					// We are sending to a local application: done after 
+					// sending the header
+					if (isApplication())
+						return asyncSendDone(PROT_EVENT_SUCCESS);
+
+					txHeaderSent = true;
+					asyncState = ASYNC_STATE_WAIT_ACCEPT;
+				}
+				ctrlInLen = 0;
+				return ASYNC_CONTINUE;
+			}
+			txLen = len;
+			txOffset = 0;
+
+			if (!txCorked) {
+				hookCork(true);
+				txCorked = true;
+			}
+		}
+
+		size_t offset = txOffset;
+		ProtocolEvent pEvent = asyncWrite(buffer, txLen, &txOffset);
+
+		if (xferBytes == 0 && txOffset > offset)
+			firstByteSent();
+
+		xferBytes += txOffset - offset;
+
+		if (pEvent == PROT_EVENT_WOULD_BLOCK)
+			return asyncWait(PROTOCOL_RECVSEND_TIMEOUT);
+		else if (pEvent != PROT_EVENT_SUCCESS)
+			return asyncSendDone(pEvent);
+	}
+}
+
+Protocol::AsyncResult Protocol::asyncReceiveCtrlMsg()
+{
+	ProtocolEvent pEvent = asyncRead(&ctrlIn, sizeof(ctrlIn), &ctrlInLen);
+
+	if (pEvent == PROT_EVENT_WOULD_BLOCK)
+		return asyncWait(PROTOCOL_RECVSEND_TIMEOUT);
+	else if (pEvent != PROT_EVENT_SUCCESS)
+		return asyncSendDone(pEvent);
+
+	HAGGLE_DBG("Received control message '%s'\n", ctrlmsgToStr(&ctrlIn).c_str());
+
+	if (asyncState == ASYNC_STATE_WAIT_ACK) {
+		if (ctrlIn.type == CTRLMSG_TYPE_ACK)
+			return asyncSendDone(PROT_EVENT_SUCCESS);
+
+		HAGGLE_ERR("Control message malformed: expected 'ACK', got '%s'\n", ctrlmsgToStr(&ctrlIn).c_str());
+		return asyncSendDone(PROT_EVENT_ERROR);
+	}
+
+	switch (ctrlIn.type) {
+	case CTRLMSG_TYPE_ACCEPT:
+		HAGGLE_DBG("%s Got ACCEPT control message, continue sending\n", getName());
+		asyncState = ASYNC_STATE_SENDING;
+		return ASYNC_CONTINUE;
+	case CTRLMSG_TYPE_REJECT:
+		HAGGLE_DBG("%s Got REJECT control message, stop sending\n", getName());
+		return asyncSendDone(PROT_EVENT_REJECT);
+	case CTRLMSG_TYPE_TERMINATE:
+		HAGGLE_DBG("%s Got TERMINATE control message, purging queue\n", getName());
+		return asyncSendDone(PROT_EVENT_TERMINATE);
+	default:
+		break;
+	}
+	HAGGLE_ERR("Did not receive accept/reject control message\n");
+
+	return asyncSendDone(PROT_EVENT_ERROR);
+}
+
+/*
+  Ends the sending of a data object in the same way as run() does after
+  sendDataObjectNow() returns.
+*/
+Protocol::AsyncResult Protocol::asyncSendDone(ProtocolEvent pEvent)
+{
+	DataObjectRef dObj = txDataObject;
+
+	if (txCorked) {
+		hookCork(false);
+		txCorked = false;
+	}
+
+	txDataObject = NULL;
+	txRetriever = NULL;
+
+	if (pEvent == PROT_EVENT_SUCCESS || pEvent == PROT_EVENT_REJECT) {
+#ifdef DEBUG
+		Timeval tx_time = Timeval::now() - xferStart;
+
+		HAGGLE_DBG("%s Sent %lu bytes data in %.3lf seconds, average speed = %.2lf kB/s\n", 
+			   getName(), xferBytes, tx_time.getTimeAsSecondsDouble(), 
+			   (double)xferBytes / (1000*tx_time.getTimeAsSecondsDouble()));
+#endif
+		// Treat reject as SUCCESS, since it probably means the peer already has the
+		// data object and we should therefore not try to send it again.
+		getKernel()->addEvent(new Event(EVENT_TYPE_DATAOBJECT_SEND_SUCCESSFUL, 
+						dObj, peerNode, 
+						(pEvent == PROT_EVENT_REJECT) ? 1 : 0));
+		asyncNumErrors = 0;
+		return asyncIdle();
+	}
+
+	getKernel()->addEvent(new Event(EVENT_TYPE_DATAOBJECT_SEND_FAILURE, dObj, peerNode));
+
+	switch (pEvent) {
+	case PROT_EVENT_ERROR:
+		HAGGLE_ERR("%s Data object send to [%s] failed...\n", 
+			   getName(), peerDescription().c_str());
+		return asyncIdle();
+	case PROT_EVENT_TERMINATE:
+	case PROT_EVENT_PEER_CLOSED:
+		HAGGLE_DBG("%s Peer [%s] closed connection.\n", 
+			   getName(), peerDescription().c_str());
+		break;
+	case PROT_EVENT_ERROR_FATAL:
+		HAGGLE_ERR("%s Fatal error when sending to %s!\n", 
+			   getName(), peerDescription().c_str());
+		break;
+	default:
+		HAGGLE_DBG("%s Send to [%s] timed out\n", 
+			   getName(), peerDescription().c_str());
+		break;
+	}
+	getQueue()->close();
+
+	return ASYNC_DONE;
+}
+
+Protocol::AsyncResult Protocol::asyncStartReceive()
+{
+	HAGGLE_DBG("%s Incoming data object from [%s]\n", 
+		   getName(), peerDescription().c_str());
+
+	rxDataObject = DataObject::create_for_putting(localIface, 
+						      peerIface, 
+						      getKernel()->getStoragePath());
+
+	if (!rxDataObject) {
+		HAGGLE_ERR("Could not create pending data object\n");
+		return asyncReceiveDone(PROT_EVENT_ERROR);
+	}
+	rxBytesRemaining = DATAOBJECT_METADATA_PENDING;
+	rxHeaderReceived = false;
+	bufferDataLen = 0;
+	xferStart = Timeval::now();
+	xferBytes = 0;
+	asyncState = ASYNC_STATE_RECEIVING;
+
+	return ASYNC_CONTINUE;
+}
+
+Protocol::AsyncResult Protocol::asyncReceive()
+{
+	while (true) {
+		if (bufferDataLen > 0) {
+			ssize_t bytesPut = rxDataObject->putData(buffer, bufferDataLen, &rxBytesRemaining);
+
+			if (bytesPut < 0) {
+				HAGGLE_ERR("%s Error on put data! [totBytesRead=%lu]\n", 
+					   getName(), xferBytes);
+				return asyncReceiveDone(PROT_EVENT_ERROR);
+			}
+			removeData(bytesPut);
+
+			if (!rxHeaderReceived && rxBytesRemaining != DATAOBJECT_METADATA_PENDING) {
+				rxHeaderReceived = true;
+
+				if (rxDataObject->getMetadata())
+					return asyncReceivedHeader();
+			}
+		}
+
+		if (rxHeaderReceived && rxBytesRemaining == 0) {
+			Timeval rx_time = Timeval::now() - xferStart;
+
+			rxDataObject->setRxTime((long)rx_time.getTimeAsMilliSeconds());
+
+			HAGGLE_DBG("%ld bytes data received in %.3lf seconds, average speed %.2lf kB/s\n", 
+				   xferBytes, rx_time.getTimeAsSecondsDouble(),
+				   ((double) xferBytes) / rxDataObject->getRxTime());
+
+			HAGGLE_DBG("Sending ACK control message to peer %s\n", peerDescription().c_str());
+
+			return asyncStartCtrlMsg(CTRLMSG_TYPE_ACK);
+		}
+
+		if (bufferDataLen == bufferSize) {
+			HAGGLE_ERR("Read buffer is full!\n");
+			return asyncReceiveDone(PROT_EVENT_ERROR);
+		}
+
+		size_t len = bufferDataLen;
+		ProtocolEvent pEvent = asyncRead(buffer, bufferSize, &bufferDataLen);
+
+		xferBytes += bufferDataLen - len;
+
+		if (pEvent == PROT_EVENT_WOULD_BLOCK) {
+			// Put what we got before waiting for more
+			if (bufferDataLen > len)
+				continue;
+
+			return asyncWait(PROTOCOL_RECVSEND_TIMEOUT);
+		} else if (pEvent == PROT_EVENT_PEER_CLOSED) {
+			HAGGLE_DBG("%s - peer [%s] closed connection\n", 
+				   getName(), peerDescription().c_str());
+			return asyncReceiveDone(pEvent);
+		} else if (pEvent != PROT_EVENT_SUCCESS) {
+			return asyncReceiveDone(pEvent);
+		}
+	}
+}
+
+Protocol::AsyncResult Protocol::asyncReceivedHeader()
+{
+	if (!rxDataObject) {
+		HAGGLE_ERR("%s No data object for received header\n", getName());
+		return asyncReceiveDone(PROT_EVENT_ERROR);
+	}
+	// Save the data object ID in the control message header.
+	memcpy(ctrlOut.dobj_id, rxDataObject->getId(), DATAOBJECT_ID_LEN);
+
+	HAGGLE_DBG("%s Incoming data object [%s] from peer %s\n", 
+		   getName(), rxDataObject->getIdStr(), peerDescription().c_str());
+
+	// Check if we already have this data object (FIXME: or are 
+	// otherwise not willing to accept it).
+	if (getKernel()->getThisNode()->getBloomfilter()->has(rxDataObject)) {
+		HAGGLE_DBG("Sending REJECT control message to peer %s\n", 
+			   peerDescription().c_str());
+		return asyncStartCtrlMsg(CTRLMSG_TYPE_REJECT);
+	}
+
+	// See receiveDataObject() for why we add the data object to the
+	// bloomfilter already here.
+	getKernel()->getThisNode()->getBloomfilter()->add(rxDataObject);
+
+	HAGGLE_DBG("Sending ACCEPT control message to peer [%s]\n", peerDescription().c_str());
+
+	getKernel()->addEvent(new Event(EVENT_TYPE_DATAOBJECT_INCOMING, rxDataObject, peerNode));
+
+	return asyncStartCtrlMsg(CTRLMSG_TYPE_ACCEPT);
+}
+
+Protocol::AsyncResult Protocol::asyncStartCtrlMsg(u_int32_t type)
+{
+	ctrlOut.type = type;
+	ctrlOutLen = 0;
+	asyncState = ASYNC_STATE_SEND_CTRLMSG;
+
+	return ASYNC_CONTINUE;
+}
+
+Protocol::AsyncResult Protocol::asyncSendCtrlMsg()
+{
+	ProtocolEvent pEvent = asyncWrite(&ctrlOut, sizeof(ctrlOut), &ctrlOutLen);
+
+	if (pEvent == PROT_EVENT_WOULD_BLOCK)
+		return asyncWait(PROTOCOL_RECVSEND_TIMEOUT);
+
+	if (pEvent == PROT_EVENT_SUCCESS) {
+		HAGGLE_DBG("Sent control message '%s'\n", ctrlmsgToStr(&ctrlOut).c_str());
+
+		if (ctrlOut.type != CTRLMSG_TYPE_ACK) {
+			LOG_ADD("%s: %s\t%s\t%s\n", 
+				Timeval::now().getAsString().c_str(), ctrlmsgToStr(&ctrlOut).c_str(), 
+				rxDataObject->getIdStr(), peerNode ? peerNode->getIdStr() : "unknown");
+		}
+	} else {
+		HAGGLE_ERR("Could not send control message '%s'\n", ctrlmsgToStr(&ctrlOut).c_str());
+	}
+
+	switch (ctrlOut.type) {
+	case CTRLMSG_TYPE_ACCEPT:
+		if (pEvent == PROT_EVENT_SUCCESS) {
+			asyncState = ASYNC_STATE_RECEIVING;
+			return ASYNC_CONTINUE;
+		}
+		break;
+	case CTRLMSG_TYPE_REJECT:
+		HAGGLE_DBG("%s receive DONE after rejecting data object\n", getName());
+		break;
+	case CTRLMSG_TYPE_ACK:
+		// The data object is complete, whether the peer gets the ACK or not
+		rxDataObject->setReceiveTime(Timeval::now());
+
+		HAGGLE_DBG("Received data object [%s] from node %s\n", 
+			   rxDataObject->getIdStr(), peerDescription().c_str());
+
+		getKernel()->addEvent(new Event(EVENT_TYPE_DATAOBJECT_RECEIVED, rxDataObject, peerNode));
+		break;
+	}
+	return asyncReceiveDone(pEvent);
+}
+
+/*
+  Ends the receiving of a data object in the same way as run() does after
+  receiveDataObject() returns.
+*/
+Protocol::AsyncResult Protocol::asyncReceiveDone(ProtocolEvent pEvent)
+{
+	rxDataObject = NULL;
+	bufferDataLen = 0;
+
+	switch (pEvent) {
+	case PROT_EVENT_SUCCESS:
+		HAGGLE_DBG("%s Data object successfully received from [%s]\n", 
+			   getName(), peerDescription().c_str());
+		asyncNumErrors = 0;
+		return asyncIdle();
+	case PROT_EVENT_PEER_CLOSED:
+		break;
+	case PROT_EVENT_ERROR:
+		HAGGLE_ERR("%s Data object receive failed... error num %d\n", 
+			   getName(), asyncNumErrors);
+
+		if (asyncNumErrors++ <= 3)
+			return asyncIdle();
+
+		HAGGLE_DBG("%s Reached max errors=%d. Cancelling.\n", 
+			   getName(), asyncNumErrors);
+		break;
+	case PROT_EVENT_ERROR_FATAL:
+		HAGGLE_ERR("%s Data object receive fatal error!\n", getName());
+		break;
+	default:
+		HAGGLE_DBG("%s Receive from [%s] timed out\n", 
+			   getName(), peerDescription().c_str());
+		break;
+	}
+	getQueue()->close();
+
+	return ASYNC_DONE;
+}
+
+int Protocol::getEngineWatchState() const
+{
+	switch (asyncState) {
+	case ASYNC_STATE_CONNECT_WAIT:
+		return WATCH_STATE_NONE;
+	case ASYNC_STATE_CONNECTING:
+	case ASYNC_STATE_SENDING:
+	case ASYNC_STATE_SEND_CTRLMSG:
+		return WATCH_STATE_WRITE;
+	default:
+		break;
+	}
+	return WATCH_STATE_READ;
+}
+
+bool Protocol::onEngineEvent(int events)
+{
+	AsyncResult res = ASYNC_CONTINUE;
+	
+	while (res == ASYNC_CONTINUE) {
+		// The protocol manager shut us down
+		if (isDone())
+			return false;
+
+		// A timeout without I/O in a transfer state means that the
+		// peer stopped talking to us
+		bool timedout = (events & ENGINE_EVENT_TIMEOUT) && 
+			!(events & (WATCH_STATE_READ | WATCH_STATE_WRITE));
+
+		switch (asyncState) {
+		case ASYNC_STATE_CONNECT_WAIT:
+			// Connect on the first event, and after sleeping
+			if (asyncConnectTry == 0 || (events & ENGINE_EVENT_TIMEOUT))
+				res = asyncConnect();
+			else
+				res = ASYNC_WAIT;
+			break;
+		case ASYNC_STATE_CONNECTING:
+			if (events & (WATCH_STATE_READ | WATCH_STATE_WRITE))
+				res = asyncConnected(completeConnection());
+			else if (timedout)
+				res = asyncConnected(PROT_EVENT_TIMEOUT);
+			else
+				res = ASYNC_WAIT;
+			break;
+		case ASYNC_STATE_IDLE:
+		{
+			QueueElement *qe = NULL;
+
+			if (events & WATCH_STATE_READ) {
+				res = asyncStartReceive();
+			} else if (getQueue()->retrieveTry(&qe) == QUEUE_ELEMENT) {
+				const DataObjectRef dObj = qe->getDataObject();
+
+				txQueueTime = qe->getQueueTime();
+				delete qe;
+
+				if (dObj) {
+					res = asyncStartSend(dObj);
+				} else {
+					HAGGLE_ERR("%s No data object in queue. ERROR when sending to [%s]!\n", 
+						   getName(), peerDescription().c_str());
+				}
+			} else if (events & ENGINE_EVENT_TIMEOUT) {
+				// Nothing happened in the keep-alive time
+				res = ASYNC_DONE;
+			} else {
+				res = ASYNC_WAIT;
+			}
+			break;
+		}
+		case ASYNC_STATE_SENDING:
+			res = timedout ? asyncSendDone(PROT_EVENT_TIMEOUT) : asyncSend();
+			break;
+		case ASYNC_STATE_WAIT_ACCEPT:
+		case ASYNC_STATE_WAIT_ACK:
+			res = timedout ? asyncSendDone(PROT_EVENT_TIMEOUT) : asyncReceiveCtrlMsg();
+			break;
+		case ASYNC_STATE_RECEIVING:
+			res = timedout ? asyncReceiveDone(PROT_EVENT_TIMEOUT) : asyncReceive();
+			break;
+		case ASYNC_STATE_SEND_CTRLMSG:
+			res = timedout ? asyncReceiveDone(PROT_EVENT_TIMEOUT) : asyncSendCtrlMsg();
+			break;
+		}
+		// The events belong to the state they arrived in. A new
+		// state tries its I/O first, and waits if it would block.
+		events = 0;
+	}
+	return res != ASYNC_DONE;
+}
+
+void Protocol::onEngineDone()
+{
+	// Anything we were in the middle of sending was not sent
+	if (txDataObject) {
+		getKernel()->addEvent(new Event(EVENT_TYPE_DATAOBJECT_SEND_FAILURE, txDataObject, peerNode));
+		txDataObject = NULL;
+		txRetriever = NULL;
+		txCorked = false;
+	}
+	rxDataObject = NULL;
+
+	HAGGLE_DBG("%s DONE!\n", getName());
+
+	setMode(PROT_MODE_DONE);
+
+	cleanup();
+}
+
 void Protocol::registerWithManager()
 {
 	if (isRegistered) {
@@ -1306,6 +2018,8 @@ void Protocol::shutdown()
 	
 	if (isRunning())
 		cancel();
+	else if (asyncStarted)
+		getManager()->getEngine()->wakeup(this);
 	else if (isRegistered)
 		unregisterWithManager();
 }
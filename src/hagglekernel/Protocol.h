@@ -23,11 +23,46 @@
 class Protocol;
 typedef unsigned short ProtType_t;
 
+/*
+	A histogram of the time it took to set up connections. Bucket 0
+	counts connections set up in less than a millisecond, and bucket i
+	those that took from 2^(i-1) up to 2^i milliseconds. The last bucket
+	also counts all slower ones. It is defined here, since both Protocol
+	and ProtocolManager keep histograms by value.
+*/
+#define PROT_CONNECT_LATENCY_BUCKETS 16
+
+struct ConnectLatencyHistogram {
+	unsigned long buckets[PROT_CONNECT_LATENCY_BUCKETS];
+	ConnectLatencyHistogram()
+	{
+		for (int i = 0; i < PROT_CONNECT_LATENCY_BUCKETS; i++)
+			buckets[i] = 0;
+	}
+	void add(double secs)
+	{
+		double limit = 0.001;
+		int i = 0;
+
+		while (secs >= limit && i < PROT_CONNECT_LATENCY_BUCKETS - 1) {
+			limit *= 2;
+			i++;
+		}
+		buckets[i]++;
+	}
+	void add(const ConnectLatencyHistogram& h)
+	{
+		for (int i = 0; i < PROT_CONNECT_LATENCY_BUCKETS; i++)
+			buckets[i] += h.buckets[i];
+	}
+};
+
 #include <libcpphaggle/Platform.h>
 #include <libcpphaggle/Timeval.h>
 #include <libcpphaggle/Watch.h>
 
 #include "ProtocolManager.h"
+#include "ProtocolEngine.h"
 #include "ManagerModule.h"
 #include "Interface.h"
 #include "DataObject.h"
@@ -71,6 +106,7 @@ typedef enum {
         PROT_EVENT_TXQ_NEW_DATAOBJECT,
         PROT_EVENT_INCOMING_DATA,
         PROT_EVENT_WRITEABLE,
+	PROT_EVENT_WOULD_BLOCK, // The operation continues in the background (non-blocking sockets)
 } ProtocolEvent;
 
 typedef enum {
@@ -91,14 +127,24 @@ typedef enum {
 #define PROT_FLAG_CONNECTED   0x4 // Protocol has establised a connection with another end-point
 #define PROT_FLAG_APPLICATION 0x8 // Protocol has establised a connection with another end-point
 
-// Wait time before closing connection and setting PROT_FLAG_DONE (seconds)
-// This should probably be quite short since it will keep a connection open and
-// potentially block the channel. This might be improved if it is possible to
-// support dynamic channel allocation
-#define PROT_WAIT_TIME_BEFORE_DONE 10
-#define PROT_WAIT_TIME_BEFORE_DONE_MSECS (PROT_WAIT_TIME_BEFORE_DONE * 1000)
-
-#define PROT_CONNECTION_ATTEMPTS 4
+// Default time (seconds) to keep an idle connection open, so that more data
+// objects to or from the same peer can reuse it, before closing it and setting
+// PROT_MODE_DONE. Connections to a peer are also closed when its interface goes
+// down, so this covers the length of a typical contact. The protocol manager's
+// configuration can change it.
+#define PROT_KEEPALIVE_TIME 60
+
+// The number of rounds of connect attempts before giving up. Each round
+// tries all the addresses of the peer interface once.
+#define PROT_CONNECTION_ATTEMPTS 6
+// Seconds to wait for a connect attempt to complete
+#define PROT_CONNECT_TIMEOUT 20
+// Milliseconds to back off after the first failed round of connect attempts.
+// The back off doubles for each round, up to the maximum, and a random
+// jitter of up to half of it is subtracted, so that peers that failed at the
+// same time do not try again at the same time.
+#define PROT_CONNECT_BACKOFF_MSECS 500
+#define PROT_CONNECT_BACKOFF_MAX_MSECS 8000
 
 
 // The number of attempts to try to send or receive something when a "would block"
@@ -123,7 +169,7 @@ typedef enum {
 	Server protocol: Can receive connections from other nodes, and will create
 		a receiving protocol instance when it does.
 */
-class Protocol : public ManagerModule<ProtocolManager>
+class Protocol : public ManagerModule<ProtocolManager>, public ProtocolEngine::Connection
 {
 	friend class ProtocolManager;
 public:
@@ -189,7 +235,86 @@ private:
                 u_int32_t type;
                 DataObjectId_t dobj_id;
         } ctrlmsg_t;
+
+	/*
+	  A protocol that runs on the protocol engine, rather than in
+	  a thread of its own, is a state machine that does the same
+	  things as run(), but without blocking. These are its states.
+	*/
+	typedef enum {
+		ASYNC_STATE_CONNECT_WAIT, // Waiting to (re)try to connect
+		ASYNC_STATE_CONNECTING, // A non-blocking connect is in progress
+		ASYNC_STATE_IDLE, // Waiting for incoming data or a data object to send
+		ASYNC_STATE_SENDING, // Writing a data object from the buffer
+		ASYNC_STATE_WAIT_ACCEPT, // Waiting for an ACCEPT or REJECT for the data object sent
+		ASYNC_STATE_WAIT_ACK, // Waiting for an ACK for the data object sent
+		ASYNC_STATE_RECEIVING, // Reading a data object into the buffer
+		ASYNC_STATE_SEND_CTRLMSG, // Writing a control message for the data object received
+	} AsyncState;
+
+	// What to do after handling a state
+	typedef enum {
+		ASYNC_CONTINUE, // The state changed, handle the new state
+		ASYNC_WAIT, // Wait for the next event
+		ASYNC_DONE, // The protocol is done
+	} AsyncResult;
+
+	bool asyncStarted;
+	AsyncState asyncState;
+	int asyncConnectTry;
+	int asyncNumErrors;
+	// The data object being sent, and how far we have come
+	DataObjectRef txDataObject;
+	DataObjectDataRetrieverRef txRetriever;
+	bool txHeaderSent;
+	bool txCorked;
+	size_t txLen, txOffset;
+	// The data object being received, and how far we have come
+	DataObjectRef rxDataObject;
+	size_t rxBytesRemaining;
+	bool rxHeaderReceived;
+	Timeval xferStart;
+	unsigned long xferBytes;
+	// Control messages being sent and received
+	struct ctrlmsg ctrlOut, ctrlIn;
+	size_t ctrlOutLen, ctrlInLen;
+
+	AsyncResult asyncWait(unsigned long secs);
+	AsyncResult asyncIdle();
+	AsyncResult asyncConnect();
+	AsyncResult asyncConnected(ProtocolEvent pEvent);
+	AsyncResult asyncStartSend(const DataObjectRef& dObj);
+	AsyncResult asyncSend();
+	AsyncResult asyncReceiveCtrlMsg();
+	AsyncResult asyncSendDone(ProtocolEvent pEvent);
+	AsyncResult asyncStartReceive();
+	AsyncResult asyncReceive();
+	AsyncResult asyncReceivedHeader();
+	AsyncResult asyncStartCtrlMsg(u_int32_t type);
+	AsyncResult asyncSendCtrlMsg();
+	AsyncResult asyncReceiveDone(ProtocolEvent pEvent);
+	ProtocolEvent asyncError();
+	ProtocolEvent asyncWrite(const void *buf, size_t len, size_t *done);
+	ProtocolEvent asyncRead(void *buf, size_t len, size_t *done);
+
+	// Statistics, which the protocol manager collects when the
+	// protocol is deleted
+	unsigned long statConnections; // Connections set up
+	double statConnectSecs; // Time spent setting them up, including retries
+	unsigned long statDataObjectsSent; // Data objects we started to send
+	double statFirstByteSecs; // Time from queueing them until their first byte was sent
+	ConnectLatencyHistogram statConnectLatency; // Time to set up each connection, including retries
+	Timeval connectStart;
+	static unsigned long getConnectBackoff(unsigned int round);
+	void connectionSetUp();
+	void firstByteSent();
+	unsigned long getKeepAliveTime() const;
 protected:
+	/**
+	   The time when the data object that is being sent was put in the
+	   queue. Set by waitForEvent() when it retrieves a data object.
+	*/
+	Timeval txQueueTime;
 	/**
 	   True if the Protocol is registered with the Protocol manager.
 	*/
@@ -324,6 +449,14 @@ protected:
 		implements cleanup().
 	*/
 	virtual void hookCleanup() {}
+
+	/**
+		A hook that is called with 'cork' set to true before the
+		header, or the data, of a data object is written, and with
+		'cork' set to false once it is written. A derived class can
+		override it to hold back partial segments in between.
+	*/
+	virtual void hookCork(bool cork) {}
 	
 	/**
 		Calls receiveData to fill the empty parts of the buffer with data.
@@ -611,6 +744,46 @@ public:
 	{
                 return PROT_EVENT_ERROR;
         }
+	/**
+	   Completes a connection that connectToPeer() left in progress
+	   by returning PROT_EVENT_WOULD_BLOCK, once the connection is
+	   writeable.
+	 */
+	virtual ProtocolEvent completeConnection()
+	{
+		return PROT_EVENT_ERROR;
+	}
+	/**
+	   Called when a connect attempt failed. Makes the next call to
+	   connectToPeer() try another address of the peer, if it has one
+	   that has not been tried in this round of attempts.
+
+	   Returns true if there is such an address, which should be
+	   tried right away, or false if the round is over and the
+	   protocol should back off before it starts over.
+	 */
+	virtual bool nextPeerAddress()
+	{
+		return false;
+	}
+	/**
+	   Returns true if the protocol runs as a state machine on the
+	   protocol manager's engine, rather than in a thread of its
+	   own. Derived classes that can run on non-blocking sockets
+	   override this.
+	 */
+	virtual bool isAsynchronous() const
+	{
+		return false;
+	}
+	// Functions that are overridden from class ProtocolEngine::Connection
+	virtual SOCKET getEngineSocket() const
+	{
+		return INVALID_SOCKET;
+	}
+	int getEngineWatchState() const;
+	bool onEngineEvent(int events);
+	void onEngineDone();
         // Functions to send and receive data objects
         /*
         	This function takes a data object to send and sends it immediately.
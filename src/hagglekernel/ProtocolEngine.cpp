@@ -0,0 +1,425 @@
+/* Copyright 2008-2009 Uppsala University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include <stdlib.h>
+#include <haggleutils.h>
+
+#include "ProtocolEngine.h"
+#include "Trace.h"
+
+#if defined(HAVE_PROTOCOL_ENGINE)
+#include <poll.h>
+#include <unistd.h>
+#include <errno.h>
+#endif
+
+// How long a worker waits before it tries again, when it could not
+// wait for events on its connections
+#define WORKER_RETRY_MSECS 100
+
+/*
+	A worker thread, which waits for events on the sockets of the
+	connections it owns and calls the connections when they occur.
+
+	The connection list and the state the engine keeps in each
+	connection are protected by the worker's mutex. The worker does not
+	hold the mutex while it waits, or while it calls a connection, so
+	that the connection can call the engine.
+*/
+class ProtocolEngine::Worker : public Runnable
+{
+	friend class ProtocolEngine;
+	Signal signal;
+	List<ProtocolEngine::Connection *> connections;
+	unsigned long numConnections;
+	// Increased whenever the connection list changes
+	unsigned long generation;
+	bool stopping;
+	// The connection that the worker is calling, or NULL
+	ProtocolEngine::Connection *current;
+	// Signaled when the worker returns from a connection
+	Condition idle;
+#if defined(HAVE_PROTOCOL_ENGINE)
+	// The poll set, and the connection of each entry
+	struct pollfd *fds;
+	ProtocolEngine::Connection **conns;
+	unsigned long capacity;
+
+	bool reserve(unsigned long n);
+	void dispatch(ProtocolEngine::Connection *c, int events, unsigned long *gen);
+#endif
+	void finish(ProtocolEngine::Connection *c);
+	bool run();
+	void cleanup() {}
+public:
+	Worker(unsigned int num);
+	~Worker();
+};
+
+static inline bool has_deadline(const Timeval& t)
+{
+	return t.getSeconds() != 0 || t.getMicroSeconds() != 0;
+}
+
+static inline char *worker_name(unsigned int num)
+{
+	static char name[30];
+
+	snprintf(name, 30, "ProtocolEngineWorker:%u", num);
+
+	return name;
+}
+
+ProtocolEngine::Worker::Worker(unsigned int num) :
+	Runnable(worker_name(num)), numConnections(0), generation(0), stopping(false), current(NULL)
+#if defined(HAVE_PROTOCOL_ENGINE)
+	, fds(NULL), conns(NULL), capacity(0)
+#endif
+{
+}
+
+ProtocolEngine::Worker::~Worker()
+{
+#if defined(HAVE_PROTOCOL_ENGINE)
+	if (fds)
+		free(fds);
+	if (conns)
+		free(conns);
+#endif
+}
+
+void ProtocolEngine::Worker::finish(ProtocolEngine::Connection *c)
+{
+	connections.remove(c);
+	numConnections--;
+	generation++;
+	c->worker = NULL;
+	c->woken = false;
+}
+
+#if defined(HAVE_PROTOCOL_ENGINE)
+
+bool ProtocolEngine::Worker::reserve(unsigned long n)
+{
+	if (n <= capacity)
+		return true;
+
+	// Grow in steps, to avoid reallocating for every new connection
+	n = n * 2;
+
+	struct pollfd *new_fds = (struct pollfd *)realloc(fds, n * sizeof(struct pollfd));
+
+	if (!new_fds)
+		return false;
+
+	fds = new_fds;
+
+	ProtocolEngine::Connection **new_conns =
+		(ProtocolEngine::Connection **)realloc(conns, n * sizeof(ProtocolEngine::Connection *));
+
+	if (!new_conns)
+		return false;
+
+	conns = new_conns;
+	capacity = n;
+
+	return true;
+}
+
+/*
+	Calls a connection with the mutex released. If the connection
+	finishes, the generation it leaves the connection list in is
+	passed back in 'gen', since the worker changed the list itself.
+*/
+void ProtocolEngine::Worker::dispatch(ProtocolEngine::Connection *c, int events, unsigned long *gen)
+{
+	if (c->woken) {
+		c->woken = false;
+		events |= ENGINE_EVENT_WAKEUP;
+	}
+
+	if (has_deadline(c->deadline) && c->deadline <= Timeval::now()) {
+		// The connection sets a new deadline if it wants one
+		c->deadline.zero();
+		events |= ENGINE_EVENT_TIMEOUT;
+	}
+
+	if (events == 0)
+		return;
+
+	current = c;
+	mutex.unlock();
+
+	bool keep = c->onEngineEvent(events);
+
+	mutex.lock();
+
+	// If remove() took the connection away during the call, it
+	// belongs to the caller of remove() now
+	if (!keep && c->worker == this) {
+		bool unchanged = (*gen == generation);
+
+		finish(c);
+
+		if (unchanged)
+			*gen = generation;
+
+		mutex.unlock();
+		c->onEngineDone();
+		mutex.lock();
+	}
+	current = NULL;
+	idle.broadcast();
+}
+
+bool ProtocolEngine::Worker::run()
+{
+	unsigned long n = 1, gen;
+	int timeout = -1;
+	Timeval now = Timeval::now();
+
+	mutex.lock();
+
+	if (stopping) {
+		mutex.unlock();
+		return false;
+	}
+
+	if (!reserve(numConnections + 1)) {
+		// The worker must keep running, or its connections would
+		// never be called again
+		HAGGLE_ERR("%s could not allocate poll set, retrying\n", getName());
+		mutex.unlock();
+		cancelableSleep(WORKER_RETRY_MSECS);
+		return true;
+	}
+
+	fds[0].fd = Watchable(signal).getSocket();
+	fds[0].events = POLLIN;
+	fds[0].revents = 0;
+
+	for (List<ProtocolEngine::Connection *>::iterator it = connections.begin(); it != connections.end(); it++) {
+		ProtocolEngine::Connection *c = *it;
+		int state = c->getEngineWatchState();
+
+		fds[n].fd = state == WATCH_STATE_NONE ? -1 : c->getEngineSocket();
+		fds[n].events = ((state & WATCH_STATE_READ) ? POLLIN : 0) |
+			((state & WATCH_STATE_WRITE) ? POLLOUT : 0);
+		fds[n].revents = 0;
+		conns[n++] = c;
+
+		if (c->woken) {
+			timeout = 0;
+		} else if (has_deadline(c->deadline)) {
+			int64_t msecs = 0;
+
+			if (c->deadline > now)
+				msecs = (c->deadline - now).getTimeAsMilliSeconds() + 1;
+
+			if (timeout < 0 || msecs < timeout)
+				timeout = (int)msecs;
+		}
+	}
+	gen = generation;
+
+	mutex.unlock();
+
+	if (poll(fds, n, timeout) < 0 && errno != EINTR) {
+		HAGGLE_ERR("%s poll failed : %s, retrying\n", getName(), STRERROR(ERRNO));
+		cancelableSleep(WORKER_RETRY_MSECS);
+		return true;
+	}
+
+	mutex.lock();
+
+	if (fds[0].revents & POLLIN)
+		signal.lower();
+
+	// If connections were added or removed while we were waiting, or
+	// while we called a connection, the poll set is stale. Events on
+	// sockets are level triggered, so we will see them again on the
+	// next round.
+	for (unsigned long i = 1; i < n && gen == generation; i++) {
+		int events = 0;
+
+		if (fds[i].revents & POLLIN)
+			events |= WATCH_STATE_READ;
+		if (fds[i].revents & POLLOUT)
+			events |= WATCH_STATE_WRITE;
+
+		// Let the connection discover errors and hangups
+		// when it tries to read or write
+		if (fds[i].revents & (POLLERR | POLLHUP | POLLNVAL))
+			events |= ((fds[i].events & POLLIN) ? WATCH_STATE_READ : 0) |
+				((fds[i].events & POLLOUT) ? WATCH_STATE_WRITE : 0);
+
+		dispatch(conns[i], events, &gen);
+	}
+	mutex.unlock();
+
+	return true;
+}
+
+#else
+
+bool ProtocolEngine::Worker::run()
+{
+	return false;
+}
+
+#endif /* HAVE_PROTOCOL_ENGINE */
+
+ProtocolEngine::ProtocolEngine(unsigned int _numWorkers) :
+	workers(NULL), numWorkers(_numWorkers ? _numWorkers : numProcessors())
+{
+	workers = new Worker *[numWorkers];
+
+	for (unsigned int i = 0; i < numWorkers; i++)
+		workers[i] = new Worker(i);
+}
+
+ProtocolEngine::~ProtocolEngine()
+{
+	stop();
+
+	for (unsigned int i = 0; i < numWorkers; i++)
+		delete workers[i];
+
+	delete [] workers;
+}
+
+bool ProtocolEngine::start()
+{
+#if defined(HAVE_PROTOCOL_ENGINE)
+	for (unsigned int i = 0; i < numWorkers; i++) {
+		if (!workers[i]->start()) {
+			HAGGLE_ERR("Could not start protocol engine worker %u\n", i);
+			stop();
+			return false;
+		}
+	}
+	HAGGLE_DBG("Protocol engine started with %u workers\n", numWorkers);
+
+	return true;
+#else
+	return false;
+#endif
+}
+
+void ProtocolEngine::stop()
+{
+	for (unsigned int i = 0; i < numWorkers; i++) {
+		Worker *w = workers[i];
+
+		w->mutex.lock();
+		w->stopping = true;
+		w->signal.raise();
+		w->mutex.unlock();
+	}
+
+	for (unsigned int i = 0; i < numWorkers; i++)
+		workers[i]->join();
+}
+
+bool ProtocolEngine::add(Connection *c)
+{
+	Worker *w = workers[0];
+
+	if (!c || c->worker)
+		return false;
+
+	// Pick the least loaded worker. The counts may be slightly off
+	// since we do not lock, but that does not matter here.
+	for (unsigned int i = 1; i < numWorkers; i++) {
+		if (workers[i]->numConnections < w->numConnections)
+			w = workers[i];
+	}
+
+	Mutex::AutoLocker l(w->mutex);
+
+	if (w->stopping)
+		return false;
+
+	w->connections.push_back(c);
+	w->numConnections++;
+	w->generation++;
+	c->worker = w;
+
+	// The first event a connection gets is a wakeup, so that it can
+	// start from within the worker
+	c->woken = true;
+	w->signal.raise();
+
+	return true;
+}
+
+void ProtocolEngine::wakeup(Connection *c)
+{
+	Worker *w = c ? c->worker : NULL;
+
+	if (!w)
+		return;
+
+	Mutex::AutoLocker l(w->mutex);
+
+	// The connection may have finished since we looked
+	if (c->worker != w)
+		return;
+
+	c->woken = true;
+	w->signal.raise();
+}
+
+void ProtocolEngine::remove(Connection *c)
+{
+	if (!c)
+		return;
+
+	// A connection that finishes no longer has a worker while it is
+	// called, so we wait for any worker that is calling it
+	for (unsigned int i = 0; i < numWorkers; i++) {
+		Worker *w = workers[i];
+		Mutex::AutoLocker l(w->mutex);
+
+		if (c->worker == w)
+			w->finish(c);
+
+		while (w->current == c)
+			w->idle.wait(&w->mutex);
+	}
+}
+
+unsigned long ProtocolEngine::getNumConnections() const
+{
+	unsigned long n = 0;
+
+	for (unsigned int i = 0; i < numWorkers; i++)
+		n += workers[i]->numConnections;
+
+	return n;
+}
+
+unsigned int ProtocolEngine::numProcessors()
+{
+	long n = 1;
+#if defined(OS_WINDOWS)
+	SYSTEM_INFO info;
+
+	GetSystemInfo(&info);
+	n = info.dwNumberOfProcessors;
+#elif defined(OS_UNIX)
+	n = sysconf(_SC_NPROCESSORS_ONLN);
+#endif
+	return n > 0 ? (unsigned int)n : 1;
+}
@@ -0,0 +1,175 @@
+/* Copyright 2008-2009 Uppsala University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef _PROTOCOLENGINE_H
+#define _PROTOCOLENGINE_H
+
+/*
+	Forward declarations of all data types declared in this file. This is to
+	avoid circular dependencies. If/when a data type is added to this file,
+	remember to add it here.
+*/
+class ProtocolEngine;
+
+#include <libcpphaggle/Platform.h>
+#include <libcpphaggle/Thread.h>
+#include <libcpphaggle/Mutex.h>
+#include <libcpphaggle/Condition.h>
+#include <libcpphaggle/Signal.h>
+#include <libcpphaggle/Timeval.h>
+#include <libcpphaggle/Watch.h>
+#include <libcpphaggle/List.h>
+
+using namespace haggle;
+
+/*
+	The engine waits on its sockets with poll(), which is only available
+	on Unix-like platforms. Elsewhere, start() fails and protocols keep
+	running in threads of their own.
+*/
+#if defined(OS_UNIX)
+#define HAVE_PROTOCOL_ENGINE 1
+#endif
+
+/*
+	Events passed to ProtocolEngine::Connection::onEngineEvent(), in
+	addition to WATCH_STATE_READ and WATCH_STATE_WRITE.
+*/
+#define ENGINE_EVENT_TIMEOUT 0x10 // The deadline of the connection passed
+#define ENGINE_EVENT_WAKEUP  0x20 // Someone called wakeup() on the connection
+
+/**
+	The protocol engine drives many connections from a small pool of
+	worker threads, one per processor by default, instead of a thread
+	per connection.
+
+	Each connection is a state machine on a non-blocking socket. A worker
+	waits for the events that the connections it owns are interested in,
+	and calls each connection when one occurs. The connection does as
+	much work as it can without blocking, and then returns to tell the
+	worker to wait again.
+
+	All calls to a connection happen in the worker that owns it, so a
+	connection never runs in two threads at once. The worker does not
+	hold any lock while it calls a connection, so the connection may
+	call the engine, e.g., to wake up another connection.
+*/
+class ProtocolEngine
+{
+	class Worker;
+public:
+	/**
+		A connection that can be driven by a ProtocolEngine.
+	*/
+	class Connection
+	{
+		friend class ProtocolEngine;
+		friend class ProtocolEngine::Worker;
+		// The worker that owns this connection, or NULL
+		Worker *worker;
+		// True if wakeup() was called since the last event
+		bool woken;
+	protected:
+		/**
+			The time when the connection should get an
+			ENGINE_EVENT_TIMEOUT. A zero Timeval means no timeout.
+		*/
+		Timeval deadline;
+	public:
+		/**
+			Returns the socket the engine should wait on.
+		*/
+		virtual SOCKET getEngineSocket() const = 0;
+		/**
+			Returns the events the connection currently waits for,
+			i.e., WATCH_STATE_READ and/or WATCH_STATE_WRITE, or
+			WATCH_STATE_NONE to only wait for the deadline or a
+			wakeup.
+		*/
+		virtual int getEngineWatchState() const = 0;
+		/**
+			Called by the worker when any of the events set in
+			'events' has occurred. The function must not block.
+
+			Returns true if the connection should keep running, or
+			false if it is finished. In the latter case, the engine
+			forgets about the connection and calls onEngineDone().
+		*/
+		virtual bool onEngineEvent(int events) = 0;
+		/**
+			Called by the worker when the connection is finished.
+			The engine does not touch the connection after this
+			call, so it may delete itself, or hand itself over to
+			a thread that will.
+		*/
+		virtual void onEngineDone() = 0;
+
+		Connection() : worker(NULL), woken(false) {}
+		virtual ~Connection() {}
+	};
+private:
+	Worker **workers;
+	unsigned int numWorkers;
+public:
+	/**
+		Creates an engine with the given number of worker threads.
+		Zero means one per processor.
+	*/
+	ProtocolEngine(unsigned int _numWorkers = 0);
+	~ProtocolEngine();
+
+	/**
+		Starts the worker threads. Returns false if the engine is
+		not available on this platform, or the threads could not
+		be started.
+	*/
+	bool start();
+	/**
+		Stops and joins the worker threads. Connections that are
+		still running are left as they are.
+	*/
+	void stop();
+	/**
+		Hands a connection over to the engine, which will call it
+		from the least loaded worker. The socket of the connection
+		should be in non-blocking mode. May be called from within
+		another connection's onEngineEvent() or onEngineDone().
+	*/
+	bool add(Connection *c);
+	/**
+		Makes the owning worker call the connection with an
+		ENGINE_EVENT_WAKEUP as soon as possible. Safe to call from
+		any thread, and on connections that have already finished.
+	*/
+	void wakeup(Connection *c);
+	/**
+		Takes a connection away from the engine. When the function
+		returns, no worker is calling the connection, and none will,
+		so it waits for a call that is in progress. Must therefore
+		not be called from within a worker.
+	*/
+	void remove(Connection *c);
+
+	unsigned int getNumWorkers() const { return numWorkers; }
+	/**
+		Returns the number of connections the engine is driving.
+	*/
+	unsigned long getNumConnections() const;
+	/**
+		Returns the number of processors available to the process.
+	*/
+	static unsigned int numProcessors();
+};
+
+#endif /* _PROTOCOLENGINE_H */
@@ -29,18 +29,27 @@
 #include <haggleutils.h>
 
 ProtocolManager::ProtocolManager(HaggleKernel * _kernel) :
-	Manager("ProtocolManager", _kernel), tcpServerPort(TCP_DEFAULT_PORT), 
-	tcpBacklog(TCP_BACKLOG_SIZE), killer(NULL)
+	Manager("ProtocolManager", _kernel), engine(NULL), tcpServerPort(TCP_DEFAULT_PORT), 
+	tcpBacklog(TCP_BACKLOG_SIZE), connectionKeepAlive(PROT_KEEPALIVE_TIME), 
+	statConnections(0), statConnectSecs(0), statDataObjectsSent(0), statFirstByteSecs(0), 
+	killer(NULL)
 {	
 }
 
 ProtocolManager::~ProtocolManager()
 {
+	// Stop the engine first, so that it does not run protocols we delete
+	if (engine)
+		engine->stop();
+
 	while (!protocol_registry.empty()) {
 		Protocol *p = (*protocol_registry.begin()).second;
 		protocol_registry.erase(p->getId());
 		delete p;
 	}
+
+	if (engine)
+		delete engine;
 	
 	if (killer) {
 		killer->stop();
@@ -110,9 +119,55 @@ bool ProtocolManager::init_derived()
 		return false;
 	}
 #endif
+	startEngine();
+
+	return true;
+}
+
+bool ProtocolManager::startEngine()
+{
+	if (engine)
+		return true;
+
+	// Connection oriented protocols run as state machines on a
+	// pool of worker threads, rather than in a thread each.
+	engine = new ProtocolEngine();
+
+	if (!engine->start()) {
+		HAGGLE_DBG("No protocol engine, protocols run in threads of their own\n");
+		delete engine;
+		engine = NULL;
+		return false;
+	}
 	return true;
 }
 
+/*
+	Formats the non-empty buckets of a connect latency histogram as
+	"<1ms:2 1-2ms:5 ...".
+*/
+static string connect_latency_str(const ConnectLatencyHistogram& h)
+{
+	string str;
+	unsigned long limit = 1;
+	char buf[50];
+
+	for (int i = 0; i < PROT_CONNECT_LATENCY_BUCKETS; i++, limit *= 2) {
+		if (h.buckets[i] == 0)
+			continue;
+
+		if (i == 0)
+			snprintf(buf, sizeof(buf), "<1ms:%lu ", h.buckets[i]);
+		else if (i == PROT_CONNECT_LATENCY_BUCKETS - 1)
+			snprintf(buf, sizeof(buf), ">=%lums:%lu ", limit / 2, h.buckets[i]);
+		else
+			snprintf(buf, sizeof(buf), "%lu-%lums:%lu ", limit / 2, limit, h.buckets[i]);
+
+		str += buf;
+	}
+	return str;
+}
+
 #ifdef DEBUG
 void ProtocolManager::onDebugCmdEvent(Event *e)
 {	
@@ -136,9 +191,96 @@ void ProtocolManager::onDebugCmdEvent(Event *e)
 			printf("\tQueue: empty\n");
 		}
 	}
+	printf("Connections: %s\n", getConnectionStatistics().c_str());
+
+	connect_latency_t latencies = getConnectLatencies();
+
+	for (connect_latency_t::iterator jt = latencies.begin(); jt != latencies.end(); jt++) {
+		printf("Connect latency to %s: %s\n", (*jt).first.c_str(), 
+		       connect_latency_str((*jt).second).c_str());
+	}
 }
 #endif /* DEBUG */
 
+/*
+	Adds the statistics of a protocol that is about to be deleted to
+	those of the protocols deleted before it.
+*/
+void ProtocolManager::collectStatistics(const Protocol *p)
+{
+	statConnections += p->statConnections;
+	statConnectSecs += p->statConnectSecs;
+	statDataObjectsSent += p->statDataObjectsSent;
+	statFirstByteSecs += p->statFirstByteSecs;
+
+	if (p->statConnections && p->getPeerInterface())
+		statConnectLatency[p->getPeerInterface()->getIdentifierStr()].add(p->statConnectLatency);
+}
+
+/*
+	Returns the connect latency histograms of the protocols deleted so
+	far, and of those still registered, by peer interface.
+*/
+ProtocolManager::connect_latency_t ProtocolManager::getConnectLatencies() const
+{
+	connect_latency_t latencies = statConnectLatency;
+
+	for (protocol_registry_t::const_iterator it = protocol_registry.begin(); it != protocol_registry.end(); it++) {
+		const Protocol *p = (*it).second;
+
+		if (p->statConnections && p->getPeerInterface())
+			latencies[p->getPeerInterface()->getIdentifierStr()].add(p->statConnectLatency);
+	}
+	return latencies;
+}
+
+string ProtocolManager::getConnectionStatistics() const
+{
+	unsigned long connections = statConnections;
+	double connectSecs = statConnectSecs;
+	unsigned long sent = statDataObjectsSent;
+	double firstByteSecs = statFirstByteSecs;
+	char buf[200];
+
+	for (protocol_registry_t::const_iterator it = protocol_registry.begin(); it != protocol_registry.end(); it++) {
+		const Protocol *p = (*it).second;
+
+		connections += p->statConnections;
+		connectSecs += p->statConnectSecs;
+		sent += p->statDataObjectsSent;
+		firstByteSecs += p->statFirstByteSecs;
+	}
+
+	snprintf(buf, sizeof(buf), 
+		 "%lu set up in %.3lf s on average, %lu data objects sent, "
+		 "%.2lf per connection, %.3lf s to first byte on average", 
+		 connections, connections ? connectSecs / connections : 0.0, 
+		 sent, connections ? (double)sent / connections : 0.0, 
+		 sent ? firstByteSecs / sent : 0.0);
+
+	return buf;
+}
+
+static string sender_key(const ProtType_t type, const InterfaceRef& iface)
+{
+	char buf[20];
+
+	snprintf(buf, sizeof(buf), "%u:%s:", (unsigned int)type, iface->getTypeStr());
+
+	return string(buf) + iface->getIdentifierStr();
+}
+
+void ProtocolManager::removeSender(Protocol *p)
+{
+	if (!p->isSender() || !p->getPeerInterface())
+		return;
+
+	sender_pool_t::iterator it = sender_pool.find(sender_key(p->getType(), p->getPeerInterface()));
+
+	if (it != sender_pool.end() && (*it).second == p)
+		sender_pool.erase(it);
+}
+
 void ProtocolManager::onAddProtocolEvent(Event *e)
 {	
 	registerProtocol(static_cast<Protocol *>(e->getData()));
@@ -224,6 +366,7 @@ void ProtocolManager::onDeleteProtocolEvent(Event *e)
 	}
 
 	protocol_registry.erase(p->getId());
+	removeSender(p);
 	
 	HAGGLE_DBG("Removing protocol %s\n", p->getName());
 
@@ -233,6 +376,7 @@ void ProtocolManager::onDeleteProtocolEvent(Event *e)
 	if (!p->isDetached()) {
 		p->join();
 		HAGGLE_DBG("Joined with protocol %s\n", p->getName());
+		collectStatistics(p);
 		delete p;
 	}
 
@@ -261,6 +405,7 @@ void ProtocolManager::onProtocolShutdownTimeout(Event *e)
 		while (!protocol_registry.empty()) {
 			Protocol *p = (*protocol_registry.begin()).second;
 			protocol_registry.erase(p->getId());
+			removeSender(p);
 			HAGGLE_DBG("Protocol \'%s\' still registered after shutdown. Detaching it!\n", p->getName());
 			
 			// We are not going to join with these threads, so we detach.
@@ -276,6 +421,8 @@ void ProtocolManager::onProtocolShutdownTimeout(Event *e)
 				// from its queue with a FAILURE verdict.
 				p->closeAndClearQueue();
 			} else {
+				if (engine)
+					engine->remove(p);
 				delete p;
 			}
 		}
@@ -307,6 +454,15 @@ void ProtocolManager::onPrepareShutdown()
 void ProtocolManager::onShutdown()
 {	
 	HAGGLE_DBG("%lu protocols are registered.\n", protocol_registry.size());
+
+	LOG_ADD("# %s: connections %s\n", getName(), getConnectionStatistics().c_str());
+
+	connect_latency_t latencies = getConnectLatencies();
+
+	for (connect_latency_t::iterator jt = latencies.begin(); jt != latencies.end(); jt++) {
+		LOG_ADD("# %s: connect latency to %s: %s\n", getName(), 
+			(*jt).first.c_str(), connect_latency_str((*jt).second).c_str());
+	}
 	
 	if (protocol_registry.empty()) {
 		unregisterWithKernel();
@@ -372,18 +528,37 @@ public:
 Protocol *ProtocolManager::getSenderProtocol(const ProtType_t type, const InterfaceRef& peerIface)
 {
 	Protocol *p = NULL;
-	protocol_registry_t::iterator it = protocol_registry.begin();
 	InterfaceRef localIface = NULL;
 	InterfaceRefList ifl;
+	string key = sender_key(type, peerIface);
+	sender_pool_t::iterator it = sender_pool.find(key);
 
-	// Go through the list of current protocols until we find one:
-	for (; it != protocol_registry.end(); it++) {
+	// Reuse the connection we have to this neighbor interface, unless
+	// it is closing
+	if (it != sender_pool.end()) {
 		p = (*it).second;
 
+		if (!p->isGarbage() && !p->isDone()) {
+			HAGGLE_DBG("Reusing protocol %s\n", p->getName());
+			return p;
+		}
+		p = NULL;
+	}
+
+	// Not in the pool, so go through the list of current protocols. This
+	// finds the protocols that are not pooled, such as the application
+	// protocols, which match on their local interface.
+	for (protocol_registry_t::iterator rit = protocol_registry.begin(); rit != protocol_registry.end(); rit++) {
+		p = (*rit).second;
+
 		// Is this protocol the one we're interested in?
 		if (p->isSender() && type == p->getType() && 
 		    p->isForInterface(peerIface) && 
 		    !p->isGarbage() && !p->isDone()) {
+			// Pool it if it is a connection to this neighbor interface,
+			// so that it is found directly the next time
+			if (p->getPeerInterface() && p->getPeerInterface() == peerIface)
+				sender_pool[key] = p;
 			break;
 		}
 		
@@ -433,6 +608,8 @@ Protocol *ProtocolManager::getSenderProtocol(const ProtType_t type, const Interf
 				HAGGLE_ERR("Could not initialize protocol %s\n", p->getName());
 				delete p;
 				p = NULL;
+			} else {
+				sender_pool[key] = p;
 			}
 		}
 	}
@@ -742,8 +919,8 @@ void ProtocolManager::onSendDataObjectActual(Event *e)
 	if (!e || !e->hasData())
 		return;
 
-	// Get a copy to work with
-	DataObjectRef dObj = e->getDataObject();
+	// Get a read-only copy to work with
+	const DataObjectRef dObj = e->getDataObject();
 
 	// Get target list:
 	NodeRefList *targets = (e->getNodeList()).copy();
@@ -993,6 +1170,50 @@ void ProtocolManager::onSendDataObjectActual(Event *e)
 	delete targets;
 }
 
+const TCPOptions& ProtocolManager::getTCPOptions(const InterfaceRef& iface) const
+{
+	if (iface && !tcpInterfaceOptions.empty()) {
+		Map<string, TCPOptions>::const_iterator it = tcpInterfaceOptions.find(iface->getName());
+
+		if (it != tcpInterfaceOptions.end())
+			return (*it).second;
+	}
+	return tcpOptions;
+}
+
+static void parse_tcp_options(const Metadata *m, TCPOptions& opts)
+{
+	const char *param = m->getParameter("send_buffer");
+
+	if (param) {
+		char *endptr = NULL;
+		int size = (int)strtol(param, &endptr, 10);
+
+		if (endptr && endptr != param && size >= 0)
+			opts.sendBufferSize = size;
+	}
+
+	param = m->getParameter("receive_buffer");
+
+	if (param) {
+		char *endptr = NULL;
+		int size = (int)strtol(param, &endptr, 10);
+
+		if (endptr && endptr != param && size >= 0)
+			opts.receiveBufferSize = size;
+	}
+
+	param = m->getParameter("nodelay");
+
+	if (param)
+		opts.nodelay = strcmp(param, "true") == 0;
+
+	param = m->getParameter("cork");
+
+	if (param)
+		opts.cork = strcmp(param, "true") == 0;
+}
+
 void ProtocolManager::onConfig(Metadata *m)
 {
 	Metadata *pm = m->getMetadata("TCPServer");
@@ -1022,4 +1243,50 @@ void ProtocolManager::onConfig(Metadata *m)
 			}
 		}
 	}
+
+	pm = m->getMetadata("Connections");
+
+	if (pm) {
+		const char *param = pm->getParameter("keepalive");
+
+		if (param) {
+			char *endptr = NULL;
+			unsigned long secs = strtoul(param, &endptr, 10);
+			
+			if (endptr && endptr != param && secs > 0) {
+				connectionKeepAlive = secs;
+				LOG_ADD("# %s: setting connection keep-alive to %lu s\n", getName(), connectionKeepAlive);
+			}
+		}
+	}
+
+	pm = m->getMetadata("TCP");
+
+	if (pm) {
+		parse_tcp_options(pm, tcpOptions);
+
+		LOG_ADD("# %s: TCP send_buffer=%d receive_buffer=%d nodelay=%s cork=%s\n", 
+			getName(), tcpOptions.sendBufferSize, tcpOptions.receiveBufferSize,
+			tcpOptions.nodelay ? "true" : "false", tcpOptions.cork ? "true" : "false");
+
+		Metadata *im = pm->getMetadata("Interface");
+
+		while (im) {
+			const char *name = im->getParameter("name");
+
+			if (name) {
+				// Options not given for the interface are those of
+				// all interfaces
+				TCPOptions opts = tcpOptions;
+
+				parse_tcp_options(im, opts);
+				tcpInterfaceOptions[name] = opts;
+
+				LOG_ADD("# %s: TCP on %s send_buffer=%d receive_buffer=%d nodelay=%s cork=%s\n", 
+					getName(), name, opts.sendBufferSize, opts.receiveBufferSize,
+					opts.nodelay ? "true" : "false", opts.cork ? "true" : "false");
+			}
+			im = pm->getNextMetadata();
+		}
+	}
 }
@@ -26,6 +26,7 @@ class ProtocolManager;
 #include <libcpphaggle/Map.h>
 
 #include "Protocol.h"
+#include "ProtocolEngine.h"
 #include "Interface.h"
 #include "Protocol.h"
 #include "Manager.h"
@@ -47,6 +48,28 @@ class ProtocolManager;
 
 using namespace haggle;
 
+/*
+	Socket options for TCP protocols. They are set for all interfaces,
+	and optionally for each local interface by name, in the TCP element
+	of the protocol manager's configuration:
+
+	<TCP send_buffer="0" receive_buffer="0" nodelay="true" cork="true">
+		<Interface name="eth0" send_buffer="262144" receive_buffer="262144"/>
+	</TCP>
+*/
+struct TCPOptions {
+	// Socket buffer sizes in bytes. Zero means the system default.
+	int sendBufferSize;
+	int receiveBufferSize;
+	// Disable Nagle's algorithm, so that small control messages are not
+	// held back waiting for the ACK of the previous segment
+	bool nodelay;
+	// Cork the socket while writing the header, and then the data, of a
+	// data object, so that they go out in full segments
+	bool cork;
+	TCPOptions() : sendBufferSize(0), receiveBufferSize(0), nodelay(true), cork(true) {}
+};
+
 /** */
 class ProtocolManager : public Manager
 {
@@ -58,8 +81,31 @@ private:
         EventType add_protocol_event;
         EventType send_data_object_actual_event;
 	EventType protocol_shutdown_timeout_event;
+	// Runs the protocols that do not need a thread of their own
+	ProtocolEngine *engine;
 	unsigned short tcpServerPort;
 	int tcpBacklog;
+	TCPOptions tcpOptions;
+	Map<string, TCPOptions> tcpInterfaceOptions;
+	// Seconds to keep idle connections open
+	unsigned long connectionKeepAlive;
+	// The sender protocol for each neighbor interface, so that data
+	// objects to a neighbor reuse the connection that is open to it
+	typedef Map<string, Protocol *> sender_pool_t;
+	sender_pool_t sender_pool;
+	void removeSender(Protocol *p);
+	// Statistics of the protocols that are deleted
+	unsigned long statConnections;
+	double statConnectSecs;
+	unsigned long statDataObjectsSent;
+	double statFirstByteSecs;
+	// Connect latency histograms by peer interface
+	typedef Map<string, ConnectLatencyHistogram> connect_latency_t;
+	connect_latency_t statConnectLatency;
+	void collectStatistics(const Protocol *p);
+	string getConnectionStatistics() const;
+	connect_latency_t getConnectLatencies() const;
+protected:
 	bool registerProtocol(Protocol *p);
         // Event processing
         void onSendDataObject(Event *e);
@@ -102,6 +148,12 @@ private:
 	void onPrepareShutdown();
         void onShutdown();
 	bool init_derived();
+	/**
+		Starts the protocol engine that connection oriented protocols
+		run on. Returns false if it is not available, in which case
+		they run in threads of their own.
+	*/
+	bool startEngine();
 	void onConfig(Metadata *m);
 	
 	// This Runnable is used to schedule a timeout event after a certain
@@ -135,6 +187,20 @@ public:
         ProtocolManager(HaggleKernel *_kernel = haggleKernel);
         ~ProtocolManager();
         void onWatchableEvent(const Watchable& wbl);
+	/**
+		Returns the protocol engine, or NULL if it is not available on
+		this platform, in which case all protocols run in threads.
+	*/
+	ProtocolEngine *getEngine() const { return engine; }
+	/**
+		Returns the TCP socket options for the given local interface.
+	*/
+	const TCPOptions& getTCPOptions(const InterfaceRef& iface) const;
+	/**
+		Returns the number of seconds an idle connection is kept
+		open, waiting for more data objects.
+	*/
+	unsigned long getConnectionKeepAlive() const { return connectionKeepAlive; }
 };
 
 #endif /* _PROTOCOLMANAGER_H */
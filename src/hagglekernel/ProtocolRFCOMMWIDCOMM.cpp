@@ -670,6 +670,7 @@ ProtocolEvent ProtocolRFCOMMClient::waitForEvent(DataObjectRef &dObj, Timeval *t
 		return PROT_EVENT_WRITEABLE;
 	case QUEUE_ELEMENT:
 		dObj = qe->getDataObject();
+		txQueueTime = qe->getQueueTime();
 		delete qe;
 		return PROT_EVENT_TXQ_NEW_DATAOBJECT;
 	case QUEUE_EMPTY:
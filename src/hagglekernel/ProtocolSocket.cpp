@@ -226,12 +226,22 @@ void ProtocolSocket::closeSocket()
 		return;
 	}
 
+	releaseSocket();
+	setMode(PROT_MODE_DONE);
+}
+
+void ProtocolSocket::releaseSocket()
+{
+	if (sock == INVALID_SOCKET)
+		return;
+
 	if (socketIsRegistered) {
 		getKernel()->unregisterWatchable(sock);
 		socketIsRegistered = false;
 	}
 	CLOSE_SOCKET(sock);
-	setMode(PROT_MODE_DONE);
+	sock = INVALID_SOCKET;
+	unSetFlag(PROT_FLAG_CONNECTED);
 }
 
 ssize_t ProtocolSocket::sendTo(const void *buf, size_t len, int flags, 
@@ -393,34 +403,93 @@ ProtocolEvent ProtocolSocket::openConnection(const struct sockaddr *saddr,
 		return PROT_EVENT_ERROR;
 	}
 
-        // Make sure that we block while trying to connect
-        if (nonblock)
-                setNonblock(false);
+        // Connect without blocking. The protocol engine waits for the
+        // connection to complete itself. Otherwise, we wait here in a
+        // way that ends as soon as the protocol's thread is cancelled,
+        // e.g., because the peer's interface went down, which a
+        // blocking connect would not.
+        if (!nonblock)
+                setNonblock(true);
 
 	if (::connect(sock, saddr, addrlen) == SOCKET_ERROR) {
-		HAGGLE_ERR("%s - %s\n", 
-			   getName(), 
-			   getProtocolErrorStr());
-		
-                if (wasNonblock)
-                        setNonblock(true);
-
-		switch (getProtocolError()) {
-		case PROT_ERROR_BAD_HANDLE:
-		case PROT_ERROR_INVALID_ARGUMENT:
-		case PROT_ERROR_NO_MEMORY:
-		case PROT_ERROR_NOT_A_SOCKET:
-		case PROT_ERROR_NO_STORAGE_SPACE:
-			return PROT_EVENT_ERROR_FATAL;
-		default:
-			break;
+		ProtocolEvent pEvent = PROT_EVENT_ERROR;
+
+		if (getProtocolError() == PROT_ERROR_WOULD_BLOCK) {
+			HAGGLE_DBG("%s connection in progress\n", getName());
+
+			if (isAsynchronous())
+				return PROT_EVENT_WOULD_BLOCK;
+
+			Timeval timeout(PROT_CONNECT_TIMEOUT);
+
+			pEvent = waitForEvent(&timeout, true);
+
+			if (pEvent == PROT_EVENT_WRITEABLE) {
+				pEvent = completeConnection();
+			} else if (pEvent == PROT_EVENT_SHOULD_EXIT) {
+				HAGGLE_DBG("%s connect aborted\n", getName());
+				pEvent = PROT_EVENT_ERROR;
+			} else {
+				HAGGLE_DBG("%s connect timed out\n", getName());
+				pEvent = PROT_EVENT_ERROR;
+			}
+		} else {
+			HAGGLE_ERR("%s - %s\n", 
+				   getName(), 
+				   getProtocolErrorStr());
+
+			switch (getProtocolError()) {
+			case PROT_ERROR_BAD_HANDLE:
+			case PROT_ERROR_INVALID_ARGUMENT:
+			case PROT_ERROR_NO_MEMORY:
+			case PROT_ERROR_NOT_A_SOCKET:
+			case PROT_ERROR_NO_STORAGE_SPACE:
+				pEvent = PROT_EVENT_ERROR_FATAL;
+				break;
+			default:
+				break;
+			}
 		}
 
+                if (!wasNonblock)
+                        setNonblock(false);
+
+		return pEvent;
+	}
+
+        if (!wasNonblock)
+                setNonblock(false);
+
+	setFlag(PROT_FLAG_CONNECTED);
+
+	return PROT_EVENT_SUCCESS;
+}
+
+ProtocolEvent ProtocolSocket::completeConnection()
+{
+	int err = 0;
+	socklen_t len = sizeof(err);
+
+	if (::getsockopt(sock, SOL_SOCKET, SO_ERROR, (char *)&err, &len) == SOCKET_ERROR) {
+		HAGGLE_ERR("%s: could not get socket error : %s\n", 
+			   getName(), STRERROR(ERRNO));
 		return PROT_EVENT_ERROR;
 	}
 
-        if (wasNonblock)
-                setNonblock(true);
+	if (err != 0) {
+		// Let getProtocolError() see the error of the connect
+#if defined(OS_WINDOWS)
+		WSASetLastError(err);
+#else
+		errno = err;
+#endif
+		ProtocolError perr = getProtocolError();
+
+		HAGGLE_ERR("%s - %s\n", getName(), getProtocolErrorStr());
+
+		return perr == PROT_ERROR_NOT_A_SOCKET ? 
+			PROT_EVENT_ERROR_FATAL : PROT_EVENT_ERROR;
+	}
 
 	setFlag(PROT_FLAG_CONNECTED);
 
@@ -544,6 +613,7 @@ ProtocolEvent ProtocolSocket::waitForEvent(DataObjectRef &dObj,
 		return PROT_EVENT_WRITEABLE;
 	case QUEUE_ELEMENT:
 		dObj = qe->getDataObject();
+		txQueueTime = qe->getQueueTime();
 		delete qe;
 		return PROT_EVENT_TXQ_NEW_DATAOBJECT;
 	case QUEUE_EMPTY:
@@ -565,6 +635,7 @@ ProtocolError ProtocolSocket::getProtocolError()
 {
 	switch (errno) {
 	case EAGAIN:
+	case EINPROGRESS:
 		error = PROT_ERROR_WOULD_BLOCK;
 		break;
 	case EBADF:
@@ -68,6 +68,11 @@ class ProtocolSocket : public Protocol
 	bool openSocket(int domain, int type, int protocol, bool registersock = false, bool nonblock = true);
 	bool setSocket(SOCKET sock, bool registersock = false);
 	void closeSocket();
+	/**
+	   Closes the socket, but unlike closeSocket(), leaves the
+	   protocol running so that it can open a new one.
+	 */
+	void releaseSocket();
 	bool bind(const struct sockaddr *saddr, socklen_t addrlen);
 	virtual bool setListen(int backlog = DEFAULT_SOCKET_BACKLOG);
 	SOCKET accept(struct sockaddr *saddr, socklen_t *addrlen);
@@ -75,6 +80,7 @@ class ProtocolSocket : public Protocol
         bool isNonblock();
         void closeConnection();
 	ProtocolEvent openConnection(const struct sockaddr *saddr, socklen_t addrlen);
+	ProtocolEvent completeConnection();
 	bool setSocketOption(int level, int optname, void *optval, socklen_t optlen);
 	ssize_t sendTo(const void *buf, size_t len, int flags, const struct sockaddr *to, socklen_t tolen);
 	ssize_t recvFrom(void *buf, size_t len, int flags, struct sockaddr *from, socklen_t *fromlen);
@@ -100,6 +106,7 @@ class ProtocolSocket : public Protocol
 
 	virtual ~ProtocolSocket();
 	bool hasWatchable(const Watchable &wbl);
+	SOCKET getEngineSocket() const { return sock; }
 };
 
 #endif /* _PROTOCOL_H */
@@ -29,13 +29,13 @@
 
 ProtocolTCP::ProtocolTCP(SOCKET _sock, const InterfaceRef& _localIface, const InterfaceRef& _peerIface, 
 			 const unsigned short _port, const short flags, ProtocolManager * m) :
-	ProtocolSocket(Protocol::TYPE_TCP, "ProtocolTCP", _localIface, _peerIface, flags, m, _sock), localport(_port)
+	ProtocolSocket(Protocol::TYPE_TCP, "ProtocolTCP", _localIface, _peerIface, flags, m, _sock), localport(_port), cork(false)
 {
 }
 
 ProtocolTCP::ProtocolTCP(const InterfaceRef& _localIface, const InterfaceRef& _peerIface, 
 			 const unsigned short _port, const short flags, ProtocolManager * m) : 
-	ProtocolSocket(Protocol::TYPE_TCP, "ProtocolTCP", _localIface, _peerIface, flags, m), localport(_port)
+	ProtocolSocket(Protocol::TYPE_TCP, "ProtocolTCP", _localIface, _peerIface, flags, m), localport(_port), cork(false)
 {
 }
 
@@ -43,13 +43,74 @@ ProtocolTCP::~ProtocolTCP()
 {
 }
 
-bool ProtocolTCP::initbase()
+/*
+  Sets the socket options configured for the local interface. A failure
+  is not fatal, since the protocol works with the default options too.
+*/
+void ProtocolTCP::setTCPOptions()
+{
+	static const TCPOptions defaults;
+	const TCPOptions& opts = getManager() ? getManager()->getTCPOptions(localIface) : defaults;
+	int optval;
+
+	// The buffer sizes must be set before connecting, or listening, for
+	// the TCP window scaling to take them into account. Accepted sockets
+	// inherit them from the listening socket.
+	if (opts.sendBufferSize > 0) {
+		optval = opts.sendBufferSize;
+
+		if (!setSocketOption(SOL_SOCKET, SO_SNDBUF, &optval, sizeof(optval))) {
+			HAGGLE_ERR("%s setsockopt SO_SNDBUF=%d failed\n", getName(), optval);
+		}
+	}
+
+	if (opts.receiveBufferSize > 0) {
+		optval = opts.receiveBufferSize;
+
+		if (!setSocketOption(SOL_SOCKET, SO_RCVBUF, &optval, sizeof(optval))) {
+			HAGGLE_ERR("%s setsockopt SO_RCVBUF=%d failed\n", getName(), optval);
+		}
+	}
+
+	if (opts.nodelay) {
+		optval = 1;
+
+		if (!setSocketOption(IPPROTO_TCP, TCP_NODELAY, &optval, sizeof(optval))) {
+			HAGGLE_ERR("%s setsockopt TCP_NODELAY failed\n", getName());
+		}
+	}
+	cork = opts.cork;
+}
+
+void ProtocolTCP::hookCork(bool corked)
+{
+	if (!cork)
+		return;
+
+	int optval = corked ? 1 : 0;
+
+	// Clearing the option sends any partial segment that is held back
+#if defined(TCP_CORK)
+	if (!setSocketOption(IPPROTO_TCP, TCP_CORK, &optval, sizeof(optval))) {
+		HAGGLE_ERR("%s setsockopt TCP_CORK failed\n", getName());
+		cork = false;
+	}
+#elif defined(TCP_NOPUSH)
+	if (!setSocketOption(IPPROTO_TCP, TCP_NOPUSH, &optval, sizeof(optval))) {
+		HAGGLE_ERR("%s setsockopt TCP_NOPUSH failed\n", getName());
+		cork = false;
+	}
+#else
+	cork = false;
+#endif
+}
+
+bool ProtocolTCP::initbase(int af)
 {
 	int optval = 1;
         char buf[SOCKADDR_SIZE];
         struct sockaddr *local_addr = (struct sockaddr *)buf;
         socklen_t addrlen = 0;
-        int af = AF_INET;
         unsigned short port = isClient() ? 0 : localport;
 	char ip_str[50];
 	
@@ -61,14 +122,18 @@ bool ProtocolTCP::initbase()
 	// Check if we are already connected, i.e., we are a client
 	// that was created from acceptClient()
 	if (isConnected()) {
-		// Nothing to initialize
+		setTCPOptions();
 		return true;
 	}
-        // Figure out the address type based on the local interface
+        // Figure out the address type based on the local interface,
+        // unless the caller knows which one it needs
+	if (af == AF_UNSPEC) {
+		af = AF_INET;
 #if defined(ENABLE_IPv6)
-	if (localIface->getAddress<IPv6Address>() && peerIface && peerIface->getAddress<IPv6Address>())
-                af = AF_INET6;
+		if (localIface->getAddress<IPv6Address>() && peerIface && peerIface->getAddress<IPv6Address>())
+			af = AF_INET6;
 #endif
+	}
 
         /* Configure a sockaddr for binding to the given port. Do not
          * bind to a specific interface. */
@@ -107,6 +172,8 @@ bool ProtocolTCP::initbase()
                 return false;
 	}
 
+	setTCPOptions();
+
 	if (!bind(local_addr, addrlen)) {
 		closeSocket();
 		HAGGLE_ERR("Could not bind TCP socket\n");
@@ -125,48 +192,73 @@ bool ProtocolTCPClient::init_derived()
 		HAGGLE_ERR("Client has no peer interface\n");
 		return false;
 	}
-	return initbase();
+	if (!initbase())
+		return false;
+
+	// Accepted sockets are blocking, but the protocol engine needs
+	// non-blocking ones
+	if (isAsynchronous() && !isNonblock())
+		return setNonblock(true);
+
+	return true;
+}
+
+bool ProtocolTCPClient::isAsynchronous() const
+{
+	return getManager() && getManager()->getEngine();
+}
+
+/*
+  Returns address number n of the peer interface that we can connect to from
+  the local interface, counting IPv6 addresses before IPv4 ones, or NULL if
+  there are not that many.
+*/
+static Address *peer_address(const InterfaceRef& localIface, const InterfaceRef& peerIface, unsigned int n)
+{
+	const Addresses *adds = peerIface->getAddresses();
+
+	if (!adds)
+		return NULL;
+
+	for (int pass = 0; pass < 2; pass++) {
+		Address::Type_t type = Address::TYPE_IPV4;
+#if defined(ENABLE_IPv6)
+		if (pass == 0) {
+			if (!localIface->getAddress<IPv6Address>())
+				continue;
+			type = Address::TYPE_IPV6;
+		}
+#else
+		if (pass == 0)
+			continue;
+#endif
+		for (Addresses::const_iterator it = adds->begin(); it != adds->end(); it++) {
+			if ((*it)->getType() == type && n-- == 0)
+				return *it;
+		}
+	}
+	return NULL;
 }
 
 ProtocolEvent ProtocolTCPClient::connectToPeer()
 {
-	socklen_t addrlen;
+	socklen_t addrlen = 0;
         char buf[SOCKADDR_SIZE];
         struct sockaddr *peer_addr = (struct sockaddr *)buf;
 	unsigned short peerPort;
-	SocketAddress *addr = NULL;
-	InterfaceRef pIface;
+	Address *addr = NULL;
 	
         // FIXME: use other port than the default one?
         peerPort = TCP_DEFAULT_PORT;
 
-	if (!peerIface ||
-	    !(peerIface->getAddress<IPv4Address>() || 
-#if defined(ENABLE_IPv6)
-	      peerIface->getAddress<IPv6Address>()
-#else
-		  0
-#endif
-		  ))
+	if (!peerIface)
 		return PROT_EVENT_ERROR;
 
-#if defined(ENABLE_IPv6)
-	IPv6Address *addr6 = peerIface->getAddress<IPv6Address>();
-	if (addr6) {
-		addrlen = addr6->fillInSockaddr((struct sockaddr_in6 *)peer_addr, peerPort);
-		addr = addr6;
-		HAGGLE_DBG("Using IPv6 address %s to connect to peer\n", addr6->getStr());
-	}
-#endif
-	
+	addr = peer_address(localIface, peerIface, peerAddress);
+
 	if (!addr) {
-		// Since the check above passed, we know there has to be an IPv4 or an 
-		// IPv6 address associated with the interface, and since there was no IPv6...
-		IPv4Address *addr4 = peerIface->getAddress<IPv4Address>();
-		if (addr4) {
-			addrlen = addr4->fillInSockaddr((struct sockaddr_in *)peer_addr, peerPort);
-			addr = addr4;
-		}
+		peerAddress = 0;
+		addr = peer_address(localIface, peerIface, peerAddress);
 	}
 
 	if (!addr) {
@@ -174,8 +266,33 @@ ProtocolEvent ProtocolTCPClient::connectToPeer()
 		return PROT_EVENT_ERROR;
 	}
 	
+#if defined(ENABLE_IPv6)
+	if (addr->getType() == Address::TYPE_IPV6) {
+		addrlen = static_cast<IPv6Address *>(addr)->fillInSockaddr((struct sockaddr_in6 *)peer_addr, peerPort);
+		HAGGLE_DBG("Using IPv6 address %s to connect to peer\n", addr->getStr());
+	}
+#endif
+	if (addr->getType() == Address::TYPE_IPV4)
+		addrlen = static_cast<IPv4Address *>(addr)->fillInSockaddr((struct sockaddr_in *)peer_addr, peerPort);
+
+	// A socket whose connect failed cannot portably be connected
+	// again, and the next address may be of another family, so start
+	// over with a new socket
+	if (connectFailed) {
+		releaseSocket();
+		connectFailed = false;
+
+		if (!initbase(peer_addr->sa_family)) {
+			HAGGLE_ERR("%s could not open a new socket\n", getName());
+			return PROT_EVENT_ERROR_FATAL;
+		}
+	}
+
 	ProtocolEvent ret = openConnection(peer_addr, addrlen);
 
+	if (ret == PROT_EVENT_WOULD_BLOCK)
+		return ret;
+
 	if (ret != PROT_EVENT_SUCCESS) {
 		HAGGLE_DBG("%s Connection failed to [%s] tcp port=%u\n", 
 			getName(), addr->getStr(), peerPort);
@@ -187,6 +304,19 @@ ProtocolEvent ProtocolTCPClient::connectToPeer()
 	return ret;
 }
 
+bool ProtocolTCPClient::nextPeerAddress()
+{
+	connectFailed = true;
+
+	if (peerIface && peer_address(localIface, peerIface, peerAddress + 1)) {
+		peerAddress++;
+		return true;
+	}
+	peerAddress = 0;
+
+	return false;
+}
+
 ProtocolTCPServer::ProtocolTCPServer(const InterfaceRef& _localIface, ProtocolManager *m, 
 				     const unsigned short _port, int _backlog) :
 	ProtocolTCP(_localIface, NULL, _port, PROT_FLAG_SERVER, m), backlog(_backlog) 
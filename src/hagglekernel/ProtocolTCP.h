@@ -41,7 +41,11 @@ class ProtocolTCP : public ProtocolSocket
         friend class ProtocolTCPServer;
         friend class ProtocolTCPClient;
 	unsigned short localport;
-	bool initbase();
+	// True if we cork the socket while writing data objects
+	bool cork;
+	bool initbase(int af = AF_UNSPEC);
+	void setTCPOptions();
+	void hookCork(bool corked);
         ProtocolTCP(SOCKET sock, const InterfaceRef& _localIface, const InterfaceRef& _peerIface,
 		const unsigned short _port, const short flags = PROT_FLAG_CLIENT, ProtocolManager *m = NULL);
 public:
@@ -55,14 +59,23 @@ public:
 class ProtocolTCPClient : public ProtocolTCP
 {
         friend class ProtocolTCPServer;
+	// The peer address that the next connect attempt uses
+	unsigned int peerAddress;
+	// True if a connect attempt failed on the current socket
+	bool connectFailed;
 	bool init_derived();
 public:
         ProtocolTCPClient(SOCKET sock, const InterfaceRef& _localIface, const InterfaceRef& _peerIface, const unsigned short _port, ProtocolManager *m = NULL) : 
-		ProtocolTCP(sock, _localIface, _peerIface, _port, PROT_FLAG_CLIENT | PROT_FLAG_CONNECTED, m) {}
+		ProtocolTCP(sock, _localIface, _peerIface, _port, PROT_FLAG_CLIENT | PROT_FLAG_CONNECTED, m), 
+		peerAddress(0), connectFailed(false) {}
         ProtocolTCPClient(const InterfaceRef& _localIface, const InterfaceRef& _peerIface,
                           const unsigned short _port = TCP_DEFAULT_PORT, ProtocolManager *m = NULL) :
-                ProtocolTCP(_localIface, _peerIface, _port, PROT_FLAG_CLIENT, m) {}
-        ProtocolEvent connectToPeer();};
+                ProtocolTCP(_localIface, _peerIface, _port, PROT_FLAG_CLIENT, m), 
+		peerAddress(0), connectFailed(false) {}
+        ProtocolEvent connectToPeer();
+	bool nextPeerAddress();
+	bool isAsynchronous() const;
+};
 
 
 /** */
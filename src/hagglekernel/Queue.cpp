@@ -38,8 +38,8 @@ QueueElement::QueueElement(const DataObjectRef& _obj, const NodeRef _node, const
 	type(QE_DataObject), 
 	dObj(_obj),
 	node(_node),
-	iface(_iface)
-	
+	iface(_iface),
+	queueTime(Timeval::now())
 {
 }
 
@@ -47,7 +47,8 @@ QueueElement::QueueElement(const QueueElement &qe) :
 	type(qe.type),
 	dObj(qe.dObj),
 	node(qe.node),
-	iface(qe.iface)
+	iface(qe.iface),
+	queueTime(qe.queueTime)
 {
 }
 
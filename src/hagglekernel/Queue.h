@@ -53,6 +53,7 @@ class QueueElement
 	DataObjectRef dObj;
 	NodeRef node;
 	InterfaceRef iface;
+	Timeval queueTime;
 public:
 	/**
 		This returns the type of data contained.
@@ -63,6 +64,11 @@ public:
 		The get* functions return NULL if the type isn't right.
 	*/
 	DataObjectRef getDataObject();
+	/**
+		Returns the time when the element was created, which is
+		when it was put in the queue.
+	*/
+	const Timeval& getQueueTime() const { return queueTime; }
 
 	//	Constructors/deconstructors:
 	QueueElement(const DataObjectRef& dObj, const NodeRef targ = NULL, const InterfaceRef iface = NULL);
@@ -47,6 +47,10 @@
 
 using namespace haggle;
 
+// The number of matching data objects whose ids are checked against a
+// node's bloomfilter at once
+#define QUERY_BLOOMFILTER_BATCH 32
+
 /*
 	Tables for basic data types
 */
@@ -3463,6 +3467,52 @@ filterQuery_cleanup:
 
 // ----- Node > Dataobjects
 
+/*
+	Adds the matching data objects in the batch that neither the node
+	nor the delegate already has to the query result, until there are
+	max_matches. The bloomfilters are checked for the whole batch at
+	once. Returns the new number of matches.
+*/
+static int addUnknownDataObjects(DataObjectRefList& batch, 
+				 const NodeRef& node, 
+				 const NodeRef& delegate_node, 
+				 DataStoreQueryResult *qr, 
+				 int max_matches, 
+				 int num_match)
+{
+	bool node_has[QUERY_BLOOMFILTER_BATCH], delegate_has[QUERY_BLOOMFILTER_BATCH];
+	unsigned int i = 0;
+
+	if (batch.empty() || (max_matches != 0 && num_match >= max_matches))
+		return num_match;
+
+	node->getBloomfilter()->hasMany(batch, node_has);
+
+	if (delegate_node)
+		delegate_node->getBloomfilter()->hasMany(batch, delegate_has);
+
+	for (DataObjectRefList::iterator it = batch.begin(); it != batch.end(); it++, i++) {
+		DataObjectRef& dObj = *it;
+
+		// Ignore this data object if the target or the potential delegate 
+		// already has it
+		if (node_has[i] || (delegate_node && delegate_has[i]))
+			continue;
+
+		// Ignore this data object if it is the node description of the target
+		// or a potential delegate
+		if (node->isDescribedBy(dObj) || (delegate_node && delegate_node->isDescribedBy(dObj)))
+			continue;
+
+		qr->addDataObject(dObj);
+		num_match++;
+
+		if (max_matches != 0 && num_match >= max_matches)
+			break;
+	}
+	return num_match;
+}
+
 int SQLDataStore::_doDataObjectQueryStep2(NodeRef &node, 
 					  NodeRef delegate_node, 
 					  DataStoreQueryResult *qr, 
@@ -3475,6 +3525,7 @@ int SQLDataStore::_doDataObjectQueryStep2(NodeRef &node,
 	const char *tail;
 	char *sql_cmd = sqlcmd;
 	int num_match = 0;
+	DataObjectRefList batch;
 	
 	sqlite_int64 node_rowid = getNodeRowId(node);
 
@@ -3504,37 +3555,32 @@ int SQLDataStore::_doDataObjectQueryStep2(NodeRef &node,
 			DataObjectRef dObj = getDataObjectFromRowId(dObjRowId);
 
 			if (dObj) {
-				bool delegate_has_dataobject = delegate_node ? delegate_node->getBloomfilter()->has(dObj) : false;
-				// Ignore this data object if the target or the potential delegate 
-				// already has it
-				if (node->getBloomfilter()->has(dObj) || delegate_has_dataobject)
-					continue;
-					
-				//HAGGLE_DBG("Data object rowid=" SQLITE_INT64_FMT "\n", dObjRowId);
-				if (dObj->isNodeDescription()) {
-					NodeRef desc_node = Node::create(Node::TYPE_PEER, dObj);
-					// Ignore this data object if it is the node description of the target
-					// or a potential delegate
-					if (desc_node == node || (delegate_node && delegate_node == desc_node)) {
-						continue;
-					}
-				}
-				qr->addDataObject(dObj);
-				num_match++;
-				
-				if (max_matches != 0 && (num_match >= max_matches)) {
-					break;
-				}
+				batch.push_back(dObj);
 			} else {
 				HAGGLE_DBG("Could not get data object from rowid\n");
 			}
+			
+			// Do not load more data objects than there are matches
+			// left to fill
+			if (batch.size() < QUERY_BLOOMFILTER_BATCH &&
+			    (max_matches == 0 || (int)batch.size() < max_matches - num_match))
+				continue;
+
+			num_match = addUnknownDataObjects(batch, node, delegate_node, qr, max_matches, num_match);
+			batch.clear();
+				
+			if (max_matches != 0 && (num_match >= max_matches)) {
+				break;
+			}
 		} else if (ret == SQLITE_ERROR) {
 			HAGGLE_DBG("data object query Error:%s\n", sqlite3_errmsg(db));
-			sqlite3_finalize(stmt);
-			return num_match;
+			break;
 		}
 	}
 
+	// The last, partial batch
+	num_match = addUnknownDataObjects(batch, node, delegate_node, qr, max_matches, num_match);
+
 	sqlite3_finalize(stmt);
 	
 	return num_match;
@@ -17,7 +17,7 @@ char *XMLMetadata::initDoc(const char *raw, size_t len)
         return (char *)xmlDocGetRootElement(doc)->name;
 }
 
-XMLMetadata::XMLMetadata(const string name, const string content, XMLMetadata *parent) :
+XMLMetadata::XMLMetadata(const string& name, const string& content, XMLMetadata *parent) :
 	Metadata(name, content, parent), doc(NULL)
 {
 }
@@ -119,7 +119,7 @@ bool XMLMetadata::addMetadata(Metadata *m)
         return _addMetadata(m);
 }
 
-Metadata *XMLMetadata::addMetadata(const string name, const string content)
+Metadata *XMLMetadata::addMetadata(const string& name, const string& content)
 {
         XMLMetadata *m = new XMLMetadata(name, content, this);
 
@@ -16,7 +16,7 @@ class XMLMetadata : public Metadata {
         bool createXMLDoc();
         bool parseXML(xmlNodePtr xn);
     public:
-        XMLMetadata(const string name, const string content = "", XMLMetadata *parent = NULL);
+        XMLMetadata(const string& name, const string& content = "", XMLMetadata *parent = NULL);
         XMLMetadata(const XMLMetadata& m);
         XMLMetadata();
         ~XMLMetadata();
@@ -25,7 +25,7 @@ class XMLMetadata : public Metadata {
         ssize_t getRaw(unsigned char *buf, size_t len);
         bool getRawAlloc(unsigned char **buf, size_t *len);
         bool addMetadata(Metadata *m);
-        Metadata *addMetadata(const string name, const string content = "");
+        Metadata *addMetadata(const string& name, const string& content = "");
 };
 
 #endif /* _XMLMETADATA_H */
@@ -11,6 +11,7 @@ LOCAL_SRC_FILES := \
 	Timeval.cpp \
 	Watch.cpp \
 	Mutex.cpp \
+	RWMutex.cpp \
 	Condition.cpp \
 	Signal.cpp \
 	Reference.cpp
@@ -156,10 +156,49 @@ HeapItem *Heap::extractFirst(void)
 	heap[0] = heap[_size];
 	heap[0]->index = 0;
 	heapify(0);
+	max->index = HeapItem::npos;
 
 	return max;
 }
 
+bool Heap::remove(HeapItem *item)
+{
+	unsigned long i, parent;
+
+	if (!item || item->index >= _size || heap[item->index] != item)
+		return false;
+
+	i = item->index;
+	_size--;
+	item->index = HeapItem::npos;
+
+	if (i == _size)
+		return true;
+
+	/* move the last item into the hole, up or down to its place */
+	heap[i] = heap[_size];
+	heap[i]->index = i;
+
+	while (i > 0) {
+		HeapItem *tmp;
+
+		parent = (i - 1) / 2;
+
+		if (!(*heap[parent] > *heap[i]))
+			break;
+
+		tmp = heap[parent];
+		heap[parent] = heap[i];
+		heap[parent]->index = parent;
+		heap[i] = tmp;
+		heap[i]->index = i;
+		i = parent;
+	}
+	heapify(i);
+
+	return true;
+}
+
 	
 bool operator< (const HeapItem& i1, const HeapItem& i2)
 {
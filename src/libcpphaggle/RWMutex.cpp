@@ -0,0 +1,157 @@
+/* Copyright 2009 Uppsala University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#include <libcpphaggle/RWMutex.h>
+
+namespace haggle {
+
+RWMutex::RWMutex() :
+	reads(0), writes(0), read_waits(0), write_waits(0),
+	read_wait_time(0, 0), write_wait_time(0, 0)
+{
+#if defined(HAS_PTHREAD_RWLOCK_PREFER_WRITER)
+	pthread_rwlockattr_t attr;
+
+	pthread_rwlockattr_init(&attr);
+	pthread_rwlockattr_setkind_np(&attr, PTHREAD_RWLOCK_PREFER_WRITER_NONRECURSIVE_NP);
+	pthread_rwlock_init(&rwlock, &attr);
+	pthread_rwlockattr_destroy(&attr);
+#elif defined(HAS_PTHREAD_RWLOCK)
+	pthread_rwlock_init(&rwlock, NULL);
+#endif
+}
+
+RWMutex::~RWMutex()
+{
+#if defined(HAS_PTHREAD_RWLOCK)
+	pthread_rwlock_destroy(&rwlock);
+#endif
+}
+
+void RWMutex::waited(const Timeval& start, bool write)
+{
+	Timeval wait_time = Timeval::now() - start;
+
+	statsMutex.lock();
+
+	if (write) {
+		write_waits++;
+		write_wait_time += wait_time;
+	} else {
+		read_waits++;
+		read_wait_time += wait_time;
+	}
+	statsMutex.unlock();
+}
+
+bool RWMutex::readLock()
+{
+	bool ret;
+
+	atomic_inc(&reads);
+
+	// Only read the clock if we have to wait
+	if (tryReadLock())
+		return true;
+
+	Timeval start = Timeval::now();
+
+#if defined(HAS_PTHREAD_RWLOCK)
+	ret = pthread_rwlock_rdlock(&rwlock) == 0;
+#else
+	ret = mutex.lock();
+#endif
+	waited(start, false);
+
+	return ret;
+}
+
+bool RWMutex::writeLock()
+{
+	bool ret;
+
+	atomic_inc(&writes);
+
+	if (tryWriteLock())
+		return true;
+
+	Timeval start = Timeval::now();
+
+#if defined(HAS_PTHREAD_RWLOCK)
+	ret = pthread_rwlock_wrlock(&rwlock) == 0;
+#else
+	ret = mutex.lock();
+#endif
+	waited(start, true);
+
+	return ret;
+}
+
+bool RWMutex::tryReadLock()
+{
+#if defined(HAS_PTHREAD_RWLOCK)
+	return pthread_rwlock_tryrdlock(&rwlock) == 0;
+#else
+	return mutex.trylock();
+#endif
+}
+
+bool RWMutex::tryWriteLock()
+{
+#if defined(HAS_PTHREAD_RWLOCK)
+	return pthread_rwlock_trywrlock(&rwlock) == 0;
+#else
+	return mutex.trylock();
+#endif
+}
+
+bool RWMutex::unlock()
+{
+#if defined(HAS_PTHREAD_RWLOCK)
+	pthread_rwlock_unlock(&rwlock);
+#else
+	mutex.unlock();
+#endif
+	return true;
+}
+
+unsigned long RWMutex::getReadWaits()
+{
+	Mutex::AutoLocker l(statsMutex);
+
+	return read_waits;
+}
+
+unsigned long RWMutex::getWriteWaits()
+{
+	Mutex::AutoLocker l(statsMutex);
+
+	return write_waits;
+}
+
+Timeval RWMutex::getReadWaitTime()
+{
+	Mutex::AutoLocker l(statsMutex);
+
+	return read_wait_time;
+}
+
+Timeval RWMutex::getWriteWaitTime()
+{
+	Mutex::AutoLocker l(statsMutex);
+
+	return write_wait_time;
+}
+
+}; // namespace haggle
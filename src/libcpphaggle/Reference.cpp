@@ -18,26 +18,49 @@ namespace haggle {
 
 HashMap<void *, RefCounter *> RefCounter::objects;
 Mutex RefCounter::objectsMutex;
-unsigned long RefCounter::totNum = 0;
+atomic_t RefCounter::totNum = 0;
+#if defined(DEBUG) && defined(DEBUG_REFERENCE)
+atomic_t RefCounter::totLocks = 0;
+#endif
 
-RefCounter::RefCounter(void *_obj) : 
-	countMutex(),
+RefCounter::RefCounter(void *_obj, RefCounted *_intrusive) : 
 	refcount(1),
+	intrusive(_intrusive),
 	objectMutex(),
 	obj(_obj), 
-	identifier(totNum++)
+	frozen(false),
+	identifier(atomic_inc(&totNum) - 1)
 {
-	objects.insert(RefcountPair(obj, this));
 }
 
-RefCounter *RefCounter::create(void *_obj)
+RefCounter *RefCounter::create(void *_obj, RefCounted *_intrusive)
 {
-	Mutex::AutoLocker l(objectsMutex);
 	RefCounter *refCount;
 	// NULL is ok, but we don't need a RefCounter to it.
 	if (!_obj)
 		return NULL;
 	
+	if (_intrusive) {
+		// No locking needed, the counter is found through the object
+		refCount = _intrusive->refCounter;
+
+		if (!refCount) {
+			refCount = new RefCounter(_obj, _intrusive);
+			
+			if (atomic_cas_ptr((void * volatile *)&_intrusive->refCounter, NULL, refCount))
+				return refCount;
+			
+			// Another thread set a counter before us
+			delete refCount;
+			refCount = _intrusive->refCounter;
+		}
+		if (refCount->inc_count() == 0)
+			return NULL;
+		return refCount;
+	}
+
+	Mutex::AutoLocker l(objectsMutex);
+	
 	RefcountMap::iterator it = objects.find(_obj);
 	
 	if (it != objects.end()) {
@@ -46,7 +69,10 @@ RefCounter *RefCounter::create(void *_obj)
 			return NULL;
 		return refCount;
 	}
-	return new RefCounter(_obj);
+	refCount = new RefCounter(_obj, NULL);
+	objects.insert(RefcountPair(_obj, refCount));
+
+	return refCount;
 }
 /**
     Destructor.
@@ -21,6 +21,11 @@ namespace haggle {
 
 char String::nullchar = '\0';
 
+#if defined(DEBUG)
+unsigned long String::num_heap_allocs = 0;
+unsigned long String::num_local_allocs = 0;
+#endif
+
 char *String::alloc(size_t len)
 {
         char *tmp;
@@ -28,13 +33,33 @@ char *String::alloc(size_t len)
         if (len <= alloc_len || len == 0)
                 return s;
 
-        // If alloc_len is 0, then s points to the static nullchar.
-        // Therefore, we must reset the s pointer to NULL first,
-        // so that realloc does not try to free it.
-        if (alloc_len == 0)
-                s = NULL;
+        // If alloc_len is 0, then s points to the static nullchar
+        // and the string is empty. A short string can then use the
+        // local buffer. Once a string has outgrown the local buffer,
+        // it stays on the heap.
+        if (alloc_len == 0 && len <= STRING_LOCAL_LEN) {
+                s = local;
+                alloc_len = STRING_LOCAL_LEN;
+                memset(s, 0, alloc_len);
+#if defined(DEBUG)
+                num_local_allocs++;
+#endif
+                return s;
+        }
+
+        if (s == local) {
+                tmp = (char *)malloc(len);
+
+                if (tmp)
+                        memcpy(tmp, local, slen + 1);
+        } else {
+                // Reset the s pointer to NULL if it points to
+                // nullchar, so that realloc does not try to free it.
+                if (alloc_len == 0)
+                        s = NULL;
 
-        tmp = (char *)realloc(s, len);
+                tmp = (char *)realloc(s, len);
+        }
         
         if (tmp) {
                 s = tmp;
@@ -43,6 +68,9 @@ char *String::alloc(size_t len)
                 // Initialize allocated memory to zero, but do not
                 // overwrite any previous string
                 memset(s + slen, 0, alloc_len - slen);
+#if defined(DEBUG)
+                num_heap_allocs++;
+#endif
         }
 
         return tmp;
@@ -81,6 +109,45 @@ String::String(const String& str) : s(&nullchar), alloc_len(0), slen(0)
         }
 }
 
+#if defined(HAVE_RVALUE_REFERENCES)
+String::String(String&& str) : s(&nullchar), alloc_len(0), slen(0)
+{
+        if (str.isHeap()) {
+                // Take over the buffer instead of copying it
+                s = str.s;
+                alloc_len = str.alloc_len;
+                slen = str.slen;
+                str.s = &nullchar;
+                str.alloc_len = 0;
+                str.slen = 0;
+        } else if (str.slen && alloc(str.slen + 1)) {
+		strcpy(s, str.s);
+                slen = str.slen;
+        }
+}
+
+String& String::operator=(String&& str)
+{
+        if (this == &str)
+                return *this;
+
+        if (!str.isHeap())
+                return *this = static_cast<const String&>(str);
+
+        if (isHeap())
+                free(s);
+
+        s = str.s;
+        alloc_len = str.alloc_len;
+        slen = str.slen;
+        str.s = &nullchar;
+        str.alloc_len = 0;
+        str.slen = 0;
+
+        return *this;
+}
+#endif
+
 String::String(const char c) : s(&nullchar), alloc_len(0), slen(0)
 {
 	if (c != '\0' && alloc(2)) {
@@ -95,7 +162,7 @@ String::String(const char c) : s(&nullchar), alloc_len(0), slen(0)
 
 String::~String() 
 {
-        if (alloc_len) 
+        if (isHeap()) 
                 free(s);
 }
 
@@ -0,0 +1,126 @@
+/* Copyright 2008-2009 Uppsala University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef __ATOMIC_H_
+#define __ATOMIC_H_
+
+#include "Platform.h"
+
+#if defined(OS_WINDOWS)
+#include <windows.h>
+#endif
+
+namespace haggle {
+
+/*
+	Lock-free operations on integers and pointers. They all imply a
+	full memory barrier.
+*/
+#if defined(OS_WINDOWS)
+typedef volatile LONG atomic_t;
+
+static inline long atomic_inc(atomic_t *v)
+{
+	return InterlockedIncrement(v);
+}
+
+static inline long atomic_dec(atomic_t *v)
+{
+	return InterlockedDecrement(v);
+}
+
+/**
+	Sets *v to newval iff it equals oldval. Returns true if it did.
+ */
+static inline bool atomic_cas(atomic_t *v, long oldval, long newval)
+{
+	return InterlockedCompareExchange(v, newval, oldval) == oldval;
+}
+
+static inline bool atomic_cas_ptr(void * volatile *p, void *oldval, void *newval)
+{
+	return InterlockedCompareExchangePointer(p, newval, oldval) == oldval;
+}
+
+static inline long atomic_read(const atomic_t *v)
+{
+	MemoryBarrier();
+	return *v;
+}
+
+static inline void atomic_set(atomic_t *v, long val)
+{
+	InterlockedExchange(v, val);
+}
+#else
+typedef volatile long atomic_t;
+
+static inline long atomic_inc(atomic_t *v)
+{
+	return __sync_add_and_fetch(v, 1);
+}
+
+static inline long atomic_dec(atomic_t *v)
+{
+	return __sync_sub_and_fetch(v, 1);
+}
+
+/**
+	Sets *v to newval iff it equals oldval. Returns true if it did.
+ */
+static inline bool atomic_cas(atomic_t *v, long oldval, long newval)
+{
+	return __sync_bool_compare_and_swap(v, oldval, newval);
+}
+
+static inline bool atomic_cas_ptr(void * volatile *p, void *oldval, void *newval)
+{
+	return __sync_bool_compare_and_swap(p, oldval, newval);
+}
+
+static inline long atomic_read(const atomic_t *v)
+{
+	__sync_synchronize();
+	return *v;
+}
+
+static inline void atomic_set(atomic_t *v, long val)
+{
+	__sync_synchronize();
+	*v = val;
+	__sync_synchronize();
+}
+#endif
+
+/**
+	Increases *v unless it is zero. Returns the new value, or zero if
+	it was not increased.
+ */
+static inline long atomic_inc_not_zero(atomic_t *v)
+{
+	long val;
+
+	do {
+		val = *v;
+
+		if (val == 0)
+			return 0;
+	} while (!atomic_cas(v, val, val + 1));
+
+	return val + 1;
+}
+
+}; // namespace haggle
+
+#endif /* __ATOMIC_H_ */
@@ -31,6 +31,11 @@ namespace haggle {}
 #include <stdint.h>
 #endif
 
+#include <string.h>
+#include <stdlib.h>
+#include <new>
+
+#include "Platform.h"
 #include "Pair.h"
 #include "List.h"
 #include "String.h"
@@ -46,9 +51,6 @@ namespace haggle {
   
    Note, that this hash map does not guarantee ordering of objects, and
    it works by default as a multimap.
-
-   The implementation is quite simple, and could probably be improved a
-   lot.
   
    @author Erik Nordström
 */
@@ -112,43 +114,87 @@ static inline unsigned int generic_hash(const char *start, const char *end) {
 	return hash_value;
 }
 	
+/*
+  64-bit hashing. Data is consumed a word at a time and each word is
+  mixed with a multiplication, and the result is finalized with the
+  MurmurHash3 64-bit finalizer, so that all bits of the hash value 
+  depend on all bits of the input.
+*/
+static inline u_int64_t hash_mix64(u_int64_t h) {
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+	return h;
+}
+
+static inline u_int64_t hash_bytes64(const void *data, size_t len) {
+	const unsigned char *p = (const unsigned char *)data;
+	u_int64_t h = 0x9e3779b97f4a7c15ULL ^ len;
+	u_int64_t v;
+
+	while (len >= sizeof(v)) {
+		memcpy(&v, p, sizeof(v));
+		h ^= v;
+		h *= 0x9e3779b97f4a7c15ULL;
+		h ^= h >> 29;
+		p += sizeof(v);
+		len -= sizeof(v);
+	}
+	if (len) {
+		v = 0;
+		memcpy(&v, p, len);
+		h ^= v;
+		h *= 0x9e3779b97f4a7c15ULL;
+	}
+	return hash_mix64(h);
+}
+
 /*
   Define a set of hash functions based on type.
-  For now, only distinguish between strings, pointers, and integer types.
+  For now, only distinguish between strings, pointers, and other types,
+  which are hashed by their bytes.
 */
 template<typename T> 
 struct Hash {
-	static unsigned int hash(const T& k) { return generic_hash((const char *)&k, (const char *)&k + sizeof(T)); }
+	static u_int64_t hash(const T& k) { 
+		if (sizeof(T) <= sizeof(u_int64_t)) {
+			u_int64_t v = 0;
+			memcpy(&v, &k, sizeof(T));
+			return hash_mix64(v);
+		}
+		return hash_bytes64(&k, sizeof(T)); 
+	}
 };
 template<typename T> 
 struct Hash<T*> {
-	static unsigned int hash(const T* k) { 
-		uintptr_t p = reinterpret_cast<uintptr_t>(k);
-		return generic_hash((const char *)&p, (const char *)&p + sizeof(uintptr_t)); 
+	static u_int64_t hash(const T* k) { 
+		return hash_mix64((u_int64_t)reinterpret_cast<uintptr_t>(k)); 
 	}
 };
 template<> 
 struct Hash<string> { 
-	static unsigned int hash(const string& k) { return generic_hash((const char *)k.c_str(), (const char *)k.c_str() + k.length()); }
+	static u_int64_t hash(const string& k) { return hash_bytes64(k.c_str(), k.length()); }
 };
-	
-
-/* from SGI STL */
-const unsigned long ms_primes[] =
-{
-	7ul,          13ul,         29ul,
-	53ul,         97ul,         193ul,       389ul,       769ul,
-	1543ul,       3079ul,       6151ul,      12289ul,     24593ul,
-	49157ul,      98317ul,      196613ul,    393241ul,    786433ul,
-	1572869ul,    3145739ul,    6291469ul,   12582917ul,  25165843ul,
-	50331653ul,   100663319ul,  201326611ul, 402653189ul, 805306457ul,
-	1610612741ul, 3221225473ul, 4294967291ul, 0
-};
- 
 
 /**
    HashMap: a class that implements a multimap container using a hash table.
-	   
+
+   The table uses open addressing with linear probing. A separate array
+   of control bytes marks each slot as empty, deleted, or full with seven
+   bits of the key's hash value, so that probing mostly touches the
+   control bytes and only compares keys when those bits match. 
+
+   Probing never wraps around. Instead, the slot array has an overflow 
+   area after the last home slot, which is extended when a run of full 
+   slots reaches its end. Together with inserting new values for a key 
+   right after the existing ones, this keeps all values for a key next 
+   to each other in iteration order, as equal_range() requires.
+
+   Erasing leaves a deleted marker in the slot, so that erasing does not
+   move other elements and iterators to them stay valid. Inserting may 
+   move elements, and invalidates iterators.
 */
 template<typename KeyType, typename ValueType>
 class HashMap {
@@ -156,204 +202,271 @@ public:
 	typedef unsigned long size_type;
 private:
 	typedef Pair<KeyType, ValueType > PairType;
-	typedef List<PairType > ListType;
+	enum {
+		SLOT_EMPTY = 0,
+		SLOT_DELETED = 1,
+		SLOT_FULL = 0x80,
+	};
+	/* The number of home slots in a new table */
+	enum { MIN_BUCKETS = 8 };
 	size_type _size;
-	unsigned long table_size;
-	ListType *table;
+	size_type num_deleted;
+	size_type num_buckets;
+	size_type num_slots;
+	unsigned char *ctrl;
+	PairType *slots;
 	
+	static bool isFull(unsigned char c) { return (c & SLOT_FULL) != 0; }
+	static unsigned char tag(u_int64_t h) { return (unsigned char)(SLOT_FULL | (h & 0x7f)); }
 	/**
-	   Get an index into the hash table given a key.
-	   @param k the key.
+	   Get the home slot in the hash table given the hash of a key.
+	   @param h the hash of the key.
 	   @returns the index into the hash table
 	*/
-	size_type getIndex(const KeyType& k) const {
-		return Hash<KeyType>::hash(k) % table_size;
+	size_type getIndex(u_int64_t h) const {
+		return (size_type)(h >> 7) & (num_buckets - 1);
 	}
 	/**
-	   Get the next prime number that is larger than the
-	   given integer.
-	   @param n the integer to compare against.
-	   @returns the first prime that follows n
+	   Get the slot of the first value for a key.
+	   @returns the index of the slot, or num_slots if the key is not
+	   in the table.
 	*/
-	unsigned long getPrime(unsigned long n) const {
-		const unsigned long* ptr = &ms_primes[0];
-		for (; *ptr != 0; ++ptr) {
-			if (n < *ptr)
-				return *ptr;
+	size_type findSlot(const KeyType& k) const {
+		if (_size == 0)
+			return num_slots;
+		
+		u_int64_t h = Hash<KeyType>::hash(k);
+		unsigned char t = tag(h);
+
+		for (size_type i = getIndex(h); i < num_slots && ctrl[i] != SLOT_EMPTY; i++) {
+			if (ctrl[i] == t && k == slots[i].first)
+				return i;
 		}
-		return 0;
+		return num_slots;
 	}
 	/**
-	   Grow the hash table if necessary.
+	   Allocate an empty table with the given number of home slots,
+	   which must be a power of two.
 	*/
-	void grow() {
-		size_type new_size = getPrime(table_size + 1);
-
-		if (!new_size || new_size <= table_size)
+	void allocate(size_type buckets) {
+		num_buckets = buckets;
+		num_slots = buckets + buckets / 4;
+		ctrl = new unsigned char[num_slots];
+		memset(ctrl, SLOT_EMPTY, num_slots);
+		slots = static_cast<PairType *>(malloc(num_slots * sizeof(PairType)));
+	}
+	void release() {
+		for (size_type i = 0; i < num_slots; i++) {
+			if (isFull(ctrl[i]))
+				slots[i].~PairType();
+		}
+		delete [] ctrl;
+		free(slots);
+		ctrl = NULL;
+		slots = NULL;
+		num_buckets = num_slots = 0;
+		_size = num_deleted = 0;
+	}
+	/**
+	   Copy another table slot by slot, so that the order of
+	   elements is kept.
+	*/
+	void copyFrom(const HashMap<KeyType, ValueType>& m) {
+		if (m.num_slots == 0)
 			return;
-			
-		HashMap<KeyType, ValueType> largerHashMap(new_size);
 
-		for (iterator it = begin(); it != end(); ++it) {
-			largerHashMap.insert(*it);
+		num_buckets = m.num_buckets;
+		num_slots = m.num_slots;
+		ctrl = new unsigned char[num_slots];
+		memcpy(ctrl, m.ctrl, num_slots);
+		slots = static_cast<PairType *>(malloc(num_slots * sizeof(PairType)));
+
+		for (size_type i = 0; i < num_slots; i++) {
+			if (isFull(ctrl[i]))
+				new (&slots[i]) PairType(m.slots[i]);
 		}
-			
-		*this = largerHashMap;
+		_size = m._size;
+		num_deleted = m.num_deleted;
 	}
 	/**
-	   Create a new hash map with the given size. The actual size 
-	   of the hash table may be equal or greater than the size.
-	   @param tsize the minumum size of the hash table.
+	   Move the element in one slot to another, empty, slot.
 	*/
-	HashMap(const size_type tsize) : _size(0), table_size(getPrime(tsize)), table(new ListType[table_size]) {}
+	void moveSlot(size_type from, size_type to) {
+		new (&slots[to]) PairType(slots[from]);
+		slots[from].~PairType();
+		ctrl[to] = ctrl[from];
+	}
+	/**
+	   Double the size of the overflow area at the end of the table.
+	   Elements keep their slots, so iterators stay valid.
+	*/
+	void extend() {
+		size_type new_num_slots = num_slots + (num_slots - num_buckets);
+		unsigned char *new_ctrl = new unsigned char[new_num_slots];
+		PairType *new_slots = static_cast<PairType *>(malloc(new_num_slots * sizeof(PairType)));
+
+		memcpy(new_ctrl, ctrl, num_slots);
+		memset(new_ctrl + num_slots, SLOT_EMPTY, new_num_slots - num_slots);
+
+		for (size_type i = 0; i < num_slots; i++) {
+			if (isFull(ctrl[i])) {
+				new (&new_slots[i]) PairType(slots[i]);
+				slots[i].~PairType();
+			}
+		}
+		delete [] ctrl;
+		free(slots);
+		ctrl = new_ctrl;
+		slots = new_slots;
+		num_slots = new_num_slots;
+	}
+	/**
+	   Rebuild the table with the given number of home slots. This 
+	   also drops all deleted markers.
+	*/
+	void rehash(size_type buckets) {
+		unsigned char *old_ctrl = ctrl;
+		PairType *old_slots = slots;
+		size_type old_num_slots = num_slots;
+		
+		allocate(buckets);
+		_size = num_deleted = 0;
+
+		// Inserting in slot order keeps the order of values for a key
+		for (size_type i = 0; i < old_num_slots; i++) {
+			if (isFull(old_ctrl[i])) {
+				insertNoGrow(old_slots[i]);
+				old_slots[i].~PairType();
+			}
+		}
+		delete [] old_ctrl;
+		free(old_slots);
+	}
+	/**
+	   Insert an element after any other elements with the same key.
+	   @returns the slot of the new element
+	*/
+	size_type insertNoGrow(const PairType& p) {
+		const KeyType& k = p.first;
+		u_int64_t h = Hash<KeyType>::hash(k);
+		unsigned char t = tag(h);
+		size_type i = getIndex(h), free_slot;
+		
+		for (; i < num_slots && ctrl[i] != SLOT_EMPTY; i++) {
+			if (ctrl[i] == t && k == slots[i].first) {
+				// Find the slot after the last value for the key.
+				// Erased values leave deleted slots between the
+				// values that remain, which are still part of the
+				// key's group.
+				size_type group_end = ++i;
+
+				for (; i < num_slots && ctrl[i] != SLOT_EMPTY; i++) {
+					if (ctrl[i] == t && k == slots[i].first)
+						group_end = i + 1;
+					else if (ctrl[i] != SLOT_DELETED)
+						break;
+				}
+				i = group_end;
+				break;
+			}
+		}
+		// A new key goes at the end of the run rather than in a 
+		// deleted slot, which could be between the values of 
+		// another key
+		free_slot = i;
+
+		// Make room by moving the rest of the run one slot forward
+		size_type j = free_slot;
+
+		while (j < num_slots && isFull(ctrl[j]))
+			j++;
+		
+		if (j == num_slots) {
+			extend();
+		}
+
+		if (ctrl[j] == SLOT_DELETED)
+			num_deleted--;
+
+		for (; j > free_slot; j--)
+			moveSlot(j - 1, j);
+		
+		new (&slots[free_slot]) PairType(p);
+		ctrl[free_slot] = t;
+		_size++;
+
+		return free_slot;
+	}
 public:
 	class iterator {
 		friend class HashMap<KeyType, ValueType>;
 		friend class HashMap<KeyType, ValueType>::const_iterator;
 		HashMap<KeyType, ValueType> *m;
-		size_type table_index;
-		typename ListType::iterator it;
-		iterator(HashMap<KeyType, ValueType> *_m, const size_type _table_index, typename ListType::iterator _it) : m(_m), table_index(_table_index), it(_it) {}
-		inline void find_next_filled_bucket() {
-			if (table_index < m->table_size) {
-				// Advance iterator position
-				it++;
-				
-				// Check if the iterator points to a
-				// filled bucket, otherwise advance to
-				// the the next filled one
-				if (it == m->table[table_index].end()) {
-					while (++table_index < m->table_size) {
-						// Go to next bucket
-						it = m->table[table_index].begin();
-						// Check if the bucket has contents
-						if (it != m->table[table_index].end())
-							break;
-					}
-				}
-			} 
-		}
-		iterator& begin() { 
-			if (it == m->table[0].end()) 
-				find_next_filled_bucket();
-			return *this;
+		size_type index;
+		iterator(HashMap<KeyType, ValueType> *_m, const size_type _index) : m(_m), index(_index) {}
+		inline void find_next_full_slot() {
+			while (index < m->num_slots && !isFull(m->ctrl[index]))
+				index++;
 		}
 	public:
-		iterator(const iterator& _it) : m(_it.m), table_index(_it.table_index), it(_it.it) {}
-		iterator() : m(0), table_index(0), it() {}
+		iterator(const iterator& _it) : m(_it.m), index(_it.index) {}
+		iterator() : m(0), index(0) {}
 		friend bool operator==(const iterator& it1, const iterator& it2) {
-			return (it1.it == it2.it);
+			return (it1.index == it2.index);
 		}
 		friend bool operator!=(const iterator& it1, const iterator& it2) {
 			return !(it1 == it2);
 		}
-		iterator& operator++() { find_next_filled_bucket(); return *this; }
-		iterator operator++(int) { iterator cit = *this; find_next_filled_bucket(); return cit; }
-		PairType& operator*() { return *it; }
+		iterator& operator++() { index++; find_next_full_slot(); return *this; }
+		iterator operator++(int) { iterator cit = *this; index++; find_next_full_slot(); return cit; }
+		PairType& operator*() { return m->slots[index]; }
+		PairType *operator->() { return &m->slots[index]; }
 	};	
 	class const_iterator {
 		friend class HashMap<KeyType, ValueType>;
-		HashMap<KeyType, ValueType> *m;
-		size_type table_index;
-		typename ListType::const_iterator it;
-		const_iterator(const HashMap<KeyType, ValueType> *_m, const size_type _table_index, typename ListType::const_iterator _it) : m(const_cast<HashMap<KeyType, ValueType> *>(_m)), table_index(_table_index), it(_it) {}
-		
-		inline void find_next_filled_bucket() {
-			if (table_index < m->table_size) {
-				// Advance list iterator position
-				it++;
-				
-				// Check if the iterator points to a
-				// filled bucket, otherwise advance to
-				// the the next filled one
-				if (it == m->table[table_index].end()) {
-					while (++table_index < m->table_size) {
-						// Go to next bucket
-						it = m->table[table_index].begin();
-						// Check if the bucket has contents
-						if (it != m->table[table_index].end())
-							break;
-					}
-				}
-			} 
-		}
-		const_iterator& begin() { 
-			if (it == m->table[0].end()) 
-				find_next_filled_bucket();
-			return *this;
+		const HashMap<KeyType, ValueType> *m;
+		size_type index;
+		const_iterator(const HashMap<KeyType, ValueType> *_m, const size_type _index) : m(_m), index(_index) {}
+		inline void find_next_full_slot() {
+			while (index < m->num_slots && !isFull(m->ctrl[index]))
+				index++;
 		}
 	public:
-		const_iterator(const const_iterator& _it) : m(_it.m), table_index(_it.table_index), it(_it.it) {}
-		const_iterator(const iterator& _it) : m(_it.m), table_index(_it.table_index), it(_it.it) {}
-		const_iterator() : m(0), table_index(0), it() {}
+		const_iterator(const const_iterator& _it) : m(_it.m), index(_it.index) {}
+		const_iterator(const iterator& _it) : m(_it.m), index(_it.index) {}
+		const_iterator() : m(0), index(0) {}
 		friend bool operator==(const const_iterator& it1, const const_iterator& it2) {
-			return (it1.it == it2.it);
+			return (it1.index == it2.index);
 		}
 		friend bool operator!=(const const_iterator& it1, const const_iterator& it2) {
 			return !(it1 == it2);
 		}
-		const_iterator& operator++() { find_next_filled_bucket(); return *this; }
-		const_iterator operator++(int) { const_iterator cit = *this; find_next_filled_bucket(); return cit; }
-		const PairType& operator*() const { return *it; }
+		const_iterator& operator++() { index++; find_next_full_slot(); return *this; }
+		const_iterator operator++(int) { const_iterator cit = *this; index++; find_next_full_slot(); return cit; }
+		const PairType& operator*() const { return m->slots[index]; }
+		const PairType *operator->() const { return &m->slots[index]; }
 	};
-	iterator begin() { return iterator(this, 0, table[0].begin()).begin(); }
-	iterator end() {return iterator(this, table_size-1, table[table_size-1].end()); }
-	const_iterator begin() const { return const_iterator(this, 0, table[0].begin()).begin(); }
-	const_iterator end() const {return const_iterator(this, table_size-1, table[table_size-1].end()); }
+	iterator begin() { iterator it(this, 0); it.find_next_full_slot(); return it; }
+	iterator end() { return iterator(this, num_slots); }
+	const_iterator begin() const { const_iterator it(this, 0); it.find_next_full_slot(); return it; }
+	const_iterator end() const { return const_iterator(this, num_slots); }
 	size_type size() const { return _size; }
 	bool empty() const { return _size == 0; }
 	virtual iterator insert(const PairType& p) {
-		typename ListType::iterator it, it_insert;
-		const KeyType& k = p.first;
-
-		if (_size + 1 > table_size) {
-			grow();
+		if (num_buckets == 0) {
+			allocate(MIN_BUCKETS);
+		} else if ((_size + num_deleted + 1) * 4 > num_buckets * 3) {
+			// Grow if the table is full of elements, otherwise
+			// just clear out the deleted markers
+			rehash((_size + 1) * 2 > num_buckets ? num_buckets * 2 : num_buckets);
 		}
-
-		size_type index = getIndex(k);
-
-                // Handle conflicts.
-                it = table[index].begin();
-                it_insert = it;
-
-                while (it != table[index].end()) {
-                        // Find any occurence of the same key
-                        if (k == (*it).first) {
-                                // find the last occurence of this same key
-                                while (it != table[index].end() && k == (*it).first) {
-                                        it_insert = ++it;
-                                }
-                                break;
-			}
-                        it_insert = ++it;
-                }
-		_size++;
-
-		return iterator(this, index, table[index].insert(it_insert, p));
+		return iterator(this, insertNoGrow(p));
 	}
 	iterator find(const KeyType& k) {		
-		typename ListType::iterator it;
-		size_type index = getIndex(k);
-
-		for (it = table[index].begin(); it != table[index].end(); ++it) {
-			if (k == (*it).first) {
-				return iterator(this, index, it);
-			}
-		}
-		return end();
+		return iterator(this, findSlot(k));
 	}
 	const_iterator find(const KeyType& k) const {
-		typename ListType::const_iterator it;
-
-		size_type index = getIndex(k);
-			
-		for (it = table[index].begin(); it != table[index].end(); ++it) {
-			if (k == (*it).first) {
-				return const_iterator(this, index, it);
-				
-			}
-		}
-		return end();
+		return const_iterator(this, findSlot(k));
 	}
 	iterator lower_bound(const KeyType& k) {
 		return find(k);
@@ -403,52 +516,52 @@ public:
 	}
 		
 	void erase(iterator& pos) {
-		table[pos.table_index].erase(pos.it);
+		slots[pos.index].~PairType();
+		
+		// No probe continues past an empty slot, so there is no 
+		// need for a deleted marker before one
+		if (pos.index + 1 == num_slots || ctrl[pos.index + 1] == SLOT_EMPTY) {
+			ctrl[pos.index] = SLOT_EMPTY;
+		} else {
+			ctrl[pos.index] = SLOT_DELETED;
+			num_deleted++;
+		}
 		_size--;
 	}
 
 	size_type erase(const KeyType& k) {
-                KeyType key = k; 
-                ListType *l = &table[getIndex(key)];
-                typename ListType::iterator it = l->begin();
-                size_type n = 0;
+		iterator it = find(k);
+		size_type n = 0;
                 
-                while (it != l->end()) {
-                        if ((*it).first == key) {
-                                it = l->erase(it);
-                                _size--;
-                                n++;
-                        } else {
-                                it++;
-                        }
-                }
+		while (it != end() && k == (*it).first) {
+			iterator it_erase = it++;
+			erase(it_erase);
+			n++;
+		}
 
 		return n;
 	}
 	void clear() {
-		for (size_type i = 0; i < table_size; i++) {
-			table[i].clear();
+		for (size_type i = 0; i < num_slots; i++) {
+			if (isFull(ctrl[i]))
+				slots[i].~PairType();
+			ctrl[i] = SLOT_EMPTY;
 		}
-		_size = 0;
+		_size = num_deleted = 0;
 	}
-	HashMap(const HashMap<KeyType, ValueType>& m) : _size(m._size), table_size(m.table_size), table(new ListType[table_size]) {
-		for (size_type i = 0; i < table_size; i++) {
-			table[i] = m.table[i];
-		}
+	HashMap(const HashMap<KeyType, ValueType>& m) : _size(0), num_deleted(0), num_buckets(0), num_slots(0), ctrl(NULL), slots(NULL) {
+		copyFrom(m);
 	}
-	HashMap() : _size(0), table_size(ms_primes[0]), table(new ListType[table_size]) {}
-	virtual ~HashMap() { delete [] table; }
+	HashMap() : _size(0), num_deleted(0), num_buckets(0), num_slots(0), ctrl(NULL), slots(NULL) {}
+	virtual ~HashMap() { release(); }
 
 	HashMap<KeyType, ValueType>& operator=(const HashMap<KeyType, ValueType>& m) {
-		delete [] table;
-		table = NULL;
-		_size = m._size;
-		table_size = m.table_size;
-		table = new ListType[table_size];
+		if (this == &m)
+			return *this;
+		
+		release();
+		copyFrom(m);
 
-		for (size_type i = 0; i < table_size; i++) {
-			table[i] = m.table[i];
-		}
 		return *this;
 	}
 	friend bool operator==(const HashMap<KeyType, ValueType>& m1, const HashMap<KeyType, ValueType>& m2) {
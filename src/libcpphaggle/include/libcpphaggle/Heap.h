@@ -62,6 +62,11 @@ public:
         bool insert(HeapItem *item);
         HeapItem *extractFirst();
 	void pop_front();
+	/**
+	 Removes an item from anywhere in the heap. Returns false if the
+	 item is not in the heap.
+	 */
+	bool remove(HeapItem *item);
         HeapItem *front();
 	unsigned long size() const;
 private:
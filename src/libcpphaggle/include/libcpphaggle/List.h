@@ -29,6 +29,8 @@ namespace haggle {}
 
 #else
 
+#include "Pool.h"
+
 namespace haggle {
 
 /**
@@ -73,6 +75,9 @@ private:
 		TT obj;
 		container(const TT& _obj, list_head *_next = NULL) : list_head(_next ? _next->prev : NULL, _next), obj(_obj) {}
                 ~container() {}
+		// Containers come from a pool, to avoid a malloc per element
+		static void *operator new(size_t n) throw() { return Pool<POOL_SIZE(sizeof(container<TT>))>::alloc(n); }
+		static void operator delete(void *p, size_t n) { Pool<POOL_SIZE(sizeof(container<TT>))>::free(p, n); }
 	};
 
         // This size of the list.
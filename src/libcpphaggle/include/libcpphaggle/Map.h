@@ -36,6 +36,11 @@ namespace haggle {
 	This is a minimal implementation of a class that does the same thing as 
 	std::map. It is not a complete implementation of std::map, since the only 
 	things implemented are the ones needed in Haggle.
+
+	The entries are kept in a red-black tree, so that insert, find and
+	erase are O(log n). Entries never move once inserted, which means
+	that iterators and references to entries stay valid until the entry
+	itself is erased.
 */
 template <typename Key, typename Value>
 class BasicMap {
@@ -44,27 +49,56 @@ public:
 private:
 	typedef Pair<Key, Value> member;
 
-	member **the_map;
+	struct node {
+		member value;
+		node *parent, *left, *right;
+		bool red;
+		node(const member& _value) : value(_value), parent(NULL), left(NULL), right(NULL), red(true) {}
+	};
+	node *root;
         size_type number_of_entries;
-        size_type map_size;
-        static const size_type npos = -1; // the largest possible position
+
+	static node *minimum(node *n)
+	{
+		while (n->left)
+			n = n->left;
+		return n;
+	}
+	/**
+		Returns the node that follows n in key order, or NULL if n is
+		the last one.
+	*/
+	static node *successor(node *n)
+	{
+		if (n->right)
+			return minimum(n->right);
+
+		node *p = n->parent;
+
+		while (p && n == p->right) {
+			n = p;
+			p = p->parent;
+		}
+		return p;
+	}
 public:
 	class iterator {
 		friend class BasicMap<Key, Value>;
+		friend class BasicMap<Key, Value>::const_iterator;
 	private:
 		typedef member& reference;
 		typedef member* pointer;
 		
 		typedef BasicMap<Key, Value> map_type;
-		// Simply the index in the map array.
-		size_type i;
+		// The tree node of the entry, or NULL for end().
+		node *n;
 		// The map which this is an iterator for.
 		map_type *map;
 		
-		iterator(size_type _i, map_type *_map) : i(_i), map(_map) {}
+		iterator(node *_n, map_type *_map) : n(_n), map(_map) {}
 	public:
-		iterator(const iterator& _it) : i(_it.i), map(_it.map) {}
-		iterator() : i(0), map(NULL) {}
+		iterator(const iterator& _it) : n(_it.n), map(_it.map) {}
+		iterator() : n(NULL), map(NULL) {}
 		~iterator() {}
 		
 		/**
@@ -72,7 +106,7 @@ public:
 		*/
 		reference operator*()
 		{
-			return *(map->the_map[i]);
+			return n->value;
 		}
 		
 		/**
@@ -80,38 +114,32 @@ public:
 		*/
 		pointer operator->()
 		{
-			return map->the_map[i];
+			return &n->value;
 		}
 		
 		iterator &operator++()
 		{
-			if (i < npos) {
-				i++;
-				if (i >= map->number_of_entries)
-					i = npos;
-			}
+			if (n)
+				n = successor(n);
 			return *this;
 		}
 		
 		iterator operator++(int)
 		{
-			iterator it = iterator(i, map);
-			if (i < npos) {
-				i++;
-				if (i >= map->number_of_entries)
-					i = npos;
-			}
+			iterator it = iterator(n, map);
+			if (n)
+				n = successor(n);
 			return it;
 		}
 		
 		friend bool operator==(const iterator &i1, const iterator &i2)
 		{
-			return i1.i == i2.i && i1.map == i2.map;
+			return i1.n == i2.n && i1.map == i2.map;
 		}
 		
 		friend bool operator!=(const iterator &i1, const iterator &i2)
 		{
-			return i1.i != i2.i || i1.map != i2.map;
+			return i1.n != i2.n || i1.map != i2.map;
 		}
 	};
 	class const_iterator {
@@ -121,16 +149,16 @@ public:
 		typedef const member* pointer;
 		
 		typedef const BasicMap<Key, Value> map_type;
-		// Simply the index in the map array.
-		size_type i;
+		// The tree node of the entry, or NULL for end().
+		node *n;
 		// The map which this is an iterator for.
 		map_type *map;
 		
-		const_iterator(size_type _i, map_type *_map) : i(_i), map(_map) {}
+		const_iterator(node *_n, map_type *_map) : n(_n), map(_map) {}
 	public:
-		const_iterator(const const_iterator& _it) : i(_it.i), map(_it.map) {}
-		const_iterator(const iterator& _it) : i(_it.i), map(_it.map) {}
-		const_iterator() : i(0), map(NULL) {}
+		const_iterator(const const_iterator& _it) : n(_it.n), map(_it.map) {}
+		const_iterator(const iterator& _it) : n(_it.n), map(_it.map) {}
+		const_iterator() : n(NULL), map(NULL) {}
 		~const_iterator() {}
 		
 		/**
@@ -138,7 +166,7 @@ public:
 		 */
 		reference operator*()
 		{
-			return *(map->the_map[i]);
+			return n->value;
 		}
 		
 		/**
@@ -146,57 +174,45 @@ public:
 		 */
 		pointer operator->()
 		{
-			return map->the_map[i];
+			return &n->value;
 		}
 		
 		const_iterator &operator++()
 		{
-			if (i < npos) {
-				i++;
-				if (i >= map->number_of_entries)
-					i = npos;
-			}
+			if (n)
+				n = successor(n);
 			return *this;
 		}
 		
 		const_iterator operator++(int)
 		{
-			const_iterator it = const_iterator(i, map);
-			if (i < npos) {
-				i++;
-				if (i >= map->number_of_entries)
-					i = npos;
-			}
+			const_iterator it = const_iterator(n, map);
+			if (n)
+				n = successor(n);
 			return it;
 		}
 		
 		friend bool operator==(const const_iterator &i1, const const_iterator &i2)
 		{
-			return i1.i == i2.i && i1.map == i2.map;
+			return i1.n == i2.n && i1.map == i2.map;
 		}
 		
 		friend bool operator!=(const const_iterator &i1, const const_iterator &i2)
 		{
-			return i1.i != i2.i || i1.map != i2.map;
+			return i1.n != i2.n || i1.map != i2.map;
 		}
 	};
 	/**
 		Constructor.
 	*/
-	BasicMap() : the_map(NULL),
-		number_of_entries(0),
-                map_size(0)
+	BasicMap() : root(NULL), number_of_entries(0)
 	{
 		
 	}
 
-        BasicMap(const BasicMap<Key, Value>& m) : the_map(new member*[m.number_of_entries]), 
-                                        number_of_entries(m.number_of_entries), 
-                                        map_size(m.map_size)
+        BasicMap(const BasicMap<Key, Value>& m) : root(_copy(m.root, NULL)), 
+                                        number_of_entries(m.number_of_entries)
         {
-		for (size_type i = 0; i < number_of_entries; i++) {
-			the_map[i] = new member(*m.the_map[i]);
-		}
         }
 	
 	/**
@@ -222,15 +238,9 @@ public:
 	*/
 	void clear()
 	{
-                for (size_type i = 0; i < number_of_entries; i++)
-                        delete the_map[i];
-                
-		if (the_map)
-			delete [] the_map;
-
+		_destroy(root);
 		number_of_entries = 0;
-                map_size = 0;
-		the_map = NULL;
+		root = NULL;
 	}
 	
 	/**
@@ -238,15 +248,15 @@ public:
 	*/
 	iterator begin()
 	{
-		if (number_of_entries > 0)
-			return iterator(0, this);
+		if (root)
+			return iterator(minimum(root), this);
 		else
 			return end();
 	}
 	const_iterator begin() const 
 	{ 
-		if (number_of_entries > 0)
-			return const_iterator(0, this);
+		if (root)
+			return const_iterator(minimum(root), this);
 		else
 			return end();
 	}
@@ -256,112 +266,274 @@ public:
 	*/
 	iterator end()
 	{
-		return iterator(npos, this);
+		return iterator(NULL, this);
 	}
 	const_iterator end() const 
 	{ 
-		return const_iterator(npos, this);
+		return const_iterator(NULL, this);
 	}
 	
 private:
+	static node *_copy(const node *n, node *parent)
+	{
+		if (!n)
+			return NULL;
+
+		node *c = new node(n->value);
+
+		c->red = n->red;
+		c->parent = parent;
+		c->left = _copy(n->left, c);
+		c->right = _copy(n->right, c);
+
+		return c;
+	}
+	static void _destroy(node *n)
+	{
+		while (n) {
+			node *left = n->left;
+
+			_destroy(n->right);
+			delete n;
+			n = left;
+		}
+	}
 	/**
-		Figures out wether or not the given key is in the map.
-		
-		Returns: <pos,true> if the key is in the map, and pos
-                indicates the position. If the key is not in the map, the function
-                returns <before,false> and before indicates the position the
-                element should be inserted at.
-			
+		Returns the first node with the given key, or NULL if the
+		key is not in the map.
 	*/
-	Pair<size_type, bool> _find(const Key& k,
-                                   size_type left_min, 
-                                   size_type right_max,
-                                   size_type before,
-                                   bool find_first = false) const
+	node *_find(const Key& k) const
 	{
-		size_type pos, left_max, right_min;
-		
-		// Dummy check:
-		if (right_max == npos || left_min > right_max) {
-			return make_pair(before, false);
-		}
-		// Find the middle:
-		pos = (right_max - left_min + 1)/2 + left_min;
+		node *n = root, *res = NULL;
 
-		// Find the end points of the left and right hand side:
-		left_max = pos-1;
-		right_min = pos+1;
-		
-		// current key < searched for key?
-		if (the_map[pos]->first < k) {
-			// The key would be in the right hand side:
-			return _find(k, right_min, right_max, right_min, find_first);
-		}
-		// searched for key < current key?
-		if (k < the_map[pos]->first) {
-			// The key would be in the left hand side:
-			return _find(k, left_min, left_max, pos, find_first);
+		while (n) {
+			if (n->value.first < k) {
+				n = n->right;
+			} else {
+				res = n;
+				n = n->left;
+			}
 		}
-                
-                if (find_first) {
-                        // We are not inserting, only finding pos for
-                        // iteration. We should always return to
-                        // first pos of key 'k' so we backtrack to the
-                        // first position
-                        while (pos > 0 && the_map[pos-1]->first == k) {
-                                pos--;
-                        }
-                }
-		// Found exact match:
-		return make_pair(pos, true);
+		if (res && k < res->value.first)
+			return NULL;
+
+		return res;
+	}
+	void _rotate_left(node *x)
+	{
+		node *y = x->right;
+
+		x->right = y->left;
+
+		if (y->left)
+			y->left->parent = x;
+
+		_replace(x, y);
+		y->left = x;
+		x->parent = y;
+	}
+	void _rotate_right(node *x)
+	{
+		node *y = x->left;
+
+		x->left = y->right;
+
+		if (y->right)
+			y->right->parent = x;
+
+		_replace(x, y);
+		y->right = x;
+		x->parent = y;
 	}
-	Pair<size_type, bool> _find(const Key& k, bool find_first = false) const
+	/**
+		Puts v in the place of u in u's parent.
+	*/
+	void _replace(node *u, node *v)
 	{
-		return _find(k, 0, number_of_entries-1, 0, find_first);
+		if (!u->parent)
+			root = v;
+		else if (u == u->parent->left)
+			u->parent->left = v;
+		else
+			u->parent->right = v;
+
+		if (v)
+			v->parent = u->parent;
 	}
 	/**
-	 Inserts a key-value pair into the map, and returns an
-	 iterator pointing to the position where the value pair
-	 was inserted.
+	 Inserts a key-value pair into the map after any entries with
+	 the same key, and returns an iterator pointing to the new entry.
 	 */
-	iterator _insert(iterator pos, const member& x)
+	iterator _insert(const member& x)
 	{
-		member **new_map;
-		size_type i;
-		
-                // If the map already has allocated space, just make room and insert.
-                if (map_size > number_of_entries) {
-                        
-                        for (i = number_of_entries; i > pos.i; i--)
-                                the_map[i] = the_map[i-1];
-                        
-                        the_map[pos.i] = new member(x.first, x.second);
-                        number_of_entries++;
-                        return pos;
-                }
-                new_map = new member*[number_of_entries + 1];
-                
-		if (new_map == NULL)
-                        return end();
-		
-		for (i = 0; i < pos.i; i++) {
-			new_map[i] = the_map[i];
-		}
-		
-		new_map[pos.i] = new member(x.first, x.second);
-		
-                for (i = pos.i+1; i < number_of_entries + 1; i++) {
-			new_map[i] = the_map[i-1];
+		node *parent = NULL, *n = root, *z;
+		bool left = false;
+
+		while (n) {
+			parent = n;
+			left = x.first < n->value.first;
+			n = left ? n->left : n->right;
 		}
-		
-		if (the_map)
-			delete [] the_map;
 
-		the_map = new_map;
+		z = new node(x);
+		z->parent = parent;
+
+		if (!parent)
+			root = z;
+		else if (left)
+			parent->left = z;
+		else
+			parent->right = z;
+
 		number_of_entries++;
-		map_size++;
-		
-		return pos;
+
+		// Restore the red-black properties
+		n = z;
+
+		while (n->parent && n->parent->red) {
+			node *gp = n->parent->parent;
+
+			if (n->parent == gp->left) {
+				node *uncle = gp->right;
+
+				if (uncle && uncle->red) {
+					n->parent->red = false;
+					uncle->red = false;
+					gp->red = true;
+					n = gp;
+				} else {
+					if (n == n->parent->right) {
+						n = n->parent;
+						_rotate_left(n);
+					}
+					n->parent->red = false;
+					gp->red = true;
+					_rotate_right(gp);
+				}
+			} else {
+				node *uncle = gp->left;
+
+				if (uncle && uncle->red) {
+					n->parent->red = false;
+					uncle->red = false;
+					gp->red = true;
+					n = gp;
+				} else {
+					if (n == n->parent->left) {
+						n = n->parent;
+						_rotate_right(n);
+					}
+					n->parent->red = false;
+					gp->red = true;
+					_rotate_left(gp);
+				}
+			}
+		}
+		root->red = false;
+
+		return iterator(z, this);
+	}
+	/**
+	 Unlinks a node from the tree and deletes it. Other nodes are
+	 relinked rather than having their entries moved, so iterators to
+	 them stay valid.
+	 */
+	void _erase(node *z)
+	{
+		node *x, *x_parent;
+		bool removed_red = z->red;
+
+		if (!z->left) {
+			x = z->right;
+			x_parent = z->parent;
+			_replace(z, x);
+		} else if (!z->right) {
+			x = z->left;
+			x_parent = z->parent;
+			_replace(z, x);
+		} else {
+			node *y = minimum(z->right);
+
+			removed_red = y->red;
+			x = y->right;
+
+			if (y->parent == z) {
+				x_parent = y;
+			} else {
+				x_parent = y->parent;
+				_replace(y, x);
+				y->right = z->right;
+				y->right->parent = y;
+			}
+			_replace(z, y);
+			y->left = z->left;
+			y->left->parent = y;
+			y->red = z->red;
+		}
+		delete z;
+		number_of_entries--;
+
+		if (removed_red)
+			return;
+
+		// Restore the red-black properties
+		while (x != root && (!x || !x->red)) {
+			if (x == x_parent->left) {
+				node *w = x_parent->right;
+
+				if (w->red) {
+					w->red = false;
+					x_parent->red = true;
+					_rotate_left(x_parent);
+					w = x_parent->right;
+				}
+				if ((!w->left || !w->left->red) && (!w->right || !w->right->red)) {
+					w->red = true;
+					x = x_parent;
+					x_parent = x->parent;
+				} else {
+					if (!w->right || !w->right->red) {
+						w->left->red = false;
+						w->red = true;
+						_rotate_right(w);
+						w = x_parent->right;
+					}
+					w->red = x_parent->red;
+					x_parent->red = false;
+					w->right->red = false;
+					_rotate_left(x_parent);
+					x = root;
+				}
+			} else {
+				node *w = x_parent->left;
+
+				if (w->red) {
+					w->red = false;
+					x_parent->red = true;
+					_rotate_right(x_parent);
+					w = x_parent->left;
+				}
+				if ((!w->left || !w->left->red) && (!w->right || !w->right->red)) {
+					w->red = true;
+					x = x_parent;
+					x_parent = x->parent;
+				} else {
+					if (!w->left || !w->left->red) {
+						w->right->red = false;
+						w->red = true;
+						_rotate_left(w);
+						w = x_parent->left;
+					}
+					w->red = x_parent->red;
+					x_parent->red = false;
+					w->left->red = false;
+					_rotate_right(x_parent);
+					x = root;
+				}
+			}
+		}
+		if (x)
+			x->red = false;
 	}
 		
 public:
@@ -373,25 +545,11 @@ public:
 	 */
 	iterator find(const Key& k)
 	{
-		Pair<size_type, bool> tmp;
-		
-		tmp = _find(k, true);
-		
-		if (tmp.second)
-			return iterator(tmp.first, this);
-		else
-			return end();
+		return iterator(_find(k), this);
 	}
 	const_iterator find(const Key& k) const
 	{
-		Pair<size_type, bool> tmp;
-		
-		tmp = _find(k, true);
-		
-		if (tmp.second)
-			return const_iterator(tmp.first, this);
-		else
-			return end();
+		return const_iterator(_find(k), this);
 	}
 	
 	iterator lower_bound(const Key& k) 
@@ -448,46 +606,38 @@ public:
 		return make_pair(it_low, it_high);
 	}
 	
+	/*
+		The position hint is not needed to insert into the tree in 
+		O(log n), and is ignored.
+	*/
 	iterator insert_unique(iterator pos, const member& x)
 	{
-		// If there is already an entry at pos with the given key, 
-                // return the entry and indicate that there was no insertion.
-                if (pos.i < number_of_entries && the_map[pos.i]->first == x.first)
-                        return pos;
-		
-		return _insert(pos, x);
+		return insert_unique(x).first;
 	}
 	iterator insert(iterator pos, const member& x)
 	{
-		return _insert(pos, x);
+		return _insert(x);
 	}
 	iterator insert(const member& x) 
 	{
-                Pair<size_type, bool> tmp = _find(x.first, true);
-		return _insert(iterator(tmp.first, this), x);
+		return _insert(x);
 	}
 	Pair<iterator, bool> insert_unique(const member& x)
 	{
-                Pair<size_type, bool> tmp = _find(x.first);
+                node *n = _find(x.first);
 		
-		if (tmp.second)
-			return make_pair(iterator(tmp.first, this), false);
+		if (n)
+			return make_pair(iterator(n, this), false);
 		else
-			return make_pair(_insert(iterator(tmp.first, this), x), true);
+			return make_pair(_insert(x), true);
         }
 	
         void erase(iterator pos)
         {
-                if (pos.i >= number_of_entries)
+                if (!pos.n)
                         return;
                  
-                delete the_map[pos.i];
-
-                for (size_type i = pos.i + 1; i < number_of_entries; i++) {
-			the_map[i-1] = the_map[i];
-		}
-
-		number_of_entries--;
+                _erase(pos.n);
         }
         size_type erase(const Key& k)
         {
@@ -512,12 +662,12 @@ public:
 	*/
 	Value &operator[](const Key& k)
 	{
-		Pair<size_type, bool> tmp = _find(k);
+		node *n = _find(k);
 		              
-		if (tmp.second)
-			return the_map[tmp.first]->second;
+		if (n)
+			return n->value.second;
 		else
-			return (*insert_unique(iterator(tmp.first, this), make_pair(k, Value()))).second;
+			return (*_insert(make_pair(k, Value()))).second;
 	}
         
         BasicMap<Key, Value>& operator=(const BasicMap<Key, Value>& m) {
@@ -525,13 +675,9 @@ public:
                         return *this;
 
                 clear();
-		map_size = m.map_size;
+		root = _copy(m.root, NULL);
 		number_of_entries = m.number_of_entries;
-		the_map = new member*[number_of_entries];
 
-		for (size_type i = 0; i < number_of_entries; i++) {
-			the_map[i] = new member(*m.the_map[i]);
-		}
 		return *this;
 	}
         
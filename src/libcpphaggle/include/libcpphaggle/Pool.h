@@ -0,0 +1,413 @@
+/* Copyright 2008-2009 Uppsala University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef __POOL_H_
+#define __POOL_H_
+
+#include <stdlib.h>
+
+#include "Platform.h"
+#include "Atomic.h"
+
+#if !defined(OS_WINDOWS)
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+/*
+	Thread local storage for the per-thread caches of free blocks.
+	Without it, all threads share one locked list. A thread's cache is
+	returned to the pool by a pthread key destructor when the thread
+	exits, so the caches are only used with pthreads.
+*/
+#if defined(OS_WINDOWS) || defined(OS_MACOSX)
+#undef POOL_THREAD_LOCAL
+#else
+#define POOL_THREAD_LOCAL __thread
+#endif
+
+/*
+	Gives up the processor while waiting for the pool lock, since the
+	thread that holds it may have been preempted.
+*/
+#if defined(OS_WINDOWS)
+#define POOL_YIELD() Sleep(0)
+#else
+#define POOL_YIELD() sched_yield()
+#endif
+
+/*
+	The block size of the pool to use for an object of size s. Sizes
+	are rounded up, so that objects of similar size share a pool.
+*/
+#define POOL_SIZE(s) (((s) + 15) & ~((size_t)15))
+
+namespace haggle {
+
+/**
+	The number of slabs all pools have allocated with malloc.
+*/
+inline atomic_t& poolSlabCount()
+{
+	static atomic_t count = 0;
+	return count;
+}
+
+/**
+	A pool of fixed size memory blocks, for small objects that are
+	allocated and freed at high rates, such as list nodes and events.
+
+	Each thread keeps a cache of free blocks that it allocates from and
+	frees to without locking. When the cache is empty, the thread takes
+	a batch of blocks from a depot shared by all threads, and when the
+	cache has grown too large, it returns a batch to the depot. This
+	keeps blocks flowing from threads that mostly free to threads that
+	mostly allocate. The depot gets new blocks from malloc, a slab of
+	blocks at a time.
+
+	Blocks are never returned to malloc. The blocks cached by a thread
+	go back to the depot when the thread exits.
+
+	Classes use the pool by defining their own operator new and delete:
+
+	static void *operator new(size_t n) throw() { return Pool<POOL_SIZE(sizeof(C))>::alloc(n); }
+	static void operator delete(void *p, size_t n) { Pool<POOL_SIZE(sizeof(C))>::free(p, n); }
+*/
+template<size_t Size>
+class Pool {
+	union block {
+		block *next;
+		char data[Size];
+		// Make sure blocks are aligned for any member type
+		double align_d;
+		long long align_ll;
+		void *align_p;
+	};
+	enum {
+		BATCH_SIZE = 32,
+		MAX_CACHE_SIZE = 2 * BATCH_SIZE,
+	};
+	static atomic_t lock;
+	static block *depot;
+	// Counts of the whole pool, protected by the lock
+	static unsigned long depot_size;
+	static unsigned long num_slabs;
+	static unsigned long num_allocs;
+	static unsigned long num_frees;
+#if defined(POOL_THREAD_LOCAL)
+	static POOL_THREAD_LOCAL block *cache;
+	static POOL_THREAD_LOCAL unsigned long cache_size;
+	// Allocations and frees from the cache that are not yet added to
+	// the counts of the pool
+	static POOL_THREAD_LOCAL unsigned long cache_allocs;
+	static POOL_THREAD_LOCAL unsigned long cache_frees;
+	// Whether the thread exit destructor is set for this thread
+	static POOL_THREAD_LOCAL bool cache_registered;
+	static pthread_once_t key_once;
+	static pthread_key_t key;
+	static void createKey()
+	{
+		pthread_key_create(&key, threadExit);
+	}
+	static void threadExit(void *)
+	{
+		flush();
+	}
+	/**
+		Makes sure the cache is flushed when the thread exits.
+	*/
+	static void registerThread()
+	{
+		pthread_once(&key_once, createKey);
+		// The destructor is only called for a non-NULL value
+		pthread_setspecific(key, &key);
+		cache_registered = true;
+	}
+	/**
+		Adds the counts of the cache to those of the pool. Called with
+		the lock held.
+	*/
+	static void addCounts()
+	{
+		num_allocs += cache_allocs;
+		num_frees += cache_frees;
+		cache_allocs = 0;
+		cache_frees = 0;
+	}
+#else
+	static block *cache;
+	static unsigned long cache_size;
+#endif
+	static void spinLock()
+	{
+		while (!atomic_cas(&lock, 0, 1))
+			POOL_YIELD();
+	}
+	static void spinUnlock()
+	{
+		atomic_dec(&lock);
+	}
+	/**
+		Moves blocks from the depot, or a new slab, to the cache.
+	*/
+	static void refill()
+	{
+#if defined(POOL_THREAD_LOCAL)
+		if (!cache_registered)
+			registerThread();
+
+		spinLock();
+		addCounts();
+#endif
+		while (depot && cache_size < BATCH_SIZE) {
+			block *b = depot;
+			depot = b->next;
+			depot_size--;
+			b->next = cache;
+			cache = b;
+			cache_size++;
+		}
+#if defined(POOL_THREAD_LOCAL)
+		spinUnlock();
+#endif
+		if (cache)
+			return;
+
+		block *slab = static_cast<block *>(malloc(BATCH_SIZE * sizeof(block)));
+
+		if (!slab)
+			return;
+
+		atomic_inc(&poolSlabCount());
+
+#if defined(POOL_THREAD_LOCAL)
+		spinLock();
+		num_slabs++;
+		spinUnlock();
+#else
+		num_slabs++;
+#endif
+
+		for (unsigned long i = 0; i < BATCH_SIZE; i++) {
+			slab[i].next = cache;
+			cache = &slab[i];
+		}
+		cache_size = BATCH_SIZE;
+	}
+#if defined(POOL_THREAD_LOCAL)
+	/**
+		Moves a batch of blocks from the cache to the depot.
+	*/
+	static void drain()
+	{
+		spinLock();
+		addCounts();
+
+		while (cache_size > BATCH_SIZE) {
+			block *b = cache;
+			cache = b->next;
+			b->next = depot;
+			depot = b;
+			depot_size++;
+			cache_size--;
+		}
+		spinUnlock();
+	}
+#endif
+public:
+	/**
+		Returns a block of Size bytes, or NULL if out of memory. Other
+		sizes, e.g., from subclasses, are passed on to malloc.
+	*/
+	static void *alloc(size_t n)
+	{
+		if (n > Size)
+			return malloc(n);
+#if !defined(POOL_THREAD_LOCAL)
+		spinLock();
+#endif
+		if (!cache)
+			refill();
+
+		block *b = cache;
+
+		if (b) {
+			cache = b->next;
+			cache_size--;
+#if defined(POOL_THREAD_LOCAL)
+			cache_allocs++;
+#else
+			num_allocs++;
+#endif
+		}
+#if !defined(POOL_THREAD_LOCAL)
+		spinUnlock();
+#endif
+		return b;
+	}
+	/**
+		Returns a block to the pool. The size must be the one the
+		block was allocated with.
+	*/
+	static void free(void *p, size_t n)
+	{
+		if (!p)
+			return;
+
+		if (n > Size) {
+			::free(p);
+			return;
+		}
+		block *b = static_cast<block *>(p);
+#if defined(POOL_THREAD_LOCAL)
+		if (!cache_registered)
+			registerThread();
+
+		b->next = cache;
+		cache = b;
+		cache_size++;
+		cache_frees++;
+
+		if (cache_size > MAX_CACHE_SIZE)
+			drain();
+#else
+		spinLock();
+		b->next = cache;
+		cache = b;
+		cache_size++;
+		num_frees++;
+		spinUnlock();
+#endif
+	}
+	/**
+		Returns the blocks cached by the calling thread to the depot,
+		and adds its counts to those of the pool. This is done when the
+		thread exits.
+	*/
+	static void flush()
+	{
+#if defined(POOL_THREAD_LOCAL)
+		spinLock();
+		addCounts();
+
+		while (cache) {
+			block *b = cache;
+			cache = b->next;
+			b->next = depot;
+			depot = b;
+			depot_size++;
+		}
+		cache_size = 0;
+		spinUnlock();
+		// Register again if the thread uses the pool after this,
+		// e.g., in another thread exit destructor
+		cache_registered = false;
+#endif
+	}
+	/**
+		The number of blocks that have been allocated from, and freed
+		to, the pool. The counts of the threads that are running are
+		added when they exchange blocks with the depot, or call flush().
+	*/
+	static unsigned long numAllocs()
+	{
+		spinLock();
+		unsigned long n = num_allocs;
+		spinUnlock();
+		return n;
+	}
+	static unsigned long numFrees()
+	{
+		spinLock();
+		unsigned long n = num_frees;
+		spinUnlock();
+		return n;
+	}
+	/**
+		The number of blocks the pool has got from malloc, and the
+		number of them that are free, not counting the blocks cached by
+		running threads. When no blocks are in use, and the threads
+		that used them have exited or called flush(), the two are
+		equal.
+	*/
+	static unsigned long numBlocks()
+	{
+		spinLock();
+		unsigned long n = num_slabs * BATCH_SIZE;
+		spinUnlock();
+		return n;
+	}
+	static unsigned long numFreeBlocks()
+	{
+		spinLock();
+#if defined(POOL_THREAD_LOCAL)
+		unsigned long n = depot_size;
+#else
+		unsigned long n = depot_size + cache_size;
+#endif
+		spinUnlock();
+		return n;
+	}
+};
+
+template<size_t Size>
+atomic_t Pool<Size>::lock = 0;
+
+template<size_t Size>
+typename Pool<Size>::block *Pool<Size>::depot = NULL;
+
+template<size_t Size>
+unsigned long Pool<Size>::depot_size = 0;
+
+template<size_t Size>
+unsigned long Pool<Size>::num_slabs = 0;
+
+template<size_t Size>
+unsigned long Pool<Size>::num_allocs = 0;
+
+template<size_t Size>
+unsigned long Pool<Size>::num_frees = 0;
+
+#if defined(POOL_THREAD_LOCAL)
+template<size_t Size>
+POOL_THREAD_LOCAL typename Pool<Size>::block *Pool<Size>::cache = NULL;
+
+template<size_t Size>
+POOL_THREAD_LOCAL unsigned long Pool<Size>::cache_size = 0;
+
+template<size_t Size>
+POOL_THREAD_LOCAL unsigned long Pool<Size>::cache_allocs = 0;
+
+template<size_t Size>
+POOL_THREAD_LOCAL unsigned long Pool<Size>::cache_frees = 0;
+
+template<size_t Size>
+POOL_THREAD_LOCAL bool Pool<Size>::cache_registered = false;
+
+template<size_t Size>
+pthread_once_t Pool<Size>::key_once = PTHREAD_ONCE_INIT;
+
+template<size_t Size>
+pthread_key_t Pool<Size>::key;
+#else
+template<size_t Size>
+typename Pool<Size>::block *Pool<Size>::cache = NULL;
+
+template<size_t Size>
+unsigned long Pool<Size>::cache_size = 0;
+#endif
+
+}; // namespace haggle
+
+#endif /* __POOL_H_ */
@@ -0,0 +1,147 @@
+/* Copyright 2009 Uppsala University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+#ifndef __RWMUTEX_H_
+#define __RWMUTEX_H_
+
+#include "Platform.h"
+#include "Mutex.h"
+#include "Atomic.h"
+#include "Timeval.h"
+
+/*
+	Windows XP and Windows Mobile have no reader-writer locks, and neither
+	has the Android C library, so there readers take the lock exclusively.
+*/
+#if defined(HAS_PTHREADS) && !defined(OS_ANDROID)
+#define HAS_PTHREAD_RWLOCK
+#endif
+
+/*
+	The GNU C library lets readers in ahead of waiting writers by default,
+	so that a steady stream of readers can keep a writer out. There the
+	lock is made to prefer writers. A thread may then not lock the mutex
+	for reading again while it holds it.
+*/
+#if defined(HAS_PTHREAD_RWLOCK) && defined(__GLIBC__) && defined(__USE_GNU)
+#define HAS_PTHREAD_RWLOCK_PREFER_WRITER
+#endif
+
+namespace haggle {
+/**
+    Reader-writer mutex. Any number of threads can hold the mutex for
+    reading at the same time, while a thread that holds it for writing
+    holds it alone. Where the platform allows it, a thread that waits to
+    lock the mutex for writing goes ahead of threads that later try to
+    lock it for reading.
+
+    The mutex keeps count of how many times it was taken, and how long
+    threads waited for it when it was not free.
+*/
+class RWMutex
+{
+private:
+#if defined(HAS_PTHREAD_RWLOCK)
+        pthread_rwlock_t rwlock;
+#else
+        Mutex mutex;
+#endif
+	atomic_t reads;
+	atomic_t writes;
+	// Protects the wait statistics below
+	Mutex statsMutex;
+	unsigned long read_waits;
+	unsigned long write_waits;
+	Timeval read_wait_time;
+	Timeval write_wait_time;
+	void waited(const Timeval& start, bool write);
+public:
+        /**
+	   Locks the mutex for reading.
+
+	   Returns true iff the lock was aquired.
+        */
+        bool readLock();
+        /**
+	   Locks the mutex for writing.
+
+	   Returns true iff the lock was aquired.
+        */
+        bool writeLock();
+        /**
+	   Tries to lock the mutex for reading.
+
+	   Returns true iff the lock was aquired.
+        */
+        bool tryReadLock();
+        /**
+	   Tries to lock the mutex for writing.
+
+	   Returns true iff the lock was aquired.
+        */
+        bool tryWriteLock();
+        /**
+	   Unlocks the mutex, whether it was locked for reading or
+	   writing. Returns true.
+        */
+        bool unlock();
+	/**
+	   Returns the number of times the mutex was locked for reading
+	   and writing.
+	*/
+	unsigned long getReads() const { return (unsigned long)reads; }
+	unsigned long getWrites() const { return (unsigned long)writes; }
+	/**
+	   Returns the number of times a thread had to wait to lock the
+	   mutex for reading and writing, and the total time waited.
+	*/
+	unsigned long getReadWaits();
+	unsigned long getWriteWaits();
+	Timeval getReadWaitTime();
+	Timeval getWriteWaitTime();
+        /**
+	   Constructor
+        */
+        RWMutex();
+        /**
+	   Destructor
+        */
+        ~RWMutex();
+
+	/**
+	   The ReadLocker and WriteLocker classes lock and unlock a
+	   reader-writer mutex within the context of a function, like
+	   Mutex::AutoLocker.
+	 */
+	class ReadLocker {
+	private:
+		RWMutex *m;
+	public:
+		inline ReadLocker(RWMutex& _m) : m(&_m) { m->readLock(); }
+		inline ReadLocker(RWMutex *_m) : m(_m) { m->readLock(); }
+		inline ~ReadLocker() { m->unlock(); }
+	};
+	class WriteLocker {
+	private:
+		RWMutex *m;
+	public:
+		inline WriteLocker(RWMutex& _m) : m(&_m) { m->writeLock(); }
+		inline WriteLocker(RWMutex *_m) : m(_m) { m->writeLock(); }
+		inline ~WriteLocker() { m->unlock(); }
+	};
+};
+
+}; // namespace haggle
+
+#endif /* __RWMUTEX_H_ */
@@ -19,6 +19,7 @@
 #include "Pair.h"
 #include "List.h"
 #include "Mutex.h"
+#include "Atomic.h"
 #include "HashMap.h"
 #include "String.h"
 
@@ -35,17 +36,84 @@
 
 namespace haggle {
 	
+class RefCounter;
+
+/**
+ Classes can opt in to intrusive reference counting by inheriting from
+ this class. The object then keeps a pointer to its own reference counter,
+ so that a reference created from a plain pointer finds the counter
+ without looking it up in the global store of refcounted objects.
+ */
+class RefCounted {
+	friend class RefCounter;
+	RefCounter * volatile refCounter;
+protected:
+	RefCounted() : refCounter(NULL) {}
+	/**
+	 A copy is a new object, which gets a reference counter of its own.
+	 */
+	RefCounted(const RefCounted &) : refCounter(NULL) {}
+	RefCounted& operator=(const RefCounted &) { return *this; }
+	~RefCounted() {}
+};
+
+/**
+ Tells whether objects of type T are refcounted through their RefCounted
+ base, or through the global store of refcounted objects.
+
+ The answer is fixed by the definition of T, which therefore has to be
+ complete wherever a reference to a T is created from a pointer. If it
+ was not, an incomplete T would be taken to not inherit from RefCounted,
+ and an object could get two reference counters, and be deleted twice.
+ The array below does not compile for an incomplete T.
+ */
+template<typename T>
+class RefCountTraits {
+	typedef char Intrusive;
+	typedef struct { char c[2]; } External;
+	static Intrusive test(const RefCounted *);
+	static External test(...);
+	typedef char complete_type_required[sizeof(T) > 0 ? 1 : -1];
+public:
+	enum { intrusive = sizeof(test(static_cast<const T *>(0))) == sizeof(Intrusive) };
+	/**
+	 Returns the object as a RefCounted if T inherits from RefCounted,
+	 and NULL otherwise.
+	 */
+	static RefCounted *toRefCounted(T *obj);
+};
+
+template<bool intrusive>
+struct RefCountedCast {
+	template<typename T>
+	static RefCounted *cast(T *obj) { return obj; }
+};
+
+template<>
+struct RefCountedCast<false> {
+	template<typename T>
+	static RefCounted *cast(T *) { return NULL; }
+};
+
+template<typename T>
+inline RefCounted *RefCountTraits<T>::toRefCounted(T *obj)
+{
+	// Instantiates the class, and so checks that T is complete
+	return RefCountedCast<RefCountTraits<T>::intrusive != 0>::cast(obj);
+}
+
 /**
  This class is for keeping a reference count to the object being 
  referenced. It is allocated on the heap, so that there is only one 
- reference count and one mutex to protect that reference count.
+ reference count per object.
  */
 class RefCounter {
 	typedef Pair<void *, RefCounter *> RefcountPair;
 	typedef HashMap<void *, RefCounter *> RefcountMap;
 	/**
 	 This is a store of objects that have already been refcounted. It is 
-	 used to ensure that objects have only one reference counter.
+	 used to ensure that objects have only one reference counter. Objects
+	 that inherit from RefCounted are not in the store.
 	 */
 	static RefcountMap objects;
 	
@@ -58,21 +126,29 @@ class RefCounter {
 	 The total number of such object having been refcounted.
 	 Used for debugging purposes.
 	*/
-	static unsigned long totNum;
+	static atomic_t totNum;
 	/**
-	 The mutex protecting the reference count
+	 The reference count. This will start at 1, and when it reaches 0, 
+	 the object will be deleted. It is only modified with atomic 
+	 operations.
 	 */
-	Mutex countMutex;
+	atomic_t refcount;
 	/**
-	 The reference count. This will start at 1, and when it reaches 0, 
-	 the object will be deleted.
+	 The object as a RefCounted, or NULL if the object is in the store.
 	 */
-	unsigned long refcount;
+	RefCounted *intrusive;
+#if defined(DEBUG) && defined(DEBUG_REFERENCE)
+	/**
+	 The number of times any object has been locked through a 
+	 reference. Used for debugging purposes.
+	 */
+	static atomic_t totLocks;
+#endif
 	
 	/**
 	 Constructor.
 	 */
-	RefCounter(void *_obj);
+	RefCounter(void *_obj, RefCounted *_intrusive);
 public:
 	
 	/**
@@ -84,6 +160,13 @@ public:
 	 The object being refcounted.
 	 */
 	void *obj;
+
+	/**
+	 Set when the object will no longer be modified, after which
+	 read-only access does not have to lock the object. It is
+	 never cleared.
+	 */
+	volatile bool frozen;
 	
 	/**
 	 An identifying integer for the object being pointed to.
@@ -91,7 +174,12 @@ public:
 	 */
 	const unsigned long identifier;
 	
-	static RefCounter *create(void *_obj);
+	/**
+	 Returns the reference counter of the object, with the count 
+	 increased, or a new counter if the object has none.
+	 */
+	static RefCounter *create(void *_obj, RefCounted *_intrusive = NULL);
+
 	/**
 	 Destructor.
 	 */
@@ -100,14 +188,12 @@ public:
 	template<typename T>
 	T *object() { return static_cast<T *>(obj); }
 	/**
-	 This function increases the reference count atomically.
+	 This function increases the reference count atomically, unless
+	 the count has already reached zero.
 	 */
 	unsigned long inc_count()
 	{
-		Mutex::AutoLocker l(countMutex);
-		if (refcount == 0)
-			return 0;
-		return ++refcount;
+		return (unsigned long)atomic_inc_not_zero(&refcount);
 	}
 	
 	/**
@@ -116,27 +202,24 @@ public:
 	template<typename T>
 	unsigned long dec_count()
 	{
-		unsigned long ret;
-		countMutex.lock();
+		long ret = atomic_dec(&refcount);
 
-		if (refcount == 0) {
-			countMutex.unlock();
+		if (ret < 0) {
+			// The object was already deleted
 			return 0;
 		}
-
-		ret = --refcount;
-
-		countMutex.unlock();
-
-		if (ret == 0) {	
-			objectsMutex.lock();
-			objects.erase(obj);
+		if (ret == 0) {
 			T * tmp_obj = static_cast<T *>(obj);
-			objectsMutex.unlock();			
+
+			if (!intrusive) {
+				objectsMutex.lock();
+				objects.erase(obj);
+				objectsMutex.unlock();
+			}
 			delete this;
 			delete tmp_obj;
 		} 
-		return ret;
+		return (unsigned long)ret;
 	}
 	
 	/**
@@ -144,8 +227,12 @@ public:
 	 */
 	unsigned long count()
 	{
-		return refcount;
+		return (unsigned long)refcount;
 	}
+#if defined(DEBUG) && defined(DEBUG_REFERENCE)
+	static void countLock() { atomic_inc(&totLocks); }
+	static unsigned long numLocks() { return (unsigned long)totLocks; }
+#endif
 };
 	
 /**
@@ -189,7 +276,15 @@ class Reference {
                    as it is, that means at the end of the sequence point where the 
                    object's member function was called.
 		*/
-		LockProxy(T *_obj, RecursiveMutex *_m) : obj(_obj), m(_m) { if (m) m->lock(); }
+		LockProxy(T *_obj, RecursiveMutex *_m) : obj(_obj), m(_m) 
+		{ 
+			if (m) {
+#if defined(DEBUG) && defined(DEBUG_REFERENCE)
+				RefCounter::countLock();
+#endif
+				m->lock(); 
+			}
+		}
 		/**
                    Destructor. Releases the hold on the object's access mutex.
 		*/
@@ -252,6 +347,29 @@ private:
 		return false;
 	}
 	
+	/**
+           Marks the referenced object as immutable. After this, member 
+           functions called through a const reference do not lock the 
+           object, so readers no longer exclude writers.
+
+           Freezing is a one-way transition, for all references to the 
+           object. It must therefore happen after the last modification 
+           of the object, except for members that are themselves read and 
+           written atomically.
+	*/
+	void freeze() const { if (refCount) refCount->frozen = true; }
+	
+	/**
+           Returns true iff the referenced object is frozen.
+	*/
+	bool isFrozen() const { return refCount ? refCount->frozen : false; }
+	
+	/**
+           Returns this reference as const, for read-only access to the 
+           object that does not lock it when it is frozen.
+	*/
+	const Reference<T>& constRef() const { return *this; }
+	
 	/**
            Returns the current reference count of the object referenced.
 	*/
@@ -265,7 +383,8 @@ private:
 	/**
            Constructor
 	*/
-	Reference(const T *obj = NULL) : refCount(RefCounter::create(const_cast<T *>(obj)))
+	Reference(const T *obj = NULL) : 
+		refCount(RefCounter::create(const_cast<T *>(obj), RefCountTraits<T>::toRefCounted(const_cast<T *>(obj))))
 	{
 		if (!refCount) {
 			// ERROR!
@@ -347,7 +466,7 @@ private:
 	const LockProxy operator->() const
 	{
 		if (refCount)
-			return LockProxy(refCount->object<T>(), &refCount->objectMutex);
+			return LockProxy(refCount->object<T>(), refCount->frozen ? NULL : &refCount->objectMutex);
 		else
 			return LockProxy(NULL, NULL);
 	}
@@ -489,14 +608,14 @@ class ReferenceList : public List<Reference<T> >
         ReferenceList() {}
         ReferenceList(const Reference<T>& item) : List<Reference<T> >()
 	{
-		push_back(item);
+		this->push_back(item);
 	}
         ReferenceList(const ReferenceList<T> & eoList) : List<Reference<T> >()
 	{
 		typename List<Reference<T> >::const_iterator it;
 		
                 for (it = eoList.begin(); it != eoList.end(); it++) {
-                        push_back(*it);
+                        this->push_back(*it);
                 }
         }
         ~ReferenceList() {}
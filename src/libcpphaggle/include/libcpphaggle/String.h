@@ -28,22 +28,53 @@ namespace haggle {}
 
 #else
 
+/*
+	Strings shorter than this (including the terminating null character)
+	are stored in the String object itself instead of in a malloc'd 
+	buffer. It makes the object 48 bytes on 64-bit platforms, and fits
+	attribute names, interface names and MAC addresses.
+*/
+#define STRING_LOCAL_LEN 24
+
+#if __cplusplus >= 201103L || (defined(_MSC_VER) && _MSC_VER >= 1600)
+#define HAVE_RVALUE_REFERENCES 1
+#endif
+
 namespace haggle {
 
 class String {
 private:
 	char *s;
-	size_t alloc_len;  // the length of the malloc'd buffer
+	size_t alloc_len;  // the length of the buffer s points to
 	size_t slen;  // the length of the string (i.e., strlen(s))
+	char local[STRING_LOCAL_LEN];
         static char nullchar;
+#if defined(DEBUG)
+	static unsigned long num_heap_allocs;
+	static unsigned long num_local_allocs;
+#endif
         char *alloc(size_t len);
+	bool isHeap() const { return alloc_len && s != local; }
 	String(const char *_s, size_t n);
 public:
 	static const size_t npos = -1; // the largest possible position
 	String(const char *_s = NULL);
 	String(const char c);
 	String(const String& str);
+#if defined(HAVE_RVALUE_REFERENCES)
+	String(String&& str);
+	String& operator=(String&& str);
+#endif
         ~String();
+#if defined(DEBUG)
+	/**
+		The number of times a string has allocated a buffer on the 
+		heap, and the number of times it could use its local buffer
+		instead.
+	*/
+	static unsigned long heapAllocations() { return num_heap_allocs; }
+	static unsigned long localAllocations() { return num_local_allocs; }
+#endif
 	const char* c_str () const;
         size_t size() const;
         size_t length() const;
@@ -21,8 +21,18 @@
 #include "base64.h"
 #include "bloomfilter.h"
 #include <openssl/sha.h>
+#if defined(__AVX2__)
+#include <immintrin.h>
+#elif defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 struct bloomfilter *bloomfilter_new(double error_rate, unsigned int capacity)
+{
+	return bloomfilter_new_with_hash(error_rate, capacity, BF_HASH_SHA1);
+}
+
+struct bloomfilter *bloomfilter_new_with_hash(double error_rate, unsigned int capacity, unsigned int hash)
 {
 	struct bloomfilter *bf;
 	unsigned int m, k, i;
@@ -32,6 +42,9 @@ struct bloomfilter *bloomfilter_new(double error_rate, unsigned int capacity)
 
 	bloomfilter_calculate_length(capacity, error_rate, &m, &k);
 
+	if (hash == BF_HASH_BLOCKED)
+		m = (m + BLOOMFILTER_BLOCK_BITS - 1) / BLOOMFILTER_BLOCK_BITS * BLOOMFILTER_BLOCK_BITS;
+
 	bflen = sizeof(struct bloomfilter) + (k * SALT_SIZE + m / VALUES_PER_BIN * BIN_SIZE);
 
 	bf = (struct bloomfilter *)malloc(bflen);
@@ -47,6 +60,17 @@ struct bloomfilter *bloomfilter_new(double error_rate, unsigned int capacity)
 	
 	salts = BLOOMFILTER_GET_SALTS(bf);
 
+	/* Double hashing does not use the salts, apart from the marker.
+	 The other salts are left zero so that filters with the same size
+	 can be merged. */
+	if (hash == BF_HASH_DOUBLE) {
+		salts[0] = BLOOMFILTER_SALT_DOUBLE_HASH;
+		return bf;
+	} else if (hash == BF_HASH_BLOCKED) {
+		salts[0] = BLOOMFILTER_SALT_BLOCKED_HASH;
+		return bf;
+	}
+
 	// Seed the rand() function's state. rand() should probably be replaced
 	// by prng_uint8() or prnguint32(), but I don't know if there would be any
 	// bad effects of doing that.	
@@ -215,13 +239,96 @@ struct bloomfilter *base64_to_bloomfilter(const char *b64str, const size_t b64le
 	return bf_net;
 }
 
+/*
+  64-bit FNV-1a over the key bytes, followed by the MurmurHash3 finalizer
+  to spread the bits. The key is processed byte by byte so that the result
+  does not depend on the byte order of the host.
+ */
+void bloomfilter_double_hash(const char *key, const unsigned int len, u_int32_t *h1, u_int32_t *h2)
+{
+	unsigned long long h = 0xcbf29ce484222325ULL;
+	unsigned int i;
+
+	for (i = 0; i < len; i++) {
+		h ^= (unsigned char)key[i];
+		h *= 0x100000001b3ULL;
+	}
+
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	h *= 0xc4ceb9fe1a85ec53ULL;
+	h ^= h >> 33;
+
+	*h1 = (u_int32_t)h;
+	/* An odd step never cycles back to the same bin too early */
+	*h2 = (u_int32_t)(h >> 32) | 1;
+}
+
+/*
+  Returns 1 if all bits set in mask are also set in block.
+ */
+static inline int bloomfilter_block_contains(const bin_t *block, const unsigned char *mask)
+{
+#if defined(__AVX2__)
+	__m256i miss = _mm256_or_si256(
+		_mm256_andnot_si256(_mm256_loadu_si256((const __m256i *)block), 
+				    _mm256_loadu_si256((const __m256i *)mask)),
+		_mm256_andnot_si256(_mm256_loadu_si256((const __m256i *)(block + 32)), 
+				    _mm256_loadu_si256((const __m256i *)(mask + 32))));
+
+	return _mm256_testz_si256(miss, miss);
+#elif defined(__SSE2__)
+	__m128i miss = _mm_setzero_si128();
+	int i;
+
+	for (i = 0; i < BLOOMFILTER_BLOCK_BYTES; i += 16) {
+		miss = _mm_or_si128(miss, _mm_andnot_si128(_mm_loadu_si128((const __m128i *)(block + i)), 
+							   _mm_loadu_si128((const __m128i *)(mask + i))));
+	}
+	return _mm_movemask_epi8(_mm_cmpeq_epi8(miss, _mm_setzero_si128())) == 0xffff;
+#else
+	int i;
+
+	for (i = 0; i < BLOOMFILTER_BLOCK_BYTES; i++) {
+		if (mask[i] & ~block[i])
+			return 0;
+	}
+	return 1;
+#endif
+}
+
+/*
+  Checks a key in a blocked filter by building a mask of the key's bits
+  and comparing it with the key's block in one go.
+ */
+static int bloomfilter_blocked_check(const struct bloomfilter *bf, u_int32_t h1, u_int32_t h2)
+{
+	unsigned char mask[BLOOMFILTER_BLOCK_BYTES];
+	unsigned int i, first;
+
+	first = bloomfilter_blocked_bin(h1, h2, bf->m, 0);
+	first -= first % BLOOMFILTER_BLOCK_BITS;
+
+	memset(mask, 0, BLOOMFILTER_BLOCK_BYTES);
+
+	for (i = 0; i < bf->k; i++) {
+		unsigned int bit = bloomfilter_blocked_bin(h1, h2, bf->m, i) - first;
+		mask[bit / VALUES_PER_BIN] |= (1 << (bit % VALUES_PER_BIN));
+	}
+
+	return bloomfilter_block_contains(BLOOMFILTER_GET_FILTER(bf) + first / VALUES_PER_BIN, mask);
+}
+
 int bloomfilter_operation(struct bloomfilter *bf, const char *key, 
 			  const unsigned int len, unsigned int op)
 {
-	unsigned char *buf;
+	unsigned char *buf = NULL;
 	unsigned int i;
 	int res = 1;
 	salt_t *salts;
+	u_int32_t h1 = 0, h2 = 0;
+	unsigned int hash_type;
 
 	if (!bf || !key)
 		return -1;
@@ -230,12 +337,23 @@ int bloomfilter_operation(struct bloomfilter *bf, const char *key,
 		return -1;
 	}
 
-	buf = malloc(len + SALTS_LEN(bf));
-	
-	if (!buf)
-		return -1;
-	
-	memcpy(buf, key, len);
+	hash_type = bloomfilter_get_hash(bf);
+
+	if (hash_type != BF_HASH_SHA1) {
+		/* One hash of the key gives all k bins */
+		bloomfilter_double_hash(key, len, &h1, &h2);
+
+		if (hash_type == BF_HASH_BLOCKED && op == BF_OP_CHECK && 
+		    bf->m % BLOOMFILTER_BLOCK_BITS == 0)
+			return bloomfilter_blocked_check(bf, h1, h2);
+	} else {
+		buf = malloc(len + SALTS_LEN(bf));
+		
+		if (!buf)
+			return -1;
+		
+		memcpy(buf, key, len);
+	}
 	
 	salts = BLOOMFILTER_GET_SALTS(bf);
 
@@ -245,20 +363,26 @@ int bloomfilter_operation(struct bloomfilter *bf, const char *key,
 		unsigned int hash = 0;
 		int j, index;
 		
-		/* Salt the input */
-		memcpy(buf + len, salts + i, SALT_SIZE);
-
-		SHA1_Init(&ctxt);
-		SHA1_Update(&ctxt, buf, len + SALT_SIZE);
-		SHA1_Final((unsigned char *)md, &ctxt);
+		if (hash_type == BF_HASH_DOUBLE) {
+			index = (h1 + i * h2) % bf->m;
+		} else if (hash_type == BF_HASH_BLOCKED) {
+			index = bloomfilter_blocked_bin(h1, h2, bf->m, i);
+		} else {
+			/* Salt the input */
+			memcpy(buf + len, salts + i, SALT_SIZE);
+
+			SHA1_Init(&ctxt);
+			SHA1_Update(&ctxt, buf, len + SALT_SIZE);
+			SHA1_Final((unsigned char *)md, &ctxt);
 				
-		for (j = 0; j < 5; j++) {
-			hash = hash ^ md[j];			
-		}
+			for (j = 0; j < 5; j++) {
+				hash = hash ^ md[j];			
+			}
 		
-		/* Maybe there is a more efficient way to set the
-		   correct bits? */
-		index = hash % bf->m;
+			/* Maybe there is a more efficient way to set the
+			   correct bits? */
+			index = hash % bf->m;
+		}
 
 		//printf("index%d=%u\n", i, index);
 
@@ -287,6 +411,50 @@ out:
 	return res;
 }
 
+#define CHECK_MANY_BATCH 16
+
+int bloomfilter_check_many(struct bloomfilter *bf, const char **keys, const unsigned int *lens, 
+			   unsigned int num, int *results)
+{
+	u_int32_t h1[CHECK_MANY_BATCH], h2[CHECK_MANY_BATCH];
+	unsigned int i, j, batch;
+	int found = 0;
+
+	if (!bf || !keys || !lens || !results)
+		return -1;
+
+	if (bloomfilter_get_hash(bf) != BF_HASH_BLOCKED || bf->m % BLOOMFILTER_BLOCK_BITS != 0) {
+		for (i = 0; i < num; i++) {
+			results[i] = bloomfilter_check(bf, keys[i], lens[i]);
+			
+			if (results[i] == -1)
+				return -1;
+			
+			found += results[i];
+		}
+		return found;
+	}
+
+	for (i = 0; i < num; i += batch) {
+		batch = num - i < CHECK_MANY_BATCH ? num - i : CHECK_MANY_BATCH;
+
+		for (j = 0; j < batch; j++) {
+			bloomfilter_double_hash(keys[i + j], lens[i + j], &h1[j], &h2[j]);
+#if defined(__GNUC__)
+			__builtin_prefetch(BLOOMFILTER_GET_FILTER(bf) + 
+					   bloomfilter_blocked_bin(h1[j], h2[j], bf->m, 0) / VALUES_PER_BIN);
+#endif
+		}
+
+		for (j = 0; j < batch; j++) {
+			results[i + j] = bloomfilter_blocked_check(bf, h1[j], h2[j]);
+			found += results[i + j];
+		}
+	}
+
+	return found;
+}
+
 int bloomfilter_merge(struct bloomfilter *bf, const struct bloomfilter *bf_merge)
 {
 	unsigned int i;
@@ -317,6 +485,261 @@ int bloomfilter_merge(struct bloomfilter *bf, const struct bloomfilter *bf_merge
 	return MERGE_RESULT_OK;
 }
 
+static u_int32_t bloomfilter_salts_sum(const struct bloomfilter *bf)
+{
+	salt_t *salts = BLOOMFILTER_GET_SALTS(bf);
+	u_int32_t sum = 0;
+	unsigned int i;
+
+	for (i = 0; i < bf->k; i++)
+		sum = ((sum << 5) | (sum >> 27)) ^ salts[i];
+
+	return sum;
+}
+
+static unsigned char *varint_put(unsigned char *p, u_int32_t val)
+{
+	while (val >= 0x80) {
+		*p++ = (unsigned char)(val | 0x80);
+		val >>= 7;
+	}
+	*p++ = (unsigned char)val;
+
+	return p;
+}
+
+static const unsigned char *varint_get(const unsigned char *p, const unsigned char *end, u_int32_t *val)
+{
+	u_int32_t v = 0;
+	unsigned int shift = 0;
+
+	while (p < end && shift < 35) {
+		v |= (u_int32_t)(*p & 0x7f) << shift;
+
+		if (!(*p++ & 0x80)) {
+			*val = v;
+			return p;
+		}
+		shift += 7;
+	}
+	return NULL;
+}
+
+unsigned char *bloomfilter_delta_new(const struct bloomfilter *base, const struct bloomfilter *bf, size_t *delta_len)
+{
+	struct bloomfilter_delta *delta;
+	bin_t *bins, *base_bins;
+	unsigned char *p, *set_p, *clear_p;
+	u_int32_t num_set = 0, num_cleared = 0, last_set = 0, last_cleared = 0;
+	unsigned int i, j;
+	size_t len;
+
+	if (!base || !bf || !delta_len)
+		return NULL;
+
+	if (base->m != bf->m || base->k != bf->k ||
+	    memcmp(BLOOMFILTER_GET_SALTS(base), BLOOMFILTER_GET_SALTS(bf), SALTS_LEN(bf)) != 0)
+		return NULL;
+
+	bins = BLOOMFILTER_GET_FILTER(bf);
+	base_bins = BLOOMFILTER_GET_FILTER(base);
+
+	/* First pass, count the changed bins */
+	for (i = 0; i < bf->m / VALUES_PER_BIN; i++) {
+		bin_t diff = bins[i] ^ base_bins[i];
+
+		for (j = 0; diff && j < VALUES_PER_BIN; j++, diff >>= 1) {
+			if (diff & 1) {
+				if (bins[i] & (1 << j))
+					num_set++;
+				else
+					num_cleared++;
+			}
+		}
+	}
+
+	/* Each gap takes at most five bytes */
+	len = sizeof(struct bloomfilter_delta) + (num_set + num_cleared) * 5;
+
+	delta = (struct bloomfilter_delta *)malloc(len);
+
+	if (!delta)
+		return NULL;
+
+	delta->m = htonl(bf->m);
+	delta->k = htonl(bf->k);
+	delta->salts_sum = htonl(bloomfilter_salts_sum(bf));
+	delta->n = htonl(bf->n);
+	delta->num_set = htonl(num_set);
+	delta->num_cleared = htonl(num_cleared);
+
+	/* Second pass, write the set bins followed by the cleared bins. The
+	 cleared bins are written to the end of the buffer first and moved
+	 into place afterwards, so that we only need to walk the filter
+	 once. */
+	set_p = (unsigned char *)delta + sizeof(struct bloomfilter_delta);
+	clear_p = set_p + num_set * 5;
+	p = clear_p;
+
+	for (i = 0; i < bf->m / VALUES_PER_BIN; i++) {
+		bin_t diff = bins[i] ^ base_bins[i];
+
+		for (j = 0; diff && j < VALUES_PER_BIN; j++, diff >>= 1) {
+			u_int32_t index = i * VALUES_PER_BIN + j;
+
+			if (!(diff & 1))
+				continue;
+
+			if (bins[i] & (1 << j)) {
+				set_p = varint_put(set_p, index - last_set);
+				last_set = index;
+			} else {
+				p = varint_put(p, index - last_cleared);
+				last_cleared = index;
+			}
+		}
+	}
+
+	memmove(set_p, clear_p, p - clear_p);
+
+	*delta_len = (set_p - (unsigned char *)delta) + (p - clear_p);
+
+	return (unsigned char *)delta;
+}
+
+char *bloomfilter_delta_to_base64(const struct bloomfilter *base, const struct bloomfilter *bf)
+{
+	unsigned char *delta;
+	size_t delta_len = 0;
+	char *b64str = NULL;
+	size_t len;
+
+	delta = bloomfilter_delta_new(base, bf, &delta_len);
+
+	if (!delta)
+		return NULL;
+
+	len = base64_encode_alloc((const char *)delta, delta_len, &b64str);
+
+	free(delta);
+
+	if (b64str == NULL || len == 0) {
+		fprintf(stderr, "Bloomfilter ERROR: could not base64 encode delta\n");
+		if (b64str)
+			free(b64str);
+		return NULL;
+	}
+
+	return b64str;
+}
+
+int bloomfilter_delta_apply(struct bloomfilter *bf, const unsigned char *delta, size_t delta_len, int exact)
+{
+	const struct bloomfilter_delta *hdr = (const struct bloomfilter_delta *)delta;
+	const unsigned char *p, *end;
+	u_int32_t num_set, num_cleared, gap = 0, i;
+	unsigned long long index, remaining;
+	bin_t *bins;
+
+	if (!bf || !delta || delta_len < sizeof(struct bloomfilter_delta))
+		return MERGE_RESULT_ERROR;
+
+	if (ntohl(hdr->m) != bf->m || ntohl(hdr->k) != bf->k)
+		return MERGE_RESULT_PARAM_ERROR;
+
+	if (ntohl(hdr->salts_sum) != bloomfilter_salts_sum(bf))
+		return MERGE_RESULT_SALTS_ERROR;
+
+	num_set = ntohl(hdr->num_set);
+	num_cleared = ntohl(hdr->num_cleared);
+	bins = BLOOMFILTER_GET_FILTER(bf);
+	p = delta + sizeof(struct bloomfilter_delta);
+	end = delta + delta_len;
+	remaining = (unsigned long long)(end - p);
+
+	/* 
+	   The counts come from the network. Each index is at least one
+	   byte, and no more indices than there are bits can change. Check
+	   the counts on their own, so that a large count cannot wrap their
+	   sum.
+	*/
+	if (num_set > bf->m || num_cleared > bf->m || 
+	    (unsigned long long)num_set + num_cleared > remaining)
+		return MERGE_RESULT_ERROR;
+
+	/* Validate the whole delta before modifying the filter */
+	for (i = 0, index = 0; i < num_set; i++) {
+		p = varint_get(p, end, &gap);
+
+		if (!p)
+			return MERGE_RESULT_ERROR;
+
+		index += gap;
+
+		if (index >= bf->m)
+			return MERGE_RESULT_ERROR;
+	}
+
+	for (i = 0, index = 0; i < num_cleared; i++) {
+		p = varint_get(p, end, &gap);
+
+		if (!p)
+			return MERGE_RESULT_ERROR;
+
+		index += gap;
+
+		if (index >= bf->m)
+			return MERGE_RESULT_ERROR;
+	}
+
+	p = delta + sizeof(struct bloomfilter_delta);
+
+	for (i = 0, index = 0; i < num_set; i++) {
+		p = varint_get(p, end, &gap);
+
+		if (!p || (index += gap) >= bf->m)
+			return MERGE_RESULT_ERROR;
+
+		bins[index / VALUES_PER_BIN] |= (1 << (index % VALUES_PER_BIN));
+	}
+
+	if (exact) {
+		for (i = 0, index = 0; i < num_cleared; i++) {
+			p = varint_get(p, end, &gap);
+
+			if (!p || (index += gap) >= bf->m)
+				return MERGE_RESULT_ERROR;
+
+			bins[index / VALUES_PER_BIN] &= ~(1 << (index % VALUES_PER_BIN));
+		}
+		bf->n = ntohl(hdr->n);
+	} else if (ntohl(hdr->n) > bf->n) {
+		bf->n = ntohl(hdr->n);
+	}
+
+	return MERGE_RESULT_OK;
+}
+
+int bloomfilter_delta_apply_base64(struct bloomfilter *bf, const char *b64str, const size_t b64len, int exact)
+{
+	struct base64_decode_context b64_ctx;
+	char *delta;
+	size_t len;
+	int ret;
+
+	base64_decode_ctx_init(&b64_ctx);
+
+	if (!base64_decode_alloc(&b64_ctx, b64str, b64len, &delta, &len)) {
+		return MERGE_RESULT_ERROR;
+	}
+
+	ret = bloomfilter_delta_apply(bf, (const unsigned char *)delta, len, exact);
+
+	free(delta);
+
+	return ret;
+}
+
 void bloomfilter_free(struct bloomfilter *bf)
 {
 	if (bf)
@@ -71,17 +71,76 @@ enum bf_op {
 	BF_OP_MAX,
 };
 
+/*
+  The hash function used to compute the bins of a key.
+
+  The original format computes one salted SHA1 digest per hash function.
+  The double hashing format computes a single 64-bit hash of the key and
+  derives the k bins as h1 + i * h2 (Kirsch and Mitzenmacher, "Less 
+  Hashing, Same Performance: Building a Better Bloom Filter").
+
+  The blocked format uses the same hash, but places all k bins of a key
+  in one block of BLOOMFILTER_BLOCK_BITS bins, so that a lookup touches a
+  single 64 byte block of a non-counting filter instead of k random cache
+  lines. The number of bins is rounded up to a whole number of blocks.
+
+  The format is stored in-band in the first salt, so that the wire format
+  and the length of the filter stay the same. Salts in the original format
+  come from rand(), which never sets the most significant bit, so the 
+  marker cannot clash with a random salt.
+*/
+enum bf_hash {
+	bf_hash_sha1,
+#define BF_HASH_SHA1    bf_hash_sha1
+	bf_hash_double,
+#define BF_HASH_DOUBLE  bf_hash_double
+	bf_hash_blocked,
+#define BF_HASH_BLOCKED bf_hash_blocked
+	BF_HASH_MAX,
+};
+
+#define BLOOMFILTER_SALT_DOUBLE_HASH  0x8d4b1b5aU
+#define BLOOMFILTER_SALT_BLOCKED_HASH 0x8d4b1b5bU
+
+#define BLOOMFILTER_BLOCK_BITS 512
+#define BLOOMFILTER_BLOCK_BYTES (BLOOMFILTER_BLOCK_BITS / 8)
+
 #if defined(WIN32) || defined(WINCE)
 #if !defined(inline)
 #define inline __inline
 #endif
 #endif
 
+void bloomfilter_double_hash(const char *key, const unsigned int len, u_int32_t *h1, u_int32_t *h2);
+
+/* Returns bin number i of a key in a blocked filter with m bins */
+static inline unsigned int bloomfilter_blocked_bin(u_int32_t h1, u_int32_t h2, unsigned int m, unsigned int i)
+{
+	unsigned int num_blocks = m / BLOOMFILTER_BLOCK_BITS;
+	unsigned int offset = (h2 >> 1) + i * ((h2 >> 10) | 1);
+
+	/* Only a corrupt filter can be smaller than a block */
+	if (num_blocks == 0)
+		return offset % m;
+
+	return (h1 % num_blocks) * BLOOMFILTER_BLOCK_BITS + (offset % BLOOMFILTER_BLOCK_BITS);
+}
+
 int bloomfilter_calculate_length(unsigned int num_keys, double error_rate, 
 				 unsigned int *lowest_m, unsigned int *best_k);
 
 struct bloomfilter *bloomfilter_new(double error_rate, unsigned int capacity);
+struct bloomfilter *bloomfilter_new_with_hash(double error_rate, unsigned int capacity, unsigned int hash);
 int bloomfilter_operation(struct bloomfilter *bf, const char *key, const unsigned int len, unsigned int op);
+/*
+  Checks num keys at once and stores the result for each key in results.
+  For blocked filters, the hashes of a batch of keys are computed first 
+  and their blocks prefetched, so that the memory accesses overlap.
+
+  Returns the number of keys in the filter, or -1 on error.
+*/
+int bloomfilter_check_many(struct bloomfilter *bf, const char **keys, const unsigned int *lens, 
+			   unsigned int num, int *results);
 void bloomfilter_free(struct bloomfilter *bf);
 struct bloomfilter *bloomfilter_copy(const struct bloomfilter *bf);
 
@@ -93,6 +152,23 @@ static inline unsigned long bloomfilter_get_n(const struct bloomfilter *bf)
 	return (unsigned long)bf->n;
 }
 
+static inline unsigned int bloomfilter_salt_to_hash(salt_t salt)
+{
+	if (salt == BLOOMFILTER_SALT_DOUBLE_HASH)
+		return BF_HASH_DOUBLE;
+	if (salt == BLOOMFILTER_SALT_BLOCKED_HASH)
+		return BF_HASH_BLOCKED;
+	return BF_HASH_SHA1;
+}
+
+static inline unsigned int bloomfilter_get_hash(const struct bloomfilter *bf)
+{
+	if (bf->k == 0)
+		return BF_HASH_SHA1;
+
+	return bloomfilter_salt_to_hash(BLOOMFILTER_GET_SALTS(bf)[0]);
+}
+
 static inline int bloomfilter_check(struct bloomfilter *bf, const char *key, const unsigned int len)
 {
 	return bloomfilter_operation(bf, key, len, BF_OP_CHECK);
@@ -111,6 +187,44 @@ enum {
 	
 int bloomfilter_merge(struct bloomfilter *bf, const struct bloomfilter *bf_merge);
 
+/*
+  Delta encoding of a bloomfilter against an older version of the same
+  filter (same m, k and salts). The delta lists the bins that were set
+  and the bins that were cleared since the base version, as gap encoded
+  variable length integers, in network byte order:
+
+  | m | k | salts checksum | n | num_set | num_cleared | set gaps... | cleared gaps... |
+
+  The delta is only compact when few bins have changed. Callers should
+  compare the length with that of the full filter and fall back to
+  sending the full filter when the delta does not pay off.
+*/
+struct bloomfilter_delta {
+	u_int32_t m; /* Number of bins in the filter the delta applies to */
+	u_int32_t k; /* Number of salts */
+	u_int32_t salts_sum; /* Checksum over the salts */
+	u_int32_t n; /* Number of inserted objects in the new version */
+	u_int32_t num_set; /* Number of set bins that follow */
+	u_int32_t num_cleared; /* Number of cleared bins that follow */
+	/* Here follows the gap encoded set and cleared bins */
+};
+
+unsigned char *bloomfilter_delta_new(const struct bloomfilter *base, const struct bloomfilter *bf, size_t *delta_len);
+char *bloomfilter_delta_to_base64(const struct bloomfilter *base, const struct bloomfilter *bf);
+/*
+  Applies a delta to the filter. If 'exact' is non-zero, the filter is
+  assumed to be the base version of the delta and cleared bins are
+  cleared. Otherwise, only set bins are applied, which gives a filter
+  that may lack some of the objects in the new version, but never
+  contains objects that the new version does not contain (unless they
+  were there before).
+
+  Returns MERGE_RESULT_OK on success, or one of the other MERGE_RESULT_*
+  values if the delta does not match the parameters of the filter.
+ */
+int bloomfilter_delta_apply(struct bloomfilter *bf, const unsigned char *delta, size_t delta_len, int exact);
+int bloomfilter_delta_apply_base64(struct bloomfilter *bf, const char *b64str, const size_t b64len, int exact);
+
 #ifdef DEBUG
 void bloomfilter_print(struct bloomfilter *bf);
 #endif
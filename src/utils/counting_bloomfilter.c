@@ -24,6 +24,11 @@
 #include "bloomfilter.h"
 
 struct counting_bloomfilter *counting_bloomfilter_new(double error_rate, unsigned int capacity)
+{
+	return counting_bloomfilter_new_with_hash(error_rate, capacity, BF_HASH_SHA1);
+}
+
+struct counting_bloomfilter *counting_bloomfilter_new_with_hash(double error_rate, unsigned int capacity, unsigned int hash)
 {
 	struct counting_bloomfilter *bf;
 	unsigned int m, k, i;
@@ -33,6 +38,9 @@ struct counting_bloomfilter *counting_bloomfilter_new(double error_rate, unsigne
 
 	bloomfilter_calculate_length(capacity, error_rate, &m, &k);
 
+	if (hash == BF_HASH_BLOCKED)
+		m = (m + BLOOMFILTER_BLOCK_BITS - 1) / BLOOMFILTER_BLOCK_BITS * BLOOMFILTER_BLOCK_BITS;
+
 	bflen = sizeof(struct counting_bloomfilter) + (k * COUNTING_SALT_SIZE + m / COUNTING_VALUES_PER_BIN * COUNTING_BIN_SIZE);
 
 	bf = (struct counting_bloomfilter *)malloc(bflen);
@@ -48,6 +56,16 @@ struct counting_bloomfilter *counting_bloomfilter_new(double error_rate, unsigne
 	
 	salts = COUNTING_BLOOMFILTER_GET_SALTS(bf);
 
+	/* Same marker as in the non-counting filter, so that it survives
+	 counting_bloomfilter_to_noncounting() */
+	if (hash == BF_HASH_DOUBLE) {
+		salts[0] = BLOOMFILTER_SALT_DOUBLE_HASH;
+		return bf;
+	} else if (hash == BF_HASH_BLOCKED) {
+		salts[0] = BLOOMFILTER_SALT_BLOCKED_HASH;
+		return bf;
+	}
+
 	// Seed the rand() function's state. rand() should probably be replaced
 	// by prng_uint8() or prnguint32(), but I don't know if there would be any
 	// bad effects of doing that.
@@ -89,7 +107,7 @@ void counting_bloomfilter_print(struct counting_bloomfilter *bf)
 
 	for (i = 0; i < bf->m; i++) {
 		counting_bin_t *bins = COUNTING_BLOOMFILTER_GET_FILTER(bf);
-		printf("%u", bins[i]);
+		printf("%x", counting_bloomfilter_get_counter(bins, i));
 	}
 	printf("\n");
 }
@@ -124,16 +142,34 @@ char *counting_bloomfilter_to_str(struct counting_bloomfilter *bf)
 	return str;
 }
 
+/* Gathers the eight counters in the four bins starting at 'bins' into
+ one non-counting bin, with a bit set for every non-zero counter. */
+static inline bin_t counting_bins_to_bin(const counting_bin_t *bins)
+{
+	u_int32_t w = (u_int32_t)bins[0] | ((u_int32_t)bins[1] << 8) | 
+		((u_int32_t)bins[2] << 16) | ((u_int32_t)bins[3] << 24);
+
+	/* Fold each nibble into its lowest bit */
+	w |= w >> 2;
+	w |= w >> 1;
+	w &= 0x11111111;
+
+	/* Pack the eight bits together */
+	w = (w | (w >> 3)) & 0x03030303;
+	w = (w | (w >> 6)) & 0x000f000f;
+
+	return (bin_t)((w | (w >> 12)) & 0xff);
+}
+
 struct bloomfilter *counting_bloomfilter_to_noncounting(const struct counting_bloomfilter *bf)
 {
         struct bloomfilter *bf_nc;
         unsigned long bflen;
 	counting_salt_t *salts;
 	counting_bin_t *bins;
-        unsigned long i, j;
+        unsigned long i;
 	salt_t *salts_nc;
 	bin_t *bins_nc;
-        unsigned int bits_to_shift;
 
         if (!bf)
                 return NULL;
@@ -145,8 +181,6 @@ struct bloomfilter *counting_bloomfilter_to_noncounting(const struct counting_bl
 	if (!bf_nc)
 		return NULL;
 
-	memset(bf_nc, 0, bflen);
-
 	bf_nc->m = bf->m;
 	bf_nc->k = bf->k;
 	bf_nc->n = bf->n;
@@ -157,29 +191,15 @@ struct bloomfilter *counting_bloomfilter_to_noncounting(const struct counting_bl
 	bins = COUNTING_BLOOMFILTER_GET_FILTER(bf);
 	bins_nc = BLOOMFILTER_GET_FILTER(bf_nc);
 
-	j = 0;
-
         // Copy the salts
         for (i = 0; i < bf->k; i++) {
                 salts_nc[i] = salts[i]; 
         }
 
-        /* Set the bins */
-	for (i = 0; i < bf->m; i++) {
-                bits_to_shift = (i % VALUES_PER_BIN);
-
-                if (bins[i]) {
-                        bins_nc[j] |= (1 << bits_to_shift);
-                }
-
-                if (bits_to_shift == (VALUES_PER_BIN - 1)) {
-                        unsigned long k = VALUES_PER_BIN - 1;
-                        while (1) {
-                                if (k-- == 0)
-                                        break;
-                        }
-                        j++;
-                }
+        /* Set the bins. The length of the filter is always a multiple of
+	 eight, so each non-counting bin maps to exactly four counting bins. */
+	for (i = 0; i < bf->m / VALUES_PER_BIN; i++) {
+		bins_nc[i] = counting_bins_to_bin(bins + i * (VALUES_PER_BIN / COUNTING_VALUES_PER_BIN));
 	}
 
         return bf_nc;
@@ -192,7 +212,7 @@ char *counting_bloomfilter_to_base64(const struct counting_bloomfilter *bf)
 	unsigned int i = 0;
 	struct counting_bloomfilter *bf_net;
 	counting_salt_t *salts, *salts_net;
-	counting_bin_t *bins, *bins_net;
+	counting_bin_t *bins_net;
 	
 	if (!bf)
 		return NULL;
@@ -211,7 +231,6 @@ char *counting_bloomfilter_to_base64(const struct counting_bloomfilter *bf)
 	/* Get pointers */
 	salts = COUNTING_BLOOMFILTER_GET_SALTS(bf);
 	salts_net = COUNTING_BLOOMFILTER_GET_SALTS(bf_net);
-	bins = COUNTING_BLOOMFILTER_GET_FILTER(bf);
 	bins_net = COUNTING_BLOOMFILTER_GET_FILTER(bf_net);
 
 	/* Now convert into network byte order */
@@ -222,9 +241,9 @@ char *counting_bloomfilter_to_base64(const struct counting_bloomfilter *bf)
 	for (i = 0; i < bf->k; i++)
 		salts_net[i] = htonl(salts[i]);
 	
-	for (i = 0; i < bf->m; i++) {
-		bins_net[i] = htons(bins[i]);
-	}
+	/* The counters are nibbles, so the bins need no conversion */
+	memcpy(bins_net, COUNTING_BLOOMFILTER_GET_FILTER(bf), CB_FILTER_LEN(bf));
+
 	len = base64_encode_alloc((const char *)bf_net, COUNTING_BLOOMFILTER_TOT_LEN(bf), &b64str);
 
 	counting_bloomfilter_free(bf_net);
@@ -289,22 +308,64 @@ struct counting_bloomfilter *base64_to_counting_bloomfilter(const char *b64str,
 	for (i = 0; i < bf_net->k; i++)
 		salts[i] = ntohl(salts[i]);
 	
-	for (i = 0; i < bf_net->m; i++) {
-		counting_bin_t *bins = COUNTING_BLOOMFILTER_GET_FILTER(bf_net);
-		bins[i] = ntohs(bins[i]);
+	/* A filter from a node running an older version */
+	if (len == COUNTING_BLOOMFILTER_LEGACY_TOT_LEN(bf_net)) {
+		struct counting_bloomfilter *bf;
+		counting_legacy_bin_t *legacy_bins = (counting_legacy_bin_t *)COUNTING_BLOOMFILTER_GET_FILTER(bf_net);
+
+		for (i = 0; i < bf_net->m; i++)
+			legacy_bins[i] = ntohs(legacy_bins[i]);
+
+		bf = counting_bloomfilter_from_legacy(bf_net);
+		free(bf_net);
+		return bf;
 	}
 
 	return bf_net;
 }
 
+struct counting_bloomfilter *counting_bloomfilter_from_legacy(const struct counting_bloomfilter *bf)
+{
+	struct counting_bloomfilter *bf_new;
+	const counting_legacy_bin_t *legacy_bins;
+	counting_bin_t *bins;
+	unsigned int i;
+
+	if (!bf)
+		return NULL;
+
+	bf_new = (struct counting_bloomfilter *)malloc(COUNTING_BLOOMFILTER_TOT_LEN(bf));
+
+	if (!bf_new)
+		return NULL;
+
+	memset(bf_new, 0, COUNTING_BLOOMFILTER_TOT_LEN(bf));
+	memcpy(bf_new, bf, sizeof(struct counting_bloomfilter) + CB_SALTS_LEN(bf));
+
+	legacy_bins = (const counting_legacy_bin_t *)COUNTING_BLOOMFILTER_GET_FILTER(bf);
+	bins = COUNTING_BLOOMFILTER_GET_FILTER(bf_new);
+
+	/* Counters that do not fit are saturated */
+	for (i = 0; i < bf->m; i++) {
+		counting_bloomfilter_set_counter(bins, i, legacy_bins[i] > COUNTING_MAX_COUNT ? 
+						 COUNTING_MAX_COUNT : legacy_bins[i]);
+	}
+
+	return bf_new;
+}
+
 int counting_bloomfilter_operation(struct counting_bloomfilter *bf, const char *key, 
 			  const unsigned int len, unsigned int op)
 {
-	unsigned char *buf;
+	unsigned char *buf = NULL;
 	unsigned int i;
 	unsigned short removed = 0;
 	int res = 1;
 	counting_salt_t *salts;
+	counting_bin_t *bins;
+	unsigned int count;
+	u_int32_t h1 = 0, h2 = 0;
+	unsigned int hash_type;
 
 	if (!bf || !key)
 		return -1;
@@ -313,18 +374,21 @@ int counting_bloomfilter_operation(struct counting_bloomfilter *bf, const char *
 		return -1;
 	}
 
-	buf = malloc(len + CB_SALTS_LEN(bf));
-	
-	if (!buf)
-		return -1;
-	
-	memcpy(buf, key, len);
+	hash_type = counting_bloomfilter_get_hash(bf);
+
+	if (hash_type != BF_HASH_SHA1) {
+		bloomfilter_double_hash(key, len, &h1, &h2);
+	} else {
+		buf = malloc(len + CB_SALTS_LEN(bf));
+		
+		if (!buf)
+			return -1;
+		
+		memcpy(buf, key, len);
+	}
 	
 	salts = COUNTING_BLOOMFILTER_GET_SALTS(bf);
-
-	/* Increment number of objects in filter */
-	if (op == COUNTING_BF_OP_ADD)
-		bf->n++;
+	bins = COUNTING_BLOOMFILTER_GET_FILTER(bf);
 
 	for (i = 0; i < bf->k; i++) {
 		SHA_CTX ctxt;
@@ -332,36 +396,48 @@ int counting_bloomfilter_operation(struct counting_bloomfilter *bf, const char *
 		unsigned int hash = 0;
 		int j, index;
 		
-		/* Salt the input */
-		memcpy(buf + len, salts + i, COUNTING_SALT_SIZE);
-
-		SHA1_Init(&ctxt);
-		SHA1_Update(&ctxt, buf, len + COUNTING_SALT_SIZE);
-		SHA1_Final((unsigned char *)md, &ctxt);
+		if (hash_type == BF_HASH_DOUBLE) {
+			index = (h1 + i * h2) % bf->m;
+		} else if (hash_type == BF_HASH_BLOCKED) {
+			index = bloomfilter_blocked_bin(h1, h2, bf->m, i);
+		} else {
+			/* Salt the input */
+			memcpy(buf + len, salts + i, COUNTING_SALT_SIZE);
+
+			SHA1_Init(&ctxt);
+			SHA1_Update(&ctxt, buf, len + COUNTING_SALT_SIZE);
+			SHA1_Final((unsigned char *)md, &ctxt);
 				
-		for (j = 0; j < 5; j++) {
-			hash = hash ^ md[j];			
-		}
+			for (j = 0; j < 5; j++) {
+				hash = hash ^ md[j];			
+			}
 		
-		/* Maybe there is a more efficient way to set the
-		   correct bits? */
-		index = hash % bf->m;
+			/* Maybe there is a more efficient way to set the
+			   correct bits? */
+			index = hash % bf->m;
+		}
 
 		//printf("index%d=%u\n", i, index);
 
+		count = counting_bloomfilter_get_counter(bins, index);
+
 		switch(op) {
 		case COUNTING_BF_OP_CHECK:
-			if (COUNTING_BLOOMFILTER_GET_FILTER(bf)[index] == 0) {
+			if (count == 0) {
 				res = 0;
 				goto out;
 			}
 			break;
 		case COUNTING_BF_OP_ADD:
-			COUNTING_BLOOMFILTER_GET_FILTER(bf)[index]++;
+			if (count < COUNTING_MAX_COUNT)
+				counting_bloomfilter_set_counter(bins, index, count + 1);
 			break;
 		case COUNTING_BF_OP_REMOVE:
-			if (COUNTING_BLOOMFILTER_GET_FILTER(bf)[index] > 0) {
-				COUNTING_BLOOMFILTER_GET_FILTER(bf)[index]--;
+			if (count > 0) {
+				/* A saturated counter cannot be decremented,
+				 because we do not know its real value */
+				if (count < COUNTING_MAX_COUNT)
+					counting_bloomfilter_set_counter(bins, index, count - 1);
 				removed++;
 			}
 			
@@ -33,6 +33,8 @@ typedef DWORD32 u_int32_t;
 #include <netinet/in.h>
 #endif
 
+#include "bloomfilter.h"
+
 typedef u_int32_t counting_salt_t;
 
 struct counting_bloomfilter {
@@ -44,19 +46,28 @@ struct counting_bloomfilter {
 	/* Then follows the actual filter */
 };
 
-/* Counting bloomfilter bin size in bits */
-typedef u_int16_t counting_bin_t;
+/* Each bin packs two 4-bit counters, the counter with the even index in
+ the low nibble. A counter that reaches COUNTING_MAX_COUNT is saturated
+ and sticks at that value, since the filter no longer knows how many
+ objects map to it. */
+typedef u_int8_t counting_bin_t;
 #define COUNTING_BIN_SIZE (sizeof(counting_bin_t))
-#define COUNTING_VALUES_PER_BIN (1)
+#define COUNTING_VALUES_PER_BIN (2)
+#define COUNTING_BITS_PER_VALUE (8 * COUNTING_BIN_SIZE / COUNTING_VALUES_PER_BIN)
+#define COUNTING_MAX_COUNT ((1 << COUNTING_BITS_PER_VALUE) - 1)
+
+/* Older versions used one 16-bit counter per bin */
+typedef u_int16_t counting_legacy_bin_t;
 
 #define K_SIZE sizeof(u_int32_t)
 #define M_SIZE sizeof(u_int32_t)
 #define N_SIZE sizeof(u_int32_t)
 #define COUNTING_SALT_SIZE sizeof(counting_salt_t)
 
-#define CB_FILTER_LEN(bf) ((bf)->m / COUNTING_VALUES_PER_BIN * COUNTING_BIN_SIZE)
+#define CB_FILTER_LEN(bf) (((bf)->m + COUNTING_VALUES_PER_BIN - 1) / COUNTING_VALUES_PER_BIN * COUNTING_BIN_SIZE)
 #define CB_SALTS_LEN(bf) ((bf)->k * COUNTING_SALT_SIZE)
 #define COUNTING_BLOOMFILTER_TOT_LEN(bf) (sizeof(struct counting_bloomfilter) + CB_SALTS_LEN(bf) + CB_FILTER_LEN(bf))
+#define COUNTING_BLOOMFILTER_LEGACY_TOT_LEN(bf) (sizeof(struct counting_bloomfilter) + CB_SALTS_LEN(bf) + (bf)->m * sizeof(counting_legacy_bin_t))
 
 #define COUNTING_BLOOMFILTER_GET_SALTS(bf) ((counting_salt_t *)((unsigned char *)(bf) + sizeof(struct counting_bloomfilter)))
 #define COUNTING_BLOOMFILTER_GET_FILTER(bf) ((counting_bin_t *)((unsigned char *)(bf) + sizeof(struct counting_bloomfilter) + CB_SALTS_LEN(bf)))
@@ -78,6 +89,7 @@ enum counting_bf_op {
 #endif
 
 struct counting_bloomfilter *counting_bloomfilter_new(double error_rate, unsigned int capacity);
+struct counting_bloomfilter *counting_bloomfilter_new_with_hash(double error_rate, unsigned int capacity, unsigned int hash);
 int counting_bloomfilter_operation(struct counting_bloomfilter *bf, const char *key, const unsigned int len, unsigned int op);
 void counting_bloomfilter_free(struct counting_bloomfilter *bf);
 struct counting_bloomfilter *counting_bloomfilter_copy(const struct counting_bloomfilter *bf);
@@ -85,12 +97,34 @@ struct bloomfilter *counting_bloomfilter_to_noncounting(const struct counting_bl
 char *counting_bloomfilter_to_base64(const struct counting_bloomfilter *bf);
 char *counting_bloomfilter_to_noncounting_base64(const struct counting_bloomfilter *bf);
 struct counting_bloomfilter *base64_to_counting_bloomfilter(const char *b64str, const size_t b64len);
+/* Converts a filter in the old format with 16-bit counters (host byte order) */
+struct counting_bloomfilter *counting_bloomfilter_from_legacy(const struct counting_bloomfilter *bf);
+
+static inline unsigned int counting_bloomfilter_get_counter(const counting_bin_t *bins, unsigned int i)
+{
+	return (bins[i / COUNTING_VALUES_PER_BIN] >> ((i % COUNTING_VALUES_PER_BIN) * COUNTING_BITS_PER_VALUE)) & COUNTING_MAX_COUNT;
+}
+
+static inline void counting_bloomfilter_set_counter(counting_bin_t *bins, unsigned int i, unsigned int value)
+{
+	unsigned int shift = (i % COUNTING_VALUES_PER_BIN) * COUNTING_BITS_PER_VALUE;
+
+	bins[i / COUNTING_VALUES_PER_BIN] = (counting_bin_t)((bins[i / COUNTING_VALUES_PER_BIN] & ~(COUNTING_MAX_COUNT << shift)) | (value << shift));
+}
 
 static inline unsigned long counting_bloomfilter_get_n(const struct counting_bloomfilter *bf)
 {
 	return (unsigned long)bf->n;
 }
 
+static inline unsigned int counting_bloomfilter_get_hash(const struct counting_bloomfilter *bf)
+{
+	if (bf->k == 0)
+		return BF_HASH_SHA1;
+
+	return bloomfilter_salt_to_hash(COUNTING_BLOOMFILTER_GET_SALTS(bf)[0]);
+}
+
 static inline int counting_bloomfilter_check(struct counting_bloomfilter *bf, const char *key, const unsigned int len)
 {
 	return counting_bloomfilter_operation(bf, key, len, COUNTING_BF_OP_CHECK);
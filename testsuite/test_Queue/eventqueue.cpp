@@ -0,0 +1,262 @@
+/* Copyright 2008 Uppsala University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "testhlp.h"
+#include "EventQueue.h"
+#include "Node.h"
+#include <libcpphaggle/Thread.h>
+#include <libcpphaggle/Atomic.h>
+#include <libcpphaggle/Exception.h>
+#include <haggleutils.h>
+
+using namespace haggle;
+
+/*
+	This program dispatches events through an event queue the way the
+	kernel does, and counts the heap allocations it takes. Events and
+	the lists they carry are allocated from pools, so there should be
+	very few.
+
+	It also checks that every event allocated from the pool is freed to
+	it, and that the blocks cached by threads that exit go back to the
+	pool.
+*/
+
+#define NUM_EVENTS 1000000
+#define NUM_THREADED_EVENTS 100000
+// The number of events in the queue at a time
+#define MAX_QUEUED 100
+#define NUM_POOL_THREADS 4
+// The number of events each pool thread allocates and then frees, at a
+// time and in total
+#define POOL_BURST 100
+#define NUM_POOL_EVENTS 100000
+
+typedef Pool<POOL_SIZE(sizeof(Event))> EventPool;
+
+static unsigned long num_news = 0;
+
+// Count the allocations made through the global operator new
+void *operator new(size_t n)
+{
+	num_news++;
+	return malloc(n);
+}
+
+void operator delete(void *p) throw()
+{
+	free(p);
+}
+
+class Dispatcher : public EventHandler {
+#define __CLASS__ Dispatcher
+public:
+	unsigned long num_dispatched;
+	EventCallback<EventHandler> *callback;
+	Dispatcher() : num_dispatched(0), callback(newEventCallback(onEvent)) {}
+	~Dispatcher() { delete callback; }
+	void onEvent(Event *e)
+	{
+		if (e->getNodeList().size() == 3)
+			num_dispatched++;
+	}
+	// Dispatches the first event in the queue the way the kernel does
+	void dispatch(EventQueue& q)
+	{
+		Event *e = q.getNextEvent();
+
+		(*callback)(e);
+
+		if (e->shouldDelete())
+			delete e;
+	}
+};
+
+/*
+	Adds events to a queue, for another thread to dispatch and
+	delete.
+ */
+class Producer : public Runnable {
+	EventQueue& q;
+	const NodeRef& node;
+	const NodeRefList& nodes;
+public:
+	atomic_t num_queued;
+	Producer(EventQueue& _q, const NodeRef& _node, const NodeRefList& _nodes) :
+		q(_q), node(_node), nodes(_nodes), num_queued(0) {}
+	bool run()
+	{
+		for (int i = 0; i < NUM_THREADED_EVENTS; i++) {
+			while (num_queued >= MAX_QUEUED)
+				;
+			q.addEvent(new Event(EVENT_TYPE_TARGET_NODES, node, nodes));
+			atomic_inc(&num_queued);
+		}
+		return false;
+	}
+	void cleanup() {}
+};
+
+/*
+	Allocates events in bursts, and frees them again, before exiting.
+ */
+class PoolUser : public Runnable {
+	const NodeRef& node;
+	const NodeRefList& nodes;
+public:
+	PoolUser(const NodeRef& _node, const NodeRefList& _nodes) : node(_node), nodes(_nodes) {}
+	bool run()
+	{
+		Event *events[POOL_BURST];
+
+		for (int i = 0; i < NUM_POOL_EVENTS; i += POOL_BURST) {
+			for (int j = 0; j < POOL_BURST; j++)
+				events[j] = new Event(EVENT_TYPE_TARGET_NODES, node, nodes);
+			for (int j = 0; j < POOL_BURST; j++)
+				delete events[j];
+		}
+		return false;
+	}
+	void cleanup() {}
+};
+
+/*
+	Checks that the given number of events have been allocated from,
+	and freed to, the event pool since the counts were taken, and that
+	none of the blocks of the pool are lost.
+ */
+static bool check_pool(unsigned long allocs, unsigned long frees, unsigned long n)
+{
+	// Add the counts of this thread's cache
+	EventPool::flush();
+
+	return EventPool::numAllocs() - allocs == n &&
+		EventPool::numFrees() - frees == n &&
+		EventPool::numFreeBlocks() == EventPool::numBlocks();
+}
+
+#if defined(OS_WINDOWS)
+int haggle_test_eventqueue(void)
+#else
+int main(int argc, char *argv[])
+#endif
+{
+	// Disable tracing
+	trace_disable(true);
+
+	bool success = true, tmp_succ;
+
+	print_over_test_str_nl(0, "Event queue test: ");
+
+	try {
+		EventQueue q;
+		Dispatcher d;
+		NodeRef node = Node::create(Node::TYPE_PEER, "target");
+		NodeRefList nodes;
+
+		for (int i = 0; i < 3; i++)
+			nodes.push_back(node);
+
+		print_over_test_str(1, "Dispatch 1M events: ");
+
+		EventPool::flush();
+
+		unsigned long news = num_news;
+		unsigned long slabs = poolSlabCount();
+		unsigned long allocs = EventPool::numAllocs();
+		unsigned long frees = EventPool::numFrees();
+		Timeval start = Timeval::now();
+
+		for (int i = 0; i < NUM_EVENTS; i++) {
+			q.addEvent(new Event(EVENT_TYPE_TARGET_NODES, node, nodes));
+
+			if (q.size() >= MAX_QUEUED)
+				d.dispatch(q);
+		}
+		while (!q.empty())
+			d.dispatch(q);
+
+		double secs = (Timeval::now() - start).getTimeAsSecondsDouble();
+
+		news = num_news - news;
+		slabs = poolSlabCount() - slabs;
+
+		printf("%.2f us/event, %lu mallocs (%lu new, %lu pool slabs) ",
+		       secs * 1000000 / NUM_EVENTS, news + slabs, news, slabs);
+
+		tmp_succ = d.num_dispatched == NUM_EVENTS;
+		success &= tmp_succ;
+		print_pass(tmp_succ);
+
+		print_over_test_str(1, "Events freed to pool: ");
+		tmp_succ = check_pool(allocs, frees, NUM_EVENTS);
+		success &= tmp_succ;
+		print_pass(tmp_succ);
+
+		print_over_test_str(1, "Dispatch events from another thread: ");
+
+		Producer p(q, node, nodes);
+
+		d.num_dispatched = 0;
+		allocs = EventPool::numAllocs();
+		frees = EventPool::numFrees();
+		p.start();
+
+		while (d.num_dispatched < NUM_THREADED_EVENTS) {
+			if (q.hasNextEvent() == EQ_EVENT) {
+				d.dispatch(q);
+				atomic_dec(&p.num_queued);
+			}
+		}
+		p.join();
+
+		tmp_succ = q.empty() && node.refcount() == 4;
+		success &= tmp_succ;
+		print_pass(tmp_succ);
+
+		// The producer only allocates, so the blocks cached when it
+		// exits are only found if the cache is returned to the pool
+		print_over_test_str(1, "Events from other thread freed to pool: ");
+		tmp_succ = check_pool(allocs, frees, NUM_THREADED_EVENTS);
+		success &= tmp_succ;
+		print_pass(tmp_succ);
+
+		print_over_test_str(1, "Allocate events from several threads: ");
+
+		PoolUser *users[NUM_POOL_THREADS];
+
+		allocs = EventPool::numAllocs();
+		frees = EventPool::numFrees();
+
+		for (int i = 0; i < NUM_POOL_THREADS; i++) {
+			users[i] = new PoolUser(node, nodes);
+			users[i]->start();
+		}
+		for (int i = 0; i < NUM_POOL_THREADS; i++) {
+			users[i]->join();
+			delete users[i];
+		}
+		tmp_succ = check_pool(allocs, frees, NUM_POOL_THREADS * NUM_POOL_EVENTS) && 
+			node.refcount() == 4;
+		success &= tmp_succ;
+		print_pass(tmp_succ);
+
+		print_over_test_str(1, "Total: ");
+		return (success ? 0 : 1);
+	} catch(Exception &) {
+		printf("**CRASH** ");
+		return 1;
+	}
+}
@@ -0,0 +1,220 @@
+/* Copyright 2009 Uppsala University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "testhlp.h"
+#include "InterfaceStore.h"
+#include "Interface.h"
+#include <haggleutils.h>
+
+using namespace haggle;
+
+/*
+	This program reports many neighbor interfaces to an interface store,
+	as the Ethernet connectivity does when it receives beacons, and checks
+	that they can be looked up and that they are aged as before.
+
+	Finally, it receives many beacons from the same neighbors, aging the
+	neighbors in between, and checks that each neighbor is added once and
+	not aged while it sends beacons.
+*/
+
+#define NUMBER_OF_NEIGHBORS 1000
+#define NUMBER_OF_BEACONS 50000
+// The number of beacons received between the times the neighbors are aged
+#define BEACONS_PER_AGE 10
+#define NEIGHBOR_LIFETIME 10
+
+static void neighbor_mac(unsigned long n, unsigned char *mac)
+{
+	mac[0] = 0x02;
+	mac[1] = 0x00;
+	mac[2] = (n >> 24) & 0xff;
+	mac[3] = (n >> 16) & 0xff;
+	mac[4] = (n >> 8) & 0xff;
+	mac[5] = n & 0xff;
+}
+
+/*
+	Reports a neighbor interface as if a beacon was received from it.
+*/
+static InterfaceRef beacon(InterfaceStore& ifs, const InterfaceRef& root, unsigned long n, const Timeval& lifetime, bool *was_added = NULL)
+{
+	unsigned char mac[ETH_MAC_LEN];
+
+	neighbor_mac(n, mac);
+
+	EthernetAddress addr(mac);
+	EthernetInterface iface(mac, "Remote Ethernet", &addr, IFFLAG_UP);
+
+	return ifs.addupdate(&iface, root, new ConnectivityInterfacePolicyTime(lifetime), was_added);
+}
+
+/*
+	Receives beacons from random neighbors, and ages the neighbors every
+	BEACONS_PER_AGE beacons. Returns the number of neighbors added, less
+	the number aged.
+*/
+static unsigned long beacons(InterfaceStore& ifs, const InterfaceRef& root)
+{
+	Timeval lifetime = Timeval::now() + Timeval(NEIGHBOR_LIFETIME, 0);
+	unsigned long neighbors = 0;
+
+	for (unsigned long b = 0; b < NUMBER_OF_BEACONS; b++) {
+		bool was_added;
+
+		beacon(ifs, root, prng_uint32() % NUMBER_OF_NEIGHBORS, lifetime, &was_added);
+
+		if (was_added)
+			neighbors++;
+
+		if (b % BEACONS_PER_AGE == 0)
+			neighbors -= ifs.age(root);
+	}
+	return neighbors;
+}
+
+#if defined(OS_WINDOWS)
+int haggle_test_interfacestore(void)
+#else
+int main(int argc, char *argv[])
+#endif
+{
+	bool success = true, tmp_succ, was_added;
+	unsigned char root_mac[ETH_MAC_LEN] = { 0x02, 0x01, 0x00, 0x00, 0x00, 0x01 };
+	Timeval lifetime = Timeval::now() + Timeval(NEIGHBOR_LIFETIME, 0);
+	Timeval expired = Timeval::now() - Timeval(1, 0);
+	Timeval next;
+	InterfaceRefList dead;
+	InterfaceRef root, bt_root;
+	InterfaceStore ifs;
+
+	// Disable tracing
+	trace_disable(true);
+
+	prng_init();
+
+	print_over_test_str_nl(0, "Interface store test: ");
+
+	print_over_test_str(1, "Add neighbors: ");
+	{
+		EthernetInterface iface(root_mac, "Local Ethernet", NULL, IFFLAG_UP | IFFLAG_LOCAL);
+		root = ifs.addupdate(&iface, InterfaceRef(), new ConnectivityInterfacePolicyAgeless());
+	}
+	tmp_succ = root;
+
+	// The first tenth of the neighbors has already expired
+	for (unsigned long n = 0; n < NUMBER_OF_NEIGHBORS && tmp_succ; n++) {
+		tmp_succ = beacon(ifs, root, n, n < NUMBER_OF_NEIGHBORS / 10 ? expired : lifetime + Timeval(n, 0), &was_added) && was_added;
+	}
+	tmp_succ = tmp_succ && beacon(ifs, root, NUMBER_OF_NEIGHBORS - 1, lifetime + Timeval(NUMBER_OF_NEIGHBORS - 1, 0), &was_added) && !was_added;
+	success &= tmp_succ;
+	print_pass(tmp_succ);
+
+	print_over_test_str(1, "Retrieve neighbors: ");
+	tmp_succ = true;
+
+	for (unsigned long n = 0; n < NUMBER_OF_NEIGHBORS && tmp_succ; n++) {
+		unsigned char mac[ETH_MAC_LEN];
+
+		neighbor_mac(n, mac);
+
+		EthernetAddress addr(mac);
+		EthernetInterface iface(mac, "Remote Ethernet", NULL, IFFLAG_UP);
+		InterfaceRef stored = ifs.retrieve(Interface::TYPE_ETHERNET, mac);
+
+		tmp_succ = stored && stored->isStored() && ifs.stored(iface) &&
+			ifs.retrieve(iface) == stored && ifs.retrieve(addr) == stored;
+	}
+	{
+		unsigned char mac[ETH_MAC_LEN];
+
+		neighbor_mac(NUMBER_OF_NEIGHBORS, mac);
+		tmp_succ = tmp_succ && !ifs.stored(Interface::TYPE_ETHERNET, mac) &&
+			!ifs.retrieve(EthernetAddress(mac)) && !ifs.stored(Interface::TYPE_WIFI, root_mac);
+	}
+	success &= tmp_succ;
+	print_pass(tmp_succ);
+
+	print_over_test_str(1, "Age expired neighbors: ");
+	tmp_succ = ifs.age(root, &dead, &next) == NUMBER_OF_NEIGHBORS / 10 &&
+		dead.size() == NUMBER_OF_NEIGHBORS / 10 && next == lifetime + Timeval(NUMBER_OF_NEIGHBORS / 10, 0);
+
+	for (InterfaceRefList::iterator it = dead.begin(); it != dead.end() && tmp_succ; it++)
+		tmp_succ = !(*it)->isStored() && !ifs.stored(*it);
+
+	tmp_succ = tmp_succ && ifs.age(root) == 0 && ifs.stored(root);
+	success &= tmp_succ;
+	print_pass(tmp_succ);
+
+	print_over_test_str(1, "Updated neighbor does not expire: ");
+	beacon(ifs, root, NUMBER_OF_NEIGHBORS / 10, lifetime + Timeval(2 * NUMBER_OF_NEIGHBORS, 0));
+	beacon(ifs, root, NUMBER_OF_NEIGHBORS / 10 + 1, expired);
+	dead.clear();
+	tmp_succ = ifs.age(root, &dead, &next) == 1 &&
+		dead.front()->getIdentifierStr() == string("02:00:00:00:00:65") &&
+		next == lifetime + Timeval(NUMBER_OF_NEIGHBORS / 10 + 2, 0);
+	success &= tmp_succ;
+	print_pass(tmp_succ);
+
+	print_over_test_str(1, "Age TTL neighbors: ");
+	{
+		unsigned char bt_mac[BT_MAC_LEN] = { 0x02, 0x02, 0x00, 0x00, 0x00, 0x01 };
+		BluetoothInterface local(bt_mac, "Local Bluetooth", NULL, IFFLAG_UP | IFFLAG_LOCAL);
+
+		bt_root = ifs.addupdate(&local, InterfaceRef(), new ConnectivityInterfacePolicyAgeless());
+		tmp_succ = bt_root;
+
+		for (unsigned char n = 0; n < 10 && tmp_succ; n++) {
+			bt_mac[5] = n + 2;
+			BluetoothInterface iface(bt_mac, "Remote Bluetooth", NULL, IFFLAG_UP);
+			tmp_succ = ifs.addupdate(&iface, bt_root, new ConnectivityInterfacePolicyTTL(2));
+		}
+	}
+	// A TTL of 2 survives two agings, and dies in the third
+	tmp_succ = tmp_succ && ifs.age(bt_root) == 0 && ifs.age(bt_root) == 0 &&
+		ifs.age(root) == 0 && ifs.age(bt_root) == 10 && ifs.stored(bt_root);
+	success &= tmp_succ;
+	print_pass(tmp_succ);
+
+	print_over_test_str(1, "Remove parent and children: ");
+	dead.clear();
+	tmp_succ = ifs.remove(root, &dead) == NUMBER_OF_NEIGHBORS - NUMBER_OF_NEIGHBORS / 10 &&
+		dead.size() == NUMBER_OF_NEIGHBORS - NUMBER_OF_NEIGHBORS / 10 &&
+		!root->isStored() && ifs.stored(bt_root) && ifs.age(root) == 0;
+	success &= tmp_succ;
+	print_pass(tmp_succ);
+
+	print_over_test_str(1, "Beacons from the same neighbors: ");
+	{
+		EthernetInterface iface(root_mac, "Local Ethernet", NULL, IFFLAG_UP | IFFLAG_LOCAL);
+		root = ifs.addupdate(&iface, InterfaceRef(), new ConnectivityInterfacePolicyAgeless());
+	}
+	tmp_succ = root && beacons(ifs, root) == NUMBER_OF_NEIGHBORS;
+
+	for (unsigned long n = 0; n < NUMBER_OF_NEIGHBORS && tmp_succ; n++) {
+		unsigned char mac[ETH_MAC_LEN];
+
+		neighbor_mac(n, mac);
+		tmp_succ = ifs.stored(Interface::TYPE_ETHERNET, mac);
+	}
+	// Removing the parent also removes its children
+	tmp_succ = tmp_succ && ifs.age(root) == 0 && ifs.remove(root) == NUMBER_OF_NEIGHBORS + 1;
+	success &= tmp_succ;
+	print_pass(tmp_succ);
+
+	print_over_test_str(1, "Total: ");
+
+	return (success ? 0 : 1);
+}
@@ -0,0 +1,276 @@
+/* Copyright 2008 Uppsala University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "testhlp.h"
+#include "Node.h"
+#include "Interface.h"
+#include "DataObject.h"
+#include "utils.h"
+#include <haggleutils.h>
+
+using namespace haggle;
+
+/*
+	This program checks which node a received node description describes,
+	as the forwarding manager does for every node description it considers
+	forwarding, during a flood of node descriptions from many peers.
+
+	It compares creating a node from each node description, which parses
+	all of its metadata including the bloomfilter, with comparing the node
+	id that the data object decoded when it was received.
+
+	Finally, it checks what the node manager finds changed between two
+	node descriptions of the same node, and that a node description with
+	a bloomfilter delta is only sent by nodes that can apply one, and is
+	replaced by one with the resulting bloomfilter when applied.
+*/
+
+#define NUMBER_OF_NODES 200
+#define DATA_OBJECTS_PER_NODE 1000
+#define NUMBER_OF_ROUNDS 20
+
+static NodeRef nodes[NUMBER_OF_NODES];
+static DataObjectRef descriptions[NUMBER_OF_NODES];
+
+static NodeRef create_node(unsigned long n, Node::Type_t type = Node::TYPE_PEER)
+{
+	char nodeid[41], nodename[20];
+	unsigned char macaddr[6];
+
+	for (int i = 0; i < 6; i++)
+		macaddr[i] = prng_uint8();
+
+	EthernetAddress addr(macaddr);
+	InterfaceRef iface = Interface::create<EthernetInterface>(macaddr, "eth", addr, 0);
+
+	snprintf(nodeid, sizeof(nodeid), "%040lx", n + 1);
+	snprintf(nodename, sizeof(nodename), "node %lu", n + 1);
+
+	NodeRef node = Node::create_with_id(type, nodeid, nodename);
+
+	if (!node || !iface)
+		return NULL;
+
+	node->addInterface(iface);
+
+	for (int i = 0; i < DATA_OBJECTS_PER_NODE; i++) {
+		DataObjectId_t id;
+
+		for (int j = 0; j < DATAOBJECT_ID_LEN; j++)
+			id[j] = prng_uint8();
+
+		node->getBloomfilter()->add(id);
+	}
+	return node;
+}
+
+/*
+	Returns the node description of a node as it would look when received
+	from the network.
+*/
+static DataObjectRef receive(const DataObjectRef& dObj)
+{
+	unsigned char *raw;
+	size_t len;
+
+	if (!dObj || !dObj->getRawMetadataAlloc(&raw, &len))
+		return NULL;
+
+	DataObjectRef received = DataObject::create(raw, len);
+
+	free(raw);
+
+	return received;
+}
+
+static DataObjectRef receive_description(const NodeRef& node)
+{
+	return receive(node->getDataObject());
+}
+
+/*
+	Returns true if a node description has the given metadata in its node
+	metadata.
+*/
+static bool has_node_metadata(const DataObjectRef& dObj, const char *name)
+{
+	const Metadata *nm = dObj ? dObj->getMetadata()->getMetadata(NODE_METADATA) : NULL;
+
+	return nm && nm->getMetadata(name);
+}
+
+/*
+	Counts the node descriptions that describe the target, and returns
+	the number of checks per second.
+*/
+static double check_descriptions(const NodeRef& target, bool create, unsigned long *matches)
+{
+	Timeval start = Timeval::now();
+
+	*matches = 0;
+
+	for (int r = 0; r < NUMBER_OF_ROUNDS; r++) {
+		for (int i = 0; i < NUMBER_OF_NODES; i++) {
+			if (create) {
+				NodeRef descNode = Node::create(Node::TYPE_PEER, descriptions[i]);
+
+				if (descNode && descNode == target)
+					(*matches)++;
+			} else if (target->isDescribedBy(descriptions[i])) {
+				(*matches)++;
+			}
+		}
+	}
+	return (NUMBER_OF_ROUNDS * NUMBER_OF_NODES) / (Timeval::now() - start).getTimeAsSecondsDouble();
+}
+
+#if defined(OS_WINDOWS)
+int haggle_test_nodedescription(void)
+#else
+int main(int argc, char *argv[])
+#endif
+{
+	bool success = true, tmp_succ;
+	unsigned long matches;
+	double rate_create, rate_id;
+
+	// Disable tracing
+	trace_disable(true);
+
+	prng_init();
+
+	print_over_test_str_nl(0, "Node description test: ");
+
+	print_over_test_str(1, "Create node descriptions: ");
+	tmp_succ = true;
+
+	for (int i = 0; i < NUMBER_OF_NODES && tmp_succ; i++) {
+		nodes[i] = create_node(i);
+
+		if (nodes[i])
+			descriptions[i] = receive_description(nodes[i]);
+
+		tmp_succ = descriptions[i] && descriptions[i]->isNodeDescription();
+	}
+	success &= tmp_succ;
+	print_pass(tmp_succ);
+
+	if (!tmp_succ)
+		return 1;
+
+	print_over_test_str(1, "Described node id decoded: ");
+	tmp_succ = descriptions[0]->getDescribedNodeId() != NULL &&
+		memcmp(descriptions[0]->getDescribedNodeId(), nodes[0]->getId(), NODE_ID_LEN) == 0;
+	success &= tmp_succ;
+	print_pass(tmp_succ);
+
+	print_over_test_str(1, "Creating nodes: ");
+	rate_create = check_descriptions(nodes[NUMBER_OF_NODES / 2], true, &matches);
+	tmp_succ = matches == NUMBER_OF_ROUNDS;
+	printf("%.0lf checks/s ", rate_create);
+	success &= tmp_succ;
+	print_pass(tmp_succ);
+
+	print_over_test_str(1, "Comparing ids: ");
+	rate_id = check_descriptions(nodes[NUMBER_OF_NODES / 2], false, &matches);
+	tmp_succ = matches == NUMBER_OF_ROUNDS;
+	printf("%.0lf checks/s ", rate_id);
+	success &= tmp_succ;
+	print_pass(tmp_succ);
+
+	print_over_test_str(1, "Other nodes not matched: ");
+	tmp_succ = !nodes[0]->isDescribedBy(descriptions[1]) &&
+		!nodes[1]->isDescribedBy(descriptions[0]) &&
+		!nodes[0]->isDescribedBy(DataObjectRef(DataObject::create()));
+	success &= tmp_succ;
+	print_pass(tmp_succ);
+
+	print_over_test_str(1, "Changes between node descriptions: ");
+	{
+		DataObjectId_t id;
+
+		NodeRef old = Node::create(descriptions[0]);
+		NodeRef same = Node::create(receive_description(nodes[0]));
+
+		memset(id, 0xab, DATAOBJECT_ID_LEN);
+		nodes[0]->getBloomfilter()->add(id);
+		NodeRef bloomfilter = Node::create(receive_description(nodes[0]));
+
+		nodes[0]->addAttribute("Interest", "news");
+		NodeRef interests = Node::create(receive_description(nodes[0]));
+
+		NodeRef undefined = Node::create(Node::TYPE_UNDEFINED, "undefined");
+
+		tmp_succ = old && same && bloomfilter && interests &&
+			same->changesFrom(*old.getObj()) == 0 &&
+			bloomfilter->changesFrom(*old.getObj()) == NODE_CHANGED_BLOOMFILTER &&
+			interests->changesFrom(*bloomfilter.getObj()) == NODE_CHANGED_INTERESTS &&
+			interests->changesFrom(*old.getObj()) == (NODE_CHANGED_INTERESTS | NODE_CHANGED_BLOOMFILTER) &&
+			old->changesFrom(*undefined.getObj()) == NODE_CHANGED_ALL;
+	}
+	success &= tmp_succ;
+	print_pass(tmp_succ);
+
+	print_over_test_str(1, "Bloomfilter delta support advertised: ");
+	{
+		NodeRef local = create_node(NUMBER_OF_NODES, Node::TYPE_LOCAL_DEVICE);
+		NodeRef from_local = local ? Node::create(receive_description(local)) : NULL;
+		NodeRef from_peer = Node::create(receive_description(nodes[1]));
+
+		tmp_succ = from_local && from_peer &&
+			from_local->acceptsBloomfilterDelta() &&
+			!from_peer->acceptsBloomfilterDelta();
+	}
+	success &= tmp_succ;
+	print_pass(tmp_succ);
+
+	print_over_test_str(1, "Bloomfilter delta replaced when applied: ");
+	{
+		DataObjectId_t id;
+		Bloomfilter *base = Bloomfilter::create(*nodes[1]->getBloomfilter());
+
+		memset(id, 0xcd, DATAOBJECT_ID_LEN);
+		nodes[1]->getBloomfilter()->add(id);
+		nodes[1]->setBloomfilterVersion(2);
+
+		DataObjectRef delta = receive(nodes[1]->getDataObjectBloomfilterDelta(*base, 1));
+		NodeRef exact = delta ? Node::create(delta) : NULL;
+		NodeRef inexact = delta ? Node::create(delta) : NULL;
+
+		tmp_succ = exact && inexact && exact->hasBloomfilterDelta() &&
+			exact->applyBloomfilterDelta(base, 1) &&
+			exact->getBloomfilterVersion() == 2 &&
+			exact->getBloomfilter()->has(id) &&
+			memcmp(exact->getDataObject()->getId(), delta->getId(), DATAOBJECT_ID_LEN) == 0 &&
+			!has_node_metadata(exact->getDataObject(), BLOOMFILTER_DELTA_METADATA) &&
+			has_node_metadata(exact->getDataObject(), BLOOMFILTER_METADATA);
+
+		// We do not have the bloomfilter that the delta is from, so
+		// we do not know which version we end up with
+		tmp_succ = tmp_succ && !inexact->applyBloomfilterDelta(base, 3) &&
+			inexact->getBloomfilterVersion() == 0 &&
+			inexact->getBloomfilter()->has(id) &&
+			!has_node_metadata(inexact->getDataObject(), BLOOMFILTER_DELTA_METADATA) &&
+			has_node_metadata(inexact->getDataObject(), BLOOMFILTER_METADATA);
+
+		delete base;
+	}
+	success &= tmp_succ;
+	print_pass(tmp_succ);
+
+	print_over_test_str(1, "Total: ");
+
+	return (success ? 0 : 1);
+}
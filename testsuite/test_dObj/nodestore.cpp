@@ -0,0 +1,182 @@
+/* Copyright 2009 Uppsala University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "testhlp.h"
+#include "NodeStore.h"
+#include "Interface.h"
+#include <haggleutils.h>
+
+using namespace haggle;
+
+/*
+	This program stores many peer nodes in a node store, and checks that
+	they can be looked up by id, by interface and as nodes, also after
+	nodes have been updated and removed, and when they are added again.
+*/
+
+#define NUMBER_OF_NODES 5000
+
+static NodeRef nodes[NUMBER_OF_NODES];
+
+static InterfaceRef create_interface(unsigned long n, bool up)
+{
+	unsigned char macaddr[6];
+
+	macaddr[0] = 0x02;
+	macaddr[1] = (n >> 24) & 0xff;
+	macaddr[2] = (n >> 16) & 0xff;
+	macaddr[3] = (n >> 8) & 0xff;
+	macaddr[4] = n & 0xff;
+	macaddr[5] = 0x01;
+
+	EthernetAddress addr(macaddr);
+
+	return Interface::create<EthernetInterface>(macaddr, "eth", addr, up ? IFFLAG_UP : 0);
+}
+
+static NodeRef create_node(unsigned long n, bool up)
+{
+	char nodeid[41], nodename[20];
+	InterfaceRef iface = create_interface(n, up);
+
+	snprintf(nodeid, sizeof(nodeid), "%040lx", n + 1);
+	snprintf(nodename, sizeof(nodename), "node %lu", n + 1);
+
+	NodeRef node = Node::create_with_id(Node::TYPE_PEER, nodeid, nodename);
+
+	if (!node || !iface)
+		return NULL;
+
+	node->addInterface(iface);
+
+	return node;
+}
+
+#if defined(OS_WINDOWS)
+int haggle_test_nodestore(void)
+#else
+int main(int argc, char *argv[])
+#endif
+{
+	bool success = true, tmp_succ;
+	NodeRefList neighbors;
+	NodeStore ns;
+
+	// Disable tracing
+	trace_disable(true);
+
+	prng_init();
+
+	print_over_test_str_nl(0, "Node store test: ");
+
+	print_over_test_str(1, "Add nodes: ");
+	tmp_succ = true;
+
+	// Every tenth node has no interface that is up, and is therefore
+	// not a neighbor
+	for (unsigned long i = 0; i < NUMBER_OF_NODES && tmp_succ; i++) {
+		nodes[i] = create_node(i, i % 10 != 0);
+		tmp_succ = nodes[i] && ns.add(nodes[i]) && nodes[i]->isStored();
+	}
+	tmp_succ = tmp_succ && !ns.add(nodes[0]);
+	success &= tmp_succ;
+	print_pass(tmp_succ);
+
+	print_over_test_str(1, "Retrieve by id: ");
+	tmp_succ = true;
+
+	for (unsigned long i = 0; i < NUMBER_OF_NODES && tmp_succ; i++) {
+		tmp_succ = ns.retrieve(string(nodes[i]->getIdStr())) == nodes[i] &&
+			ns.retrieve(nodes[i]->getId()) == nodes[i] &&
+			ns.stored(nodes[i]->getId());
+	}
+	tmp_succ = tmp_succ && !ns.retrieve(string("0123456789012345678901234567890123456789"));
+	tmp_succ = tmp_succ && !ns.retrieve(string(nodes[0]->getIdStr()), true) &&
+		ns.retrieve(string(nodes[1]->getIdStr()), true) == nodes[1];
+	success &= tmp_succ;
+	print_pass(tmp_succ);
+
+	print_over_test_str(1, "Retrieve by interface: ");
+	tmp_succ = true;
+
+	for (unsigned long i = 0; i < NUMBER_OF_NODES && tmp_succ; i++) {
+		// An equal interface object, rather than the node's own
+		tmp_succ = ns.retrieve(create_interface(i, false)) == nodes[i];
+	}
+	tmp_succ = tmp_succ && !ns.retrieve(create_interface(NUMBER_OF_NODES, false));
+	success &= tmp_succ;
+	print_pass(tmp_succ);
+
+	print_over_test_str(1, "Undefined node matches interface: ");
+	{
+		NodeRef undefined = Node::create(Node::TYPE_UNDEFINED, "undefined");
+		undefined->addInterface(create_interface(7, false));
+		tmp_succ = ns.retrieve(undefined) == nodes[7] && ns.stored(*undefined.getObj());
+	}
+	success &= tmp_succ;
+	print_pass(tmp_succ);
+
+	print_over_test_str(1, "Neighbors: ");
+	tmp_succ = ns.retrieveNeighbors(neighbors) == NUMBER_OF_NODES - NUMBER_OF_NODES / 10 &&
+		ns.numNeighbors() == NUMBER_OF_NODES - NUMBER_OF_NODES / 10;
+	success &= tmp_succ;
+	print_pass(tmp_succ);
+
+	print_over_test_str(1, "Update undefined node: ");
+	{
+		NodeRef undefined = Node::create(Node::TYPE_UNDEFINED, "undefined");
+		NodeRef peer = create_node(NUMBER_OF_NODES, false);
+		NodeRefList nl;
+
+		undefined->addInterface(create_interface(NUMBER_OF_NODES, true));
+		tmp_succ = ns.add(undefined) && ns.retrieve(create_interface(NUMBER_OF_NODES, false), true) == undefined;
+		tmp_succ = tmp_succ && ns.update(peer, &nl) && nl.size() == 1 && nl.front() == undefined;
+		// The peer's interface is up, since it was up in the undefined node
+		tmp_succ = tmp_succ && !undefined->isStored() && peer->isStored() && peer->isNeighbor() &&
+			ns.retrieve(create_interface(NUMBER_OF_NODES, false)) == peer &&
+			ns.retrieve(string(peer->getIdStr())) == peer;
+		tmp_succ = tmp_succ && ns.remove(peer) && !ns.retrieve(string(peer->getIdStr()));
+	}
+	success &= tmp_succ;
+	print_pass(tmp_succ);
+
+	print_over_test_str(1, "Remove nodes: ");
+	tmp_succ = ns.remove(create_interface(3, false)) == nodes[3] && !nodes[3]->isStored() &&
+		!ns.retrieve(string(nodes[3]->getIdStr())) && ns.remove(nodes[4]) &&
+		!ns.retrieve(create_interface(4, false)) && !ns.remove(nodes[4]) &&
+		ns.remove(Node::TYPE_PEER) == NUMBER_OF_NODES - 2 && !ns.retrieve(nodes[5]) &&
+		ns.numNeighbors() == 0;
+	success &= tmp_succ;
+	print_pass(tmp_succ);
+
+	print_over_test_str(1, "Add removed nodes again: ");
+	tmp_succ = true;
+
+	for (unsigned long i = 0; i < NUMBER_OF_NODES && tmp_succ; i++) {
+		tmp_succ = ns.add(nodes[i]) && nodes[i]->isStored();
+	}
+	for (unsigned long i = 0; i < NUMBER_OF_NODES && tmp_succ; i++) {
+		tmp_succ = ns.retrieve(string(nodes[i]->getIdStr())) == nodes[i] &&
+			ns.retrieve(create_interface(i, false)) == nodes[i];
+	}
+	neighbors.clear();
+	tmp_succ = tmp_succ && ns.retrieveNeighbors(neighbors) == NUMBER_OF_NODES - NUMBER_OF_NODES / 10;
+	success &= tmp_succ;
+	print_pass(tmp_succ);
+
+	print_over_test_str(1, "Total: ");
+
+	return (success ? 0 : 1);
+}
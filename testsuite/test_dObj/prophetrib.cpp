@@ -0,0 +1,419 @@
+/* Copyright 2009 Uppsala University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "testhlp.h"
+#include "ProphetRIB.h"
+#include "ForwarderProphet.h"
+#include "Node.h"
+#include <libcpphaggle/Map.h>
+#include <libcpphaggle/Pair.h>
+#include <haggleutils.h>
+#include <base64.h>
+#include <math.h>
+
+using namespace haggle;
+
+/*
+	This program ages the PRoPHET metrics of a local node that knows many
+	destinations, and checks that each metric is aged by gamma^K, where K
+	is the number of whole aging time units since it was last aged, and
+	that the rest of a time unit counts towards the next aging. It then
+	measures the rate at which all metrics can be aged and looked up, as
+	the Prophet forwarder does when it generates targets for a neighbor.
+	Aging all metrics in one pass and then reading them is compared with
+	aging each metric in a map when it is looked up, which reads the
+	clock and computes gamma^K for every lookup, as the forwarder used to.
+
+	It then selects the best targets among all destinations, and checks
+	that they are the ones with the highest metrics, in order of
+	decreasing metric, also when there are fewer candidates than targets.
+
+	Finally, it encodes a RIB in the binary format that it is sent in,
+	decodes it again, and checks that malformed routing information is
+	rejected.
+*/
+
+#define NUMBER_OF_DESTINATIONS 10000
+#define NUMBER_OF_ROUNDS 50
+#define GAMMA 0.999
+#define AGING_TIME_UNIT 600
+#define NUMBER_OF_TARGETS 10
+#define NUMBER_OF_SELECTIONS 5
+
+typedef Pair<double, Timeval> metric_t;
+typedef Map<prophet_node_id_t, metric_t> rib_t;
+
+static double initial[NUMBER_OF_DESTINATIONS];
+
+/*
+	Ages a metric when it is looked up. Only used to measure the rate of
+	lookups; the result is checked against gamma^K like the RIB's.
+*/
+static metric_t& age_on_lookup(metric_t& metric)
+{
+	Timeval now = Timeval::now();
+	long K = (long)((now - metric.second).getSeconds() / AGING_TIME_UNIT);
+
+	if (K > 0) {
+		metric.first = metric.first * pow(GAMMA, K);
+
+		if (metric.first < 0.000001)
+			metric.first = 0.0;
+
+		metric.second = now;
+	}
+	return metric;
+}
+
+static double lookup_lazy(rib_t& rib, double *sum)
+{
+	Timeval start = Timeval::now();
+
+	for (int r = 0; r < NUMBER_OF_ROUNDS; r++) {
+		*sum = 0;
+
+		for (prophet_node_id_t id = 0; id < NUMBER_OF_DESTINATIONS; id++)
+			*sum += age_on_lookup(rib[id]).first;
+	}
+	return (NUMBER_OF_ROUNDS * NUMBER_OF_DESTINATIONS) / (Timeval::now() - start).getTimeAsSecondsDouble();
+}
+
+static double lookup_batch(ProphetRIB& rib, double *sum)
+{
+	Timeval start = Timeval::now();
+
+	for (int r = 0; r < NUMBER_OF_ROUNDS; r++) {
+		*sum = 0;
+
+		rib.age();
+
+		for (prophet_node_id_t id = 0; id < NUMBER_OF_DESTINATIONS; id++)
+			*sum += rib.get(id);
+	}
+	return (NUMBER_OF_ROUNDS * NUMBER_OF_DESTINATIONS) / (Timeval::now() - start).getTimeAsSecondsDouble();
+}
+
+static const char *node_id_str(prophet_node_id_t id)
+{
+	static char str[MAX_NODE_ID_STR_LEN];
+
+	snprintf(str, sizeof(str), "%040lx", id + 1);
+
+	return str;
+}
+
+/*
+	Selects the best targets among the destinations with a higher metric
+	than ours, and returns the number of selections per second.
+*/
+static double select_targets(ProphetTopK **best)
+{
+	Timeval start = Timeval::now();
+
+	for (int r = 0; r < NUMBER_OF_SELECTIONS; r++) {
+		if (*best)
+			delete *best;
+
+		*best = new ProphetTopK(NUMBER_OF_TARGETS);
+
+		for (prophet_node_id_t id = 0; id < NUMBER_OF_DESTINATIONS; id++) {
+			if (initial[id] > 0.5)
+				(*best)->insert(id, initial[id]);
+		}
+		(*best)->sort();
+	}
+	return NUMBER_OF_SELECTIONS / (Timeval::now() - start).getTimeAsSecondsDouble();
+}
+
+/*
+	Checks that the selected candidates are sorted by decreasing metric,
+	and have the metrics of their id numbers.
+*/
+static bool check_sorted(const ProphetTopK& best, const double *metrics)
+{
+	for (unsigned long i = 0; i < best.size(); i++) {
+		if (best.getMetric(i) != metrics[best.getId(i)])
+			return false;
+
+		if (i > 0 && best.getMetric(i) > best.getMetric(i - 1))
+			return false;
+	}
+	return true;
+}
+
+/*
+	Encodes the metrics of the given number of nodes in the binary RIB
+	format, and returns it base64 encoded. Entries whose node id is not
+	valid are left out.
+*/
+static string encode_rib(const double *metrics, unsigned long n, size_t extra_bytes = 0)
+{
+	unsigned char *entries = (unsigned char *)malloc(n * PROPHET_WIRE_ENTRY_LEN + extra_bytes + 1);
+	size_t len = 0;
+	char *b64 = NULL;
+	string str;
+
+	if (!entries)
+		return str;
+
+	for (unsigned long i = 0; i < n; i++) {
+		if (prophet_wire_put_entry(entries + len, node_id_str(i), prophet_metric_to_wire(metrics[i])))
+			len += PROPHET_WIRE_ENTRY_LEN;
+	}
+	memset(entries + len, 0, extra_bytes);
+	len += extra_bytes;
+
+	if (base64_encode_alloc((char *)entries, len, &b64) && b64) {
+		str = b64;
+		free(b64);
+	}
+	free(entries);
+
+	return str;
+}
+
+#if defined(OS_WINDOWS)
+int haggle_test_prophetrib(void)
+#else
+int main(int argc, char *argv[])
+#endif
+{
+	bool success = true, tmp_succ;
+	double rate_lazy, rate_batch, sum_lazy, sum_batch, sum_expected = 0, rate_top_k;
+	ProphetTopK *best_targets = NULL;
+	Timeval then = Timeval::now() - Timeval(3 * AGING_TIME_UNIT, 0);
+	ProphetRIB rib(GAMMA, AGING_TIME_UNIT);
+	rib_t lazy_rib;
+
+	// Disable tracing
+	trace_disable(true);
+
+	prng_init();
+
+	print_over_test_str_nl(0, "PRoPHET RIB test: ");
+
+	print_over_test_str(1, "Create RIBs: ");
+	tmp_succ = true;
+
+	for (prophet_node_id_t id = 0; id < NUMBER_OF_DESTINATIONS && tmp_succ; id++) {
+		initial[id] = (prng_uint32() % 1000 + 1) / 1000.0;
+		tmp_succ = rib.set(id, initial[id], then);
+		lazy_rib[id] = make_pair(initial[id], then);
+	}
+	success &= tmp_succ;
+	print_pass(tmp_succ);
+
+	print_over_test_str(1, "Metrics aged by gamma^K: ");
+	tmp_succ = rib.age() == NUMBER_OF_DESTINATIONS;
+
+	for (prophet_node_id_t id = 0; id < NUMBER_OF_DESTINATIONS && tmp_succ; id++)
+		tmp_succ = fabs(rib.get(id) - initial[id] * pow(GAMMA, 3)) < 0.000001;
+
+	success &= tmp_succ;
+	print_pass(tmp_succ);
+
+	print_over_test_str(1, "Aged once per time unit: ");
+	tmp_succ = rib.age() == 0 && fabs(rib.get(0) - initial[0] * pow(GAMMA, 3)) < 0.000001;
+	success &= tmp_succ;
+	print_pass(tmp_succ);
+
+	print_over_test_str(1, "Rest of a time unit carried over: ");
+	{
+		ProphetRIB prib(GAMMA, AGING_TIME_UNIT);
+		Timeval now = Timeval::now();
+		Timeval aged = now - Timeval(AGING_TIME_UNIT * 3 / 2, 0);
+
+		// 1.5 time units: aged once, with half a time unit left
+		tmp_succ = prib.set(0, 0.5, aged) && prib.age(now) == 1 &&
+			fabs(prib.get(0) - 0.5 * GAMMA) < 0.000001 &&
+			fabs((prib.getAgedTime(0) - aged).getTimeAsSecondsDouble() - AGING_TIME_UNIT) < 0.001;
+
+		// The half time unit left and 0.4 more is not a whole one
+		tmp_succ = tmp_succ && prib.age(now + Timeval(AGING_TIME_UNIT * 2 / 5, 0)) == 0 &&
+			fabs(prib.get(0) - 0.5 * GAMMA) < 0.000001;
+
+		// but with 0.6 more it is
+		tmp_succ = tmp_succ && prib.age(now + Timeval(AGING_TIME_UNIT * 3 / 5, 0)) == 1 &&
+			fabs(prib.get(0) - 0.5 * GAMMA * GAMMA) < 0.000001;
+	}
+	success &= tmp_succ;
+	print_pass(tmp_succ);
+
+	print_over_test_str(1, "Aged past precomputed powers: ");
+	{
+		ProphetRIB prib(GAMMA, AGING_TIME_UNIT);
+		Timeval now = Timeval::now();
+
+		tmp_succ = prib.set(0, 0.5, now - Timeval(100 * AGING_TIME_UNIT, 0)) &&
+			prib.age(now) == 1 && fabs(prib.get(0) - 0.5 * pow(GAMMA, 100)) < 0.000001;
+	}
+	success &= tmp_succ;
+	print_pass(tmp_succ);
+
+	print_over_test_str(1, "Small metrics set to zero: ");
+	rib.set(0, 0.0000010005, then);
+	rib.age();
+	tmp_succ = rib.get(0) == 0.0;
+	success &= tmp_succ;
+	print_pass(tmp_succ);
+
+	print_over_test_str(1, "Lookups do not grow RIB: ");
+	tmp_succ = rib.get(2 * NUMBER_OF_DESTINATIONS) == 0.0 && rib.end() == NUMBER_OF_DESTINATIONS;
+	success &= tmp_succ;
+	print_pass(tmp_succ);
+
+	// Metric 0 was set to zero above
+	for (prophet_node_id_t id = 1; id < NUMBER_OF_DESTINATIONS; id++)
+		sum_expected += initial[id] * pow(GAMMA, 3);
+
+	print_over_test_str(1, "Aging on lookup: ");
+	lazy_rib[0].first = 0.0;
+	rate_lazy = lookup_lazy(lazy_rib, &sum_lazy);
+	tmp_succ = fabs(sum_lazy - sum_expected) < 0.001;
+	printf("%.0lf lookups/s ", rate_lazy);
+	success &= tmp_succ;
+	print_pass(tmp_succ);
+
+	print_over_test_str(1, "Aging in one pass: ");
+	rate_batch = lookup_batch(rib, &sum_batch);
+	tmp_succ = fabs(sum_batch - sum_expected) < 0.001;
+	printf("%.0lf lookups/s (%.0lfx) ", rate_batch, rate_batch / rate_lazy);
+	success &= tmp_succ;
+	print_pass(tmp_succ);
+
+	print_over_test_str(1, "Top-k selection: ");
+	tmp_succ = true;
+	{
+		ProphetTopK best(3);
+		double metrics[] = { 0.2, 0.9, 0.1, 0.5, 0.7, 0.3 };
+
+		for (prophet_node_id_t id = 0; id < 6; id++)
+			best.insert(id, metrics[id]);
+
+		best.sort();
+		tmp_succ = best.size() == 3 && best.getId(0) == 1 && best.getId(1) == 4 && best.getId(2) == 3;
+	}
+	success &= tmp_succ;
+	print_pass(tmp_succ);
+
+	print_over_test_str(1, "Top-k with k = 0: ");
+	{
+		ProphetTopK best(0);
+
+		tmp_succ = !best.insert(1, 0.5) && best.size() == 0;
+		best.sort();
+		tmp_succ = tmp_succ && best.size() == 0;
+	}
+	success &= tmp_succ;
+	print_pass(tmp_succ);
+
+	print_over_test_str(1, "Top-k with k > n: ");
+	{
+		ProphetTopK best(10);
+		double metrics[] = { 0.3, 0.8, 0.1, 0.6 };
+
+		for (prophet_node_id_t id = 0; id < 4; id++)
+			tmp_succ = best.insert(id, metrics[id]);
+
+		best.sort();
+		tmp_succ = tmp_succ && best.size() == 4 && check_sorted(best, metrics) &&
+			best.getId(0) == 1 && best.getId(1) == 3 && best.getId(2) == 0 && best.getId(3) == 2;
+	}
+	success &= tmp_succ;
+	print_pass(tmp_succ);
+
+	print_over_test_str(1, "Targets by top-k: ");
+	rate_top_k = select_targets(&best_targets);
+	tmp_succ = best_targets->size() == NUMBER_OF_TARGETS && check_sorted(*best_targets, initial);
+
+	// No destination that was not selected has a higher metric than
+	// the selected ones
+	if (tmp_succ) {
+		unsigned long higher = 0;
+		double worst = best_targets->getMetric(NUMBER_OF_TARGETS - 1);
+
+		for (prophet_node_id_t id = 0; id < NUMBER_OF_DESTINATIONS; id++) {
+			if (initial[id] > worst)
+				higher++;
+		}
+		tmp_succ = higher < NUMBER_OF_TARGETS;
+	}
+	delete best_targets;
+
+	printf("%.1lf selections/s ", rate_top_k);
+	success &= tmp_succ;
+	print_pass(tmp_succ);
+
+	print_over_test_str(1, "Binary RIB round trip: ");
+	{
+		double metrics[] = { 0.0, 1.0, 0.5, 0.000001, 0.999999, 1.5, -0.5, 0.123456 };
+		unsigned long n = sizeof(metrics) / sizeof(metrics[0]);
+		unsigned char *entries = NULL;
+		size_t len = 0;
+
+		tmp_succ = prophet_metric_to_wire(1.0) == PROPHET_WIRE_METRIC_MAX &&
+			prophet_metric_to_wire(-0.5) == 0 &&
+			prophet_wire_decode(encode_rib(metrics, n), &entries, &len) &&
+			len == n * PROPHET_WIRE_ENTRY_LEN;
+
+		for (unsigned long i = 0; tmp_succ && i < n; i++) {
+			string id;
+			prophet_wire_metric_t q;
+			double P = metrics[i] < 0.0 ? 0.0 : (metrics[i] > 1.0 ? 1.0 : metrics[i]);
+
+			prophet_wire_get_entry(entries + i * PROPHET_WIRE_ENTRY_LEN, id, q);
+
+			tmp_succ = id == node_id_str(i) &&
+				fabs(prophet_metric_from_wire(q) - P) <= 0.5 / PROPHET_WIRE_METRIC_MAX;
+		}
+		if (entries)
+			free(entries);
+
+		// Node ids that are not 40 hex digits have no raw form
+		unsigned char entry[PROPHET_WIRE_ENTRY_LEN];
+
+		tmp_succ = tmp_succ && !prophet_wire_put_entry(entry, "0123", 1) &&
+			!prophet_wire_put_entry(entry, "0123456789abcdef0123456789abcdefxxxxxxxx", 1);
+	}
+	success &= tmp_succ;
+	print_pass(tmp_succ);
+
+	print_over_test_str(1, "Malformed binary RIB rejected: ");
+	{
+		double metrics[] = { 0.1, 0.2, 0.3 };
+		unsigned char *entries = NULL;
+		size_t len = 0;
+
+		// An empty RIB is a valid delta
+		tmp_succ = prophet_wire_decode("", &entries, &len) && len == 0;
+
+		if (entries)
+			free(entries);
+
+		tmp_succ = tmp_succ &&
+			!prophet_wire_decode(encode_rib(metrics, 3, 1), &entries, &len) &&
+			!entries && len == 0 &&
+			!prophet_wire_decode(encode_rib(metrics, 3, PROPHET_WIRE_ENTRY_LEN - 1), &entries, &len) &&
+			!prophet_wire_decode(encode_rib(metrics, 3).substr(0, 10), &entries, &len) &&
+			!prophet_wire_decode("!!!! not base64 ????", &entries, &len) &&
+			!entries && len == 0;
+	}
+	success &= tmp_succ;
+	print_pass(tmp_succ);
+
+	print_over_test_str(1, "Total: ");
+
+	return (success ? 0 : 1);
+}
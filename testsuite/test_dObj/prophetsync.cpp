@@ -0,0 +1,340 @@
+/* Copyright 2008-2009 Uppsala University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "testhlp.h"
+#include "ForwarderProphet.h"
+#include "ForwardingManager.h"
+#include "HaggleKernel.h"
+#include <haggleutils.h>
+#include <string.h>
+
+#if defined(OS_WINDOWS)
+#define usleep(n) Sleep((n)/1000)
+#endif
+
+using namespace haggle;
+
+/*
+	This program runs the Prophet forwarders of two nodes, A and B, and
+	passes the routing information that they create for each other
+	between them, the way the forwarding manager does when it is sent.
+
+	A node first gets routing information in the text format, which tells
+	it that the other node can decode the binary format. After that, it
+	gets full binary RIBs until the sender knows that one got there, and
+	then deltas from the last one that got there. A node that gets a
+	delta from routing information that it does not have asks for a full
+	RIB again.
+
+	The kernels are not started, so the routing information is not sent,
+	and the forwarders are told whether it got there.
+*/
+
+#define MANAGER_NAME "ForwardingManager"
+// The event type that the forwarders return their tasks to the test in
+#define TASK_EVENT_TYPE EVENT_TYPE_PRIVATE_MIN
+// How long to wait for a forwarder to create routing information
+#define EVENT_TIMEOUT_MSECS 5000
+
+typedef struct {
+	HaggleKernel *kernel;
+	// The Prophet forwarder hides the newRoutingInformation() that
+	// takes a data object
+	ForwarderAsynchronous *forwarder;
+	NodeRef node;
+} prophet_node_t;
+
+static NodeRef create_node(unsigned long n)
+{
+	char nodeid[41], nodename[20];
+
+	snprintf(nodeid, sizeof(nodeid), "%040lx", n);
+	snprintf(nodename, sizeof(nodename), "node %lu", n);
+
+	return Node::create_with_id(Node::TYPE_PEER, nodeid, nodename);
+}
+
+/*
+	Starts the forwarder of a node. The kernel is not initialized, since
+	it has no data store, and the manager and forwarder are not deleted,
+	since the manager would remove its configuration filter from the data
+	store.
+*/
+static bool start_node(prophet_node_t *pn, unsigned long n)
+{
+	pn->node = create_node(n);
+
+	if (!pn->node)
+		return false;
+
+	pn->kernel = new HaggleKernel(NULL);
+	pn->kernel->setThisNode(pn->node);
+	pn->forwarder = new ForwarderProphet(new ForwardingManager(pn->kernel), TASK_EVENT_TYPE);
+
+	return pn->forwarder->start();
+}
+
+static void stop_node(prophet_node_t *pn)
+{
+	pn->forwarder->quit();
+
+	while (!pn->kernel->empty()) {
+		Event *e = pn->kernel->getNextEvent();
+
+		if (e->getData())
+			delete static_cast<ForwardingTask *>(e->getData());
+
+		delete e;
+	}
+}
+
+/*
+	Has the forwarder of a node create routing information for a
+	neighbor, and returns it, or NULL if it does not within
+	EVENT_TIMEOUT_MSECS.
+*/
+static DataObjectRef routing_info(prophet_node_t *pn, const NodeRef& neighbor)
+{
+	DataObjectRef dObj;
+
+	pn->forwarder->generateRoutingInformationDataObject(neighbor);
+
+	for (int i = 0; i < EVENT_TIMEOUT_MSECS && pn->kernel->empty(); i++)
+		usleep(1000);
+
+	if (pn->kernel->empty())
+		return NULL;
+
+	Event *e = pn->kernel->getNextEvent();
+	ForwardingTask *task = static_cast<ForwardingTask *>(e->getData());
+
+	if (task) {
+		dObj = task->getDataObject();
+		delete task;
+	}
+	delete e;
+
+	return dObj;
+}
+
+static const Metadata *prophet_metadata(const DataObjectRef& dObj)
+{
+	if (!dObj)
+		return NULL;
+
+	const Metadata *m = dObj->getMetadata()->getMetadata(MANAGER_NAME);
+
+	return m ? m->getMetadata(PROPHET_NAME) : NULL;
+}
+
+/*
+	Returns the value of a parameter of routing information, or an empty
+	string if it does not have the parameter.
+*/
+static string param(const DataObjectRef& dObj, const char *name)
+{
+	const Metadata *m = prophet_metadata(dObj);
+	const char *value = m ? m->getParameter(name) : NULL;
+
+	return value ? value : "";
+}
+
+/*
+	Checks that routing information is binary, full or a delta, and has
+	the given sequence numbers.
+*/
+static bool is_binary(const DataObjectRef& dObj, bool full, const char *seq, const char *base = "")
+{
+	return param(dObj, "encoding") == "binary" &&
+		param(dObj, "sync") == (full ? "full" : "delta") &&
+		param(dObj, "seq") == seq && param(dObj, "base") == base;
+}
+
+/*
+	Returns the number of entries in binary routing information, and
+	checks that each of the given nodes has one, or returns -1.
+*/
+static long num_entries(const DataObjectRef& dObj, const NodeRef& n1 = NULL, const NodeRef& n2 = NULL)
+{
+	const Metadata *m = prophet_metadata(dObj);
+	unsigned char *entries = NULL;
+	size_t len = 0;
+	bool found1 = !n1, found2 = !n2;
+
+	if (!m || !prophet_wire_decode(m->getContent(), &entries, &len))
+		return -1;
+
+	for (size_t i = 0; i < len; i += PROPHET_WIRE_ENTRY_LEN) {
+		string id;
+		prophet_wire_metric_t q;
+
+		prophet_wire_get_entry(entries + i, id, q);
+
+		if (n1 && id == n1->getIdStr())
+			found1 = true;
+		if (n2 && id == n2->getIdStr())
+			found2 = true;
+	}
+	if (entries)
+		free(entries);
+
+	return found1 && found2 ? (long)(len / PROPHET_WIRE_ENTRY_LEN) : -1;
+}
+
+#if defined(OS_WINDOWS)
+int haggle_test_prophetsync(void)
+#else
+int main(int argc, char *argv[])
+#endif
+{
+	bool success = true, tmp_succ;
+	prophet_node_t a, b, restarted_b;
+	NodeRef c = create_node(3), d = create_node(4);
+	DataObjectRef dObj, full, delta, from_b;
+
+	// Disable tracing
+	trace_disable(true);
+
+	print_over_test_str_nl(0, "Prophet routing information test: ");
+
+	print_over_test_str(1, "Start forwarders: ");
+	tmp_succ = c && d && start_node(&a, 1) && start_node(&b, 2);
+	success &= tmp_succ;
+	print_pass(tmp_succ);
+
+	if (!tmp_succ) {
+		print_over_test_str(1, "Total: ");
+		return 1;
+	}
+
+	// A has met B, so it has a metric for it
+	a.forwarder->newNeighbor(b.node);
+
+	print_over_test_str(1, "Text to unknown neighbor: ");
+	dObj = routing_info(&a, b.node);
+	tmp_succ = dObj && param(dObj, "encoding") == "" && param(dObj, "accept") == "binary" &&
+		prophet_metadata(dObj)->getMetadata("Metric") &&
+		prophet_metadata(dObj)->getMetadata("Metric")->getParameter("node_id") == string(b.node->getIdStr());
+	success &= tmp_succ;
+	print_pass(tmp_succ);
+
+	print_over_test_str(1, "Binary after announcement: ");
+	// B learns from the text that A can decode binary, and A learns it
+	// from what B sends back
+	if (dObj)
+		b.forwarder->newRoutingInformation(dObj);
+	dObj = routing_info(&b, a.node);
+	tmp_succ = is_binary(dObj, true, "1") && num_entries(dObj) == 0;
+
+	if (dObj)
+		a.forwarder->newRoutingInformation(dObj);
+	full = routing_info(&a, b.node);
+	tmp_succ = tmp_succ && is_binary(full, true, "1") && num_entries(full, b.node) == 1;
+	success &= tmp_succ;
+	print_pass(tmp_succ);
+
+	print_over_test_str(1, "Full until acknowledged: ");
+	// Neither the first full RIB, nor one that could not be sent, is
+	// known to have got there
+	a.forwarder->routingInformationSendResult(full, b.node, false);
+	full = routing_info(&a, b.node);
+	tmp_succ = is_binary(full, true, "2") && num_entries(full, b.node) == 1;
+	success &= tmp_succ;
+	print_pass(tmp_succ);
+
+	print_over_test_str(1, "Delta after acknowledged: ");
+	// Only the metric for the node that A just met has changed
+	a.forwarder->routingInformationSendResult(full, b.node, true);
+	a.forwarder->newNeighbor(c);
+	delta = routing_info(&a, b.node);
+	tmp_succ = is_binary(delta, false, "3", "2") && num_entries(delta, c) == 1;
+	success &= tmp_succ;
+	print_pass(tmp_succ);
+
+	print_over_test_str(1, "Unacknowledged delta resent: ");
+	// B may or may not have got the last delta, so the next one is still
+	// from the full RIB, and has its metrics too
+	a.forwarder->routingInformationSendResult(delta, b.node, false);
+	a.forwarder->newNeighbor(d);
+	delta = routing_info(&a, b.node);
+	tmp_succ = is_binary(delta, false, "4", "2") && num_entries(delta, c, d) == 2;
+
+	a.forwarder->routingInformationSendResult(delta, b.node, true);
+	dObj = routing_info(&a, b.node);
+	tmp_succ = tmp_succ && is_binary(dObj, false, "5", "4") && num_entries(dObj) == 0;
+	success &= tmp_succ;
+	print_pass(tmp_succ);
+
+	print_over_test_str(1, "Delta from what we have: ");
+	// B got the full RIB that A got to know about, and then the delta
+	// from it, so it does not ask for a full RIB
+	b.forwarder->newRoutingInformation(full);
+	b.forwarder->newRoutingInformation(delta);
+	from_b = routing_info(&b, a.node);
+	tmp_succ = is_binary(from_b, true, "2") && param(from_b, "resync") == "";
+	success &= tmp_succ;
+	print_pass(tmp_succ);
+
+	print_over_test_str(1, "Resync after missed delta: ");
+	// B restarts, and then gets a delta from a RIB that it does not have
+	tmp_succ = start_node(&restarted_b, 2);
+
+	if (tmp_succ) {
+		restarted_b.forwarder->newRoutingInformation(delta);
+		dObj = routing_info(&restarted_b, a.node);
+		tmp_succ = is_binary(dObj, true, "1") && param(dObj, "resync") == "true";
+	}
+	success &= tmp_succ;
+	print_pass(tmp_succ);
+
+	print_over_test_str(1, "Full after resync: ");
+	if (dObj)
+		a.forwarder->newRoutingInformation(dObj);
+	full = routing_info(&a, b.node);
+	tmp_succ = is_binary(full, true, "6") && num_entries(full, c, d) == 3;
+
+	// It asks until it gets one
+	if (full) {
+		restarted_b.forwarder->newRoutingInformation(full);
+		dObj = routing_info(&restarted_b, a.node);
+		tmp_succ = tmp_succ && param(dObj, "resync") == "";
+	}
+	success &= tmp_succ;
+	print_pass(tmp_succ);
+
+	print_over_test_str(1, "Full after neighbor sends text: ");
+	// A neighbor that sends text, e.g., since it restarted, does not have
+	// what we sent it in binary
+	b.forwarder->routingInformationSendResult(from_b, a.node, true);
+	dObj = routing_info(&b, a.node);
+	tmp_succ = is_binary(dObj, false, "3", "2");
+	dObj = routing_info(&a, c);
+	tmp_succ = tmp_succ && param(dObj, "encoding") == "";
+
+	if (dObj)
+		b.forwarder->newRoutingInformation(dObj);
+	dObj = routing_info(&b, a.node);
+	tmp_succ = tmp_succ && is_binary(dObj, true, "4");
+	success &= tmp_succ;
+	print_pass(tmp_succ);
+
+	stop_node(&a);
+	stop_node(&b);
+	stop_node(&restarted_b);
+
+	print_over_test_str(1, "Total: ");
+
+	return (success ? 0 : 1);
+}
@@ -0,0 +1,139 @@
+/* Copyright 2008-2009 Uppsala University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "testhlp.h"
+#include "HaggleKernel.h"
+#include "ProtocolManager.h"
+#include "ProtocolTCP.h"
+#include "ProtocolUDP.h"
+#include "Interface.h"
+#include <haggleutils.h>
+
+using namespace haggle;
+
+/*
+	This program gets sender protocols from a protocol manager, the way
+	it does when data objects are sent. A TCP neighbor gets a new sender
+	the first time, which is then reused from the sender pool, and an
+	application interface gets the UDP application protocol, which is
+	registered with the manager but not pooled.
+
+	The kernel is not started, so no events are processed and no
+	protocol is run.
+*/
+
+#define APPLICATION_PORT 9797
+
+class TestProtocolManager : public ProtocolManager
+{
+public:
+	TestProtocolManager(HaggleKernel *_kernel) : ProtocolManager(_kernel) {}
+	bool add(Protocol *p) { return registerProtocol(p); }
+	Protocol *sender(const ProtType_t type, const InterfaceRef& iface) { return getSenderProtocol(type, iface); }
+};
+
+#if defined(OS_WINDOWS)
+int haggle_test_protocolmanager(void)
+#else
+int main(int argc, char *argv[])
+#endif
+{
+	bool success = true, tmp_succ;
+	unsigned char local_mac[ETH_MAC_LEN] = { 0x02, 0x01, 0x00, 0x00, 0x00, 0x01 };
+	unsigned char peer_mac[ETH_MAC_LEN] = { 0x02, 0x01, 0x00, 0x00, 0x00, 0x02 };
+	unsigned char other_mac[ETH_MAC_LEN] = { 0x02, 0x01, 0x00, 0x00, 0x00, 0x03 };
+	struct in_addr loopback;
+	InterfaceRef localIface, peerIface, otherIface, appIface;
+	Protocol *p, *tcp, *udp;
+
+	// Disable tracing
+	trace_disable(true);
+
+	// The kernel has no data store, so it is not initialized, and the
+	// manager is not deleted, since it would remove its configuration
+	// filter from the data store.
+	HaggleKernel *kernel = new HaggleKernel(NULL);
+	TestProtocolManager *pm = new TestProtocolManager(kernel);
+
+	loopback.s_addr = htonl(INADDR_LOOPBACK);
+
+	{
+		IPv4Address addr(loopback, TransportTCP(0));
+		EthernetInterface iface(local_mac, "Local Ethernet", &addr, IFFLAG_UP | IFFLAG_LOCAL);
+		localIface = kernel->getInterfaceStore()->addupdate(&iface, InterfaceRef(), new ConnectivityInterfacePolicyAgeless());
+	}
+	{
+		IPv4Address addr(loopback, TransportTCP(TCP_DEFAULT_PORT));
+		EthernetInterface iface(peer_mac, "Remote Ethernet", &addr, IFFLAG_UP);
+		peerIface = kernel->getInterfaceStore()->addupdate(&iface, localIface, new ConnectivityInterfacePolicyAgeless());
+	}
+	{
+		IPv4Address addr(loopback, TransportTCP(TCP_DEFAULT_PORT));
+		EthernetInterface iface(other_mac, "Remote Ethernet", &addr, IFFLAG_UP);
+		otherIface = kernel->getInterfaceStore()->addupdate(&iface, localIface, new ConnectivityInterfacePolicyAgeless());
+	}
+
+	print_over_test_str_nl(0, "Protocol manager test: ");
+
+	print_over_test_str(1, "Create TCP sender: ");
+	tcp = pm->sender(Protocol::TYPE_TCP, peerIface);
+	tmp_succ = tcp && tcp->getType() == Protocol::TYPE_TCP && tcp->isForInterface(peerIface);
+	print_pass(tmp_succ);
+	success &= tmp_succ;
+
+	print_over_test_str(1, "Reuse pooled TCP sender: ");
+	tmp_succ = tcp && pm->sender(Protocol::TYPE_TCP, peerIface) == tcp;
+	print_pass(tmp_succ);
+	success &= tmp_succ;
+
+	print_over_test_str(1, "New TCP sender for other neighbor: ");
+	p = pm->sender(Protocol::TYPE_TCP, otherIface);
+	tmp_succ = p && p != tcp && p->isForInterface(otherIface) &&
+		pm->sender(Protocol::TYPE_TCP, otherIface) == p;
+	print_pass(tmp_succ);
+	success &= tmp_succ;
+
+	print_over_test_str(1, "Replace closing TCP sender: ");
+	// A sender that is closing is not reused, and a new one is pooled
+	// in its place
+	if (tcp)
+		tcp->setMode(PROT_MODE_DONE);
+	p = pm->sender(Protocol::TYPE_TCP, peerIface);
+	tmp_succ = p && p != tcp && pm->sender(Protocol::TYPE_TCP, peerIface) == p;
+	print_pass(tmp_succ);
+	success &= tmp_succ;
+
+	print_over_test_str(1, "No UDP sender before registered: ");
+	{
+		IPv4Address addr(loopback, TransportUDP(APPLICATION_PORT + 1));
+		ApplicationPortInterface iface(APPLICATION_PORT + 1, "Application", &addr, IFFLAG_UP);
+		appIface = kernel->getInterfaceStore()->addupdate(&iface, InterfaceRef(), new ConnectivityInterfacePolicyAgeless());
+	}
+	tmp_succ = appIface && pm->sender(Protocol::TYPE_UDP, appIface) == NULL;
+	print_pass(tmp_succ);
+	success &= tmp_succ;
+
+	print_over_test_str(1, "UDP application sender: ");
+	udp = new ProtocolUDP("127.0.0.1", APPLICATION_PORT, pm);
+	udp->setFlag(PROT_FLAG_APPLICATION);
+	tmp_succ = pm->add(udp) &&
+		pm->sender(Protocol::TYPE_UDP, appIface) == udp &&
+		pm->sender(Protocol::TYPE_UDP, appIface) == udp;
+	print_pass(tmp_succ);
+	success &= tmp_succ;
+
+	print_over_test_str(1, "Total: ");
+	return (success ? 0 : 1);
+}
@@ -0,0 +1,186 @@
+/* Copyright 2008 Uppsala University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "testhlp.h"
+#include "Bloomfilter.h"
+#include "XMLMetadata.h"
+#include "utils.h"
+#include <haggleutils.h>
+
+using namespace haggle;
+
+/*
+	This program tests that a scalable bloomfilter grows when it holds
+	more data objects than its capacity, and that the slices survive
+	copying, serialization to metadata and the raw format. It also checks
+	that an object is only removed when a single slice has it.
+*/
+
+#define CAPACITY 100
+#define ERROR_RATE 0.01
+#define NUMBER_OF_DATA_OBJECTS 2000
+
+static DataObjectId_t ids[NUMBER_OF_DATA_OBJECTS];
+
+static bool has_all(const Bloomfilter *bf)
+{
+	for (int i = 0; i < NUMBER_OF_DATA_OBJECTS; i++) {
+		if (!bf->has(ids[i]))
+			return false;
+	}
+	return true;
+}
+
+#if defined(OS_WINDOWS)
+int haggle_test_scalableBloomfilter(void)
+#else
+int main(int argc, char *argv[])
+#endif
+{
+	bool success = true, tmp_succ;
+	Bloomfilter *bf, *bf_fixed, *bf_copy;
+
+	// Disable tracing
+	trace_disable(true);
+
+	prng_init();
+
+	for (int i = 0; i < NUMBER_OF_DATA_OBJECTS; i++) {
+		for (int j = 0; j < DATAOBJECT_ID_LEN; j++)
+			ids[i][j] = prng_uint8();
+	}
+
+	print_over_test_str_nl(0, "Scalable bloomfilter test: ");
+
+	print_over_test_str(1, "Create: ");
+	bf = Bloomfilter::create(Bloomfilter::TYPE_COUNTING, ERROR_RATE, CAPACITY);
+	bf_fixed = Bloomfilter::create(Bloomfilter::TYPE_COUNTING, ERROR_RATE, CAPACITY);
+
+	if (!bf || !bf_fixed)
+		return 1;
+
+	bf->setScalable(true);
+	print_passed();
+
+	print_over_test_str(1, "Grows beyond capacity: ");
+	for (int i = 0; i < NUMBER_OF_DATA_OBJECTS; i++) {
+		bf->add(ids[i]);
+		bf_fixed->add(ids[i]);
+	}
+	tmp_succ = bf->numSlices() > 0 && bf->numObjects() == NUMBER_OF_DATA_OBJECTS && has_all(bf);
+	success &= tmp_succ;
+	print_pass(tmp_succ);
+
+	print_over_test_str(1, "Error rate stays bounded: ");
+	// The fixed size filter is saturated, while the compound error
+	// rate of the slices is at most twice the error rate
+	tmp_succ = bf->estimatedErrorRate() < 2 * ERROR_RATE &&
+		bf_fixed->estimatedErrorRate() > 2 * ERROR_RATE;
+	success &= tmp_succ;
+	print_pass(tmp_succ);
+
+	print_over_test_str(1, "Remove from slice: ");
+	{
+		// An object is not removed if a false positive in another
+		// slice also has it, so try a few of the newest objects
+		int i = NUMBER_OF_DATA_OBJECTS - 1;
+
+		while (i > NUMBER_OF_DATA_OBJECTS - 10 && !bf->remove(ids[i]))
+			i--;
+
+		tmp_succ = i > NUMBER_OF_DATA_OBJECTS - 10 &&
+			bf->numObjects() == NUMBER_OF_DATA_OBJECTS - 1;
+		bf->add(ids[i]);
+	}
+	success &= tmp_succ;
+	print_pass(tmp_succ);
+
+	print_over_test_str(1, "Remove from two slices refused: ");
+	{
+		unsigned long n = bf->numObjects();
+
+		// The oldest object is in the first slice, and now also in
+		// the newest one
+		bf->add(ids[0]);
+		tmp_succ = !bf->remove(ids[0]) && bf->numObjects() == n + 1 && bf->has(ids[0]);
+	}
+	success &= tmp_succ;
+	print_pass(tmp_succ);
+
+	print_over_test_str(1, "Non-counting copy has slices: ");
+	bf_copy = bf->to_noncounting();
+	tmp_succ = bf_copy && bf_copy->numSlices() == bf->numSlices() && has_all(bf_copy);
+	success &= tmp_succ;
+	print_pass(tmp_succ);
+
+	print_over_test_str(1, "Slices to metadata and back: ");
+	if (bf_copy) {
+		XMLMetadata nm("Node");
+		Metadata *bm = bf_copy->toMetadata();
+
+		tmp_succ = bm != NULL && nm.addMetadata(bm);
+
+		for (unsigned int i = 0; i < bf_copy->numSlices(); i++)
+			tmp_succ &= nm.addMetadata(bf_copy->sliceToMetadata(i));
+
+		Bloomfilter *bf_md = tmp_succ ? Bloomfilter::fromMetadata(*nm.getMetadata(BLOOMFILTER_METADATA)) : NULL;
+
+		tmp_succ &= bf_md != NULL;
+
+		if (bf_md) {
+			unsigned int i = 0;
+
+			while ((bm = nm.getMetadata(BLOOMFILTER_SLICE_METADATA, i++)))
+				tmp_succ &= bf_md->addSlice(Bloomfilter::fromMetadata(*bm));
+
+			tmp_succ &= bf_md->equals(*bf_copy) && has_all(bf_md);
+			delete bf_md;
+		}
+		delete bf_copy;
+	}
+	success &= tmp_succ;
+	print_pass(tmp_succ);
+
+	print_over_test_str(1, "Slices to raw and back: ");
+	{
+		size_t len;
+		unsigned char *raw = bf->getSlicesRawAlloc(&len);
+
+		bf_copy = Bloomfilter::create(bf->getRaw(), bf->getRawLen());
+		tmp_succ = raw != NULL && bf_copy != NULL;
+
+		if (tmp_succ) {
+			tmp_succ = bf_copy->setSlicesRaw(raw, len) && bf_copy->equals(*bf) && has_all(bf_copy);
+		}
+		if (raw)
+			free(raw);
+		if (bf_copy)
+			delete bf_copy;
+	}
+	success &= tmp_succ;
+	print_pass(tmp_succ);
+
+	print_over_test_str(1, "Reset drops slices: ");
+	bf->reset();
+	tmp_succ = bf->numSlices() == 0 && bf->numObjects() == 0;
+	success &= tmp_succ;
+	print_pass(tmp_succ);
+
+	delete bf;
+	delete bf_fixed;
+
+	print_over_test_str(1, "Total: ");
+	return (success ? 0 : 1);
+}
@@ -0,0 +1,469 @@
+/* Copyright 2009 Uppsala University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "testhlp.h"
+#include "ForwarderSprayAndWait.h"
+#include "ForwardingManager.h"
+#include "HaggleKernel.h"
+#include "Interface.h"
+#include <haggleutils.h>
+#include <string.h>
+
+#if defined(OS_WINDOWS)
+#define usleep(n) Sleep((n)/1000)
+#endif
+
+using namespace haggle;
+
+/*
+	This program simulates a network of nodes that meet each other at
+	random, and data objects that are created on one node for another.
+
+	Epidemic forwarding, where every node gives every data object to every
+	node it meets, is compared with binary Spray and Wait, where the copies
+	of a data object are split as the Spray and Wait forwarder splits them.
+	Data objects are only forwarded for a limited time after they are
+	created. The delivery ratio, the delay and the number of copies sent
+	per delivered data object are reported for each.
+
+	Both run on the same contacts, so Spray and Wait cannot deliver a data
+	object that epidemic forwarding does not deliver.
+
+	It also checks that the number of copies is carried in the metadata of
+	copies of real data objects, and runs the Spray and Wait forwarder
+	to check the copies it delegates to neighbors and sends to targets.
+*/
+
+#define NUMBER_OF_NODES 50
+#define NUMBER_OF_DATAOBJECTS 200
+#define NUMBER_OF_STEPS 2000
+#define CONTACTS_PER_STEP 5
+// The number of steps that a data object is forwarded after it is created
+#define DATAOBJECT_LIFETIME 50
+#define MAX_CONTACTS (NUMBER_OF_STEPS * CONTACTS_PER_STEP)
+#define MANAGER_NAME "ForwardingManager"
+#define DATA_FILE "sprayandwait.data"
+#define UNSTORED_DATA_FILE "sprayandwait_unstored.data"
+// How long to wait for the forwarder to generate an event
+#define EVENT_TIMEOUT_MSECS 5000
+
+typedef struct {
+	unsigned int a, b;
+} contact_t;
+
+typedef struct {
+	unsigned int source, target, created;
+} dataobject_t;
+
+typedef struct {
+	unsigned long delivered;
+	unsigned long sent;
+	unsigned long delay;
+	// The largest number of nodes that had a data object, not counting
+	// its target
+	unsigned long max_holders;
+} result_t;
+
+static contact_t contacts[MAX_CONTACTS];
+static dataobject_t dataobjects[NUMBER_OF_DATAOBJECTS];
+// The number of copies each node has of each data object, zero if it
+// does not have it
+static unsigned long copies[NUMBER_OF_NODES][NUMBER_OF_DATAOBJECTS];
+static bool delivered_epidemic[NUMBER_OF_DATAOBJECTS];
+
+/*
+	Gives a data object from one node to another, if the other node does
+	not have it. With Spray and Wait, a node only gives a data object to a
+	node that is not its target if it has copies to hand out.
+*/
+static bool forward(unsigned int from, unsigned int to, unsigned int d, unsigned long L)
+{
+	if (copies[from][d] == 0 || copies[to][d] != 0)
+		return false;
+
+	if (L == 0 || to == dataobjects[d].target) {
+		copies[to][d] = 1;
+		return true;
+	}
+
+	if (copies[from][d] <= 1)
+		return false;
+
+	copies[to][d] = ForwarderSprayAndWait::splitCopies(copies[from][d]);
+
+	return true;
+}
+
+/*
+	Runs the simulation with L copies of each data object, or epidemic
+	forwarding if L is zero.
+*/
+static result_t simulate(unsigned long L, bool *delivered)
+{
+	result_t res = { 0, 0, 0, 0 };
+	unsigned long holders[NUMBER_OF_DATAOBJECTS];
+
+	memset(copies, 0, sizeof(copies));
+
+	for (unsigned int d = 0; d < NUMBER_OF_DATAOBJECTS; d++) {
+		delivered[d] = false;
+		holders[d] = 0;
+	}
+
+	for (unsigned int step = 0, c = 0; step < NUMBER_OF_STEPS; step++) {
+		for (unsigned int d = 0; d < NUMBER_OF_DATAOBJECTS; d++) {
+			if (dataobjects[d].created == step) {
+				copies[dataobjects[d].source][d] = L ? L : 1;
+				holders[d] = 1;
+			}
+		}
+
+		for (unsigned int i = 0; i < CONTACTS_PER_STEP; i++, c++) {
+			unsigned int a = contacts[c].a, b = contacts[c].b;
+
+			for (unsigned int d = 0; d < NUMBER_OF_DATAOBJECTS; d++) {
+				unsigned int to;
+
+				if (copies[a][d] == 0 && copies[b][d] == 0)
+					continue;
+
+				if (step - dataobjects[d].created > DATAOBJECT_LIFETIME)
+					continue;
+
+				if (forward(a, b, d, L))
+					to = b;
+				else if (forward(b, a, d, L))
+					to = a;
+				else
+					continue;
+
+				res.sent++;
+
+				if (to == dataobjects[d].target) {
+					delivered[d] = true;
+					res.delivered++;
+					res.delay += step - dataobjects[d].created;
+				} else if (++holders[d] > res.max_holders) {
+					res.max_holders = holders[d];
+				}
+			}
+		}
+	}
+	return res;
+}
+
+static bool write_data_file(const char *filename)
+{
+	FILE *fp = fopen(filename, "w");
+	bool ret = fp && fputs("Spray and Wait", fp) >= 0;
+
+	if (fp)
+		fclose(fp);
+
+	return ret;
+}
+
+static NodeRef create_node(HaggleKernel *kernel, unsigned long n, bool neighbor)
+{
+	char nodeid[41], nodename[20];
+	unsigned char macaddr[ETH_MAC_LEN] = { 0x02, 0x00, 0x00, 0x00, 0x00, 0x01 };
+
+	macaddr[4] = (unsigned char)n;
+
+	EthernetAddress addr(macaddr);
+	InterfaceRef iface = Interface::create<EthernetInterface>(macaddr, "eth", addr, neighbor ? IFFLAG_UP : 0);
+
+	snprintf(nodeid, sizeof(nodeid), "%040lx", n + 1);
+	snprintf(nodename, sizeof(nodename), "node %lu", n + 1);
+
+	NodeRef node = Node::create_with_id(Node::TYPE_PEER, nodeid, nodename);
+
+	if (!node || !iface)
+		return NULL;
+
+	node->addInterface(iface);
+
+	if (neighbor)
+		kernel->getNodeStore()->add(node);
+
+	return node;
+}
+
+/*
+	Waits for the forwarder to add an event to the kernel's queue, and
+	returns it, or NULL if there is none within EVENT_TIMEOUT_MSECS.
+*/
+static Event *next_event(HaggleKernel *kernel)
+{
+	for (int i = 0; i < EVENT_TIMEOUT_MSECS && kernel->empty(); i++)
+		usleep(1000);
+
+	return kernel->empty() ? NULL : kernel->getNextEvent();
+}
+
+/*
+	Checks that an event delegates a data object with the given id,
+	carrying the given number of copies, to the neighbor.
+*/
+static bool is_delegation(Event *e, const DataObjectRef& dObj, const NodeRef& neighbor, unsigned long copies)
+{
+	if (!e || e->getType() != EVENT_TYPE_DELEGATE_NODES)
+		return false;
+
+	DataObjectRef& dObjCopy = e->getDataObject();
+	NodeRefList& delegates = e->getNodeList();
+
+	return dObjCopy && dObjCopy.getObj() != dObj.getObj() && 
+		memcmp(dObjCopy->getId(), dObj->getId(), DATAOBJECT_ID_LEN) == 0 &&
+		ForwarderSprayAndWait::getCopies(dObjCopy, MANAGER_NAME) == copies &&
+		delegates.size() == 1 && delegates.front() == neighbor;
+}
+
+static void print_result(const result_t& res)
+{
+	printf("delivery %.2lf, delay %.0lf, %.1lf copies/delivered ",
+	       (double)res.delivered / NUMBER_OF_DATAOBJECTS,
+	       res.delivered ? (double)res.delay / res.delivered : 0.0,
+	       res.delivered ? (double)res.sent / res.delivered : 0.0);
+}
+
+#if defined(OS_WINDOWS)
+int haggle_test_sprayandwait(void)
+#else
+int main(int argc, char *argv[])
+#endif
+{
+	bool success = true, tmp_succ;
+	bool delivered[NUMBER_OF_DATAOBJECTS];
+	unsigned long n, handed_out;
+	result_t epidemic;
+
+	// Disable tracing
+	trace_disable(true);
+
+	prng_init();
+
+	print_over_test_str_nl(0, "Spray and Wait test: ");
+
+	print_over_test_str(1, "Binary split of copies: ");
+	n = 8;
+	handed_out = ForwarderSprayAndWait::splitCopies(n);
+	tmp_succ = handed_out == 4 && n == 4;
+	n = 5;
+	handed_out = ForwarderSprayAndWait::splitCopies(n);
+	tmp_succ = tmp_succ && handed_out == 2 && n == 3;
+	n = 1;
+	handed_out = ForwarderSprayAndWait::splitCopies(n);
+	tmp_succ = tmp_succ && handed_out == 0 && n == 1;
+	success &= tmp_succ;
+	print_pass(tmp_succ);
+
+	print_over_test_str(1, "Copies in metadata: ");
+	{
+		DataObjectRef dObj = DataObject::create();
+		DataObjectRef dObjCopy = ForwarderSprayAndWait::setCopies(dObj, 4, MANAGER_NAME);
+		DataObjectRef dObjTarget;
+
+		if (dObjCopy)
+			dObjTarget = ForwarderSprayAndWait::setCopies(dObjCopy, 1, MANAGER_NAME);
+
+		// The copies are not part of the id, and the data object that
+		// was copied keeps its own copies
+		tmp_succ = dObj && dObjCopy && dObjTarget &&
+			ForwarderSprayAndWait::getCopies(dObj, MANAGER_NAME) == 0 &&
+			ForwarderSprayAndWait::getCopies(dObjCopy, MANAGER_NAME) == 4 &&
+			ForwarderSprayAndWait::getCopies(dObjTarget, MANAGER_NAME) == 1 &&
+			ForwarderSprayAndWait::getCopies(dObjCopy, "OtherManager") == 0 &&
+			memcmp(dObjCopy->getId(), dObj->getId(), DATAOBJECT_ID_LEN) == 0;
+	}
+	success &= tmp_succ;
+	print_pass(tmp_succ);
+
+	print_over_test_str(1, "Copies of data objects with data: ");
+	{
+		DataObjectRef dObj;
+
+		tmp_succ = write_data_file(DATA_FILE);
+
+		if (tmp_succ)
+			dObj = DataObject::create(DATA_FILE);
+
+		// A data object that is not stored cannot be copied, since
+		// the copy would delete its file
+		tmp_succ = dObj && dObj->getDataLen() > 0 &&
+			!ForwarderSprayAndWait::setCopies(dObj, 4, MANAGER_NAME);
+
+		if (dObj) {
+			dObj->setStored();
+
+			DataObjectRef dObjCopy = ForwarderSprayAndWait::setCopies(dObj, 4, MANAGER_NAME);
+
+			tmp_succ = tmp_succ && dObjCopy &&
+				ForwarderSprayAndWait::getCopies(dObjCopy, MANAGER_NAME) == 4 &&
+				dObjCopy->getFilePath() == dObj->getFilePath();
+
+			// Let the data object delete the file
+			dObj->setStored(false);
+		}
+	}
+	success &= tmp_succ;
+	print_pass(tmp_succ);
+
+	{
+		// The kernel is not initialized, since it has no data store, and
+		// the managers are not deleted, since they would remove their
+		// configuration filters from the data store
+		HaggleKernel *kernel = new HaggleKernel(NULL);
+		ForwardingManager *fm = new ForwardingManager(kernel);
+		ForwarderSprayAndWait *forwarder = new ForwarderSprayAndWait(fm);
+		NodeRef target = create_node(kernel, 0, false);
+		NodeRef first = create_node(kernel, 1, true);
+		NodeRef second;
+		DataObjectRef dObj, dObjTarget, dObjUnstored, dObjNoData = DataObject::create();
+		Event *e;
+
+		forwarder->start();
+
+		print_over_test_str(1, "Forwarder sprays to neighbor: ");
+		tmp_succ = write_data_file(DATA_FILE);
+
+		if (tmp_succ)
+			dObj = DataObject::create(DATA_FILE);
+
+		if (dObj) {
+			dObj->setStored();
+			forwarder->generateDelegatesFor(dObj, target, NULL);
+		}
+		// Half of the initial copies are handed out
+		e = next_event(kernel);
+		tmp_succ = dObj && is_delegation(e, dObj, first, SPRAY_AND_WAIT_COPIES_DEFAULT / 2);
+
+		if (e)
+			delete e;
+
+		success &= tmp_succ;
+		print_pass(tmp_succ);
+
+		print_over_test_str(1, "Forwarder sprays to new neighbor: ");
+		second = create_node(kernel, 2, true);
+		forwarder->newNeighbor(second);
+		e = next_event(kernel);
+		tmp_succ = dObj && is_delegation(e, dObj, second, SPRAY_AND_WAIT_COPIES_DEFAULT / 4);
+
+		if (e)
+			delete e;
+
+		success &= tmp_succ;
+		print_pass(tmp_succ);
+
+		print_over_test_str(1, "Forwarder sends target one copy: ");
+		if (dObj)
+			dObjTarget = forwarder->dataObjectForTargets(dObj);
+
+		tmp_succ = dObjTarget && dObjTarget.getObj() != dObj.getObj() &&
+			ForwarderSprayAndWait::getCopies(dObjTarget, MANAGER_NAME) == 1;
+		success &= tmp_succ;
+		print_pass(tmp_succ);
+
+		print_over_test_str(1, "Forwarder waits with unstored data object: ");
+		tmp_succ = write_data_file(UNSTORED_DATA_FILE);
+
+		if (tmp_succ)
+			dObjUnstored = DataObject::create(UNSTORED_DATA_FILE);
+
+		// The data object is not sprayed, so the first event is the one
+		// for the data object without data
+		if (dObjUnstored && dObjNoData) {
+			forwarder->generateDelegatesFor(dObjUnstored, target, NULL);
+			forwarder->generateDelegatesFor(dObjNoData, target, NULL);
+		}
+		e = next_event(kernel);
+		tmp_succ = dObjUnstored && dObjNoData && e && 
+			(is_delegation(e, dObjNoData, first, SPRAY_AND_WAIT_COPIES_DEFAULT / 2) ||
+			 is_delegation(e, dObjNoData, second, SPRAY_AND_WAIT_COPIES_DEFAULT / 2));
+
+		if (e)
+			delete e;
+
+		success &= tmp_succ;
+		print_pass(tmp_succ);
+
+		print_over_test_str(1, "Forwarder sends unstored data object to target: ");
+		// It cannot carry a copy, but is still delivered
+		tmp_succ = dObjUnstored && forwarder->dataObjectForTargets(dObjUnstored).getObj() == dObjUnstored.getObj() &&
+			dObjUnstored->getDataLen() > 0;
+		success &= tmp_succ;
+		print_pass(tmp_succ);
+
+		forwarder->quit();
+
+		while (!kernel->empty())
+			delete kernel->getNextEvent();
+
+		// Let the data object delete the file
+		if (dObj)
+			dObj->setStored(false);
+	}
+
+	for (unsigned int c = 0; c < MAX_CONTACTS; c++) {
+		contacts[c].a = prng_uint32() % NUMBER_OF_NODES;
+
+		do {
+			contacts[c].b = prng_uint32() % NUMBER_OF_NODES;
+		} while (contacts[c].b == contacts[c].a);
+	}
+
+	for (unsigned int d = 0; d < NUMBER_OF_DATAOBJECTS; d++) {
+		dataobjects[d].source = prng_uint32() % NUMBER_OF_NODES;
+
+		do {
+			dataobjects[d].target = prng_uint32() % NUMBER_OF_NODES;
+		} while (dataobjects[d].target == dataobjects[d].source);
+
+		dataobjects[d].created = prng_uint32() % (NUMBER_OF_STEPS / 2);
+	}
+
+	print_over_test_str(1, "Epidemic: ");
+	epidemic = simulate(0, delivered_epidemic);
+	tmp_succ = epidemic.delivered > 0;
+	print_result(epidemic);
+	success &= tmp_succ;
+	print_pass(tmp_succ);
+
+	for (unsigned long L = 2; L <= 16; L *= 2) {
+		char str[40];
+		result_t res;
+
+		snprintf(str, sizeof(str), "Spray and Wait, L=%lu: ", L);
+		print_over_test_str(1, str);
+
+		res = simulate(L, delivered);
+
+		// No more than L nodes have the data object, and only the ones
+		// that epidemic forwarding delivers can be delivered
+		tmp_succ = res.max_holders <= L && res.sent < epidemic.sent;
+
+		for (unsigned int d = 0; d < NUMBER_OF_DATAOBJECTS && tmp_succ; d++)
+			tmp_succ = !delivered[d] || delivered_epidemic[d];
+
+		print_result(res);
+		success &= tmp_succ;
+		print_pass(tmp_succ);
+	}
+
+	print_over_test_str(1, "Total: ");
+
+	return (success ? 0 : 1);
+}
@@ -15,12 +15,15 @@
 
 #include "testhlp.h"
 #include <libcpphaggle/Map.h>
+#include <libcpphaggle/HashMap.h>
+#include <libcpphaggle/Timeval.h>
 #include <haggleutils.h>
 #include <libcpphaggle/Exception.h>
 
 using namespace haggle;
 /*
-  This program tests the map implementation
+  This program tests the map and hash map implementations, and 
+  benchmarks the hash map against the chained hash map it replaced.
 */
 
 class TestObj {
@@ -52,6 +55,277 @@ class TestObj {
 
 long TestObj::num = 0;
 
+#define NUM_KEYS 50
+#define NUM_VALUES_PER_KEY 20
+#define NUM_BENCH_KEYS 100000
+
+/*
+	Checks that every key in the map has the given number of values
+	and that they are next to each other when iterating.
+ */
+static bool check_grouping(HashMap<long, long>& m, unsigned long values_per_key)
+{
+	bool seen[NUM_KEYS] = { false };
+	long prev_key = -1;
+	
+	for (HashMap<long, long>::iterator it = m.begin(); it != m.end(); it++) {
+		long key = (*it).first;
+
+		if (key != prev_key) {
+			if (key < 0 || key >= NUM_KEYS || seen[key])
+				return false;
+			seen[key] = true;
+			prev_key = key;
+		}
+	}
+
+	for (long key = 0; key < NUM_KEYS; key++) {
+		Pair<HashMap<long, long>::iterator, HashMap<long, long>::iterator> r = m.equal_range(key);
+		unsigned long n = 0;
+
+		for (; r.first != r.second; r.first++)
+			n++;
+		
+		if (n != values_per_key || m.upper_bound(key) != r.second)
+			return false;
+	}
+	return m.size() == NUM_KEYS * values_per_key;
+}
+
+static unsigned int chained_hash(const long& k)
+{
+	return generic_hash((const char *)&k, (const char *)&k + sizeof(k));
+}
+
+static unsigned int chained_hash(const string& k)
+{
+	return generic_hash(k.c_str(), k.c_str() + k.length());
+}
+
+static const unsigned long chained_primes[] = {
+	7ul, 13ul, 29ul, 53ul, 97ul, 193ul, 389ul, 769ul, 1543ul, 3079ul, 
+	6151ul, 12289ul, 24593ul, 49157ul, 98317ul, 196613ul, 393241ul, 
+	786433ul, 1572869ul, 3145739ul, 0
+};
+
+/*
+	The chained hash map that HashMap replaced, reduced to what the
+	benchmark uses. It keeps a list of pairs in each bucket of a prime
+	sized table, and grows by inserting the elements one by one into 
+	a larger table.
+ */
+template<typename KeyType, typename ValueType>
+class ChainedHashMap {
+	typedef Pair<KeyType, ValueType> PairType;
+	typedef List<PairType> ListType;
+	unsigned long _size, table_size;
+	ListType *table;
+
+	void grow() {
+		unsigned long new_size = 0;
+
+		for (const unsigned long *p = chained_primes; *p; p++) {
+			if (*p > table_size) {
+				new_size = *p;
+				break;
+			}
+		}
+		if (!new_size)
+			return;
+
+		ListType *new_table = new ListType[new_size];
+
+		for (unsigned long i = 0; i < table_size; i++) {
+			for (typename ListType::iterator it = table[i].begin(); it != table[i].end(); it++)
+				new_table[chained_hash((*it).first) % new_size].push_back(*it);
+		}
+		delete [] table;
+		table = new_table;
+		table_size = new_size;
+	}
+public:
+	ChainedHashMap() : _size(0), table_size(chained_primes[0]), table(new ListType[table_size]) {}
+	~ChainedHashMap() { delete [] table; }
+	unsigned long size() const { return _size; }
+	void insert(const PairType& p) {
+		if (_size + 1 > table_size)
+			grow();
+		table[chained_hash(p.first) % table_size].push_back(p);
+		_size++;
+	}
+	bool find(const KeyType& k) {
+		ListType& l = table[chained_hash(k) % table_size];
+
+		for (typename ListType::iterator it = l.begin(); it != l.end(); it++) {
+			if (k == (*it).first)
+				return true;
+		}
+		return false;
+	}
+	unsigned long erase(const KeyType& k) {
+		ListType& l = table[chained_hash(k) % table_size];
+		typename ListType::iterator it = l.begin();
+		unsigned long n = 0;
+
+		while (it != l.end()) {
+			if (k == (*it).first) {
+				it = l.erase(it);
+				n++;
+			} else {
+				it++;
+			}
+		}
+		_size -= n;
+		return n;
+	}
+};
+
+template<typename KeyType>
+static bool map_has(HashMap<KeyType, long>& m, const KeyType& k)
+{
+	return m.find(k) != m.end();
+}
+
+template<typename KeyType>
+static bool map_has(ChainedHashMap<KeyType, long>& m, const KeyType& k)
+{
+	return m.find(k);
+}
+
+/*
+	The sorted array of entry pointers that Map used before, reduced to
+	what the benchmark uses. Inserting and erasing shift the entries
+	after the position.
+ */
+template<typename KeyType, typename ValueType>
+class SortedArrayMap {
+	typedef Pair<KeyType, ValueType> PairType;
+	PairType **entries;
+	unsigned long _size, capacity;
+
+	// Returns the position of the first entry not less than k
+	unsigned long position(const KeyType& k) const {
+		unsigned long low = 0, high = _size;
+
+		while (low < high) {
+			unsigned long mid = (low + high) / 2;
+
+			if (entries[mid]->first < k)
+				low = mid + 1;
+			else
+				high = mid;
+		}
+		return low;
+	}
+public:
+	SortedArrayMap() : entries(NULL), _size(0), capacity(0) {}
+	~SortedArrayMap() { 
+		for (unsigned long i = 0; i < _size; i++)
+			delete entries[i];
+		delete [] entries; 
+	}
+	unsigned long size() const { return _size; }
+	void insert(const PairType& p) {
+		unsigned long pos = position(p.first);
+
+		if (_size == capacity) {
+			capacity = capacity ? capacity * 2 : 8;
+			PairType **new_entries = new PairType *[capacity];
+			memcpy(new_entries, entries, _size * sizeof(PairType *));
+			delete [] entries;
+			entries = new_entries;
+		}
+		memmove(&entries[pos + 1], &entries[pos], (_size - pos) * sizeof(PairType *));
+		entries[pos] = new PairType(p);
+		_size++;
+	}
+	bool find(const KeyType& k) const {
+		unsigned long pos = position(k);
+
+		return pos < _size && entries[pos]->first == k;
+	}
+	unsigned long erase(const KeyType& k) {
+		unsigned long pos = position(k);
+
+		if (pos == _size || !(entries[pos]->first == k))
+			return 0;
+
+		delete entries[pos];
+		memmove(&entries[pos], &entries[pos + 1], (_size - pos - 1) * sizeof(PairType *));
+		_size--;
+		return 1;
+	}
+};
+
+template<typename KeyType>
+static bool map_has(SortedArrayMap<KeyType, long>& m, const KeyType& k)
+{
+	return m.find(k);
+}
+
+template<typename KeyType>
+static bool map_has(Map<KeyType, long>& m, const KeyType& k)
+{
+	return m.find(k) != m.end();
+}
+
+/*
+	Checks that the keys of a map are in order.
+ */
+static bool check_order(Map<long, long>& m)
+{
+	Map<long, long>::iterator it = m.begin();
+	unsigned long n = 0;
+
+	if (it == m.end())
+		return m.size() == 0;
+
+	long prev_key = (*it).first;
+	
+	for (; it != m.end(); it++, n++) {
+		if ((*it).first < prev_key)
+			return false;
+		prev_key = (*it).first;
+	}
+	return n == m.size();
+}
+
+/*
+	Inserts, finds and erases the keys, and prints the time each
+	step takes. Returns false if any key is not found or erased.
+ */
+template<typename MapType, typename KeyType>
+static bool benchmark_map(const char *name, const KeyType *keys)
+{
+	MapType m;
+	bool ret = true;
+	long i;
+
+	Timeval start = Timeval::now();
+	
+	for (i = 0; i < NUM_BENCH_KEYS; i++)
+		m.insert(make_pair(keys[i], i));
+
+	double insert_secs = (Timeval::now() - start).getTimeAsSecondsDouble();
+	start = Timeval::now();
+
+	for (i = 0; i < NUM_BENCH_KEYS; i++)
+		ret &= map_has(m, keys[i]);
+
+	double find_secs = (Timeval::now() - start).getTimeAsSecondsDouble();
+	start = Timeval::now();
+
+	for (i = 0; i < NUM_BENCH_KEYS; i++)
+		ret &= m.erase(keys[i]) == 1;
+
+	double erase_secs = (Timeval::now() - start).getTimeAsSecondsDouble();
+	
+	printf("%s: insert %.1f ms, find %.1f ms, erase %.1f ms ", name, 
+	       insert_secs * 1000, find_secs * 1000, erase_secs * 1000);
+
+	return ret && m.size() == 0;
+}
+
 #if defined(OS_WINDOWS) 
 int haggle_test_map(void)
 #else 
@@ -207,6 +481,203 @@ try {
 			success &= tmp_succ;
 			print_pass(tmp_succ);
                 }
+
+		{
+			Map<long, long> tmap;
+			bool present[4096] = { false };
+			long i;
+
+			print_over_test_str(1, "Iterators stay valid: ");
+			
+			prng_init();
+
+			for (i = 0; i < 1000; i++)
+				tmap[prng_uint32() % 4096] = i;
+			
+			tmap[5000] = 4711;
+			Map<long, long>::iterator it = tmap.find(5000);
+			long *value = &(*it).second;
+			
+			for (i = 0; i < 1000; i++) {
+				tmap[prng_uint32() % 4096] = i;
+				tmap.erase(prng_uint32() % 4096);
+			}
+			tmp_succ = (*it).first == 5000 && value == &tmap[5000] && *value == 4711;
+			success &= tmp_succ;
+			print_pass(tmp_succ);
+
+			print_over_test_str(1, "Random insert and erase: ");
+			tmap.clear();
+			tmp_succ = true;
+
+			for (i = 0; i < 50000; i++) {
+				long key = prng_uint32() % 4096;
+
+				if (prng_uint32() % 3) {
+					tmp_succ &= tmap.insert(make_pair(key, i)).second == !present[key];
+					present[key] = true;
+				} else {
+					tmp_succ &= tmap.erase(key) == (present[key] ? 1UL : 0UL);
+					present[key] = false;
+				}
+			}
+			for (i = 0; i < 4096; i++)
+				tmp_succ &= (tmap.find(i) != tmap.end()) == present[i];
+
+			tmp_succ &= check_order(tmap);
+			
+			Map<long, long> tmap_copy = tmap;
+			
+			tmp_succ &= check_order(tmap_copy) && tmap_copy.size() == tmap.size();
+			success &= tmp_succ;
+			print_pass(tmp_succ);
+		}
+
+		{
+			HashMap<long, long> hmap;
+			long i;
+
+			print_over_test_str(1, "HashMap keeps values of a key together: ");
+			
+			// Interleave the keys, so that the table grows
+			// several times while the groups are built
+			for (i = 0; i < NUM_KEYS * NUM_VALUES_PER_KEY; i++)
+				hmap.insert(make_pair(i % NUM_KEYS, i));
+
+			tmp_succ = check_grouping(hmap, NUM_VALUES_PER_KEY);
+			success &= tmp_succ;
+			print_pass(tmp_succ);
+
+			print_over_test_str(1, "HashMap erase while iterating: ");
+			HashMap<long, long>::iterator it = hmap.begin();
+			
+			while (it != hmap.end()) {
+				HashMap<long, long>::iterator it_erase = it++;
+
+				// Erase every other value of each key
+				if (((*it_erase).second / NUM_KEYS) % 2)
+					hmap.erase(it_erase);
+			}
+			
+			tmp_succ = check_grouping(hmap, NUM_VALUES_PER_KEY / 2);
+
+			for (it = hmap.begin(); it != hmap.end(); it++) {
+				if (((*it).second / NUM_KEYS) % 2)
+					tmp_succ = false;
+			}
+			success &= tmp_succ;
+			print_pass(tmp_succ);
+
+			print_over_test_str(1, "HashMap insert after erase: ");
+			
+			for (i = 0; i < NUM_KEYS * NUM_VALUES_PER_KEY; i++) {
+				if ((i / NUM_KEYS) % 2)
+					hmap.insert(make_pair(i % NUM_KEYS, i));
+			}
+
+			tmp_succ = check_grouping(hmap, NUM_VALUES_PER_KEY) && 
+				hmap.erase(NUM_KEYS / 2) == NUM_VALUES_PER_KEY &&
+				hmap.find(NUM_KEYS / 2) == hmap.end();
+			success &= tmp_succ;
+			print_pass(tmp_succ);
+			
+			print_over_test_str(1, "HashMap insert after erase keeps order: ");
+			{
+				HashMap<long, long> omap;
+				HashMap<long, long>::iterator it_next, it_erase;
+				const long expected[] = { 0, 3, 4, 5, 6 };
+				unsigned long n = 0;
+
+				for (i = 0; i < 5; i++)
+					omap.insert(make_pair(1L, i));
+
+				// Erase values from the middle of the group
+				it_next = omap.find(1);
+				it_next++;
+
+				for (i = 0; i < 2; i++) {
+					it_erase = it_next++;
+					omap.erase(it_erase);
+				}
+
+				omap.insert(make_pair(1L, 5L));
+				omap.insert(make_pair(1L, 6L));
+
+				Pair<HashMap<long, long>::iterator, HashMap<long, long>::iterator> r = omap.equal_range(1);
+
+				tmp_succ = omap.size() == 5;
+
+				for (; r.first != r.second && n < 5; r.first++, n++)
+					tmp_succ &= (*r.first).second == expected[n];
+
+				tmp_succ &= n == 5 && r.first == r.second;
+			}
+			success &= tmp_succ;
+			print_pass(tmp_succ);
+			
+			print_over_test_str(1, "HashMap copy and clear: ");
+			HashMap<long, long> hmap_copy = hmap;
+
+			hmap.clear();
+			
+			tmp_succ = hmap.empty() && hmap.begin() == hmap.end() && 
+				hmap_copy.size() == (NUM_KEYS - 1) * NUM_VALUES_PER_KEY &&
+				hmap_copy.find(0) != hmap_copy.end();
+			success &= tmp_succ;
+			print_pass(tmp_succ);
+		}
+
+		{
+			long *long_keys = new long[NUM_BENCH_KEYS];
+			string *string_keys = new string[NUM_BENCH_KEYS];
+			char buf[32];
+
+			prng_init();
+			
+			for (long i = 0; i < NUM_BENCH_KEYS; i++) {
+				long_keys[i] = i * 4096;
+				// The index makes the string keys unique
+				snprintf(buf, sizeof(buf), "node-%08lx-%ld", prng_uint32(), i);
+				string_keys[i] = buf;
+			}
+			print_over_test_str_nl(1, "HashMap benchmark: ");
+			
+			print_over_test_str(2, "Long keys: ");
+			tmp_succ = benchmark_map<ChainedHashMap<long, long> >("chained", long_keys);
+			tmp_succ &= benchmark_map<HashMap<long, long> >("open addressing", long_keys);
+			success &= tmp_succ;
+			print_pass(tmp_succ);
+			
+			print_over_test_str(2, "String keys: ");
+			tmp_succ = benchmark_map<ChainedHashMap<string, long> >("chained", string_keys);
+			tmp_succ &= benchmark_map<HashMap<string, long> >("open addressing", string_keys);
+			success &= tmp_succ;
+			print_pass(tmp_succ);
+			
+			// Insert in random order, as the prophet forwarder 
+			// does when it learns about nodes
+			for (long i = NUM_BENCH_KEYS - 1; i > 0; i--) {
+				long j = prng_uint32() % (i + 1), tmp = long_keys[i];
+				long_keys[i] = long_keys[j];
+				long_keys[j] = tmp;
+			}
+			print_over_test_str_nl(1, "Map benchmark: ");
+			
+			print_over_test_str(2, "Long keys: ");
+			tmp_succ = benchmark_map<SortedArrayMap<long, long> >("sorted array", long_keys);
+			tmp_succ &= benchmark_map<Map<long, long> >("red-black tree", long_keys);
+			success &= tmp_succ;
+			print_pass(tmp_succ);
+			
+			print_over_test_str(2, "String keys: ");
+			tmp_succ = benchmark_map<SortedArrayMap<string, long> >("sorted array", string_keys);
+			tmp_succ &= benchmark_map<Map<string, long> >("red-black tree", string_keys);
+			success &= tmp_succ;
+			print_pass(tmp_succ);
+
+			delete [] long_keys;
+			delete [] string_keys;
+		}
 			
                 print_over_test_str(1, "Total: ");
 					
@@ -29,6 +29,74 @@ static long pass_cppreference(const InterfaceRef &iface)
 	return iface.refcount();
 }
 
+#define NUM_THREADS 4
+#define NUM_ITERATIONS 200000
+
+// Refcounted through the global store of objects
+class PlainObject {
+public:
+	int value;
+	PlainObject() : value(0) {}
+};
+
+// Refcounted through its own counter
+class IntrusiveObject : public RefCounted {
+public:
+	int value;
+	IntrusiveObject() : value(0) {}
+};
+
+/*
+	Copies and drops a shared reference, and creates and drops references
+	from the plain object pointer, in a thread of its own.
+ */
+template<typename T>
+class RefcountRunnable : public Runnable {
+	const Reference<T> &ref;
+	T *obj;
+public:
+	RefcountRunnable(const Reference<T> &_ref) : ref(_ref), obj(const_cast<T *>(_ref.getObj())) {}
+	~RefcountRunnable() {}
+	
+	bool run()
+	{
+		for (int i = 0; i < NUM_ITERATIONS; i++) {
+			Reference<T> copy = ref;
+			Reference<T> fromPtr = obj;
+		}
+		return false;
+	}
+	void cleanup() {}
+};
+
+/*
+	Runs NUM_THREADS threads that copy and drop references to the same 
+	object. Returns true if the refcount is back at one afterwards.
+ */
+template<typename T>
+static bool threaded_copy_drop(const char *name)
+{
+	Reference<T> ref = new T();
+	RefcountRunnable<T> *thr[NUM_THREADS];
+	Timeval start = Timeval::now();
+	int i;
+	
+	for (i = 0; i < NUM_THREADS; i++) {
+		thr[i] = new RefcountRunnable<T>(ref);
+		thr[i]->start();
+	}
+	for (i = 0; i < NUM_THREADS; i++) {
+		thr[i]->join();
+		delete thr[i];
+	}
+
+	double secs = (Timeval::now() - start).getTimeAsSecondsDouble();
+	
+	printf("%s: %.2f Mops/s ", name, 2.0 * NUM_THREADS * NUM_ITERATIONS / secs / 1000000.0);
+
+	return ref.refcount() == 1;
+}
+
 #if defined(OS_WINDOWS)
 int haggle_test_refcount(void)
 #else
@@ -160,6 +228,42 @@ int haggle_test_refcount(void)
 
 			success &= tmp_succ;
  			print_pass(tmp_succ);
+
+#if defined(DEBUG) && defined(DEBUG_REFERENCE)
+			print_over_test_str(1, "No locking on const access when frozen: ");
+			{
+				unsigned long locks_before, locks_frozen;
+				unsigned long start = RefCounter::numLocks();
+				
+				for (int i = 0; i < 1000; i++)
+					ifaceRef3.constRef()->getType();
+
+				locks_before = RefCounter::numLocks() - start;
+				ifaceRef3.freeze();
+				start = RefCounter::numLocks();
+
+				for (int i = 0; i < 1000; i++)
+					ifaceRef3.constRef()->getType();
+
+				locks_frozen = RefCounter::numLocks() - start;
+				
+				// Non-const access still locks
+				ifaceRef3->getType();
+				
+				printf("%lu locks before, %lu frozen ", locks_before, locks_frozen);
+				
+				tmp_succ = (ifaceRef3.isFrozen() && locks_before == 1000 && 
+					    locks_frozen == 0 && RefCounter::numLocks() - start == 1);
+			}
+			success &= tmp_succ;
+			print_pass(tmp_succ);
+#endif
+
+			print_over_test_str(1, "Threaded copy/drop: ");
+			tmp_succ = threaded_copy_drop<PlainObject>("store");
+			tmp_succ &= threaded_copy_drop<IntrusiveObject>("intrusive");
+			success &= tmp_succ;
+			print_pass(tmp_succ);
 			
 			print_over_test_str(1, "Total: ");
 					
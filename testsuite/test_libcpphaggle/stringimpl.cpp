@@ -15,14 +15,66 @@
 
 #include "testhlp.h"
 #include <libcpphaggle/String.h>
+#include <libcpphaggle/Timeval.h>
 #include <haggleutils.h>
 #include <libcpphaggle/Exception.h>
+#include "XMLMetadata.h"
 
 using namespace haggle;
 /*
-  This program tests the map implementation
+  This program tests the string implementation, and counts the string
+  allocations made when parsing metadata.
 */
 
+#define NUM_PARSES 1000
+#define NUM_ATTRIBUTES 20
+
+/*
+	Creates a data object header with attributes and a node 
+	description, like the ones nodes exchange.
+ */
+static string make_metadata()
+{
+	string xml = "<?xml version=\"1.0\"?><Haggle persistent=\"no\" create_time=\"1262304000.123456\">";
+	char buf[128];
+
+	for (int i = 0; i < NUM_ATTRIBUTES; i++) {
+		snprintf(buf, sizeof(buf), "<Attr name=\"Keyword\" weight=\"%d\">topic-%d</Attr>", i + 1, i);
+		xml += buf;
+	}
+	xml += "<Node id=\"9f3c64c5b8a1e02d7c6b5a49382716e5d4c3b2a1\" type=\"peer\" name=\"node-17\">";
+	xml += "<Interface type=\"ethernet\" identifier=\"00:11:22:33:44:55\"/>";
+	xml += "<Interface type=\"bluetooth\" identifier=\"00:aa:bb:cc:dd:ee\"/>";
+	xml += "</Node></Haggle>";
+
+	return xml;
+}
+
+/*
+	Parses the metadata and looks up its attributes, the way the
+	data object code does.
+ */
+static bool parse_metadata(const string& xml)
+{
+	XMLMetadata m;
+
+	if (!m.initFromRaw((const unsigned char *)xml.c_str(), xml.length()))
+		return false;
+
+	Metadata *md;
+	int n = 0;
+
+	while ((md = m.getMetadata("Attr", n))) {
+		string name = md->getParameter("name");
+		string value = md->getContent();
+
+		if (name != "Keyword" || value.empty())
+			return false;
+		n++;
+	}
+	return n == NUM_ATTRIBUTES && m.getMetadata("Node") != NULL;
+}
+
 #if defined(OS_WINDOWS) 
 int haggle_test_list(void)
 #else 
@@ -143,6 +195,102 @@ int main(int argc, char *argv[])
 		success &= tmp_succ;
 		print_pass(tmp_succ);
 		
+		print_over_test_str_nl(1, "Short and long strings: ");
+
+		print_over_test_str(2, "Grow past local buffer: ");
+		
+		tmp_succ = true;
+		{
+			string str1 = "short";
+			string str2 = str1;
+
+			for (int i = 0; i < 10; i++)
+				str1 += "0123456789";
+
+			str2 = str1;
+			str1.erase(5);
+			tmp_succ = str1 == "short" && str2.length() == 105 && 
+				str2.substr(0, 15) == "short0123456789" && 
+				str2.find("89", 100) == 103;
+		}
+		success &= tmp_succ;
+		print_pass(tmp_succ);
+		
+		print_over_test_str(2, "Copy and assign: ");
+		
+		tmp_succ = true;
+		{
+			string empty;
+			string str1 = "a string that does not fit locally";
+			string str2 = "local";
+			string str3 = str2;
+
+			str2 = str1;
+			str1 = str3;
+			str3 = empty;
+			tmp_succ = str1 == "local" && str2 == "a string that does not fit locally" && 
+				str3.empty() && str3 == "";
+		}
+		success &= tmp_succ;
+		print_pass(tmp_succ);
+
+#if defined(HAVE_RVALUE_REFERENCES)
+		print_over_test_str(2, "Move: ");
+		
+		tmp_succ = true;
+		{
+			string str1 = "a string that does not fit locally";
+			const char *buf = str1.c_str();
+			string str2 = static_cast<string&&>(str1);
+			string str3 = "local";
+			string str4 = static_cast<string&&>(str3);
+
+			// The heap buffer moves, the local one is copied
+			tmp_succ = str2.c_str() == buf && str1.empty() && str4 == "local";
+
+			str3 = "another string that does not fit locally";
+			buf = str3.c_str();
+			str4 = static_cast<string&&>(str3);
+			tmp_succ &= str4.c_str() == buf && str3.empty();
+			
+			str3 = "local";
+			str4 = static_cast<string&&>(str3);
+			tmp_succ &= str4 == "local";
+		}
+		success &= tmp_succ;
+		print_pass(tmp_succ);
+#endif
+		
+		print_over_test_str(1, "Metadata parse benchmark: ");
+		
+		tmp_succ = true;
+		{
+			string xml = make_metadata();
+#if defined(DEBUG) && !defined(ENABLE_STL)
+			unsigned long heap = String::heapAllocations();
+			unsigned long local = String::localAllocations();
+#endif
+			Timeval start = Timeval::now();
+
+			for (int i = 0; i < NUM_PARSES; i++)
+				tmp_succ &= parse_metadata(xml);
+
+			double secs = (Timeval::now() - start).getTimeAsSecondsDouble();
+
+			printf("%.1f us/parse ", secs * 1000000 / NUM_PARSES);
+#if defined(DEBUG) && !defined(ENABLE_STL)
+			heap = String::heapAllocations() - heap;
+			local = String::localAllocations() - local;
+
+			printf("heap allocations %lu, local %lu per parse ", 
+			       heap / NUM_PARSES, local / NUM_PARSES);
+
+			tmp_succ &= local > heap;
+#endif
+		}
+		success &= tmp_succ;
+		print_pass(tmp_succ);
+		
 		print_over_test_str(1, "Total: ");
 		
 		return success ? 0 : 1;
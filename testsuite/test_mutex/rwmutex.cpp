@@ -0,0 +1,117 @@
+/* Copyright 2009 Uppsala University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "testhlp.h"
+#include <libcpphaggle/Thread.h>
+#include <libcpphaggle/RWMutex.h>
+#include "utils.h"
+#include <haggleutils.h>
+
+using namespace haggle;
+/*
+	This program tests that readers share a reader-writer mutex, that a
+	writer holds it alone, that a waiting writer goes ahead of new
+	readers where the platform allows it, and that the time a writer
+	waits for it is counted.
+*/
+
+static RWMutex *myRWMutex;
+static bool returned_from_write_lock;
+
+class rwmutexRunnable : public Runnable {
+public:
+	rwmutexRunnable() {}
+	~rwmutexRunnable() {}
+
+	bool run()
+	{
+		// The mutex is held for reading, so this should wait.
+		myRWMutex->writeLock();
+		returned_from_write_lock = true;
+		myRWMutex->unlock();
+
+		return false;
+	}
+	void cleanup() { }
+};
+
+#if defined(OS_WINDOWS)
+int haggle_test_rwmutex(void)
+#else
+int main(int argc, char *argv[])
+#endif
+{
+	// Disable tracing
+	trace_disable(true);
+
+	print_over_test_str_nl(0, "Reader-writer mutex test: ");
+	try {
+		int success = (1==1), tmp_succ;
+
+		myRWMutex = new RWMutex();
+		returned_from_write_lock = false;
+
+		print_over_test_str(1, "Read locked mutex: ");
+		tmp_succ = myRWMutex->readLock();
+#if defined(HAS_PTHREAD_RWLOCK)
+		// Another reader can lock the mutex, but not a writer
+		tmp_succ = tmp_succ && myRWMutex->tryReadLock() && myRWMutex->unlock();
+#endif
+		tmp_succ = tmp_succ && !myRWMutex->tryWriteLock();
+		success &= tmp_succ;
+		print_pass(tmp_succ);
+
+		print_over_test_str(1, "Writer waits for reader: ");
+		(new rwmutexRunnable())->start();
+
+		// Wait for the thread to hang on the write lock:
+		milli_sleep(500);
+		tmp_succ = !returned_from_write_lock;
+#if defined(HAS_PTHREAD_RWLOCK_PREFER_WRITER)
+		// Readers do not get ahead of the waiting writer
+		if (myRWMutex->tryReadLock()) {
+			myRWMutex->unlock();
+			tmp_succ = false;
+		}
+#endif
+		myRWMutex->unlock();
+		milli_sleep(500);
+		tmp_succ = tmp_succ && returned_from_write_lock;
+		success &= tmp_succ;
+		print_pass(tmp_succ);
+
+		print_over_test_str(1, "Write locked mutex: ");
+		tmp_succ = myRWMutex->writeLock() && !myRWMutex->tryReadLock() &&
+			!myRWMutex->tryWriteLock() && myRWMutex->unlock();
+		success &= tmp_succ;
+		print_pass(tmp_succ);
+
+		print_over_test_str(1, "Counted waits: ");
+		tmp_succ = myRWMutex->getReads() == 1 && myRWMutex->getWrites() == 2 &&
+			myRWMutex->getReadWaits() == 0 && myRWMutex->getWriteWaits() == 1 &&
+			myRWMutex->getWriteWaitTime() > Timeval(0, 250000);
+		success &= tmp_succ;
+		print_pass(tmp_succ);
+
+		delete myRWMutex;
+
+		print_over_test_str(1, "Total: ");
+
+		return (success?0:1);
+	} catch(Exception &) {
+		printf("**CRASH** ");
+		return 1;
+	}
+}
@@ -0,0 +1,558 @@
+/* Copyright 2008-2009 Uppsala University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "testhlp.h"
+#include "ProtocolEngine.h"
+#include <libcpphaggle/Thread.h>
+#include <libcpphaggle/Atomic.h>
+#include <libcpphaggle/Exception.h>
+#include <haggleutils.h>
+
+using namespace haggle;
+
+/*
+	This program runs many concurrent transfers between peers on the
+	loopback interface, first with a thread per connection and blocking
+	sockets, the way protocols used to run, and then as state machines
+	on non-blocking sockets driven by a protocol engine.
+
+	Each client peer connects to the server, and then sends a number of
+	messages, waiting for a control message sized ACK after each one,
+	like a protocol sending data objects. The server side of each
+	connection is a peer too.
+
+	Finally, it checks that connections can call the engine from their
+	callbacks, and that removing a connection waits for a call to it
+	that is in progress.
+*/
+
+#if defined(HAVE_PROTOCOL_ENGINE)
+#include <sys/socket.h>
+#include <sys/resource.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <string.h>
+
+#define NUM_PEERS 500
+#define NUM_MSGS 10
+#define MSG_SIZE 4096
+#define ACK_SIZE 24
+// Give up if the transfers have not completed in this many seconds
+#define MAX_SECS 60
+// How long to wait for a connection that calls the engine
+#define CALLBACK_SECS 5
+
+static atomic_t num_done = 0;
+static atomic_t num_ok = 0;
+
+static struct sockaddr_in server_addr;
+
+static SOCKET open_server()
+{
+	socklen_t len = sizeof(server_addr);
+	SOCKET sock = socket(AF_INET, SOCK_STREAM, 0);
+
+	if (sock == INVALID_SOCKET)
+		return INVALID_SOCKET;
+
+	memset(&server_addr, 0, sizeof(server_addr));
+	server_addr.sin_family = AF_INET;
+	server_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	server_addr.sin_port = 0;
+
+	if (bind(sock, (struct sockaddr *)&server_addr, sizeof(server_addr)) == SOCKET_ERROR ||
+	    listen(sock, NUM_PEERS) == SOCKET_ERROR ||
+	    getsockname(sock, (struct sockaddr *)&server_addr, &len) == SOCKET_ERROR) {
+		CLOSE_SOCKET(sock);
+		return INVALID_SOCKET;
+	}
+	return sock;
+}
+
+static bool set_nonblock(SOCKET sock)
+{
+	return fcntl(sock, F_SETFL, fcntl(sock, F_GETFL) | O_NONBLOCK) != -1;
+}
+
+/*
+	Make room for a socket per peer, on both sides of the connection.
+*/
+static bool raise_file_limit(rlim_t n)
+{
+	struct rlimit rl;
+
+	if (getrlimit(RLIMIT_NOFILE, &rl) < 0)
+		return false;
+
+	if (rl.rlim_cur >= n)
+		return true;
+
+	if (rl.rlim_max != RLIM_INFINITY && rl.rlim_max < n)
+		return false;
+
+	rl.rlim_cur = n;
+
+	return setrlimit(RLIMIT_NOFILE, &rl) == 0;
+}
+
+/*
+	Accepts a connection for each peer, and hands it to the server side
+	peer that 'create' makes.
+*/
+static bool accept_peers(SOCKET server, bool (*create)(SOCKET))
+{
+	for (int i = 0; i < NUM_PEERS; i++) {
+		SOCKET sock = accept(server, NULL, NULL);
+
+		if (sock == INVALID_SOCKET)
+			return false;
+
+		if (!create(sock))
+			return false;
+	}
+	return true;
+}
+
+static bool wait_for_peers()
+{
+	Timeval end = Timeval::now() + Timeval(MAX_SECS, 0);
+
+	while (num_done < 2 * NUM_PEERS) {
+		if (Timeval::now() > end)
+			return false;
+		milli_sleep(10);
+	}
+	return num_ok == 2 * NUM_PEERS;
+}
+
+/*
+	A peer with a thread of its own, on a blocking socket.
+*/
+class ThreadPeer : public Runnable {
+	SOCKET sock;
+	bool client;
+	char buf[MSG_SIZE];
+
+	bool xfer(char *data, size_t len, bool send)
+	{
+		size_t done = 0;
+
+		while (done < len) {
+			ssize_t n = send ? ::send(sock, data + done, len - done, 0) :
+				::recv(sock, data + done, len - done, 0);
+
+			if (n <= 0)
+				return false;
+
+			done += n;
+		}
+		return true;
+	}
+public:
+	ThreadPeer(SOCKET _sock = INVALID_SOCKET) :
+		Runnable("ThreadPeer"), sock(_sock), client(_sock == INVALID_SOCKET)
+	{
+		memset(buf, 'h', MSG_SIZE);
+	}
+	~ThreadPeer()
+	{
+		if (sock != INVALID_SOCKET)
+			CLOSE_SOCKET(sock);
+	}
+	bool run()
+	{
+		bool ok = true;
+
+		if (client) {
+			sock = socket(AF_INET, SOCK_STREAM, 0);
+
+			ok = sock != INVALID_SOCKET &&
+				connect(sock, (struct sockaddr *)&server_addr, sizeof(server_addr)) != SOCKET_ERROR;
+		}
+
+		for (int i = 0; ok && i < NUM_MSGS; i++) {
+			if (client)
+				ok = xfer(buf, MSG_SIZE, true) && xfer(buf, ACK_SIZE, false);
+			else
+				ok = xfer(buf, MSG_SIZE, false) && xfer(buf, ACK_SIZE, true);
+		}
+		if (ok)
+			atomic_inc(&num_ok);
+
+		atomic_inc(&num_done);
+
+		return false;
+	}
+	void cleanup() {}
+};
+
+static ThreadPeer *thread_peers[2 * NUM_PEERS];
+static int num_thread_peers = 0;
+
+static bool create_thread_peer(SOCKET sock)
+{
+	ThreadPeer *p = new ThreadPeer(sock);
+
+	thread_peers[num_thread_peers++] = p;
+
+	return p->start();
+}
+
+/*
+	A peer that is a state machine on a non-blocking socket, driven by
+	a protocol engine.
+*/
+class EnginePeer : public ProtocolEngine::Connection {
+	typedef enum {
+		STATE_CONNECTING,
+		STATE_SEND,
+		STATE_RECV_ACK,
+		STATE_RECV,
+		STATE_SEND_ACK,
+	} State;
+	SOCKET sock;
+	State state;
+	bool ok;
+	int numMsgs;
+	size_t len;
+	char buf[MSG_SIZE];
+
+	/*
+	  Sends or receives until 'size' bytes are done. Returns 1 when
+	  done, 0 if the socket would block, and -1 on error.
+	*/
+	int xfer(size_t size, bool send)
+	{
+		while (len < size) {
+			ssize_t n = send ? ::send(sock, buf + len, size - len, 0) :
+				::recv(sock, buf + len, size - len, 0);
+
+			if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+				return 0;
+			else if (n <= 0)
+				return -1;
+
+			len += n;
+		}
+		len = 0;
+
+		return 1;
+	}
+public:
+	EnginePeer(SOCKET _sock) :
+		sock(_sock), state(STATE_RECV), ok(false), numMsgs(0), len(0)
+	{
+		memset(buf, 'h', MSG_SIZE);
+	}
+	EnginePeer() :
+		sock(INVALID_SOCKET), state(STATE_CONNECTING), ok(false), numMsgs(0), len(0)
+	{
+		memset(buf, 'h', MSG_SIZE);
+	}
+	~EnginePeer()
+	{
+		if (sock != INVALID_SOCKET)
+			CLOSE_SOCKET(sock);
+	}
+	SOCKET getEngineSocket() const
+	{
+		return sock;
+	}
+	int getEngineWatchState() const
+	{
+		switch (state) {
+		case STATE_CONNECTING:
+		case STATE_SEND:
+		case STATE_SEND_ACK:
+			return WATCH_STATE_WRITE;
+		default:
+			break;
+		}
+		return WATCH_STATE_READ;
+	}
+	bool onEngineEvent(int events)
+	{
+		int res = 1;
+
+		while (res > 0) {
+			switch (state) {
+			case STATE_CONNECTING:
+				if (sock == INVALID_SOCKET) {
+					// Start connecting on the first event
+					sock = socket(AF_INET, SOCK_STREAM, 0);
+
+					if (sock == INVALID_SOCKET || !set_nonblock(sock))
+						return false;
+
+					if (connect(sock, (struct sockaddr *)&server_addr,
+						    sizeof(server_addr)) == SOCKET_ERROR &&
+					    errno != EINPROGRESS)
+						return false;
+
+					res = 0;
+				} else if (events & WATCH_STATE_WRITE) {
+					int err = 0;
+					socklen_t errlen = sizeof(err);
+
+					if (getsockopt(sock, SOL_SOCKET, SO_ERROR, &err, &errlen) < 0 || err)
+						return false;
+
+					state = STATE_SEND;
+				} else {
+					res = 0;
+				}
+				break;
+			case STATE_SEND:
+				if ((res = xfer(MSG_SIZE, true)) > 0)
+					state = STATE_RECV_ACK;
+				break;
+			case STATE_RECV_ACK:
+				if ((res = xfer(ACK_SIZE, false)) > 0) {
+					if (++numMsgs == NUM_MSGS) {
+						ok = true;
+						return false;
+					}
+					state = STATE_SEND;
+				}
+				break;
+			case STATE_RECV:
+				if ((res = xfer(MSG_SIZE, false)) > 0)
+					state = STATE_SEND_ACK;
+				break;
+			case STATE_SEND_ACK:
+				if ((res = xfer(ACK_SIZE, true)) > 0) {
+					if (++numMsgs == NUM_MSGS) {
+						ok = true;
+						return false;
+					}
+					state = STATE_RECV;
+				}
+				break;
+			}
+		}
+		return res == 0;
+	}
+	void onEngineDone()
+	{
+		if (ok)
+			atomic_inc(&num_ok);
+
+		atomic_inc(&num_done);
+	}
+};
+
+static EnginePeer *engine_peers[2 * NUM_PEERS];
+static int num_engine_peers = 0;
+static ProtocolEngine *engine = NULL;
+
+static bool create_engine_peer(SOCKET sock)
+{
+	EnginePeer *p = new EnginePeer(sock);
+
+	engine_peers[num_engine_peers++] = p;
+
+	return set_nonblock(sock) && engine->add(p);
+}
+
+/*
+	A connection without a socket, which calls the engine from its
+	callbacks.
+*/
+class CallbackPeer : public ProtocolEngine::Connection {
+public:
+	// Added to the engine, or woken up, in the first call
+	CallbackPeer *addPeer;
+	CallbackPeer *wakePeer;
+	// Milliseconds to spend in each call
+	unsigned long sleepMsecs;
+	// Calls before the connection is finished
+	long calls;
+	atomic_t numCalls;
+	atomic_t inCall;
+	atomic_t done;
+
+	CallbackPeer(long _calls = 1) : addPeer(NULL), wakePeer(NULL), sleepMsecs(0), 
+		calls(_calls), numCalls(0), inCall(0), done(0) {}
+
+	SOCKET getEngineSocket() const { return INVALID_SOCKET; }
+	int getEngineWatchState() const { return WATCH_STATE_NONE; }
+
+	bool onEngineEvent(int events)
+	{
+		atomic_set(&inCall, 1);
+
+		if (atomic_inc(&numCalls) == 1) {
+			if (addPeer)
+				engine->add(addPeer);
+			if (wakePeer)
+				engine->wakeup(wakePeer);
+		}
+		if (sleepMsecs)
+			milli_sleep(sleepMsecs);
+
+		atomic_set(&inCall, 0);
+
+		return atomic_read(&numCalls) < calls;
+	}
+	void onEngineDone()
+	{
+		atomic_set(&done, 1);
+	}
+};
+
+static bool wait_for(const atomic_t *v, long value)
+{
+	Timeval end = Timeval::now() + Timeval(CALLBACK_SECS, 0);
+
+	while (atomic_read(v) != value) {
+		if (Timeval::now() > end)
+			return false;
+		milli_sleep(1);
+	}
+	return true;
+}
+
+#endif /* HAVE_PROTOCOL_ENGINE */
+
+#if defined(OS_WINDOWS)
+int haggle_test_protocolengine(void)
+#else
+int main(int argc, char *argv[])
+#endif
+{
+	// Disable tracing
+	trace_disable(true);
+
+	bool success = true, tmp_succ;
+
+	print_over_test_str_nl(0, "Protocol engine test: ");
+
+	try {
+#if defined(HAVE_PROTOCOL_ENGINE)
+		SOCKET server;
+		Timeval start;
+
+		print_over_test_str(1, "Raise open file limit: ");
+		tmp_succ = raise_file_limit(4 * NUM_PEERS + 100);
+		success &= tmp_succ;
+		print_pass(tmp_succ);
+
+		if (!tmp_succ)
+			return 1;
+
+		server = open_server();
+
+		print_over_test_str(1, "500 peers, thread per connection: ");
+
+		num_done = num_ok = 0;
+		start = Timeval::now();
+		tmp_succ = server != INVALID_SOCKET;
+
+		for (int i = 0; tmp_succ && i < NUM_PEERS; i++) {
+			ThreadPeer *p = new ThreadPeer();
+
+			thread_peers[num_thread_peers++] = p;
+			tmp_succ = p->start();
+		}
+
+		tmp_succ = tmp_succ && accept_peers(server, create_thread_peer) && wait_for_peers();
+
+		printf("%.3lf s, %d threads ",
+		       (Timeval::now() - start).getTimeAsSecondsDouble(), num_thread_peers);
+
+		for (int i = 0; i < num_thread_peers; i++) {
+			thread_peers[i]->join();
+			delete thread_peers[i];
+		}
+		success &= tmp_succ;
+		print_pass(tmp_succ);
+
+		engine = new ProtocolEngine();
+		tmp_succ = server != INVALID_SOCKET && engine->start();
+
+		print_over_test_str(1, "500 peers, protocol engine: ");
+
+		num_done = num_ok = 0;
+		start = Timeval::now();
+
+		for (int i = 0; tmp_succ && i < NUM_PEERS; i++) {
+			EnginePeer *p = new EnginePeer();
+
+			engine_peers[num_engine_peers++] = p;
+			tmp_succ = engine->add(p);
+		}
+
+		tmp_succ = tmp_succ && accept_peers(server, create_engine_peer) && wait_for_peers();
+
+		printf("%.3lf s, %u threads ",
+		       (Timeval::now() - start).getTimeAsSecondsDouble(), engine->getNumWorkers());
+
+		tmp_succ = tmp_succ && engine->getNumConnections() == 0;
+
+		engine->stop();
+
+		for (int i = 0; i < num_engine_peers; i++)
+			delete engine_peers[i];
+
+		delete engine;
+
+		success &= tmp_succ;
+		print_pass(tmp_succ);
+
+		if (server != INVALID_SOCKET)
+			CLOSE_SOCKET(server);
+
+		print_over_test_str(1, "Callbacks call the engine: ");
+
+		// A single worker calls all the connections
+		engine = new ProtocolEngine(1);
+		tmp_succ = engine->start();
+		{
+			CallbackPeer first, added, woken(2), slow(2);
+
+			first.addPeer = &added;
+			added.wakePeer = &woken;
+			slow.sleepMsecs = 100;
+
+			// The first connection adds one that wakes up another
+			tmp_succ = tmp_succ && engine->add(&woken) && wait_for(&woken.numCalls, 1) && 
+				engine->add(&first) && wait_for(&woken.done, 1) &&
+				first.done && added.done;
+
+			// Removing a connection waits for the call to it to return
+			tmp_succ = tmp_succ && engine->add(&slow) && wait_for(&slow.inCall, 1);
+			engine->remove(&slow);
+			tmp_succ = tmp_succ && atomic_read(&slow.inCall) == 0 && 
+				!slow.done && engine->getNumConnections() == 0;
+
+			engine->stop();
+		}
+		delete engine;
+
+		success &= tmp_succ;
+		print_pass(tmp_succ);
+#else
+		print_over_test_str(1, "Protocol engine not available: ");
+		print_passed();
+#endif
+		print_over_test_str(1, "Total: ");
+		return (success ? 0 : 1);
+	} catch(Exception &) {
+		printf("**CRASH** ");
+		return 1;
+	}
+}
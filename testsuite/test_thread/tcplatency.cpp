@@ -0,0 +1,253 @@
+/* Copyright 2008-2009 Uppsala University
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include "testhlp.h"
+#include <libcpphaggle/Thread.h>
+#include <libcpphaggle/Exception.h>
+#include <haggleutils.h>
+
+using namespace haggle;
+
+/*
+	This program measures the time from when a sender starts writing the
+	header of a data object until it has the ACCEPT control message back,
+	on the loopback interface, with the TCP socket options that the TCP
+	protocols can be configured with.
+
+	The header is written in two parts, as when it does not fit in the
+	protocol's buffer. Without TCP_NODELAY, Nagle's algorithm holds the
+	second part back until the first is ACKed, and the receiver delays
+	that ACK since it has nothing to send until it has the whole header.
+*/
+
+#if defined(OS_UNIX)
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <string.h>
+
+#define NUM_ROUNDS 20
+#define HEADER_SIZE 1500
+#define HEADER_PART 1000
+#define DATA_SIZE 32768
+#define CTRLMSG_SIZE 24
+
+typedef struct {
+	const char *name;
+	bool nodelay;
+	bool cork;
+} options_t;
+
+static options_t options[] = {
+	{ "Default options: ", false, false },
+	{ "TCP_NODELAY: ", true, false },
+	{ "TCP_NODELAY and corking: ", true, true },
+};
+
+static bool set_option(SOCKET sock, int name, bool on)
+{
+	int optval = on ? 1 : 0;
+
+	return setsockopt(sock, IPPROTO_TCP, name, &optval, sizeof(optval)) == 0;
+}
+
+static bool set_cork(SOCKET sock, bool on)
+{
+#if defined(TCP_CORK)
+	return set_option(sock, TCP_CORK, on);
+#elif defined(TCP_NOPUSH)
+	return set_option(sock, TCP_NOPUSH, on);
+#else
+	return true;
+#endif
+}
+
+static bool xfer(SOCKET sock, char *buf, size_t len, bool send)
+{
+	size_t done = 0;
+
+	while (done < len) {
+		ssize_t n = send ? ::send(sock, buf + done, len - done, 0) :
+			::recv(sock, buf + done, len - done, 0);
+
+		if (n <= 0)
+			return false;
+
+		done += n;
+	}
+	return true;
+}
+
+/*
+	The receiving side, which answers each header with an ACCEPT, and
+	each data object with an ACK.
+*/
+class Receiver : public Runnable {
+	SOCKET server;
+	const options_t& opts;
+	char buf[DATA_SIZE];
+public:
+	bool success;
+	Receiver(SOCKET _server, const options_t& _opts) :
+		Runnable("Receiver"), server(_server), opts(_opts), success(false) {}
+	bool run()
+	{
+		SOCKET sock = accept(server, NULL, NULL);
+
+		if (sock == INVALID_SOCKET)
+			return false;
+
+		if (opts.nodelay)
+			set_option(sock, TCP_NODELAY, true);
+
+		int i;
+
+		for (i = 0; i < NUM_ROUNDS; i++) {
+			if (!xfer(sock, buf, HEADER_SIZE, false) ||
+			    !xfer(sock, buf, CTRLMSG_SIZE, true) ||
+			    !xfer(sock, buf, DATA_SIZE, false) ||
+			    !xfer(sock, buf, CTRLMSG_SIZE, true))
+				break;
+		}
+		success = i == NUM_ROUNDS;
+		CLOSE_SOCKET(sock);
+
+		return false;
+	}
+	void cleanup() {}
+};
+
+/*
+	Sends NUM_ROUNDS data objects, and returns the average time in
+	milliseconds from starting to write the header until the ACCEPT is
+	received, or a negative number on failure.
+*/
+static double measure(const options_t& opts)
+{
+	struct sockaddr_in addr;
+	socklen_t len = sizeof(addr);
+	SOCKET server = socket(AF_INET, SOCK_STREAM, 0);
+	SOCKET sock = INVALID_SOCKET;
+	static char buf[DATA_SIZE];
+	double total = 0;
+	int i = 0;
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+
+	if (bind(server, (struct sockaddr *)&addr, sizeof(addr)) == SOCKET_ERROR ||
+	    listen(server, 1) == SOCKET_ERROR ||
+	    getsockname(server, (struct sockaddr *)&addr, &len) == SOCKET_ERROR) {
+		CLOSE_SOCKET(server);
+		return -1;
+	}
+
+	Receiver r(server, opts);
+
+	if (!r.start()) {
+		CLOSE_SOCKET(server);
+		return -1;
+	}
+
+	sock = socket(AF_INET, SOCK_STREAM, 0);
+
+	if (sock != INVALID_SOCKET && (!opts.nodelay || set_option(sock, TCP_NODELAY, true)) &&
+	    connect(sock, (struct sockaddr *)&addr, sizeof(addr)) != SOCKET_ERROR) {
+		for (; i < NUM_ROUNDS; i++) {
+			Timeval start = Timeval::now();
+
+			if (opts.cork)
+				set_cork(sock, true);
+
+			if (!xfer(sock, buf, HEADER_PART, true) ||
+			    !xfer(sock, buf, HEADER_SIZE - HEADER_PART, true))
+				break;
+
+			if (opts.cork)
+				set_cork(sock, false);
+
+			if (!xfer(sock, buf, CTRLMSG_SIZE, false))
+				break;
+
+			total += (Timeval::now() - start).getTimeAsMilliSecondsDouble();
+
+			if (opts.cork)
+				set_cork(sock, true);
+
+			if (!xfer(sock, buf, DATA_SIZE, true))
+				break;
+
+			if (opts.cork)
+				set_cork(sock, false);
+
+			if (!xfer(sock, buf, CTRLMSG_SIZE, false))
+				break;
+		}
+	}
+	if (sock != INVALID_SOCKET)
+		CLOSE_SOCKET(sock);
+
+	r.join();
+	CLOSE_SOCKET(server);
+
+	if (i != NUM_ROUNDS || !r.success)
+		return -1;
+
+	return total / NUM_ROUNDS;
+}
+
+#endif /* OS_UNIX */
+
+#if defined(OS_WINDOWS)
+int haggle_test_tcplatency(void)
+#else
+int main(int argc, char *argv[])
+#endif
+{
+	// Disable tracing
+	trace_disable(true);
+
+	bool success = true, tmp_succ;
+
+	print_over_test_str_nl(0, "TCP control message latency test: ");
+
+	try {
+#if defined(OS_UNIX)
+		for (unsigned int i = 0; i < sizeof(options) / sizeof(options[0]); i++) {
+			print_over_test_str(1, options[i].name);
+
+			double msecs = measure(options[i]);
+
+			tmp_succ = msecs >= 0;
+
+			if (tmp_succ)
+				printf("%.3lf ms to ACCEPT ", msecs);
+
+			success &= tmp_succ;
+			print_pass(tmp_succ);
+		}
+#else
+		print_over_test_str(1, "Not available on this platform: ");
+		print_passed();
+#endif
+		print_over_test_str(1, "Total: ");
+		return (success ? 0 : 1);
+	} catch(Exception &) {
+		printf("**CRASH** ");
+		return 1;
+	}
+}
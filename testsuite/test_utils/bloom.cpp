@@ -21,6 +21,9 @@
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
+#if !defined(OS_WINDOWS)
+#include <sys/time.h>
+#endif
 
 #if defined(OS_MACOSX)
 #include <stdlib.h>
@@ -90,6 +93,68 @@ int check_for_data_objects_all(struct bloomfilter *bf)
 	return 1;
 }
 
+#define BENCHMARK_KEY_BYTES 20
+
+static double elapsed(struct timeval *t1, struct timeval *t2)
+{
+	return (t2->tv_sec - t1->tv_sec) + (t2->tv_usec - t1->tv_usec) / 1000000.0;
+}
+
+// Prints the number of add and check operations per second with the 
+// given hash on a filter sized for num_keys keys. Half of the checked
+// keys are in the filter.
+void benchmark_hash(unsigned int hash, unsigned int num_keys)
+{
+	struct bloomfilter *bf = bloomfilter_new_with_hash((float)0.01, num_keys, hash);
+	char *keys = (char *)malloc(2 * num_keys * BENCHMARK_KEY_BYTES);
+	const char **key_ptrs = (const char **)malloc(2 * num_keys * sizeof(char *));
+	unsigned int *lens = (unsigned int *)malloc(2 * num_keys * sizeof(unsigned int));
+	int *results = (int *)malloc(2 * num_keys * sizeof(int));
+	struct timeval t1, t2, t3, t4;
+	unsigned int i, j;
+	
+	if (bf == NULL || keys == NULL || key_ptrs == NULL || lens == NULL || results == NULL) {
+		printf("out of memory\n");
+		goto out;
+	}
+	
+	// Data object ids are SHA1 digests, i.e., random looking bytes
+	for (i = 0; i < 2 * num_keys; i++) {
+		for (j = 0; j < BENCHMARK_KEY_BYTES; j++)
+			keys[i * BENCHMARK_KEY_BYTES + j] = prng_uint8();
+		key_ptrs[i] = keys + i * BENCHMARK_KEY_BYTES;
+		lens[i] = BENCHMARK_KEY_BYTES;
+	}
+	
+	gettimeofday(&t1, NULL);
+	
+	for (i = 0; i < num_keys; i++)
+		bloomfilter_add(bf, key_ptrs[i], BENCHMARK_KEY_BYTES);
+	
+	gettimeofday(&t2, NULL);
+	
+	for (i = 0; i < 2 * num_keys; i++)
+		bloomfilter_check(bf, key_ptrs[i], BENCHMARK_KEY_BYTES);
+	
+	gettimeofday(&t3, NULL);
+	
+	bloomfilter_check_many(bf, key_ptrs, lens, 2 * num_keys, results);
+	
+	gettimeofday(&t4, NULL);
+	
+	printf("add %.2f, has %.2f, hasMany %.2f Mops/s\n", 
+	       num_keys / elapsed(&t1, &t2) / 1000000.0,
+	       2 * num_keys / elapsed(&t2, &t3) / 1000000.0,
+	       2 * num_keys / elapsed(&t3, &t4) / 1000000.0);
+out:
+	if (bf)
+		bloomfilter_free(bf);
+	free(keys);
+	free(key_ptrs);
+	free(lens);
+	free(results);
+}
+
 #if defined(OS_WINDOWS)
 int haggle_test_bloom(void)
 #else
@@ -209,6 +274,82 @@ int main(int argc, char *argv[])
 	success &= tmp_succ;
 	print_pass(tmp_succ);
 
+	print_over_test_str(1, "Delta to Base64: ");
+	// bf_copy contains the objects of filter 1, add those of filter 2
+	// to the copy and compute the delta against filter 1
+	for (i = NUMBER_OF_DATA_OBJECTS_1; i < NUMBER_OF_DATA_OBJECTS; i++)
+		bloomfilter_add(bf_copy, data_object[i], data_object_len[i]);
+	
+	free(b64_bf_copy_2);
+	b64_bf_copy_2 = bloomfilter_delta_to_base64(bf1, bf_copy);
+	
+	// Check that it worked, and that the delta is smaller than the filter
+	tmp_succ = (b64_bf_copy_2 != NULL && strlen(b64_bf_copy_2) < strlen(b64_bf_copy_1));
+	success &= tmp_succ;
+	print_pass(tmp_succ);
+	
+	if (b64_bf_copy_2 == NULL)
+		return 1;
+	
+	print_over_test_str(1, "Delta applied contains all data objects: ");
+	{
+		struct bloomfilter *bf_delta = bloomfilter_copy(bf1);
+		
+		if (bf_delta == NULL)
+			return 1;
+		
+		tmp_succ = (bloomfilter_delta_apply_base64(bf_delta, b64_bf_copy_2, strlen(b64_bf_copy_2), 1) == MERGE_RESULT_OK);
+		tmp_succ &= check_for_data_objects_all(bf_delta);
+		tmp_succ &= (memcmp(bf_delta, bf_copy, BLOOMFILTER_TOT_LEN(bf_copy)) == 0);
+		success &= tmp_succ;
+		print_pass(tmp_succ);
+		
+		print_over_test_str(1, "Delta rejected by unrelated filter: ");
+		// A new filter has different salts
+		bloomfilter_free(bf_delta);
+		bf_delta = bloomfilter_new((float)0.01, 1000);
+		
+		if (bf_delta == NULL)
+			return 1;
+		
+		tmp_succ = (bloomfilter_delta_apply_base64(bf_delta, b64_bf_copy_2, strlen(b64_bf_copy_2), 1) != MERGE_RESULT_OK);
+		success &= tmp_succ;
+		print_pass(tmp_succ);
+		bloomfilter_free(bf_delta);
+	}
+
+	print_over_test_str(1, "Delta with bad counts rejected: ");
+	{
+		struct bloomfilter *bf_delta = bloomfilter_copy(bf1);
+		size_t delta_len;
+		unsigned char *delta = bloomfilter_delta_new(bf1, bf_copy, &delta_len);
+		struct bloomfilter_delta *hdr = (struct bloomfilter_delta *)delta;
+
+		if (bf_delta == NULL || delta == NULL)
+			return 1;
+
+		// Counts whose sum wraps to a few entries
+		hdr->num_set = htonl(0xffffffff);
+		hdr->num_cleared = htonl(2);
+		tmp_succ = (bloomfilter_delta_apply(bf_delta, delta, delta_len, 1) == MERGE_RESULT_ERROR);
+
+		// More entries than there are bytes left
+		hdr->num_set = htonl(delta_len);
+		hdr->num_cleared = htonl(0);
+		tmp_succ &= (bloomfilter_delta_apply(bf_delta, delta, delta_len, 1) == MERGE_RESULT_ERROR);
+
+		// Truncated in the middle of the entries
+		hdr->num_set = htonl(1);
+		tmp_succ &= (bloomfilter_delta_apply(bf_delta, delta, sizeof(struct bloomfilter_delta), 1) == MERGE_RESULT_ERROR);
+
+		// The rejected deltas left the filter as it was
+		tmp_succ &= (memcmp(bf_delta, bf1, BLOOMFILTER_TOT_LEN(bf1)) == 0);
+		success &= tmp_succ;
+		print_pass(tmp_succ);
+		free(delta);
+		bloomfilter_free(bf_delta);
+	}
+	
 	print_over_test_str(1, "Merge filters 1 & 2: ");
 	// Check filter contents:
 	tmp_succ = (bloomfilter_merge(bf1, bf2) == MERGE_RESULT_OK);
@@ -228,6 +369,107 @@ int main(int argc, char *argv[])
 	bloomfilter_free(bf2);
 	
 	print_passed();
+	
+	print_over_test_str(1, "Double hashing filters contain data objects: ");
+	bf1 = bloomfilter_new_with_hash((float)0.01, 1000, BF_HASH_DOUBLE);
+	bf2 = bloomfilter_new_with_hash((float)0.01, 1000, BF_HASH_DOUBLE);
+	
+	if (bf1 == NULL || bf2 == NULL)
+		return 1;
+	
+	for (i = 0; i < NUMBER_OF_DATA_OBJECTS_1; i++)
+		bloomfilter_add(bf1, data_object[i], data_object_len[i]);
+	
+	for (i = NUMBER_OF_DATA_OBJECTS_1; i < NUMBER_OF_DATA_OBJECTS; i++)
+		bloomfilter_add(bf2, data_object[i], data_object_len[i]);
+	
+	tmp_succ = (bloomfilter_get_hash(bf1) == BF_HASH_DOUBLE);
+	tmp_succ &= check_for_data_objects_1(bf1);
+	tmp_succ &= check_for_data_objects_2(bf2);
+	success &= tmp_succ;
+	print_pass(tmp_succ);
+	
+	print_over_test_str(1, "Double hashing filter from Base64: ");
+	free(b64_bf_copy_1);
+	b64_bf_copy_1 = bloomfilter_to_base64(bf1);
+	
+	if (b64_bf_copy_1 == NULL)
+		return 1;
+	
+	bf_copy = base64_to_bloomfilter(b64_bf_copy_1, strlen(b64_bf_copy_1));
+	
+	if (bf_copy == NULL)
+		return 1;
+	
+	tmp_succ = (bloomfilter_get_hash(bf_copy) == BF_HASH_DOUBLE);
+	tmp_succ &= check_for_data_objects_1(bf_copy);
+	success &= tmp_succ;
+	print_pass(tmp_succ);
+	bloomfilter_free(bf_copy);
+	
+	print_over_test_str(1, "Merge independent double hashing filters: ");
+	// Double hashing filters do not have random salts, so filters 
+	// created independently can be merged
+	tmp_succ = (bloomfilter_merge(bf1, bf2) == MERGE_RESULT_OK);
+	tmp_succ &= check_for_data_objects_all(bf1);
+	success &= tmp_succ;
+	print_pass(tmp_succ);
+	
+	bloomfilter_free(bf1);
+	bloomfilter_free(bf2);
+	
+	print_over_test_str(1, "Blocked filter contains data objects: ");
+	bf1 = bloomfilter_new_with_hash((float)0.01, 1000, BF_HASH_BLOCKED);
+	
+	if (bf1 == NULL)
+		return 1;
+	
+	for (i = 0; i < NUMBER_OF_DATA_OBJECTS_1; i++)
+		bloomfilter_add(bf1, data_object[i], data_object_len[i]);
+	
+	tmp_succ = (bloomfilter_get_hash(bf1) == BF_HASH_BLOCKED);
+	tmp_succ &= (bf1->m % BLOOMFILTER_BLOCK_BITS == 0);
+	tmp_succ &= check_for_data_objects_1(bf1);
+	success &= tmp_succ;
+	print_pass(tmp_succ);
+	
+	print_over_test_str(1, "Blocked filter batch check: ");
+	{
+		const char *keys[NUMBER_OF_DATA_OBJECTS];
+		unsigned int lens[NUMBER_OF_DATA_OBJECTS];
+		int results[NUMBER_OF_DATA_OBJECTS];
+		
+		for (i = 0; i < NUMBER_OF_DATA_OBJECTS; i++) {
+			keys[i] = data_object[i];
+			lens[i] = data_object_len[i];
+		}
+		tmp_succ = (bloomfilter_check_many(bf1, keys, lens, NUMBER_OF_DATA_OBJECTS, results) == NUMBER_OF_DATA_OBJECTS_1);
+		
+		for (i = 0; i < NUMBER_OF_DATA_OBJECTS; i++)
+			tmp_succ &= (results[i] == (i < NUMBER_OF_DATA_OBJECTS_1));
+	}
+	success &= tmp_succ;
+	print_pass(tmp_succ);
+	
+	bloomfilter_free(bf1);
+	
+	{
+		const unsigned int bench_keys[] = { 10000, 100000, 1000000, 0 };
+		const char *bench_hash_str[] = { "SHA1", "double", "blocked" };
+		char str[80];
+		
+		for (i = 0; bench_keys[i]; i++) {
+			for (j = BF_HASH_SHA1; j < BF_HASH_MAX; j++) {
+				snprintf(str, 80, "Benchmark %s %u keys: ", bench_hash_str[j], bench_keys[i]);
+				print_over_test_str(1, str);
+				benchmark_hash(j, bench_keys[i]);
+			}
+		}
+	}
+
+	free(b64_bf_copy_1);
+	free(b64_bf_copy_2);
+	
 	print_over_test_str(1, "Total: ");
 	// Success?
 	return (success?0:1);
@@ -22,6 +22,9 @@
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
+#if !defined(OS_WINDOWS)
+#include <sys/time.h>
+#endif
 
 #if defined(OS_MACOSX)
 #include <stdlib.h>
@@ -93,6 +96,55 @@ int check_for_data_objects_noncounting(struct bloomfilter *bf)
 	return 1;
 }
 
+#define BENCHMARK_CAPACITY 100000
+#define BENCHMARK_CONVERSIONS 100
+
+static double elapsed(struct timeval *t1, struct timeval *t2)
+{
+	return (t2->tv_sec - t1->tv_sec) + (t2->tv_usec - t1->tv_usec) / 1000000.0;
+}
+
+// Prints the memory used by a counting filter sized for BENCHMARK_CAPACITY
+// keys, and the time it takes to convert it into a non-counting filter.
+void benchmark_to_noncounting(void)
+{
+	struct counting_bloomfilter *cbf = counting_bloomfilter_new((float)0.01, BENCHMARK_CAPACITY);
+	struct bloomfilter *bf;
+	struct timeval t1, t2;
+	char key[20];
+	unsigned int i, j;
+
+	if (cbf == NULL) {
+		printf("out of memory\n");
+		return;
+	}
+
+	for (i = 0; i < BENCHMARK_CAPACITY; i++) {
+		for (j = 0; j < sizeof(key); j++)
+			key[j] = prng_uint8();
+		counting_bloomfilter_add(cbf, key, sizeof(key));
+	}
+
+	gettimeofday(&t1, NULL);
+
+	for (i = 0; i < BENCHMARK_CONVERSIONS; i++) {
+		bf = counting_bloomfilter_to_noncounting(cbf);
+		
+		if (bf)
+			bloomfilter_free(bf);
+	}
+
+	gettimeofday(&t2, NULL);
+
+	printf("%lu bytes (%lu with 16-bit counters, %lu non-counting), to noncounting %.1f us\n",
+	       (unsigned long)COUNTING_BLOOMFILTER_TOT_LEN(cbf),
+	       (unsigned long)COUNTING_BLOOMFILTER_LEGACY_TOT_LEN(cbf),
+	       (unsigned long)(sizeof(struct bloomfilter) + CB_SALTS_LEN(cbf) + cbf->m / 8),
+	       elapsed(&t1, &t2) * 1000000.0 / BENCHMARK_CONVERSIONS);
+
+	counting_bloomfilter_free(cbf);
+}
+
 #if defined(OS_WINDOWS)
 int haggle_test_bloom_count(void)
 #else
@@ -237,6 +289,57 @@ int main(int argc, char *argv[])
 	success &= tmp_succ;
 	print_pass(tmp_succ);
 	
+	print_over_test_str(1, "Saturated counters stay set:");
+	counting_bloomfilter_free(cbf_copy);
+	cbf_copy = counting_bloomfilter_copy(cbf);
+
+	if (cbf_copy == NULL)
+		return 1;
+
+	// Adding an object more times than a counter can hold and then
+	// removing it again must not remove it from the filter
+	for (i = 0; i < COUNTING_MAX_COUNT + 5; i++)
+		counting_bloomfilter_add(cbf_copy, data_object_count[0], data_object_count_len[0]);
+
+	for (i = 0; i < COUNTING_MAX_COUNT + 5; i++)
+		counting_bloomfilter_remove(cbf_copy, data_object_count[0], data_object_count_len[0]);
+
+	tmp_succ = check_for_data_objects(cbf_copy);
+	success &= tmp_succ;
+	print_pass(tmp_succ);
+
+	print_over_test_str(1, "Convert filter with 16-bit counters:");
+	{
+		struct counting_bloomfilter *cbf_legacy = (struct counting_bloomfilter *)malloc(COUNTING_BLOOMFILTER_LEGACY_TOT_LEN(cbf));
+		struct counting_bloomfilter *cbf_converted = NULL;
+
+		tmp_succ = (cbf_legacy != NULL);
+
+		if (tmp_succ) {
+			counting_legacy_bin_t *legacy_bins;
+			
+			memcpy(cbf_legacy, cbf, sizeof(struct counting_bloomfilter) + CB_SALTS_LEN(cbf));
+			legacy_bins = (counting_legacy_bin_t *)COUNTING_BLOOMFILTER_GET_FILTER(cbf_legacy);
+
+			for (i = 0; i < (long)cbf->m; i++)
+				legacy_bins[i] = counting_bloomfilter_get_counter(COUNTING_BLOOMFILTER_GET_FILTER(cbf), i);
+
+			cbf_converted = counting_bloomfilter_from_legacy(cbf_legacy);
+
+			tmp_succ = (cbf_converted != NULL && 
+				    memcmp(cbf_converted, cbf, COUNTING_BLOOMFILTER_TOT_LEN(cbf)) == 0);
+		}
+		if (cbf_legacy)
+			free(cbf_legacy);
+		if (cbf_converted)
+			counting_bloomfilter_free(cbf_converted);
+	}
+	success &= tmp_succ;
+	print_pass(tmp_succ);
+
+	print_over_test_str(1, "Benchmark: ");
+	benchmark_to_noncounting();
+	
 	print_over_test_str(1, "Release: ");
 
         if (cbf)
@@ -99,6 +99,8 @@ int main(void)
 	ADD_TEST(haggle_test_stopthread);
 	ADD_TEST(haggle_test_stackmanagement);
 	ADD_TEST(haggle_test_cancelthreadsocket);
+	ADD_TEST(haggle_test_protocolengine);
+	ADD_TEST(haggle_test_tcplatency);
 	
 	ADD_SEPA("------ Mutex test suite              ------\n");
 	ADD_TEST(haggle_test_createmutex);
@@ -108,6 +110,7 @@ int main(void)
 	ADD_TEST(haggle_test_recursive);
 	ADD_TEST(haggle_test_trylock);
 	ADD_TEST(haggle_test_cancelonmutex);
+	ADD_TEST(haggle_test_rwmutex);
 
 	ADD_SEPA("------ Condition variable test suite ------\n");
 	ADD_TEST(haggle_test_createcondition);
@@ -135,6 +138,7 @@ int main(void)
 	ADD_TEST(haggle_test_timeouttest);
 	ADD_TEST(haggle_test_waitforsocket);
 	ADD_TEST(haggle_test_cancelonqueue);
+	ADD_TEST(haggle_test_eventqueue);
 	
 	ADD_SEPA("------ Utilities test suite          ------\n");
 	ADD_TEST(haggle_test_test64);
@@ -144,6 +148,15 @@ int main(void)
 	
 	ADD_SEPA("------ Data object test suite        ------\n");
 	ADD_TEST(haggle_test_getputData);
+	ADD_TEST(haggle_test_scalableBloomfilter);
+	ADD_TEST(haggle_test_nodedescription);
+	ADD_TEST(haggle_test_prophetrib);
+	ADD_TEST(haggle_test_prophetsync);
+	ADD_TEST(haggle_test_sprayandwait);
+	ADD_TEST(haggle_test_nodestore);
+	ADD_TEST(haggle_test_interfacestore);
+	ADD_TEST(haggle_test_protocolmanager);
+	ADD_TEST(haggle_test_protocolasync);
 /*
 	ADD_SEPA("------ Haggle kernel test suite      ------\n");
 	ADD_TEST(haggle_test_hagglemain);